@@ -6,7 +6,7 @@
  *
  */
 
-#include <string.h> /* strlen() */
+#include <string.h> /* memset(), strlen() */
 #include "transmission.h"
 #include "crypto-utils.h"
 #include "bitfield.h"
@@ -221,12 +221,185 @@ static int test_bitfield_has_all_none(void)
     return 0;
 }
 
+static int test_bitfield_copy(void)
+{
+    tr_bitfield src;
+    tr_bitfield dst;
+
+    /* only the first few bits are set, so src's array is shorter than it could be */
+    tr_bitfieldConstruct(&src, 100);
+    tr_bitfieldAddRange(&src, 0, 4);
+    tr_bitfieldConstruct(&dst, 100);
+    tr_bitfieldSetFromBitfield(&dst, &src);
+
+    check_uint(tr_bitfieldCountTrueBits(&dst), ==, 4);
+    check(tr_bitfieldHas(&dst, 3));
+    check(!tr_bitfieldHas(&dst, 4));
+    check(!tr_bitfieldHas(&dst, 99));
+
+    tr_bitfieldDestruct(&dst);
+    tr_bitfieldDestruct(&src);
+    return 0;
+}
+
+static size_t findNextSlowly(tr_bitfield const* a, tr_bitfield const* b, size_t begin, size_t end, bool set)
+{
+    for (size_t i = begin; i < end; ++i)
+    {
+        if ((tr_bitfieldHas(a, i) || (b != NULL && tr_bitfieldHas(b, i))) == set)
+        {
+            return i;
+        }
+    }
+
+    return end;
+}
+
+static int test_bitfield_find_next(void)
+{
+    size_t const bit_count = 1000;
+    tr_bitfield a;
+    tr_bitfield b;
+    tr_bitfield all;
+
+    /* long runs, so that whole words get skipped, with a few holes in them */
+    tr_bitfieldConstruct(&a, bit_count);
+    tr_bitfieldAddRange(&a, 3, 400);
+    tr_bitfieldConstruct(&b, bit_count);
+    tr_bitfieldAddRange(&b, 350, 900);
+
+    for (int i = 0; i < 20; ++i)
+    {
+        tr_bitfieldRem(&a, tr_rand_int_weak(bit_count));
+        tr_bitfieldRem(&b, tr_rand_int_weak(bit_count));
+    }
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        size_t const begin = tr_rand_int_weak(bit_count);
+        size_t const end = begin + tr_rand_int_weak(bit_count - begin + 1);
+
+        check_uint(tr_bitfieldFindNextUnset(&a, &b, begin, end), ==, findNextSlowly(&a, &b, begin, end, false));
+        check_uint(tr_bitfieldFindNextSet(&a, &b, begin, end), ==, findNextSlowly(&a, &b, begin, end, true));
+        check_uint(tr_bitfieldFindNextUnset(&a, NULL, begin, end), ==, findNextSlowly(&a, NULL, begin, end, false));
+        check_uint(tr_bitfieldFindNextSet(&b, NULL, begin, end), ==, findNextSlowly(&b, NULL, begin, end, true));
+    }
+
+    /* the array's shorter than the bitfield, so the rest is unset */
+    check_uint(tr_bitfieldFindNextUnset(&a, NULL, 0, 1), ==, 0);
+    tr_bitfieldRemRange(&b, 0, bit_count);
+    check_uint(tr_bitfieldFindNextSet(&b, NULL, 0, bit_count), ==, bit_count);
+    check_uint(tr_bitfieldFindNextUnset(&b, NULL, 10, bit_count), ==, 10);
+
+    /* have-all bitfields don't have arrays */
+    tr_bitfieldConstruct(&all, bit_count);
+    tr_bitfieldSetHasAll(&all);
+    check_uint(tr_bitfieldFindNextUnset(&a, &all, 10, bit_count), ==, bit_count);
+    check_uint(tr_bitfieldFindNextSet(&all, NULL, 10, bit_count), ==, 10);
+    check_uint(tr_bitfieldFindNextSet(&a, NULL, 20, 20), ==, 20);
+
+    tr_bitfieldDestruct(&all);
+    tr_bitfieldDestruct(&b);
+    tr_bitfieldDestruct(&a);
+    return 0;
+}
+
+static void addToCountsSlowly(tr_bitfield const* b, uint16_t* counts, size_t n, int delta)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (tr_bitfieldHas(b, i))
+        {
+            counts[i] += (uint16_t)delta;
+        }
+    }
+}
+
+static bool intersectsSlowly(tr_bitfield const* a, tr_bitfield const* b, size_t end)
+{
+    for (size_t i = 0; i < end; ++i)
+    {
+        if (tr_bitfieldHas(a, i) && tr_bitfieldHas(b, i))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static int test_bitfield_counts(void)
+{
+    size_t const bit_count = 1003;
+    uint16_t counts[1003];
+    uint16_t expected[1003];
+    tr_bitfield a;
+    tr_bitfield b;
+    tr_bitfield all;
+
+    memset(counts, 0, sizeof(counts));
+    memset(expected, 0, sizeof(expected));
+    tr_bitfieldConstruct(&a, bit_count);
+    tr_bitfieldConstruct(&b, bit_count);
+    tr_bitfieldConstruct(&all, bit_count);
+    tr_bitfieldSetHasAll(&all);
+
+    for (int i = 0; i < 100; ++i)
+    {
+        size_t const begin = tr_rand_int_weak(bit_count);
+        size_t const end = begin + 1 + tr_rand_int_weak(bit_count - begin);
+        size_t const n = tr_rand_int_weak(bit_count + 1);
+        int const delta = tr_rand_int_weak(3) - 1;
+
+        /* a mix of runs and scattered bits */
+        if (tr_rand_int_weak(2) == 0)
+        {
+            tr_bitfieldAddRange(&a, begin, end);
+        }
+        else
+        {
+            tr_bitfieldRemRange(&a, begin, end);
+        }
+
+        tr_bitfieldAdd(&b, tr_rand_int_weak(bit_count));
+        tr_bitfieldRem(&a, tr_rand_int_weak(bit_count));
+
+        tr_bitfieldAddToCounts(&a, counts, n, delta);
+        addToCountsSlowly(&a, expected, n, delta);
+        tr_bitfieldAddToCounts(i % 10 == 0 ? &all : &b, counts, n, 1);
+        addToCountsSlowly(i % 10 == 0 ? &all : &b, expected, n, 1);
+        check_mem(counts, ==, expected, sizeof(counts));
+
+        check_bool(tr_bitfieldIntersects(&a, &b, n), ==, intersectsSlowly(&a, &b, n));
+        check_bool(tr_bitfieldIntersects(&all, &b, n), ==, intersectsSlowly(&all, &b, n));
+        check_bool(tr_bitfieldIntersects(&a, &all, n), ==, intersectsSlowly(&a, &all, n));
+    }
+
+    /* nothing in common */
+    tr_bitfieldRemRange(&a, 0, bit_count);
+    tr_bitfieldAddRange(&a, 0, 500);
+    tr_bitfieldRemRange(&b, 0, bit_count);
+    tr_bitfieldAddRange(&b, 500, bit_count);
+    check(!tr_bitfieldIntersects(&a, &b, bit_count));
+    tr_bitfieldAdd(&b, 499);
+    check(tr_bitfieldIntersects(&a, &b, bit_count));
+    check(!tr_bitfieldIntersects(&a, &b, 499));
+
+    tr_bitfieldDestruct(&all);
+    tr_bitfieldDestruct(&b);
+    tr_bitfieldDestruct(&a);
+    return 0;
+}
+
 int main(void)
 {
     testFunc const tests[] =
     {
         test_bitfields,
-        test_bitfield_has_all_none
+        test_bitfield_has_all_none,
+        test_bitfield_copy,
+        test_bitfield_find_next,
+        test_bitfield_counts
     };
 
     int ret = runTests(tests, NUM_TESTS(tests));
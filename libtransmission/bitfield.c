@@ -6,7 +6,7 @@
  *
  */
 
-#include <string.h> /* memset */
+#include <string.h> /* memcpy(), memset() */
 
 #include "transmission.h"
 #include "bitfield.h"
@@ -161,6 +161,209 @@ bool tr_bitfieldHas(tr_bitfield const* b, size_t n)
     return (b->bits[n >> 3U] << (n & 7U) & 0x80) != 0;
 }
 
+/* byte `i' of the array, which is treated as if it were padded out with zeroes */
+static inline uint8_t getByte(tr_bitfield const* b, size_t i)
+{
+    return i < b->alloc_count ? b->bits[i] : 0;
+}
+
+/* the eight bytes starting at byte `i'. The byte order doesn't matter,
+   since callers only compare the result to all zeroes or all ones */
+static uint64_t getWord(tr_bitfield const* b, size_t i)
+{
+    uint64_t word = 0;
+
+    if (i + sizeof(word) <= b->alloc_count)
+    {
+        memcpy(&word, b->bits + i, sizeof(word));
+    }
+    else
+    {
+        for (size_t j = i; j < b->alloc_count; ++j)
+        {
+            ((uint8_t*)&word)[j - i] = b->bits[j];
+        }
+    }
+
+    return word;
+}
+
+static inline bool eitherHas(tr_bitfield const* a, tr_bitfield const* b, size_t n)
+{
+    return ((getByte(a, n >> 3U) | getByte(b, n >> 3U)) << (n & 7U) & 0x80) != 0;
+}
+
+static size_t findNext(tr_bitfield const* a, tr_bitfield const* b, size_t begin, size_t end, bool set)
+{
+    uint8_t const skip_byte = set ? 0 : UINT8_MAX;
+    uint64_t const skip_word = set ? 0 : UINT64_MAX;
+    size_t i = begin;
+
+    if (b == NULL)
+    {
+        b = &TR_BITFIELD_INIT;
+    }
+
+    if (begin >= end)
+    {
+        return end;
+    }
+
+    if (tr_bitfieldHasAll(a) || tr_bitfieldHasAll(b))
+    {
+        return set ? begin : end;
+    }
+
+    /* bit by bit up to the first whole byte... */
+    for (; i < end && (i & 7U) != 0; ++i)
+    {
+        if (eitherHas(a, b, i) == set)
+        {
+            return i;
+        }
+    }
+
+    /* ...then skip the words and bytes that can't hold a match... */
+    while (end - i >= 64 && (getWord(a, i >> 3U) | getWord(b, i >> 3U)) == skip_word)
+    {
+        i += 64;
+    }
+
+    while (end - i >= 8 && (getByte(a, i >> 3U) | getByte(b, i >> 3U)) == skip_byte)
+    {
+        i += 8;
+    }
+
+    /* ...and if there's a match, it's in the next byte */
+    for (; i < end; ++i)
+    {
+        if (eitherHas(a, b, i) == set)
+        {
+            return i;
+        }
+    }
+
+    return end;
+}
+
+size_t tr_bitfieldFindNextUnset(tr_bitfield const* a, tr_bitfield const* b, size_t begin, size_t end)
+{
+    return findNext(a, b, begin, end, false);
+}
+
+size_t tr_bitfieldFindNextSet(tr_bitfield const* a, tr_bitfield const* b, size_t begin, size_t end)
+{
+    return findNext(a, b, begin, end, true);
+}
+
+/* no branches, so the compiler can do the eight counts in one go */
+static inline void addByteToCounts(uint8_t byte, uint16_t* counts, uint16_t delta)
+{
+    for (unsigned int k = 0; k < 8; ++k)
+    {
+        counts[k] += (uint16_t)(delta * ((byte >> (7U - k)) & 1U));
+    }
+}
+
+void tr_bitfieldAddToCounts(tr_bitfield const* b, uint16_t* counts, size_t n, int delta)
+{
+    uint16_t const d = (uint16_t)delta;
+    size_t byte_count;
+    size_t i;
+
+    if (tr_bitfieldHasAll(b))
+    {
+        for (i = 0; i < n; ++i)
+        {
+            counts[i] += d;
+        }
+
+        return;
+    }
+
+    if (tr_bitfieldHasNone(b))
+    {
+        return;
+    }
+
+    byte_count = MIN(n >> 3U, b->alloc_count);
+
+    /* skip the empty words, and add the rest a byte at a time... */
+    for (i = 0; i + 8 <= byte_count; i += 8)
+    {
+        if (getWord(b, i) != 0)
+        {
+            for (size_t j = i; j < i + 8; ++j)
+            {
+                addByteToCounts(b->bits[j], counts + (j << 3U), d);
+            }
+        }
+    }
+
+    for (; i < byte_count; ++i)
+    {
+        addByteToCounts(b->bits[i], counts + (i << 3U), d);
+    }
+
+    /* ...and the bits of a partial last byte one at a time */
+    for (i <<= 3U; i < n && (i >> 3U) < b->alloc_count; ++i)
+    {
+        if (tr_bitfieldHas(b, i))
+        {
+            counts[i] += d;
+        }
+    }
+}
+
+bool tr_bitfieldIntersects(tr_bitfield const* a, tr_bitfield const* b, size_t end)
+{
+    size_t byte_count;
+    size_t i;
+
+    if (tr_bitfieldHasAll(a))
+    {
+        return tr_bitfieldFindNextSet(b, NULL, 0, end) != end;
+    }
+
+    if (tr_bitfieldHasAll(b))
+    {
+        return tr_bitfieldFindNextSet(a, NULL, 0, end) != end;
+    }
+
+    if (tr_bitfieldHasNone(a) || tr_bitfieldHasNone(b))
+    {
+        return false;
+    }
+
+    byte_count = MIN(end >> 3U, MIN(a->alloc_count, b->alloc_count));
+
+    for (i = 0; i + 8 <= byte_count; i += 8)
+    {
+        if ((getWord(a, i) & getWord(b, i)) != 0)
+        {
+            return true;
+        }
+    }
+
+    for (; i < byte_count; ++i)
+    {
+        if ((a->bits[i] & b->bits[i]) != 0)
+        {
+            return true;
+        }
+    }
+
+    for (i <<= 3U; i < end && (i >> 3U) < MIN(a->alloc_count, b->alloc_count); ++i)
+    {
+        if (tr_bitfieldHas(a, i) && tr_bitfieldHas(b, i))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 /***
 ****
 ***/
@@ -370,18 +573,15 @@ void tr_bitfieldSetRaw(tr_bitfield* b, void const* bits, size_t byte_count, bool
     b->bits = tr_memdup(bits, byte_count);
     b->alloc_count = byte_count;
 
-    if (bounded)
+    /* the array can be shorter than the bitfield if the last bits were never set */
+    if (bounded && byte_count * 8 > b->bit_count)
     {
         /* ensure the excess bits are set to '0' */
-        int const excess_bit_count = byte_count * 8 - b->bit_count;
+        size_t const excess_bit_count = byte_count * 8 - b->bit_count;
 
-        TR_ASSERT(excess_bit_count >= 0);
         TR_ASSERT(excess_bit_count <= 7);
 
-        if (excess_bit_count != 0)
-        {
-            b->bits[b->alloc_count - 1] &= 0xff << excess_bit_count;
-        }
+        b->bits[b->alloc_count - 1] &= 0xff << excess_bit_count;
     }
 
     tr_bitfieldRebuildTrueCount(b);
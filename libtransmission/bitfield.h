@@ -80,6 +80,29 @@ size_t tr_bitfieldCountRange(tr_bitfield const*, size_t begin, size_t end);
 
 size_t tr_bitfieldCountTrueBits(tr_bitfield const* b);
 
+/**
+ * @brief Find the first bit in [begin, end) that's set in neither `a' nor `b'.
+ *
+ * `b' may be NULL. Returns `end' if there isn't one. This skips over runs
+ * of set bits a word at a time, so it's cheap even on big bitfields.
+ */
+size_t tr_bitfieldFindNextUnset(tr_bitfield const* a, tr_bitfield const* b, size_t begin, size_t end);
+
+/** @brief Find the first bit in [begin, end) that's set in `a' or `b', or `end' if there isn't one. */
+size_t tr_bitfieldFindNextSet(tr_bitfield const* a, tr_bitfield const* b, size_t begin, size_t end);
+
+/**
+ * @brief Add `delta' to `counts[i]' for each bit `i' in [0, n) that's set.
+ *
+ * The counts wrap around like any other uint16_t. Empty words are skipped
+ * and the rest are added without branching, so this is much cheaper than
+ * calling tr_bitfieldHas() for every bit.
+ */
+void tr_bitfieldAddToCounts(tr_bitfield const* b, uint16_t* counts, size_t n, int delta);
+
+/** @brief Check whether any bit in [0, end) is set in both `a' and `b'. */
+bool tr_bitfieldIntersects(tr_bitfield const* a, tr_bitfield const* b, size_t end);
+
 static inline bool tr_bitfieldHasAll(tr_bitfield const* b)
 {
     return b->bit_count != 0 ? (b->true_count == b->bit_count) : b->have_all_hint;
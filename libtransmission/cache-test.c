@@ -0,0 +1,580 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <string.h> /* memset() */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "cache.h"
+#include "crypto-utils.h" /* tr_rand_int_weak() */
+#include "diskio.h"
+#include "file.h"
+#include "inout.h"
+#include "torrent.h"
+#include "trevent.h"
+#include "utils.h" /* tr_time() */
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+/***
+****
+***/
+
+struct test_cache_data
+{
+    tr_session* session;
+    tr_torrent* tor;
+    void (* func)(struct test_cache_data*);
+    int err;
+    bool done;
+};
+
+static void test_cache_threadfunc(void* vdata)
+{
+    struct test_cache_data* data = vdata;
+    data->func(data);
+    data->done = true;
+}
+
+static void run_in_event_thread(struct test_cache_data* data, void (* func)(struct test_cache_data*))
+{
+    data->func = func;
+    data->err = 0;
+    data->done = false;
+    tr_runInEventThread(data->session, test_cache_threadfunc, data);
+
+    do
+    {
+        tr_wait_msec(10);
+    }
+    while (!data->done);
+}
+
+static void fill_block(tr_torrent const* tor, tr_block_index_t block, uint8_t* buf)
+{
+    memset(buf, (int)(block % 251) + 1, tr_torBlockCountBytes(tor, block));
+}
+
+static void write_block(struct test_cache_data* data, tr_block_index_t block)
+{
+    tr_torrent* tor = data->tor;
+    uint32_t const len = tr_torBlockCountBytes(tor, block);
+    uint64_t const offset = (uint64_t)block * tor->blockSize;
+    tr_piece_index_t const piece = offset / tor->info.pieceSize;
+    uint8_t* buf = tr_new(uint8_t, len);
+    struct evbuffer* evbuf = evbuffer_new();
+
+    fill_block(tor, block, buf);
+    evbuffer_add(evbuf, buf, len);
+
+    if (data->err == 0)
+    {
+        data->err = tr_cacheWriteBlock(data->session->cache, tor, piece, offset - (uint64_t)piece * tor->info.pieceSize, len,
+            evbuf);
+    }
+
+    evbuffer_free(evbuf);
+    tr_free(buf);
+}
+
+/* write every block, in random order, through a cache too small to hold them all */
+static void write_all_blocks_shuffled(struct test_cache_data* data)
+{
+    tr_torrent* tor = data->tor;
+    tr_block_index_t* order = tr_new(tr_block_index_t, tor->blockCount);
+
+    for (tr_block_index_t i = 0; i < tor->blockCount; ++i)
+    {
+        order[i] = i;
+    }
+
+    for (tr_block_index_t i = tor->blockCount - 1; i > 0; --i)
+    {
+        int const j = tr_rand_int_weak(i + 1);
+        tr_block_index_t const tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    tr_cacheSetLimit(data->session->cache, tor->blockSize * 8);
+
+    for (tr_block_index_t i = 0; i < tor->blockCount; ++i)
+    {
+        write_block(data, order[i]);
+    }
+
+    tr_free(order);
+}
+
+static bool check_blocks(tr_torrent* tor, bool use_cache)
+{
+    bool ok = true;
+    uint8_t* expected = tr_new(uint8_t, tor->blockSize);
+    uint8_t* actual = tr_new(uint8_t, tor->blockSize);
+
+    for (tr_block_index_t block = 0; ok && block < tor->blockCount; ++block)
+    {
+        uint32_t const len = tr_torBlockCountBytes(tor, block);
+        uint64_t const offset = (uint64_t)block * tor->blockSize;
+        tr_piece_index_t const piece = offset / tor->info.pieceSize;
+        uint32_t const piece_offset = offset - (uint64_t)piece * tor->info.pieceSize;
+        int err;
+
+        fill_block(tor, block, expected);
+
+        if (use_cache)
+        {
+            err = tr_cacheReadBlock(tor->session->cache, tor, piece, piece_offset, len, actual);
+        }
+        else
+        {
+            err = tr_ioRead(tor, piece, piece_offset, len, actual);
+        }
+
+        ok = err == 0 && memcmp(expected, actual, len) == 0;
+    }
+
+    tr_free(actual);
+    tr_free(expected);
+    return ok;
+}
+
+static void check_blocks_through_cache(struct test_cache_data* data)
+{
+    data->err = check_blocks(data->tor, true) ? 0 : 1;
+}
+
+static void check_block_read(void* vdata, int err, tr_piece_index_t piece, uint32_t offset, uint32_t length,
+    uint8_t const* block)
+{
+    struct test_cache_data* data = vdata;
+    tr_torrent* tor = data->tor;
+    tr_block_index_t const index = _tr_block(tor, piece, offset);
+    uint8_t* expected = tr_new(uint8_t, length);
+
+    fill_block(tor, index, expected);
+
+    if (data->err == 0 && (err != 0 || length != tr_torBlockCountBytes(tor, index) || memcmp(expected, block, length) != 0))
+    {
+        data->err = 1;
+    }
+
+    tr_free(expected);
+}
+
+static void check_blocks_async(struct test_cache_data* data)
+{
+    tr_torrent* tor = data->tor;
+
+    for (tr_block_index_t block = 0; block < tor->blockCount; ++block)
+    {
+        uint64_t const offset = (uint64_t)block * tor->blockSize;
+        tr_piece_index_t const piece = offset / tor->info.pieceSize;
+
+        tr_cacheReadBlockAsync(data->session->cache, tor, piece, offset - (uint64_t)piece * tor->info.pieceSize,
+            tr_torBlockCountBytes(tor, block), check_block_read, data);
+    }
+
+    tr_diskioWait(data->session->diskio, tor);
+}
+
+static void flush_torrent(struct test_cache_data* data)
+{
+    data->err = tr_cacheFlushTorrent(data->session->cache, data->tor);
+}
+
+static void flush_files(struct test_cache_data* data)
+{
+    for (tr_file_index_t i = 0; data->err == 0 && i < data->tor->info.fileCount; ++i)
+    {
+        data->err = tr_cacheFlushFile(data->session->cache, data->tor, i);
+    }
+}
+
+static void check_blocks_on_disk(struct test_cache_data* data)
+{
+    data->err = check_blocks(data->tor, false) ? 0 : 1;
+}
+
+static int test_cache_write_flush_impl(void (* flush)(struct test_cache_data*), int disk_io_threads, int queue_depth,
+    bool io_uring)
+{
+    struct test_cache_data data;
+    tr_variant settings;
+
+    tr_variantInitDict(&settings, 3);
+    tr_variantDictAddInt(&settings, TR_KEY_disk_io_queue_depth, queue_depth);
+    tr_variantDictAddInt(&settings, TR_KEY_disk_io_threads, disk_io_threads);
+    tr_variantDictAddBool(&settings, TR_KEY_io_uring_enabled, io_uring);
+    data.session = libttest_session_init(&settings);
+    tr_variantFree(&settings);
+    data.tor = libttest_zero_torrent_init(data.session);
+    libttest_zero_torrent_populate(data.tor, true);
+
+    run_in_event_thread(&data, write_all_blocks_shuffled);
+    check_int(data.err, ==, 0);
+
+    /* whatever is cached, being written, or trimmed to disk should read back the same */
+    run_in_event_thread(&data, check_blocks_through_cache);
+    check_int(data.err, ==, 0);
+
+    run_in_event_thread(&data, check_blocks_async);
+    check_int(data.err, ==, 0);
+
+    run_in_event_thread(&data, flush);
+    check_int(data.err, ==, 0);
+
+    /* after the flush, everything should be on disk */
+    run_in_event_thread(&data, check_blocks_on_disk);
+    check_int(data.err, ==, 0);
+
+    tr_torrentRemove(data.tor, true, tr_sys_path_remove);
+    libttest_session_close(data.session);
+    return 0;
+}
+
+static int test_cache_flush_torrent(void)
+{
+    return test_cache_write_flush_impl(flush_torrent, 4, 1, false);
+}
+
+static int test_cache_flush_file(void)
+{
+    return test_cache_write_flush_impl(flush_files, 4, 1, false);
+}
+
+/* with no disk threads, all the I/O happens in place */
+static int test_cache_flush_in_place(void)
+{
+    return test_cache_write_flush_impl(flush_torrent, 0, 1, false);
+}
+
+/* several threads writing to the same device at once */
+static int test_cache_flush_queue_depth(void)
+{
+    return test_cache_write_flush_impl(flush_torrent, 4, 4, false);
+}
+
+/* where io_uring isn't available, this falls back to the disk threads */
+static int test_cache_flush_io_uring(void)
+{
+    return test_cache_write_flush_impl(flush_torrent, 4, 1, true);
+}
+
+/***
+****
+***/
+
+static void write_all_blocks(struct test_cache_data* data)
+{
+    tr_cacheSetSyncEnabled(data->session->cache, true);
+    data->err = tr_cacheSetLimit(data->session->cache, 4 * 1024 * 1024);
+
+    for (tr_block_index_t i = 0; i < data->tor->blockCount; ++i)
+    {
+        write_block(data, i);
+    }
+}
+
+static void flush_pulse_now(struct test_cache_data* data)
+{
+    /* the pieces are complete, but they haven't sat for long enough to be written */
+    data->err = tr_cacheFlushPulse(data->session->cache, data->session);
+    tr_diskioWait(data->session->diskio, NULL);
+}
+
+static void flush_pulse_later(struct test_cache_data* data)
+{
+    /* the pieces are complete, so once they've sat for a while the pulse writes them out */
+    tr_timeUpdate(tr_time() + 60);
+    data->err = tr_cacheFlushPulse(data->session->cache, data->session);
+    tr_diskioWait(data->session->diskio, NULL);
+}
+
+static int test_cache_flush_pulse(void)
+{
+    struct test_cache_data data;
+
+    data.session = libttest_session_init(NULL);
+    data.tor = libttest_zero_torrent_init(data.session);
+    libttest_zero_torrent_populate(data.tor, true);
+
+    /* the whole torrent fits, so nothing is flushed as it's written */
+    run_in_event_thread(&data, write_all_blocks);
+    check_int(data.err, ==, 0);
+    run_in_event_thread(&data, check_blocks_on_disk);
+    check_int(data.err, !=, 0);
+
+    run_in_event_thread(&data, flush_pulse_now);
+    check_int(data.err, ==, 0);
+    run_in_event_thread(&data, check_blocks_on_disk);
+    check_int(data.err, !=, 0);
+
+    run_in_event_thread(&data, flush_pulse_later);
+    check_int(data.err, ==, 0);
+    run_in_event_thread(&data, check_blocks_on_disk);
+    check_int(data.err, ==, 0);
+
+    tr_torrentRemove(data.tor, true, tr_sys_path_remove);
+    libttest_session_close(data.session);
+    return 0;
+}
+
+/***
+****
+***/
+
+static void count_block_read(void* vdata, int err, tr_piece_index_t piece UNUSED, uint32_t offset UNUSED,
+    uint32_t length UNUSED, uint8_t const* block UNUSED)
+{
+    struct test_cache_data* data = vdata;
+
+    if (err != 0 && data->err == 0)
+    {
+        data->err = err;
+    }
+}
+
+static void read_first_blocks(struct test_cache_data* data)
+{
+    tr_torrent* tor = data->tor;
+
+    /* both blocks are in piece 0, which gets read from disk in one go */
+    tr_cacheReadBlockAsync(data->session->cache, tor, 0, 0, tor->blockSize, count_block_read, data);
+    tr_cacheReadBlockAsync(data->session->cache, tor, 0, tor->blockSize, tor->blockSize, count_block_read, data);
+    tr_diskioWait(data->session->diskio, tor);
+
+    /* and now they're both in the read cache */
+    tr_cacheReadBlockAsync(data->session->cache, tor, 0, 0, tor->blockSize, count_block_read, data);
+    tr_cacheReadBlockAsync(data->session->cache, tor, 0, tor->blockSize, tor->blockSize, count_block_read, data);
+}
+
+static void read_first_block_sync(struct test_cache_data* data)
+{
+    uint8_t* expected = tr_new(uint8_t, data->tor->blockSize);
+    uint8_t* actual = tr_new(uint8_t, data->tor->blockSize);
+
+    data->err = tr_ioRead(data->tor, 0, 0, data->tor->blockSize, expected);
+
+    if (data->err == 0)
+    {
+        data->err = tr_cacheReadBlock(data->session->cache, data->tor, 0, 0, data->tor->blockSize, actual);
+    }
+
+    if (data->err == 0 && memcmp(expected, actual, data->tor->blockSize) != 0)
+    {
+        data->err = 1;
+    }
+
+    tr_free(actual);
+    tr_free(expected);
+}
+
+static void read_ahead(struct test_cache_data* data)
+{
+    tr_torrent* tor = data->tor;
+    uint64_t const len = 2 * (uint64_t)tor->info.pieceSize;
+
+    /* read pieces 1 and 2 ahead, then ask for a block from each */
+    if (tr_cacheReadAhead(data->session->cache, tor, 1, 0, len) != len)
+    {
+        data->err = 1;
+    }
+
+    tr_diskioWait(data->session->diskio, tor);
+
+    tr_cacheReadBlockAsync(data->session->cache, tor, 1, tor->blockSize, tor->blockSize, count_block_read, data);
+    tr_cacheReadBlockAsync(data->session->cache, tor, 2, 0, tor->blockSize, count_block_read, data);
+}
+
+static void set_large_cache(struct test_cache_data* data)
+{
+    data->err = tr_cacheSetLimit(data->session->cache, 4 * 1024 * 1024);
+}
+
+static void set_no_cache(struct test_cache_data* data)
+{
+    data->err = tr_cacheSetLimit(data->session->cache, 0);
+}
+
+static int test_cache_read_cache(void)
+{
+    struct test_cache_data data;
+    tr_cache_stats stats;
+
+    data.session = libttest_session_init(NULL);
+    data.tor = libttest_zero_torrent_init(data.session);
+    libttest_zero_torrent_populate(data.tor, true);
+    check_uint(tr_torPieceCountBytes(data.tor, 0), >=, 2 * data.tor->blockSize);
+    check_uint(data.tor->info.pieceCount, >=, 4);
+
+    run_in_event_thread(&data, set_large_cache);
+    check_int(data.err, ==, 0);
+
+    tr_cacheGetStats(data.session->cache, &stats);
+    check_uint(stats.read_hits, ==, 0);
+    check_uint(stats.read_misses, ==, 0);
+
+    /* one disk read for the piece, then three hits */
+    run_in_event_thread(&data, read_first_blocks);
+    check_int(data.err, ==, 0);
+    tr_cacheGetStats(data.session->cache, &stats);
+    check_uint(stats.read_misses, ==, 1);
+    check_uint(stats.read_hits, ==, 3);
+
+    run_in_event_thread(&data, read_first_block_sync);
+    check_int(data.err, ==, 0);
+    tr_cacheGetStats(data.session->cache, &stats);
+    check_uint(stats.read_misses, ==, 1);
+    check_uint(stats.read_hits, ==, 4);
+
+    run_in_event_thread(&data, read_ahead);
+    check_int(data.err, ==, 0);
+    tr_cacheGetStats(data.session->cache, &stats);
+    check_uint(stats.read_misses, ==, 1);
+    check_uint(stats.read_hits, ==, 6);
+
+    /* shrinking the cache evicts the clean blocks */
+    run_in_event_thread(&data, set_no_cache);
+    check_int(data.err, ==, 0);
+    tr_cacheGetStats(data.session->cache, &stats);
+    check_uint(stats.read_evictions, >, 0);
+
+    tr_torrentRemove(data.tor, true, tr_sys_path_remove);
+    libttest_session_close(data.session);
+    return 0;
+}
+
+/***
+****
+***/
+
+/* write piece 0's blocks, which the torrent doesn't have yet, as zeros */
+static void write_first_piece(struct test_cache_data* data, bool reversed, tr_block_index_t bad_block)
+{
+    tr_torrent* tor = data->tor;
+    tr_block_index_t first;
+    tr_block_index_t last;
+    struct evbuffer* evbuf = evbuffer_new();
+
+    tr_torGetPieceBlockRange(tor, 0, &first, &last);
+
+    for (tr_block_index_t i = first; data->err == 0 && i <= last; ++i)
+    {
+        tr_block_index_t const block = reversed ? last - (i - first) : i;
+        uint32_t const len = tr_torBlockCountBytes(tor, block);
+        uint8_t* buf = tr_new0(uint8_t, len);
+
+        if (block == bad_block)
+        {
+            buf[0] = 1;
+        }
+
+        evbuffer_add(evbuf, buf, len);
+        data->err = tr_cacheWriteBlock(data->session->cache, tor, 0, (block - first) * tor->blockSize, len, evbuf);
+        tr_free(buf);
+    }
+
+    evbuffer_free(evbuf);
+}
+
+static void write_first_piece_in_order(struct test_cache_data* data)
+{
+    write_first_piece(data, false, data->tor->blockCount);
+    data->err = data->err == 0 && tr_ioTestPiece(data->tor, 0) ? 0 : 1;
+}
+
+static void write_first_piece_reversed(struct test_cache_data* data)
+{
+    write_first_piece(data, true, data->tor->blockCount);
+    data->err = data->err == 0 && tr_ioTestPiece(data->tor, 0) ? 0 : 1;
+}
+
+static void set_one_block_cache(struct test_cache_data* data)
+{
+    data->err = tr_cacheSetLimit(data->session->cache, data->tor->blockSize);
+}
+
+static void write_first_piece_with_bad_block(struct test_cache_data* data)
+{
+    write_first_piece(data, false, 1);
+    data->err = data->err == 0 && !tr_ioTestPiece(data->tor, 0) ? 0 : 1;
+}
+
+static int test_cache_piece_hash(void)
+{
+    struct test_cache_data data;
+    tr_cache_stats before;
+    tr_cache_stats stats;
+
+    data.session = libttest_session_init(NULL);
+    data.tor = libttest_zero_torrent_init(data.session);
+    libttest_zero_torrent_populate(data.tor, false);
+    check_uint(data.tor->blockCount, >, 2);
+
+    run_in_event_thread(&data, set_large_cache);
+    check_int(data.err, ==, 0);
+
+    /* blocks that come in order are hashed as they're written, so there's nothing to read back */
+    run_in_event_thread(&data, write_first_piece_in_order);
+    check_int(data.err, ==, 0);
+    tr_cacheGetStats(data.session->cache, &stats);
+    check_uint(stats.read_hits, ==, 0);
+    check_uint(stats.read_misses, ==, 0);
+
+    /* blocks that come early wait in the cache for the ones before them */
+    run_in_event_thread(&data, write_first_piece_reversed);
+    check_int(data.err, ==, 0);
+    tr_cacheGetStats(data.session->cache, &stats);
+    check_uint(stats.read_hits, ==, 0);
+    check_uint(stats.read_misses, ==, 0);
+
+    run_in_event_thread(&data, write_first_piece_with_bad_block);
+    check_int(data.err, ==, 0);
+
+    /* past the high watermark, early blocks still aren't flushed while the cache has room for them */
+    run_in_event_thread(&data, set_one_block_cache);
+    check_int(data.err, ==, 0);
+    tr_cacheGetStats(data.session->cache, &before);
+    run_in_event_thread(&data, write_first_piece_reversed);
+    check_int(data.err, ==, 0);
+    tr_cacheGetStats(data.session->cache, &stats);
+    check_uint(stats.read_hits, ==, before.read_hits);
+    check_uint(stats.read_misses, ==, before.read_misses);
+
+    /* with no room to keep them, early blocks are read back instead */
+    run_in_event_thread(&data, set_no_cache);
+    check_int(data.err, ==, 0);
+    run_in_event_thread(&data, write_first_piece_reversed);
+    check_int(data.err, ==, 0);
+    tr_cacheGetStats(data.session->cache, &stats);
+    check_uint(stats.read_hits + stats.read_misses, >, 0);
+
+    tr_torrentRemove(data.tor, true, tr_sys_path_remove);
+    libttest_session_close(data.session);
+    return 0;
+}
+
+int main(void)
+{
+    testFunc const tests[] =
+    {
+        test_cache_flush_torrent,
+        test_cache_flush_file,
+        test_cache_flush_in_place,
+        test_cache_flush_queue_depth,
+        test_cache_flush_io_uring,
+        test_cache_flush_pulse,
+        test_cache_read_cache,
+        test_cache_piece_hash
+    };
+
+    return runTests(tests, NUM_TESTS(tests));
+}
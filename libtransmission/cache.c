@@ -7,15 +7,20 @@
  */
 
 #include <stdlib.h> /* qsort() */
+#include <string.h> /* memcpy() */
 
 #include <event2/buffer.h>
 
 #include "transmission.h"
 #include "cache.h"
-#include "inout.h"
+#include "crypto-utils.h" /* tr_sha1_init(), tr_sha1_update() */
+#include "diskio.h"
+#include "file.h" /* tr_sys_file_iovec */
+#include "inout.h" /* tr_ioFindFileLocation() */
 #include "log.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
 #include "ptrarray.h"
+#include "session.h"
 #include "torrent.h"
 #include "tr-assert.h"
 #include "trevent.h"
@@ -29,6 +34,46 @@
 *****
 ****/
 
+/* Blocks are indexed per-torrent in a two-level radix table keyed by block
+ * index, so lookup and insertion are O(1). Contiguous blocks are grouped
+ * into runs; the runs live in a binary heap ordered by flush priority, and
+ * are kept up to date as blocks arrive so that trimming never has to rescan
+ * the whole cache.
+ *
+ * Flushed runs are handed to the disk workers, and their blocks stay
+ * readable from here until the write completes.
+ *
+ * Most flushing is done by tr_cacheFlushPulse() once a second, rather than
+ * when the cache overflows, so that the disks see a steady trickle of
+ * writes instead of bursts: completed pieces are written once they've aged
+ * a little, and if the cache is above its low watermark, the best runs are
+ * written until it's back down. Only if the cache fills past the high
+ * watermark between pulses does a write have to flush in place. */
+
+enum
+{
+    /* percentages of the cache size */
+    CACHE_HIGH_WATERMARK = 75,
+    CACHE_LOW_WATERMARK = 50,
+
+    /* how long a completed piece waits for its neighbours, so
+       that they can be written together, before it's flushed */
+    CACHE_FLUSH_AGE_SECS = 5,
+
+    /* how often the files that were written to are synced, if that's enabled */
+    CACHE_SYNC_INTERVAL_SECS = 10,
+
+    CACHE_ALL_TORRENTS = -1
+};
+
+#define CACHE_ALL_FILES ((tr_file_index_t)-1)
+
+#define CACHE_PAGE_BITS 8
+#define CACHE_PAGE_SIZE (1u << CACHE_PAGE_BITS)
+#define CACHE_PAGE_MASK (CACHE_PAGE_SIZE - 1)
+
+struct cache_run;
+
 struct cache_block
 {
     tr_torrent* tor;
@@ -40,204 +85,1600 @@ struct cache_block
     time_t time;
     tr_block_index_t block;
 
-    struct evbuffer* evbuf;
+    /* only valid for the first and last blocks of a run */
+    struct cache_run* run;
+
+    uint8_t* data;
+};
+
+struct cache_free_page
+{
+    struct cache_free_page* next;
+};
+
+struct cache_page
+{
+    int block_count;
+    struct cache_block* blocks[CACHE_PAGE_SIZE];
+};
+
+struct cache_torrent
+{
+    tr_torrent* tor;
+    int unique_id;
+
+    struct cache_page** pages;
+    size_t page_count;
+    int block_count;
+};
+
+struct cache_run
+{
+    struct cache_torrent* ct;
+
+    tr_block_index_t first;
+    tr_block_index_t last;
+
+    time_t last_block_time;
+    bool is_multi_piece;
+    bool is_piece_done;
+    bool is_ahead_of_hash;
+
+    /* position in tr_cache.runs, or -1 if it's been taken out to be flushed */
+    int heap_pos;
+
+    /* its place in tr_cache's list of done runs, if its piece is done */
+    bool is_in_done_list;
+    time_t done_time;
+    struct cache_run* done_prev;
+    struct cache_run* done_next;
+};
+
+/* one block of a flushed run, indexed in tr_cache.writes */
+struct cache_write_entry
+{
+    int unique_id;
+    tr_block_index_t block;
+    struct cache_block* cb;
+};
+
+/* a flushed run that the disk workers are writing */
+struct cache_write
+{
+    struct tr_cache* cache;
+    unsigned int block_count;
+    struct cache_write_entry* entries;
+};
+
+/* the read cache's queues; see "Read cache" below */
+enum
+{
+    CLEAN_A1IN,
+    CLEAN_AM,
+    CLEAN_A1OUT,
+    CLEAN_QUEUE_COUNT
+};
+
+/* a file that's been written to since it was last synced */
+struct cache_unsynced
+{
+    int unique_id;
+    tr_file_index_t file;
+};
+
+/* a clean block in the read cache, or the ghost of one that was evicted */
+struct cache_clean
+{
+    int unique_id;
+    tr_block_index_t block;
+    uint32_t length;
+    int queue;
+
+    /* NULL for ghosts */
+    uint8_t* data;
+
+    struct cache_clean* hash_next;
+    struct cache_clean* prev;
+    struct cache_clean* next;
+};
+
+struct cache_queue
+{
+    struct cache_clean* head; /* most recently used */
+    struct cache_clean* tail;
+    int count;
+};
+
+struct cache_read_waiter
+{
+    uint32_t offset;
+    uint32_t length;
+    tr_diskio_done_func done_func;
+    void* user_data;
+};
+
+/* the SHA-1 of a piece that's being downloaded, as far as it's been written in order */
+struct cache_piece_hash
+{
+    int unique_id;
+    tr_piece_index_t piece;
+    uint32_t length;
+    tr_sha1_ctx_t sha;
+};
+
+/* a disk read of (usually) a whole piece, and the requests waiting for it */
+struct cache_piece_read
+{
+    struct tr_cache* cache;
+    tr_torrent* tor;
+    tr_piece_index_t piece;
+    uint32_t offset;
+    uint32_t length;
+
+    struct cache_read_waiter* waiters;
+    int waiter_count;
+};
+
+struct tr_cache
+{
+    tr_ptrArray torrents; /* struct cache_torrent*, sorted by unique_id */
+    tr_ptrArray runs; /* struct cache_run*, a max-heap ordered by compareRuns() */
+    struct cache_run* done_head; /* the runs of done pieces, oldest done_time first */
+    struct cache_run* done_tail;
+    tr_ptrArray slabs; /* uint8_t*, each holding CACHE_SLAB_PAGES block payloads */
+    tr_ptrArray writes; /* struct cache_write_entry*, sorted by compareWriteEntries() */
+    struct cache_free_page* free_pages;
+    int block_count;
+    int write_block_count;
+    int max_blocks;
+    size_t max_bytes;
+
+    /* the first error from the writes that finished during a flush */
+    int write_err;
+
+    bool is_sync_enabled;
+    time_t next_sync_time;
+    tr_ptrArray unsynced; /* struct cache_unsynced*, sorted by compareUnsynced() */
+
+    struct cache_clean** clean_buckets;
+    size_t clean_bucket_count;
+    size_t clean_entry_count;
+    struct cache_queue clean_queues[CLEAN_QUEUE_COUNT];
+    tr_ptrArray piece_reads; /* struct cache_piece_read* */
+
+    tr_ptrArray piece_hashes; /* struct cache_piece_hash*, sorted by compareHashes() */
+
+    uint64_t read_hits;
+    uint64_t read_misses;
+    uint64_t read_evictions;
+
+    size_t disk_writes;
+    size_t disk_write_bytes;
+    size_t cache_writes;
+    size_t cache_write_bytes;
 };
 
-struct tr_cache
+/****
+*****  Slab pool
+****/
+
+/* Block payloads live in fixed-size MAX_BLOCK_SIZE pages carved out of
+ * larger slabs, so the steady stream of incoming blocks doesn't churn the
+ * allocator, and flushes hand the pages straight to tr_ioWritev(). */
+
+#define CACHE_SLAB_PAGES 64
+
+static uint8_t* slabAllocPage(tr_cache* cache)
+{
+    struct cache_free_page* page;
+
+    if (cache->free_pages == NULL)
+    {
+        uint8_t* slab = tr_valloc(CACHE_SLAB_PAGES * MAX_BLOCK_SIZE);
+
+        for (int i = CACHE_SLAB_PAGES - 1; i >= 0; --i)
+        {
+            page = (struct cache_free_page*)(slab + i * MAX_BLOCK_SIZE);
+            page->next = cache->free_pages;
+            cache->free_pages = page;
+        }
+
+        tr_ptrArrayAppend(&cache->slabs, slab);
+    }
+
+    page = cache->free_pages;
+    cache->free_pages = page->next;
+    return (uint8_t*)page;
+}
+
+static void slabFreePage(tr_cache* cache, uint8_t* data)
+{
+    struct cache_free_page* page = (struct cache_free_page*)data;
+
+    page->next = cache->free_pages;
+    cache->free_pages = page;
+}
+
+/* give the slabs back to the system once nothing is cached */
+static void slabReleaseIfEmpty(tr_cache* cache)
+{
+    if (cache->block_count == 0 && cache->write_block_count == 0 &&
+        cache->clean_queues[CLEAN_A1IN].count + cache->clean_queues[CLEAN_AM].count == 0)
+    {
+        tr_ptrArrayDestruct(&cache->slabs, tr_free);
+        cache->slabs = TR_PTR_ARRAY_INIT;
+        cache->free_pages = NULL;
+    }
+}
+
+/****
+*****  Per-torrent block index
+****/
+
+static int compareTorrentId(void const* va, void const* vb)
+{
+    struct cache_torrent const* a = va;
+    struct cache_torrent const* b = vb;
+
+    if (a->unique_id != b->unique_id)
+    {
+        return a->unique_id < b->unique_id ? -1 : 1;
+    }
+
+    return 0;
+}
+
+static struct cache_torrent* findTorrent(tr_cache* cache, tr_torrent const* tor)
+{
+    struct cache_torrent key;
+    key.unique_id = tor->uniqueId;
+    return tr_ptrArrayFindSorted(&cache->torrents, &key, compareTorrentId);
+}
+
+static struct cache_torrent* getTorrent(tr_cache* cache, tr_torrent* tor)
+{
+    struct cache_torrent* ct = findTorrent(cache, tor);
+
+    if (ct == NULL)
+    {
+        ct = tr_new0(struct cache_torrent, 1);
+        ct->tor = tor;
+        ct->unique_id = tor->uniqueId;
+        ct->page_count = (tor->blockCount + CACHE_PAGE_MASK) >> CACHE_PAGE_BITS;
+        ct->pages = tr_new0(struct cache_page*, ct->page_count);
+        tr_ptrArrayInsertSorted(&cache->torrents, ct, compareTorrentId);
+    }
+
+    return ct;
+}
+
+static void releaseTorrentIfEmpty(tr_cache* cache, struct cache_torrent* ct)
+{
+    if (ct->block_count == 0)
+    {
+        tr_ptrArrayRemoveSortedPointer(&cache->torrents, ct, compareTorrentId);
+        tr_free(ct->pages);
+        tr_free(ct);
+    }
+
+    slabReleaseIfEmpty(cache);
+}
+
+static inline struct cache_block* getBlock(struct cache_torrent const* ct, tr_block_index_t block)
+{
+    size_t const page = block >> CACHE_PAGE_BITS;
+
+    if (page >= ct->page_count || ct->pages[page] == NULL)
+    {
+        return NULL;
+    }
+
+    return ct->pages[page]->blocks[block & CACHE_PAGE_MASK];
+}
+
+static void setBlock(tr_cache* cache, struct cache_torrent* ct, struct cache_block* cb)
+{
+    size_t const page = cb->block >> CACHE_PAGE_BITS;
+
+    TR_ASSERT(page < ct->page_count);
+
+    if (ct->pages[page] == NULL)
+    {
+        ct->pages[page] = tr_new0(struct cache_page, 1);
+    }
+
+    TR_ASSERT(ct->pages[page]->blocks[cb->block & CACHE_PAGE_MASK] == NULL);
+
+    ct->pages[page]->blocks[cb->block & CACHE_PAGE_MASK] = cb;
+    ++ct->pages[page]->block_count;
+    ++ct->block_count;
+    ++cache->block_count;
+}
+
+static struct cache_block* takeBlock(tr_cache* cache, struct cache_torrent* ct, tr_block_index_t block)
+{
+    size_t const page = block >> CACHE_PAGE_BITS;
+    struct cache_page* p = ct->pages[page];
+    struct cache_block* cb = p->blocks[block & CACHE_PAGE_MASK];
+
+    TR_ASSERT(cb != NULL);
+
+    p->blocks[block & CACHE_PAGE_MASK] = NULL;
+
+    if (--p->block_count == 0)
+    {
+        tr_free(p);
+        ct->pages[page] = NULL;
+    }
+
+    --ct->block_count;
+    --cache->block_count;
+    return cb;
+}
+
+/* find the first cached block in [begin, end) */
+static struct cache_block* findNextBlock(struct cache_torrent const* ct, tr_block_index_t begin, tr_block_index_t end)
+{
+    while (begin < end)
+    {
+        struct cache_page const* p = ct->pages[begin >> CACHE_PAGE_BITS];
+
+        if (p == NULL)
+        {
+            begin = (begin | CACHE_PAGE_MASK) + 1;
+            continue;
+        }
+
+        if (p->blocks[begin & CACHE_PAGE_MASK] != NULL)
+        {
+            return p->blocks[begin & CACHE_PAGE_MASK];
+        }
+
+        ++begin;
+    }
+
+    return NULL;
+}
+
+/****
+*****  Runs
+****/
+
+static inline unsigned int runLength(struct cache_run const* run)
+{
+    return run->last - run->first + 1;
+}
+
+/* Higher priority comes first:
+ *   - Flushing stale blocks should be a top priority as the probability of them
+ *     growing is very small, for blocks on piece boundaries, and nonexistant for
+ *     blocks inside pieces.
+ *   - Runs that are waiting for the blocks before them, so that their piece can
+ *     be hashed in order, go last. They're only flushed if the cache is full.
+ *   - Move the multi piece runs higher.
+ *   - Otherwise, longer runs and runs that have languished in the cache go first.
+ *     The age adds ~2 to the relative length of a run for every minute, and since
+ *     every run ages at the same rate the ordering doesn't depend on the time. */
+static int compareRuns(struct cache_run const* a, struct cache_run const* b)
+{
+    int64_t ascore;
+    int64_t bscore;
+
+    if (a->is_piece_done != b->is_piece_done)
+    {
+        return a->is_piece_done ? 1 : -1;
+    }
+
+    if (a->is_ahead_of_hash != b->is_ahead_of_hash)
+    {
+        return a->is_ahead_of_hash ? -1 : 1;
+    }
+
+    if (a->is_multi_piece != b->is_multi_piece)
+    {
+        return a->is_multi_piece ? 1 : -1;
+    }
+
+    ascore = (int64_t)runLength(a) * 32 - a->last_block_time;
+    bscore = (int64_t)runLength(b) * 32 - b->last_block_time;
+
+    if (ascore != bscore)
+    {
+        return ascore > bscore ? 1 : -1;
+    }
+
+    return 0;
+}
+
+static inline struct cache_run* heapNth(tr_cache* cache, int pos)
+{
+    return tr_ptrArrayNth(&cache->runs, pos);
+}
+
+static inline void heapSet(tr_cache* cache, int pos, struct cache_run* run)
+{
+    tr_ptrArrayBase(&cache->runs)[pos] = run;
+    run->heap_pos = pos;
+}
+
+static void heapSiftUp(tr_cache* cache, struct cache_run* run)
+{
+    int pos = run->heap_pos;
+
+    while (pos > 0)
+    {
+        int const parent = (pos - 1) / 2;
+        struct cache_run* p = heapNth(cache, parent);
+
+        if (compareRuns(p, run) >= 0)
+        {
+            break;
+        }
+
+        heapSet(cache, pos, p);
+        pos = parent;
+    }
+
+    heapSet(cache, pos, run);
+}
+
+static void heapSiftDown(tr_cache* cache, struct cache_run* run)
+{
+    int const n = tr_ptrArraySize(&cache->runs);
+    int pos = run->heap_pos;
+
+    for (;;)
+    {
+        int child = pos * 2 + 1;
+        struct cache_run* c;
+
+        if (child >= n)
+        {
+            break;
+        }
+
+        if (child + 1 < n && compareRuns(heapNth(cache, child + 1), heapNth(cache, child)) > 0)
+        {
+            ++child;
+        }
+
+        c = heapNth(cache, child);
+
+        if (compareRuns(run, c) >= 0)
+        {
+            break;
+        }
+
+        heapSet(cache, pos, c);
+        pos = child;
+    }
+
+    heapSet(cache, pos, run);
+}
+
+static void heapUpdate(tr_cache* cache, struct cache_run* run)
+{
+    heapSiftUp(cache, run);
+    heapSiftDown(cache, run);
+}
+
+static void heapAdd(tr_cache* cache, struct cache_run* run)
+{
+    run->heap_pos = tr_ptrArrayAppend(&cache->runs, run);
+    heapSiftUp(cache, run);
+}
+
+static void heapRemove(tr_cache* cache, struct cache_run* run)
+{
+    struct cache_run* back = tr_ptrArrayPop(&cache->runs);
+
+    if (back != run)
+    {
+        heapSet(cache, run->heap_pos, back);
+        heapUpdate(cache, back);
+    }
+
+    run->heap_pos = -1;
+}
+
+static struct cache_piece_hash* hashFind(tr_cache* cache, int unique_id, tr_piece_index_t piece);
+
+/* True if the run starts past the point that its piece has been hashed to, and
+ * the blocks in between are still to come. Once they do, the run is hashed
+ * from the cache; if it had been flushed, it'd have to be read back instead */
+static bool isRunAheadOfHash(tr_cache* cache, struct cache_run const* run)
+{
+    struct cache_block const* first = getBlock(run->ct, run->first);
+    tr_torrent const* tor = first->tor;
+    struct cache_piece_hash const* h;
+    uint32_t hashed;
+
+    if (tr_torrentPieceIsComplete(tor, first->piece))
+    {
+        return false;
+    }
+
+    h = hashFind(cache, run->ct->unique_id, first->piece);
+    hashed = h != NULL ? h->length : 0;
+
+    return first->offset > hashed && !tr_torrentBlockIsComplete(tor, _tr_block(tor, first->piece, hashed));
+}
+
+/* The runs whose pieces are done are also kept in a list in the order they
+ * were done, or last grew, so that the ones that have aged can be taken
+ * off the front without looking at every run */
+static void doneListRemove(tr_cache* cache, struct cache_run* run)
+{
+    if (!run->is_in_done_list)
+    {
+        return;
+    }
+
+    if (run->done_prev != NULL)
+    {
+        run->done_prev->done_next = run->done_next;
+    }
+    else
+    {
+        cache->done_head = run->done_next;
+    }
+
+    if (run->done_next != NULL)
+    {
+        run->done_next->done_prev = run->done_prev;
+    }
+    else
+    {
+        cache->done_tail = run->done_prev;
+    }
+
+    run->done_prev = NULL;
+    run->done_next = NULL;
+    run->is_in_done_list = false;
+}
+
+static void doneListAppend(tr_cache* cache, struct cache_run* run)
+{
+    doneListRemove(cache, run);
+
+    run->done_time = tr_time();
+    run->done_prev = cache->done_tail;
+    run->done_next = NULL;
+    run->is_in_done_list = true;
+
+    if (cache->done_tail != NULL)
+    {
+        cache->done_tail->done_next = run;
+    }
+    else
+    {
+        cache->done_head = run;
+    }
+
+    cache->done_tail = run;
+}
+
+static void runFree(tr_cache* cache, struct cache_run* run)
+{
+    doneListRemove(cache, run);
+    tr_free(run);
+}
+
+static void runRefresh(tr_cache* cache, struct cache_run* run, bool is_piece_done)
+{
+    struct cache_block const* first = getBlock(run->ct, run->first);
+    struct cache_block const* last = getBlock(run->ct, run->last);
+
+    run->last_block_time = last->time;
+    run->is_multi_piece = first->piece != last->piece;
+    run->is_piece_done = is_piece_done || tr_torrentPieceIsComplete(last->tor, last->piece);
+    run->is_ahead_of_hash = isRunAheadOfHash(cache, run);
+    heapUpdate(cache, run);
+
+    if (run->is_piece_done)
+    {
+        doneListAppend(cache, run);
+    }
+    else
+    {
+        doneListRemove(cache, run);
+    }
+}
+
+/* returns the run that `block' ends, or NULL if it's not the end of a run */
+static struct cache_run* getRunEndingAt(struct cache_torrent const* ct, tr_block_index_t block)
+{
+    struct cache_block const* cb = getBlock(ct, block);
+
+    if (cb == NULL || getBlock(ct, block + 1) != NULL)
+    {
+        return NULL;
+    }
+
+    return cb->run;
+}
+
+/* returns the run that contains `cb' */
+static struct cache_run* getRunContaining(struct cache_torrent const* ct, struct cache_block const* cb)
+{
+    tr_block_index_t last = cb->block;
+
+    while (getBlock(ct, last + 1) != NULL)
+    {
+        ++last;
+    }
+
+    return getBlock(ct, last)->run;
+}
+
+/* link a newly-indexed block into its neighbours' runs */
+static void runsAddBlock(tr_cache* cache, struct cache_torrent* ct, struct cache_block* cb)
+{
+    struct cache_block* prev = cb->block > 0 ? getBlock(ct, cb->block - 1) : NULL;
+    struct cache_block* next = getBlock(ct, cb->block + 1);
+    struct cache_run* run;
+
+    if (prev != NULL && next != NULL)
+    {
+        struct cache_run* right = next->run;
+
+        run = prev->run;
+        run->last = right->last;
+        getBlock(ct, right->last)->run = run;
+        heapRemove(cache, right);
+        runFree(cache, right);
+    }
+    else if (prev != NULL)
+    {
+        run = prev->run;
+        run->last = cb->block;
+    }
+    else if (next != NULL)
+    {
+        run = next->run;
+        run->first = cb->block;
+    }
+    else
+    {
+        run = tr_new0(struct cache_run, 1);
+        run->ct = ct;
+        run->first = cb->block;
+        run->last = cb->block;
+        heapAdd(cache, run);
+    }
+
+    cb->run = run;
+    runRefresh(cache, run, false);
+}
+
+/* this block finishes its piece, so bump any run that ends inside the piece */
+static void runsPieceDone(tr_cache* cache, struct cache_torrent* ct, tr_piece_index_t piece)
+{
+    tr_block_index_t first;
+    tr_block_index_t last;
+
+    tr_torGetPieceBlockRange(ct->tor, piece, &first, &last);
+
+    for (tr_block_index_t i = first; i <= last; ++i)
+    {
+        struct cache_run* run = getRunEndingAt(ct, i);
+
+        if (run != NULL)
+        {
+            runRefresh(cache, run, true);
+        }
+    }
+}
+
+/* returns the highest-priority run, refreshing pieces that completed
+   and hashes that caught up since it was ranked */
+static struct cache_run* getTopRun(tr_cache* cache)
+{
+    while (!tr_ptrArrayEmpty(&cache->runs))
+    {
+        struct cache_run* run = heapNth(cache, 0);
+        struct cache_block const* last = getBlock(run->ct, run->last);
+
+        if (!run->is_piece_done && tr_torrentPieceIsComplete(last->tor, last->piece))
+        {
+            run->is_piece_done = true;
+            heapUpdate(cache, run);
+            doneListAppend(cache, run);
+        }
+        else if (run->is_ahead_of_hash && !isRunAheadOfHash(cache, run))
+        {
+            run->is_ahead_of_hash = false;
+            heapUpdate(cache, run);
+        }
+        else
+        {
+            return run;
+        }
+    }
+
+    return NULL;
+}
+
+/****
+*****  Syncing
+****/
+
+static int compareUnsynced(void const* va, void const* vb)
+{
+    struct cache_unsynced const* a = va;
+    struct cache_unsynced const* b = vb;
+
+    if (a->unique_id != b->unique_id)
+    {
+        return a->unique_id < b->unique_id ? -1 : 1;
+    }
+
+    if (a->file != b->file)
+    {
+        return a->file < b->file ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/* note the files that a write of `len' bytes at `piece' and `offset' touches */
+static void markUnsynced(tr_cache* cache, tr_torrent const* tor, tr_piece_index_t piece, uint32_t offset, uint64_t len)
+{
+    struct cache_unsynced key;
+    uint64_t file_offset;
+
+    key.unique_id = tor->uniqueId;
+    tr_ioFindFileLocation(tor, piece, offset, &key.file, &file_offset);
+
+    for (; len > 0 && key.file < tor->info.fileCount; ++key.file, file_offset = 0)
+    {
+        uint64_t const n = MIN(len, tor->info.files[key.file].length - file_offset);
+
+        if (n > 0 && tr_ptrArrayFindSorted(&cache->unsynced, &key, compareUnsynced) == NULL)
+        {
+            tr_ptrArrayInsertSorted(&cache->unsynced, tr_memdup(&key, sizeof(key)), compareUnsynced);
+        }
+
+        len -= n;
+    }
+}
+
+/* queue a sync of each matching file, behind the writes that are already queued.
+   no matter how many times a file was written to, it's only synced once */
+static void syncFiles(tr_cache* cache, tr_session* session, int unique_id, tr_file_index_t file)
+{
+    for (int i = tr_ptrArraySize(&cache->unsynced) - 1; i >= 0; --i)
+    {
+        struct cache_unsynced* e = tr_ptrArrayNth(&cache->unsynced, i);
+        tr_torrent* tor;
+
+        if ((unique_id != CACHE_ALL_TORRENTS && e->unique_id != unique_id) || (file != CACHE_ALL_FILES && e->file != file))
+        {
+            continue;
+        }
+
+        if ((tor = tr_torrentFindFromId(session, e->unique_id)) != NULL)
+        {
+            tr_diskioSync(session->diskio, tor, e->file, NULL, NULL);
+        }
+
+        tr_ptrArrayRemove(&cache->unsynced, i);
+        tr_free(e);
+    }
+}
+
+/****
+*****  Flushing
+****/
+
+static int compareWriteEntries(void const* va, void const* vb)
+{
+    struct cache_write_entry const* a = va;
+    struct cache_write_entry const* b = vb;
+
+    if (a->unique_id != b->unique_id)
+    {
+        return a->unique_id < b->unique_id ? -1 : 1;
+    }
+
+    if (a->block != b->block)
+    {
+        return a->block < b->block ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/* A block that's written again while its first write is still in flight
+   takes over the index entry, since the newest data is the one to read back */
+static void writesAdd(tr_cache* cache, struct cache_write_entry* e)
+{
+    bool exact;
+    int const pos = tr_ptrArrayLowerBound(&cache->writes, e, compareWriteEntries, &exact);
+
+    if (exact)
+    {
+        tr_ptrArrayRemove(&cache->writes, pos);
+    }
+
+    tr_ptrArrayInsert(&cache->writes, e, pos);
+}
+
+static void writesRemove(tr_cache* cache, struct cache_write_entry const* e)
+{
+    bool exact;
+    int const pos = tr_ptrArrayLowerBound(&cache->writes, e, compareWriteEntries, &exact);
+
+    if (exact && tr_ptrArrayNth(&cache->writes, pos) == e)
+    {
+        tr_ptrArrayRemove(&cache->writes, pos);
+    }
+}
+
+static void onWriteDone(void* vw, int err, tr_piece_index_t piece UNUSED, uint32_t offset UNUSED,
+    uint32_t length UNUSED, uint8_t const* data UNUSED)
+{
+    struct cache_write* w = vw;
+    tr_cache* cache = w->cache;
+
+    for (unsigned int i = 0; i < w->block_count; ++i)
+    {
+        writesRemove(cache, &w->entries[i]);
+        slabFreePage(cache, w->entries[i].cb->data);
+        tr_free(w->entries[i].cb);
+    }
+
+    cache->write_block_count -= w->block_count;
+
+    if (err != 0 && cache->write_err == 0)
+    {
+        cache->write_err = err;
+    }
+
+    tr_free(w->entries);
+    tr_free(w);
+
+    slabReleaseIfEmpty(cache);
+}
+
+/* hand the tail [begin...run->last] of a run to the disk workers */
+static void flushContiguous(tr_cache* cache, struct cache_run* run, tr_block_index_t begin)
+{
+    struct cache_torrent* ct = run->ct;
+    tr_block_index_t const end = run->last + 1;
+    unsigned int const n = end - begin;
+    struct cache_write* w = tr_new(struct cache_write, 1);
+    tr_sys_file_iovec* iov = tr_new(tr_sys_file_iovec, n);
+    uint64_t bytes = 0;
+    tr_torrent* tor = ct->tor;
+
+    TR_ASSERT(run->first <= begin);
+    TR_ASSERT(begin <= run->last);
+
+    if (begin > run->first)
+    {
+        run->last = begin - 1;
+        getBlock(ct, run->last)->run = run;
+        runRefresh(cache, run, false);
+    }
+    else
+    {
+        if (run->heap_pos != -1)
+        {
+            heapRemove(cache, run);
+        }
+
+        runFree(cache, run);
+    }
+
+    w->cache = cache;
+    w->block_count = n;
+    w->entries = tr_new(struct cache_write_entry, n);
+
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        struct cache_write_entry* e = &w->entries[i];
+
+        e->unique_id = ct->unique_id;
+        e->block = begin + i;
+        e->cb = takeBlock(cache, ct, begin + i);
+        iov[i].base = e->cb->data;
+        iov[i].size = e->cb->length;
+        bytes += e->cb->length;
+        writesAdd(cache, e);
+    }
+
+    cache->write_block_count += n;
+
+    ++cache->disk_writes;
+    cache->disk_write_bytes += bytes;
+
+    if (cache->is_sync_enabled)
+    {
+        markUnsynced(cache, tor, w->entries[0].cb->piece, w->entries[0].cb->offset, bytes);
+    }
+
+    tr_diskioWritev(tor->session->diskio, tor, w->entries[0].cb->piece, w->entries[0].cb->offset, iov, n, onWriteDone, w);
+
+    tr_free(iov);
+}
+
+static void flushRun(tr_cache* cache, struct cache_run* run)
+{
+    struct cache_torrent* ct = run->ct;
+
+    flushContiguous(cache, run, run->first);
+    releaseTorrentIfEmpty(cache, ct);
+}
+
+static inline int getWatermark(tr_cache const* cache, int percent)
+{
+    return cache->max_blocks * percent / 100;
+}
+
+/* true if the disk holding the torrent already has plenty of writes to be getting on with */
+static bool isDeviceBacklogged(tr_cache const* cache, tr_torrent const* tor)
+{
+    return tr_diskioGetWriteBacklog(tor->session->diskio, tor) >= cache->max_bytes / 2;
+}
+
+static int compareRunPosition(void const* va, void const* vb)
+{
+    struct cache_run const* a = *(struct cache_run const* const*)va;
+    struct cache_run const* b = *(struct cache_run const* const*)vb;
+
+    if (a->ct->unique_id != b->ct->unique_id)
+    {
+        return a->ct->unique_id < b->ct->unique_id ? -1 : 1;
+    }
+
+    return a->first < b->first ? -1 : 1;
+}
+
+/* flush runs that have been taken out of the heap. They're written in
+   order of torrent and position, so that each disk sees ascending writes */
+static void flushBatch(tr_cache* cache, tr_ptrArray* batch)
+{
+    int const n = tr_ptrArraySize(batch);
+    struct cache_run** runs = (struct cache_run**)tr_ptrArrayBase(batch);
+
+    qsort(runs, n, sizeof(struct cache_run*), compareRunPosition);
+
+    for (int i = 0; i < n; ++i)
+    {
+        struct cache_torrent* ct = runs[i]->ct;
+
+        if (cache->write_err != 0)
+        {
+            /* try again later */
+            heapAdd(cache, runs[i]);
+
+            if (runs[i]->is_piece_done)
+            {
+                doneListAppend(cache, runs[i]);
+            }
+
+            continue;
+        }
+
+        flushContiguous(cache, runs[i], runs[i]->first);
+        releaseTorrentIfEmpty(cache, ct);
+    }
+}
+
+/* Flush the highest-priority runs until no more than `target' blocks are left.
+ * Runs on disks that are already backed up are passed over, so that one slow
+ * disk can't keep the others from being flushed, and so are runs that are
+ * ahead of their piece's hash, unless `force' is set. */
+static void flushDownTo(tr_cache* cache, int target, bool force)
+{
+    tr_ptrArray batch = TR_PTR_ARRAY_INIT;
+    tr_ptrArray skipped = TR_PTR_ARRAY_INIT;
+    int block_count = cache->block_count;
+    struct cache_run* run;
+
+    while (block_count > target && (run = getTopRun(cache)) != NULL)
+    {
+        /* the rest are all ahead of their pieces' hashes */
+        if (!force && run->is_ahead_of_hash)
+        {
+            break;
+        }
+
+        heapRemove(cache, run);
+
+        if (!force && isDeviceBacklogged(cache, run->ct->tor))
+        {
+            tr_ptrArrayAppend(&skipped, run);
+        }
+        else
+        {
+            tr_ptrArrayAppend(&batch, run);
+            block_count -= runLength(run);
+        }
+    }
+
+    for (int i = 0, n = tr_ptrArraySize(&skipped); i < n; ++i)
+    {
+        heapAdd(cache, tr_ptrArrayNth(&skipped, i));
+    }
+
+    flushBatch(cache, &batch);
+
+    tr_ptrArrayDestruct(&skipped, NULL);
+    tr_ptrArrayDestruct(&batch, NULL);
+}
+
+/* flush the runs of completed pieces that haven't grown for a while */
+static void flushAged(tr_cache* cache, time_t now)
+{
+    tr_ptrArray batch = TR_PTR_ARRAY_INIT;
+    struct cache_run* run;
+
+    while ((run = cache->done_head) != NULL && run->done_time + CACHE_FLUSH_AGE_SECS <= now)
+    {
+        if (isDeviceBacklogged(cache, run->ct->tor))
+        {
+            /* send it to the back, to try again once it's aged again */
+            doneListAppend(cache, run);
+        }
+        else
+        {
+            doneListRemove(cache, run);
+            heapRemove(cache, run);
+            tr_ptrArrayAppend(&batch, run);
+        }
+    }
+
+    flushBatch(cache, &batch);
+
+    tr_ptrArrayDestruct(&batch, NULL);
+}
+
+/* If a disk can't keep up, this doesn't wait for it. The peer manager stops
+   asking for blocks for its torrents instead; see tr_cacheIsWriteBacklogged() */
+static int cacheTrim(tr_cache* cache)
+{
+    cache->write_err = 0;
+
+    if (cache->block_count > getWatermark(cache, CACHE_HIGH_WATERMARK))
+    {
+        /* past the hard limit, memory matters more than keeping the disks even */
+        flushDownTo(cache, getWatermark(cache, CACHE_LOW_WATERMARK), cache->block_count > cache->max_blocks);
+    }
+
+    return cache->write_err;
+}
+
+/***
+****
+***/
+
+static struct cache_block* findBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset)
+{
+    tr_block_index_t const block = _tr_block(torrent, piece, offset);
+    struct cache_torrent const* ct = findTorrent(cache, torrent);
+    struct cache_block* cb = ct != NULL ? getBlock(ct, block) : NULL;
+
+    /* if it's not cached, it may still be on its way to the disk */
+    if (cb == NULL)
+    {
+        struct cache_write_entry key;
+        struct cache_write_entry const* e;
+
+        key.unique_id = torrent->uniqueId;
+        key.block = block;
+
+        if ((e = tr_ptrArrayFindSorted(&cache->writes, &key, compareWriteEntries)) != NULL)
+        {
+            cb = e->cb;
+        }
+    }
+
+    return cb;
+}
+
+/****
+*****  Read cache
+****/
+
+/* Clean blocks read from disk for uploads are kept in a 2Q cache, keyed by
+ * torrent and block index. New blocks go into the A1in FIFO, and a block only
+ * makes it into the Am LRU if it's asked for again after falling out of A1in,
+ * which is what the ghost entries in A1out remember. That way one peer
+ * sweeping through a torrent can't flush out the pieces that everyone wants.
+ *
+ * The read cache only gets the part of the cache's budget that the write
+ * cache isn't using, and gives it back as soon as the write cache needs it. */
+
+#define CLEAN_MIN_BUCKETS 256u
+
+static int cleanMaxBlocks(tr_cache const* cache)
+{
+    return MAX(0, cache->max_blocks - cache->block_count - cache->write_block_count);
+}
+
+static inline int cleanBlockCount(tr_cache const* cache)
+{
+    return cache->clean_queues[CLEAN_A1IN].count + cache->clean_queues[CLEAN_AM].count;
+}
+
+static inline size_t cleanBucket(tr_cache const* cache, int unique_id, tr_block_index_t block)
+{
+    uint64_t const key = ((uint64_t)(uint32_t)unique_id << 32) | block;
+
+    return (size_t)((key * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & (cache->clean_bucket_count - 1);
+}
+
+static struct cache_clean* cleanFind(tr_cache const* cache, int unique_id, tr_block_index_t block)
+{
+    struct cache_clean* e = NULL;
+
+    if (cache->clean_bucket_count != 0)
+    {
+        e = cache->clean_buckets[cleanBucket(cache, unique_id, block)];
+    }
+
+    while (e != NULL && (e->unique_id != unique_id || e->block != block))
+    {
+        e = e->hash_next;
+    }
+
+    return e;
+}
+
+static void cleanHashAdd(tr_cache* cache, struct cache_clean* e)
+{
+    size_t bucket;
+
+    if (cache->clean_entry_count >= cache->clean_bucket_count)
+    {
+        struct cache_clean** old_buckets = cache->clean_buckets;
+        size_t const old_count = cache->clean_bucket_count;
+
+        cache->clean_bucket_count = MAX(CLEAN_MIN_BUCKETS, old_count * 2);
+        cache->clean_buckets = tr_new0(struct cache_clean*, cache->clean_bucket_count);
+
+        for (size_t i = 0; i < old_count; ++i)
+        {
+            struct cache_clean* next;
+
+            for (struct cache_clean* o = old_buckets[i]; o != NULL; o = next)
+            {
+                next = o->hash_next;
+                bucket = cleanBucket(cache, o->unique_id, o->block);
+                o->hash_next = cache->clean_buckets[bucket];
+                cache->clean_buckets[bucket] = o;
+            }
+        }
+
+        tr_free(old_buckets);
+    }
+
+    bucket = cleanBucket(cache, e->unique_id, e->block);
+    e->hash_next = cache->clean_buckets[bucket];
+    cache->clean_buckets[bucket] = e;
+    ++cache->clean_entry_count;
+}
+
+static void cleanHashRemove(tr_cache* cache, struct cache_clean* e)
+{
+    struct cache_clean** walk = &cache->clean_buckets[cleanBucket(cache, e->unique_id, e->block)];
+
+    while (*walk != e)
+    {
+        walk = &(*walk)->hash_next;
+    }
+
+    *walk = e->hash_next;
+    --cache->clean_entry_count;
+}
+
+static void queuePush(tr_cache* cache, int queue, struct cache_clean* e)
+{
+    struct cache_queue* q = &cache->clean_queues[queue];
+
+    e->queue = queue;
+    e->prev = NULL;
+    e->next = q->head;
+
+    if (q->head != NULL)
+    {
+        q->head->prev = e;
+    }
+    else
+    {
+        q->tail = e;
+    }
+
+    q->head = e;
+    ++q->count;
+}
+
+static void queueRemove(tr_cache* cache, struct cache_clean* e)
+{
+    struct cache_queue* q = &cache->clean_queues[e->queue];
+
+    if (e->prev != NULL)
+    {
+        e->prev->next = e->next;
+    }
+    else
+    {
+        q->head = e->next;
+    }
+
+    if (e->next != NULL)
+    {
+        e->next->prev = e->prev;
+    }
+    else
+    {
+        q->tail = e->prev;
+    }
+
+    --q->count;
+}
+
+static void cleanFree(tr_cache* cache, struct cache_clean* e)
+{
+    queueRemove(cache, e);
+    cleanHashRemove(cache, e);
+
+    if (e->data != NULL)
+    {
+        slabFreePage(cache, e->data);
+    }
+
+    tr_free(e);
+}
+
+static void cleanEvictOne(tr_cache* cache)
+{
+    struct cache_queue const* a1in = &cache->clean_queues[CLEAN_A1IN];
+    struct cache_queue const* am = &cache->clean_queues[CLEAN_AM];
+
+    if (am->count == 0 || a1in->count > cleanMaxBlocks(cache) / 4)
+    {
+        /* keep a ghost of A1in's oldest block, so we notice if it's wanted again */
+        struct cache_clean* e = a1in->tail;
+
+        queueRemove(cache, e);
+        slabFreePage(cache, e->data);
+        e->data = NULL;
+        queuePush(cache, CLEAN_A1OUT, e);
+
+        while (cache->clean_queues[CLEAN_A1OUT].count > cache->max_blocks / 2)
+        {
+            cleanFree(cache, cache->clean_queues[CLEAN_A1OUT].tail);
+        }
+    }
+    else
+    {
+        cleanFree(cache, am->tail);
+    }
+
+    ++cache->read_evictions;
+}
+
+/* evict clean blocks until there's room for `room' more */
+static void cleanTrim(tr_cache* cache, int room)
+{
+    while (cleanBlockCount(cache) > 0 && cleanBlockCount(cache) + room > cleanMaxBlocks(cache))
+    {
+        cleanEvictOne(cache);
+    }
+}
+
+static void cleanAdd(tr_cache* cache, tr_torrent const* tor, tr_block_index_t block, uint8_t const* data, uint32_t length)
+{
+    struct cache_clean* e;
+    int queue = CLEAN_A1IN;
+
+    if (cleanMaxBlocks(cache) == 0)
+    {
+        return;
+    }
+
+    if ((e = cleanFind(cache, tor->uniqueId, block)) != NULL)
+    {
+        if (e->data != NULL)
+        {
+            return;
+        }
+
+        /* it was evicted from A1in not long ago and it's wanted again, so it's hot */
+        queueRemove(cache, e);
+        queue = CLEAN_AM;
+    }
+
+    cleanTrim(cache, 1);
+
+    if (e == NULL)
+    {
+        e = tr_new(struct cache_clean, 1);
+        e->unique_id = tor->uniqueId;
+        e->block = block;
+        cleanHashAdd(cache, e);
+    }
+
+    e->length = length;
+    e->data = slabAllocPage(cache);
+    memcpy(e->data, data, length);
+    queuePush(cache, queue, e);
+}
+
+/* returns the cached copy of a requested block, or NULL if it's not in the read cache */
+static struct cache_clean* cleanGet(tr_cache* cache, tr_torrent const* tor, tr_piece_index_t piece, uint32_t offset,
+    uint32_t len)
 {
-    tr_ptrArray blocks;
-    int max_blocks;
-    size_t max_bytes;
+    struct cache_clean* e;
 
-    size_t disk_writes;
-    size_t disk_write_bytes;
-    size_t cache_writes;
-    size_t cache_write_bytes;
-};
+    /* only whole blocks are cached */
+    if (offset % tor->blockSize != 0)
+    {
+        return NULL;
+    }
 
-/****
-*****
-****/
+    e = cleanFind(cache, tor->uniqueId, _tr_block(tor, piece, offset));
 
-struct run_info
-{
-    int pos;
-    int rank;
-    time_t last_block_time;
-    bool is_multi_piece;
-    bool is_piece_done;
-    unsigned int len;
-};
+    if (e == NULL || e->data == NULL || len > e->length)
+    {
+        return NULL;
+    }
+
+    /* hits in A1in don't promote the block; that's what keeps scans out of Am */
+    if (e->queue == CLEAN_AM)
+    {
+        queueRemove(cache, e);
+        queuePush(cache, CLEAN_AM, e);
+    }
+
+    return e;
+}
 
-/* return a count of how many contiguous blocks there are starting at this pos */
-static int getBlockRun(tr_cache const* cache, int pos, struct run_info* info)
+static void cleanDropBlock(tr_cache* cache, tr_torrent const* tor, tr_block_index_t block)
 {
-    int const n = tr_ptrArraySize(&cache->blocks);
-    struct cache_block const* const* blocks = (struct cache_block const* const*)tr_ptrArrayBase(&cache->blocks);
-    struct cache_block const* ref = blocks[pos];
-    tr_block_index_t block = ref->block;
-    int len = 0;
+    struct cache_clean* e = cleanFind(cache, tor->uniqueId, block);
 
-    for (int i = pos; i < n; ++i, ++block, ++len)
+    if (e != NULL)
     {
-        struct cache_block const* b = blocks[i];
+        cleanFree(cache, e);
+    }
+}
 
-        if (b->block != block)
-        {
-            break;
-        }
+/* drop every clean block and ghost of a torrent, or of all torrents if `unique_id' is -1 */
+static void cleanDropTorrent(tr_cache* cache, int unique_id)
+{
+    for (size_t i = 0; i < cache->clean_bucket_count; ++i)
+    {
+        struct cache_clean* next;
 
-        if (b->tor != ref->tor)
+        for (struct cache_clean* e = cache->clean_buckets[i]; e != NULL; e = next)
         {
-            break;
-        }
+            next = e->hash_next;
 
-        // fprintf(stderr, "pos %d tor %d block %zu time %zu\n", i, b->tor->uniqueId, (size_t)b->block, (size_t)b->time);
+            if (unique_id == -1 || e->unique_id == unique_id)
+            {
+                cleanFree(cache, e);
+            }
+        }
     }
 
-    // fprintf(stderr, "run is %d long from [%d to %d)\n", len, pos, pos + len);
+    slabReleaseIfEmpty(cache);
+}
+
+/* peers ask for blocks, but we read whole pieces so that the rest of the
+   piece is cached when they ask for it next, unless that would crowd out
+   too much of the read cache */
+static void getPieceReadRange(tr_cache const* cache, tr_torrent const* tor, tr_piece_index_t piece, uint32_t offset,
+    uint32_t len, uint32_t* setme_offset, uint32_t* setme_length)
+{
+    uint32_t const piece_size = tr_torPieceCountBytes(tor, piece);
 
-    if (info != NULL)
+    if (piece_size / tor->blockSize <= (uint32_t)cleanMaxBlocks(cache) / 4)
     {
-        struct cache_block const* b = blocks[pos + len - 1];
-        info->last_block_time = b->time;
-        info->is_piece_done = tr_torrentPieceIsComplete(b->tor, b->piece);
-        info->is_multi_piece = b->piece != blocks[pos]->piece;
-        info->len = len;
-        info->pos = pos;
+        *setme_offset = 0;
+        *setme_length = piece_size;
+    }
+    else
+    {
+        *setme_offset = offset;
+        *setme_length = len;
     }
-
-    return len;
 }
 
-/* higher rank comes before lower rank */
-static int compareRuns(void const* va, void const* vb)
+static struct cache_piece_read* findPieceRead(tr_cache* cache, tr_torrent const* tor, tr_piece_index_t piece,
+    uint32_t offset, uint32_t len)
 {
-    struct run_info const* a = va;
-    struct run_info const* b = vb;
-    return b->rank - a->rank;
+    for (int i = 0, n = tr_ptrArraySize(&cache->piece_reads); i < n; ++i)
+    {
+        struct cache_piece_read* pr = tr_ptrArrayNth(&cache->piece_reads, i);
+
+        if (pr->tor == tor && pr->piece == piece && pr->offset <= offset &&
+            offset + len <= pr->offset + pr->length)
+        {
+            return pr;
+        }
+    }
+
+    return NULL;
 }
 
-enum
+static void pieceReadAddWaiter(struct cache_piece_read* pr, uint32_t offset, uint32_t len, tr_diskio_done_func done_func,
+    void* user_data)
 {
-    MULTIFLAG = 0x1000,
-    DONEFLAG = 0x2000,
-    SESSIONFLAG = 0x4000
-};
+    struct cache_read_waiter* w;
+
+    pr->waiters = tr_renew(struct cache_read_waiter, pr->waiters, pr->waiter_count + 1);
+    w = &pr->waiters[pr->waiter_count++];
+    w->offset = offset;
+    w->length = len;
+    w->done_func = done_func;
+    w->user_data = user_data;
+}
 
-/* Calculte runs
- *   - Stale runs, runs sitting in cache for a long time or runs not growing, get priority.
- *     Returns number of runs.
- */
-static int calcRuns(tr_cache* cache, struct run_info* runs)
+static void onPieceRead(void* vpr, int err, tr_piece_index_t piece, uint32_t offset UNUSED, uint32_t length UNUSED,
+    uint8_t const* data)
 {
-    int const n = tr_ptrArraySize(&cache->blocks);
-    int i = 0;
-    time_t const now = tr_time();
+    struct cache_piece_read* pr = vpr;
+    tr_cache* cache = pr->cache;
+    tr_torrent* tor = pr->tor;
+
+    for (int i = tr_ptrArraySize(&cache->piece_reads) - 1; i >= 0; --i)
+    {
+        if (tr_ptrArrayNth(&cache->piece_reads, i) == pr)
+        {
+            tr_ptrArrayRemove(&cache->piece_reads, i);
+            break;
+        }
+    }
 
-    for (int pos = 0; pos < n; pos += runs[i++].len)
+    if (err == 0)
     {
-        int rank = getBlockRun(cache, pos, &runs[i]);
+        uint32_t const end = pr->offset + pr->length;
+        uint32_t pos = (pr->offset + tor->blockSize - 1) / tor->blockSize * tor->blockSize;
+
+        /* cache the whole blocks that were read, unless the write cache has newer copies */
+        while (pos < end)
+        {
+            tr_block_index_t const block = _tr_block(tor, piece, pos);
+            uint32_t const block_len = tr_torBlockCountBytes(tor, block);
 
-        /* This adds ~2 to the relative length of a run for every minute it has
-         * languished in the cache. */
-        rank += (now - runs[i].last_block_time) / 32;
+            if (pos + block_len > end)
+            {
+                break;
+            }
 
-        /* Flushing stale blocks should be a top priority as the probability of them
-         * growing is very small, for blocks on piece boundaries, and nonexistant for
-         * blocks inside pieces. */
-        rank |= runs[i].is_piece_done ? DONEFLAG : 0;
+            if (findBlock(cache, tor, piece, pos) == NULL)
+            {
+                cleanAdd(cache, tor, block, data + (pos - pr->offset), block_len);
+            }
 
-        /* Move the multi piece runs higher */
-        rank |= runs[i].is_multi_piece ? MULTIFLAG : 0;
+            pos += block_len;
+        }
+    }
 
-        runs[i].rank = rank;
+    for (int i = 0; i < pr->waiter_count; ++i)
+    {
+        struct cache_read_waiter const* w = &pr->waiters[i];
 
-        // fprintf(stderr, "block run at pos %d of length %d and age %ld adjusted +%d\n", runs[i].pos, runs[i].len,
-        //     now - runs[i].last_block_time, rank - runs[i].len);
+        if (w->done_func != NULL)
+        {
+            (*w->done_func)(w->user_data, err, piece, w->offset, w->length, err == 0 ? data + (w->offset - pr->offset) : NULL);
+        }
     }
 
-    // fprintf(stderr, "%d block runs\n", i);
-    qsort(runs, i, sizeof(struct run_info), compareRuns);
-    return i;
+    tr_free(pr->waiters);
+    tr_free(pr);
 }
 
-static int flushContiguous(tr_cache* cache, int pos, int n)
+/****
+*****  Piece hashing
+****/
+
+/* Checking a piece that was just completed would mean reading it back,
+ * often from disk if some of it had been flushed already. Instead, blocks
+ * are hashed as they're written, as long as they come in order. Blocks
+ * that come early are ranked last for flushing (see isRunAheadOfHash()),
+ * so they stay in the write cache until the gap before them is filled.
+ * If the cache fills up anyway, or the torrent or file is flushed, they're
+ * written out, and the part of the piece that couldn't be hashed in order
+ * is read back when the piece is checked. */
+
+static int compareHashes(void const* va, void const* vb)
 {
-    int err = 0;
-    uint8_t* buf = tr_new(uint8_t, n * MAX_BLOCK_SIZE);
-    uint8_t* walk = buf;
-    struct cache_block** blocks = (struct cache_block**)tr_ptrArrayBase(&cache->blocks);
+    struct cache_piece_hash const* a = va;
+    struct cache_piece_hash const* b = vb;
 
-    struct cache_block* b = blocks[pos];
-    tr_torrent* tor = b->tor;
-    tr_piece_index_t const piece = b->piece;
-    uint32_t const offset = b->offset;
+    if (a->unique_id != b->unique_id)
+    {
+        return a->unique_id < b->unique_id ? -1 : 1;
+    }
 
-    for (int i = 0; i < n; ++i)
+    if (a->piece != b->piece)
     {
-        b = blocks[pos + i];
-        evbuffer_copyout(b->evbuf, walk, b->length);
-        walk += b->length;
-        evbuffer_free(b->evbuf);
-        tr_free(b);
+        return a->piece < b->piece ? -1 : 1;
     }
 
-    tr_ptrArrayErase(&cache->blocks, pos, pos + n);
+    return 0;
+}
+
+static struct cache_piece_hash* hashFind(tr_cache* cache, int unique_id, tr_piece_index_t piece)
+{
+    struct cache_piece_hash key;
+    key.unique_id = unique_id;
+    key.piece = piece;
+    return tr_ptrArrayFindSorted(&cache->piece_hashes, &key, compareHashes);
+}
 
-    err = tr_ioWrite(tor, piece, offset, walk - buf, buf);
-    tr_free(buf);
+static void hashFree(void* vh)
+{
+    struct cache_piece_hash* h = vh;
 
-    ++cache->disk_writes;
-    cache->disk_write_bytes += walk - buf;
-    return err;
+    tr_sha1_final(h->sha, NULL);
+    tr_free(h);
 }
 
-static int flushRuns(tr_cache* cache, struct run_info* runs, int n)
+static void hashDrop(tr_cache* cache, struct cache_piece_hash* h)
 {
-    int err = 0;
+    tr_ptrArrayRemoveSortedPointer(&cache->piece_hashes, h, compareHashes);
+    hashFree(h);
+}
 
-    for (int i = 0; err == 0 && i < n; i++)
+static void hashDropTorrent(tr_cache* cache, int unique_id)
+{
+    for (int i = tr_ptrArraySize(&cache->piece_hashes) - 1; i >= 0; --i)
     {
-        err = flushContiguous(cache, runs[i].pos, runs[i].len);
+        struct cache_piece_hash* h = tr_ptrArrayNth(&cache->piece_hashes, i);
 
-        for (int j = i + 1; j < n; j++)
+        if (h->unique_id == unique_id)
         {
-            if (runs[j].pos > runs[i].pos)
-            {
-                runs[j].pos -= runs[i].len;
-            }
+            tr_ptrArrayRemove(&cache->piece_hashes, i);
+            hashFree(h);
         }
     }
-
-    return err;
 }
 
-static int cacheTrim(tr_cache* cache)
+/* hash as many of the piece's blocks as are cached in order after what's been hashed so far */
+static void hashAdvance(struct cache_torrent const* ct, struct cache_piece_hash* h)
 {
-    int err = 0;
+    tr_torrent const* tor = ct->tor;
+    uint32_t const piece_size = tr_torPieceCountBytes(tor, h->piece);
+    struct cache_block const* cb;
 
-    if (tr_ptrArraySize(&cache->blocks) > cache->max_blocks)
+    while (h->length < piece_size && (cb = getBlock(ct, _tr_block(tor, h->piece, h->length))) != NULL)
     {
-        /* Amount of cache that should be removed by the flush. This influences how large
-         * runs can grow as well as how often flushes will happen. */
-        int const cacheCutoff = 1 + cache->max_blocks / 4;
-        struct run_info* runs = tr_new(struct run_info, tr_ptrArraySize(&cache->blocks));
-        int i = 0;
-        int j = 0;
+        tr_sha1_update(h->sha, cb->data, cb->length);
+        h->length += cb->length;
+    }
+}
 
-        calcRuns(cache, runs);
+static void hashAddBlock(tr_cache* cache, struct cache_torrent const* ct, struct cache_block const* cb)
+{
+    struct cache_piece_hash* h = hashFind(cache, ct->unique_id, cb->piece);
 
-        while (j < cacheCutoff)
-        {
-            j += runs[i++].len;
-        }
+    /* if a block that was already hashed is written again, start over */
+    if (h != NULL && cb->offset < h->length)
+    {
+        hashDrop(cache, h);
+        h = NULL;
+    }
 
-        err = flushRuns(cache, runs, i);
-        tr_free(runs);
+    if (h == NULL && cb->offset == 0 && !tr_torrentPieceIsComplete(ct->tor, cb->piece))
+    {
+        h = tr_new(struct cache_piece_hash, 1);
+        h->unique_id = ct->unique_id;
+        h->piece = cb->piece;
+        h->length = 0;
+        h->sha = tr_sha1_init();
+        tr_ptrArrayInsertSorted(&cache->piece_hashes, h, compareHashes);
     }
 
-    return err;
+    if (h != NULL && h->length == cb->offset)
+    {
+        hashAdvance(ct, h);
+    }
 }
 
 /***
@@ -249,12 +1690,18 @@ static int getMaxBlocks(int64_t max_bytes)
     return max_bytes / (double)MAX_BLOCK_SIZE;
 }
 
+bool tr_cacheIsWriteBacklogged(tr_cache const* cache, tr_torrent const* torrent)
+{
+    return cache->write_block_count > cache->max_blocks && isDeviceBacklogged(cache, torrent);
+}
+
 int tr_cacheSetLimit(tr_cache* cache, int64_t max_bytes)
 {
     char buf[128];
 
     cache->max_bytes = max_bytes;
     cache->max_blocks = getMaxBlocks(max_bytes);
+    cleanTrim(cache, 0);
 
     tr_formatter_mem_B(buf, cache->max_bytes, sizeof(buf));
     tr_logAddNamedDbg(MY_NAME, "Maximum cache size set to %s (%d blocks)", buf, cache->max_blocks);
@@ -270,7 +1717,13 @@ int64_t tr_cacheGetLimit(tr_cache const* cache)
 tr_cache* tr_cacheNew(int64_t max_bytes)
 {
     tr_cache* cache = tr_new0(tr_cache, 1);
-    cache->blocks = TR_PTR_ARRAY_INIT;
+    cache->torrents = TR_PTR_ARRAY_INIT;
+    cache->runs = TR_PTR_ARRAY_INIT;
+    cache->slabs = TR_PTR_ARRAY_INIT;
+    cache->writes = TR_PTR_ARRAY_INIT;
+    cache->piece_reads = TR_PTR_ARRAY_INIT;
+    cache->unsynced = TR_PTR_ARRAY_INIT;
+    cache->piece_hashes = TR_PTR_ARRAY_INIT;
     cache->max_bytes = max_bytes;
     cache->max_blocks = getMaxBlocks(max_bytes);
     return cache;
@@ -278,9 +1731,21 @@ tr_cache* tr_cacheNew(int64_t max_bytes)
 
 void tr_cacheFree(tr_cache* cache)
 {
-    TR_ASSERT(tr_ptrArrayEmpty(&cache->blocks));
-
-    tr_ptrArrayDestruct(&cache->blocks, NULL);
+    TR_ASSERT(tr_ptrArrayEmpty(&cache->torrents));
+    TR_ASSERT(tr_ptrArrayEmpty(&cache->runs));
+    TR_ASSERT(tr_ptrArrayEmpty(&cache->writes));
+    TR_ASSERT(tr_ptrArrayEmpty(&cache->piece_reads));
+
+    cleanDropTorrent(cache, -1);
+
+    tr_ptrArrayDestruct(&cache->torrents, NULL);
+    tr_ptrArrayDestruct(&cache->runs, NULL);
+    tr_ptrArrayDestruct(&cache->writes, NULL);
+    tr_ptrArrayDestruct(&cache->piece_reads, NULL);
+    tr_ptrArrayDestruct(&cache->unsynced, tr_free);
+    tr_ptrArrayDestruct(&cache->piece_hashes, hashFree);
+    tr_free(cache->clean_buckets);
+    tr_ptrArrayDestruct(&cache->slabs, tr_free);
     tr_free(cache);
 }
 
@@ -288,33 +1753,10 @@ void tr_cacheFree(tr_cache* cache)
 ****
 ***/
 
-static int cache_block_compare(void const* va, void const* vb)
+/* true if writing this block completes its piece */
+static bool blockCompletesPiece(tr_torrent const* tor, struct cache_block const* cb)
 {
-    struct cache_block const* a = va;
-    struct cache_block const* b = vb;
-
-    /* primary key: torrent id */
-    if (a->tor->uniqueId != b->tor->uniqueId)
-    {
-        return a->tor->uniqueId < b->tor->uniqueId ? -1 : 1;
-    }
-
-    /* secondary key: block # */
-    if (a->block != b->block)
-    {
-        return a->block < b->block ? -1 : 1;
-    }
-
-    /* they're equal */
-    return 0;
-}
-
-static struct cache_block* findBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset)
-{
-    struct cache_block key;
-    key.tor = torrent;
-    key.block = _tr_block(torrent, piece, offset);
-    return tr_ptrArrayFindSorted(&cache->blocks, &key, cache_block_compare);
+    return !tr_torrentBlockIsComplete(tor, cb->block) && tr_cpMissingBlocksInPiece(&tor->completion, cb->piece) == 1;
 }
 
 int tr_cacheWriteBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset, uint32_t length,
@@ -322,26 +1764,54 @@ int tr_cacheWriteBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t pi
 {
     TR_ASSERT(tr_amInEventThread(torrent->session));
 
-    struct cache_block* cb = findBlock(cache, torrent, piece, offset);
+    struct cache_torrent* ct = getTorrent(cache, torrent);
+    tr_block_index_t const block = _tr_block(torrent, piece, offset);
+    struct cache_block* cb = getBlock(ct, block);
+    bool const is_new = cb == NULL;
 
-    if (cb == NULL)
+    if (is_new)
     {
         cb = tr_new(struct cache_block, 1);
         cb->tor = torrent;
         cb->piece = piece;
         cb->offset = offset;
         cb->length = length;
-        cb->block = _tr_block(torrent, piece, offset);
-        cb->evbuf = evbuffer_new();
-        tr_ptrArrayInsertSorted(&cache->blocks, cb, cache_block_compare);
+        cb->block = block;
+        cb->run = NULL;
+        cb->data = slabAllocPage(cache);
+        setBlock(cache, ct, cb);
+
+        /* the write cache's copy supersedes the clean one, and takes its room */
+        cleanDropBlock(cache, torrent, block);
+        cleanTrim(cache, 0);
     }
 
     TR_ASSERT(cb->length == length);
 
     cb->time = tr_time();
 
-    evbuffer_drain(cb->evbuf, evbuffer_get_length(cb->evbuf));
-    evbuffer_remove_buffer(writeme, cb->evbuf, cb->length);
+    evbuffer_remove(writeme, cb->data, cb->length);
+
+    if (is_new)
+    {
+        runsAddBlock(cache, ct, cb);
+    }
+    else
+    {
+        struct cache_run* run = getRunEndingAt(ct, block);
+
+        if (run != NULL)
+        {
+            runRefresh(cache, run, run->is_piece_done);
+        }
+    }
+
+    hashAddBlock(cache, ct, cb);
+
+    if (blockCompletesPiece(torrent, cb))
+    {
+        runsPieceDone(cache, ct, piece);
+    }
 
     cache->cache_writes++;
     cache->cache_write_bytes += cb->length;
@@ -354,25 +1824,155 @@ int tr_cacheReadBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t pie
 {
     int err = 0;
     struct cache_block* cb = findBlock(cache, torrent, piece, offset);
+    struct cache_clean* e;
 
     if (cb != NULL)
     {
-        evbuffer_copyout(cb->evbuf, setme, len);
+        memcpy(setme, cb->data, len);
+        ++cache->read_hits;
+    }
+    else if ((e = cleanGet(cache, torrent, piece, offset, len)) != NULL)
+    {
+        memcpy(setme, e->data, len);
+        ++cache->read_hits;
     }
     else
     {
         err = tr_ioRead(torrent, piece, offset, len, setme);
+        ++cache->read_misses;
     }
 
     return err;
 }
 
+tr_sha1_ctx_t tr_cacheTakePieceHash(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t* setme_length)
+{
+    tr_sha1_ctx_t sha = NULL;
+    struct cache_piece_hash* h = hashFind(cache, torrent->uniqueId, piece);
+
+    *setme_length = 0;
+
+    if (h != NULL)
+    {
+        tr_ptrArrayRemoveSortedPointer(&cache->piece_hashes, h, compareHashes);
+        sha = h->sha;
+        *setme_length = h->length;
+        tr_free(h);
+    }
+
+    return sha;
+}
+
+void tr_cacheReadBlockAsync(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset, uint32_t len,
+    tr_diskio_done_func done_func, void* user_data)
+{
+    struct cache_block* cb = findBlock(cache, torrent, piece, offset);
+    struct cache_clean* e = cb == NULL ? cleanGet(cache, torrent, piece, offset, len) : NULL;
+    struct cache_piece_read* pr;
+
+    if (cb != NULL || e != NULL)
+    {
+        ++cache->read_hits;
+        (*done_func)(user_data, 0, piece, offset, len, cb != NULL ? cb->data : e->data);
+    }
+    else if ((pr = findPieceRead(cache, torrent, piece, offset, len)) != NULL)
+    {
+        /* it's already being read for someone else */
+        ++cache->read_hits;
+        pieceReadAddWaiter(pr, offset, len, done_func, user_data);
+    }
+    else
+    {
+        ++cache->read_misses;
+
+        pr = tr_new0(struct cache_piece_read, 1);
+        pr->cache = cache;
+        pr->tor = torrent;
+        pr->piece = piece;
+        getPieceReadRange(cache, torrent, piece, offset, len, &pr->offset, &pr->length);
+        pieceReadAddWaiter(pr, offset, len, done_func, user_data);
+        tr_ptrArrayAppend(&cache->piece_reads, pr);
+
+        tr_diskioRead(torrent->session->diskio, torrent, piece, pr->offset, pr->length, onPieceRead, pr);
+    }
+}
+
+void tr_cacheCancelReads(tr_cache* cache, void const* user_data)
+{
+    for (int i = 0, n = tr_ptrArraySize(&cache->piece_reads); i < n; ++i)
+    {
+        struct cache_piece_read* pr = tr_ptrArrayNth(&cache->piece_reads, i);
+
+        for (int j = 0; j < pr->waiter_count; ++j)
+        {
+            if (pr->waiters[j].user_data == user_data)
+            {
+                pr->waiters[j].done_func = NULL;
+            }
+        }
+    }
+}
+
+static bool isBlockCached(tr_cache* cache, tr_torrent* tor, tr_piece_index_t piece, uint32_t offset)
+{
+    struct cache_clean const* e = cleanFind(cache, tor->uniqueId, _tr_block(tor, piece, offset));
+
+    return (e != NULL && e->data != NULL) || findBlock(cache, tor, piece, offset) != NULL;
+}
+
+/* queue a read of whatever part of [offset, offset+len) in a piece isn't already cached or being read */
+static void readAheadInPiece(tr_cache* cache, tr_torrent* tor, tr_piece_index_t piece, uint32_t offset, uint32_t len)
+{
+    uint32_t const end = offset + len;
+    struct cache_piece_read* pr;
+
+    while (offset < end && isBlockCached(cache, tor, piece, offset))
+    {
+        offset += tr_torBlockCountBytes(tor, _tr_block(tor, piece, offset));
+    }
+
+    if (offset < end && findPieceRead(cache, tor, piece, offset, end - offset) == NULL)
+    {
+        pr = tr_new0(struct cache_piece_read, 1);
+        pr->cache = cache;
+        pr->tor = tor;
+        pr->piece = piece;
+        pr->offset = offset;
+        pr->length = end - offset;
+        tr_ptrArrayAppend(&cache->piece_reads, pr);
+
+        tr_diskioRead(tor->session->diskio, tor, piece, pr->offset, pr->length, onPieceRead, pr);
+    }
+}
+
+uint64_t tr_cacheReadAhead(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset, uint64_t len)
+{
+    uint64_t done = 0;
+
+    /* don't let one read-ahead take over the read cache */
+    len = MIN(len, (uint64_t)(cleanMaxBlocks(cache) / 4) * torrent->blockSize);
+
+    while (done < len && piece < torrent->info.pieceCount && tr_torrentPieceIsComplete(torrent, piece))
+    {
+        uint32_t const n = (uint32_t)MIN(len - done, (uint64_t)(tr_torPieceCountBytes(torrent, piece) - offset));
+        uint32_t const block_offset = offset - offset % torrent->blockSize;
+
+        readAheadInPiece(cache, torrent, piece, block_offset, offset + n - block_offset);
+
+        done += n;
+        offset = 0;
+        ++piece;
+    }
+
+    return done;
+}
+
 int tr_cachePrefetchBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset, uint32_t len)
 {
     int err = 0;
     struct cache_block* cb = findBlock(cache, torrent, piece, offset);
 
-    if (cb == NULL)
+    if (cb == NULL && cleanFind(cache, torrent->uniqueId, _tr_block(torrent, piece, offset)) == NULL)
     {
         err = tr_ioPrefetch(torrent, piece, offset, len);
     }
@@ -384,89 +1984,157 @@ int tr_cachePrefetchBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t
 ****
 ***/
 
-static int findBlockPos(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t block)
+int tr_cacheFlushPulse(tr_cache* cache, tr_session* session)
+{
+    time_t const now = tr_time();
+    int const low = getWatermark(cache, CACHE_LOW_WATERMARK);
+
+    cache->write_err = 0;
+
+    flushAged(cache, now);
+
+    if (cache->block_count > low)
+    {
+        flushDownTo(cache, low, false);
+    }
+
+    if (now >= cache->next_sync_time && !tr_ptrArrayEmpty(&cache->unsynced))
+    {
+        syncFiles(cache, session, CACHE_ALL_TORRENTS, CACHE_ALL_FILES);
+        cache->next_sync_time = now + CACHE_SYNC_INTERVAL_SECS;
+    }
+
+    return cache->write_err;
+}
+
+void tr_cacheSetSyncEnabled(tr_cache* cache, bool enabled)
+{
+    cache->is_sync_enabled = enabled;
+
+    if (!enabled)
+    {
+        tr_ptrArrayDestruct(&cache->unsynced, tr_free);
+        cache->unsynced = TR_PTR_ARRAY_INIT;
+    }
+}
+
+bool tr_cacheIsSyncEnabled(tr_cache const* cache)
 {
-    struct cache_block key;
-    key.tor = torrent;
-    key.block = block;
-    return tr_ptrArrayLowerBound(&cache->blocks, &key, cache_block_compare, NULL);
+    return cache->is_sync_enabled;
 }
 
 int tr_cacheFlushDone(tr_cache* cache)
 {
-    int err = 0;
+    int const n = tr_ptrArraySize(&cache->runs);
+    struct cache_run* run;
+
+    cache->write_err = 0;
+
+    /* re-rank every run against the torrents' current completeness,
+     * e.g. to demote runs whose piece failed its checksum */
+    for (int i = 0; i < n; ++i)
+    {
+        struct cache_block const* last;
+
+        run = heapNth(cache, i);
+        last = getBlock(run->ct, run->last);
+        run->is_piece_done = tr_torrentPieceIsComplete(last->tor, last->piece);
 
-    if (tr_ptrArraySize(&cache->blocks) > 0)
+        if (!run->is_piece_done)
+        {
+            doneListRemove(cache, run);
+        }
+        else if (!run->is_in_done_list)
+        {
+            doneListAppend(cache, run);
+        }
+    }
+
+    for (int i = n / 2 - 1; i >= 0; --i)
     {
-        int i;
-        int n;
-        struct run_info* runs;
+        heapSiftDown(cache, heapNth(cache, i));
+    }
 
-        runs = tr_new(struct run_info, tr_ptrArraySize(&cache->blocks));
-        i = 0;
-        n = calcRuns(cache, runs);
+    while (cache->write_err == 0 && !tr_ptrArrayEmpty(&cache->runs))
+    {
+        run = heapNth(cache, 0);
 
-        while (i < n && (runs[i].is_piece_done || runs[i].is_multi_piece))
+        if (!run->is_piece_done && (!run->is_multi_piece || run->is_ahead_of_hash))
         {
-            runs[i++].rank |= SESSIONFLAG;
+            break;
         }
 
-        err = flushRuns(cache, runs, i);
-        tr_free(runs);
+        flushRun(cache, run);
     }
 
-    return err;
+    return cache->write_err;
 }
 
 int tr_cacheFlushFile(tr_cache* cache, tr_torrent* torrent, tr_file_index_t i)
 {
-    int pos;
-    int err = 0;
     tr_block_index_t first;
     tr_block_index_t last;
+    struct cache_torrent* ct = findTorrent(cache, torrent);
+    struct cache_block const* b;
 
-    tr_torGetFileBlockRange(torrent, i, &first, &last);
-    pos = findBlockPos(cache, torrent, first);
-    dbgmsg("flushing file %d from cache to disk: blocks [%zu...%zu]", (int)i, (size_t)first, (size_t)last);
+    cache->write_err = 0;
 
-    /* flush out all the blocks in that file */
-    while (err == 0 && pos < tr_ptrArraySize(&cache->blocks))
+    if (ct != NULL)
     {
-        struct cache_block const* b = tr_ptrArrayNth(&cache->blocks, pos);
-
-        if (b->tor != torrent)
-        {
-            break;
-        }
+        tr_torGetFileBlockRange(torrent, i, &first, &last);
+        dbgmsg("flushing file %d from cache to disk: blocks [%zu...%zu]", (int)i, (size_t)first, (size_t)last);
 
-        if (b->block < first || b->block > last)
+        /* flush out all the blocks in that file */
+        while ((b = findNextBlock(ct, first, last + 1)) != NULL)
         {
-            break;
+            flushContiguous(cache, getRunContaining(ct, b), b->block);
         }
 
-        err = flushContiguous(cache, pos, getBlockRun(cache, pos, NULL));
+        releaseTorrentIfEmpty(cache, ct);
     }
 
-    return err;
+    /* the caller is about to close the file, so wait for it to hit the disk */
+    syncFiles(cache, torrent->session, torrent->uniqueId, i);
+    tr_diskioWait(torrent->session->diskio, torrent);
+
+    return cache->write_err;
 }
 
 int tr_cacheFlushTorrent(tr_cache* cache, tr_torrent* torrent)
 {
-    int err = 0;
-    int const pos = findBlockPos(cache, torrent, 0);
+    struct cache_torrent* ct = findTorrent(cache, torrent);
+    struct cache_block const* b;
 
-    /* flush out all the blocks in that torrent */
-    while (err == 0 && pos < tr_ptrArraySize(&cache->blocks))
-    {
-        struct cache_block const* b = tr_ptrArrayNth(&cache->blocks, pos);
+    cache->write_err = 0;
 
-        if (b->tor != torrent)
+    if (ct != NULL)
+    {
+        /* flush out all the blocks in that torrent */
+        while ((b = findNextBlock(ct, 0, torrent->blockCount)) != NULL)
         {
-            break;
+            flushContiguous(cache, b->run, b->block);
         }
 
-        err = flushContiguous(cache, pos, getBlockRun(cache, pos, NULL));
+        releaseTorrentIfEmpty(cache, ct);
     }
 
-    return err;
+    syncFiles(cache, torrent->session, torrent->uniqueId, CACHE_ALL_FILES);
+    tr_diskioWait(torrent->session->diskio, torrent);
+
+    /* the torrent is being stopped, moved, or removed */
+    cleanDropTorrent(cache, torrent->uniqueId);
+    hashDropTorrent(cache, torrent->uniqueId);
+
+    return cache->write_err;
+}
+
+/***
+****
+***/
+
+void tr_cacheGetStats(tr_cache const* cache, tr_cache_stats* setme)
+{
+    setme->read_hits = cache->read_hits;
+    setme->read_misses = cache->read_misses;
+    setme->read_evictions = cache->read_evictions;
 }
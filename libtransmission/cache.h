@@ -12,10 +12,21 @@
 #error only libtransmission should #include this header.
 #endif
 
+#include "crypto-utils.h" /* tr_sha1_ctx_t */
+#include "diskio.h" /* tr_diskio_done_func */
+
 struct evbuffer;
 
 typedef struct tr_cache tr_cache;
 
+typedef struct tr_cache_stats
+{
+    uint64_t read_hits; /* reads that didn't have to wait for the disk */
+    uint64_t read_misses; /* reads that went to the disk */
+    uint64_t read_evictions; /* clean blocks dropped from the read cache to make room */
+}
+tr_cache_stats;
+
 /***
 ****
 ***/
@@ -32,20 +43,75 @@ int tr_cacheSetLimit(tr_cache* cache, int64_t max_bytes);
 
 int64_t tr_cacheGetLimit(tr_cache const*);
 
+/**
+ * True if more blocks are waiting to be written than the cache can hold, and
+ * the disk holding `torrent' is one of the ones that's behind. Until the
+ * writes catch up, no more blocks should be requested for the torrent.
+ */
+bool tr_cacheIsWriteBacklogged(tr_cache const* cache, tr_torrent const* torrent);
+
 int tr_cacheWriteBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset, uint32_t len,
     struct evbuffer* writeme);
 
 int tr_cacheReadBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset, uint32_t len,
     uint8_t* setme);
 
+/**
+ * Returns the SHA-1 context of a piece whose first `setme_length' bytes were
+ * hashed as they were written, or NULL if none of it was. The caller owns
+ * the context, and the cache forgets about it.
+ */
+tr_sha1_ctx_t tr_cacheTakePieceHash(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t* setme_length);
+
+/**
+ * Like tr_cacheReadBlock(), but if the block isn't cached, a disk read of its
+ * piece is queued and `done_func' is called from the libtransmission thread once
+ * it finishes. The rest of the piece is kept in the read cache for later requests.
+ * If the block is cached, `done_func' is called before this returns.
+ */
+void tr_cacheReadBlockAsync(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset, uint32_t len,
+    tr_diskio_done_func done_func, void* user_data);
+
+/** Keeps the callbacks of any pending tr_cacheReadBlockAsync() calls with this `user_data' from being called. */
+void tr_cacheCancelReads(tr_cache* cache, void const* user_data);
+
+/**
+ * Reads up to `len' bytes, starting at the specified piece and offset, into the
+ * read cache so that later requests for them don't have to wait for the disk.
+ * The read stops at the first piece we don't have, or when it would take up
+ * too much of the read cache.
+ *
+ * @return the number of bytes that are now cached or being read, which is 0
+ *         if the read cache has no room
+ */
+uint64_t tr_cacheReadAhead(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset, uint64_t len);
+
 int tr_cachePrefetchBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset, uint32_t len);
 
 /***
 ****
 ***/
 
+/**
+ * Called once a second. Writes out the completed pieces that have been
+ * sitting in the cache for a while, brings the cache back down to its low
+ * watermark, and every so often syncs the files that were written to.
+ */
+int tr_cacheFlushPulse(tr_cache* cache, tr_session* session);
+
+/** If enabled, written files are synced to disk periodically and when they're closed. */
+void tr_cacheSetSyncEnabled(tr_cache* cache, bool enabled);
+
+bool tr_cacheIsSyncEnabled(tr_cache const* cache);
+
 int tr_cacheFlushDone(tr_cache* cache);
 
 int tr_cacheFlushTorrent(tr_cache* cache, tr_torrent* torrent);
 
 int tr_cacheFlushFile(tr_cache* cache, tr_torrent* torrent, tr_file_index_t file);
+
+/***
+****
+***/
+
+void tr_cacheGetStats(tr_cache const* cache, tr_cache_stats* setme);
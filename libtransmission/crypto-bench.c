@@ -0,0 +1,402 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+/* Measures the crypto-utils backend this was built with. It prints one JSON
+ * object per line, so that results from different builds can be compared:
+ *
+ * {"backend":"openssl","name":"sha1","size":16384,"iterations":52161,"msec":500,...}
+ */
+
+#include <stdio.h> /* printf() */
+#include <stdlib.h> /* strtoul(), EXIT_FAILURE */
+#include <string.h> /* strcmp() */
+
+#include "transmission.h"
+#include "crypto.h"
+#include "crypto-utils.h"
+#include "sha1-batch.h"
+#include "tr-getopt.h"
+#include "utils.h"
+#include "version.h"
+
+#define MY_NAME "transmission-bench-crypto"
+
+#ifndef TR_CRYPTO_PKG
+#define TR_CRYPTO_PKG "unknown"
+#endif
+
+#define MAX_SIZE (16 * 1024 * 1024)
+
+/* how much data a peer sends in one go */
+#define PEER_BLOCK_SIZE (16 * 1024)
+
+static uint32_t const sha1_sizes[] =
+{
+    16 * 1024,
+    64 * 1024,
+    256 * 1024,
+    1024 * 1024,
+    4 * 1024 * 1024,
+    16 * 1024 * 1024
+};
+
+static uint64_t duration_msec = 500;
+static char const* only_name = NULL;
+static bool showVersion = false;
+
+static tr_option options[] =
+{
+    { 'd', "duration", "Run each measurement for this many milliseconds", "d", true, "<msec>" },
+    { 'n', "name", "Only run the measurements with this name, e.g. \"sha1\"", "n", true, "<name>" },
+    { 'V', "version", "Show version number and exit", "V", false, NULL },
+    { 0, NULL, NULL, NULL, false, NULL }
+};
+
+static char const* getUsage(void)
+{
+    return "Usage: " MY_NAME " [options]";
+}
+
+static int parseCommandLine(int argc, char const* const* argv)
+{
+    int c;
+    char const* optarg;
+
+    while ((c = tr_getopt(getUsage(), argc, argv, options, &optarg)) != TR_OPT_DONE)
+    {
+        switch (c)
+        {
+        case 'd':
+            duration_msec = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'n':
+            only_name = optarg;
+            break;
+
+        case 'V':
+            showVersion = true;
+            break;
+
+        default:
+            fprintf(stderr, "Invalid option\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/***
+****
+***/
+
+typedef bool (* benchFunc)(void* user_data, size_t size);
+
+static bool wants(char const* name)
+{
+    return only_name == NULL || strcmp(only_name, name) == 0;
+}
+
+/* runs `func' over and over until the duration's up, then prints what it did */
+static bool measure(char const* name, size_t size, benchFunc func, void* user_data)
+{
+    uint64_t const start = tr_time_msec();
+    uint64_t iterations = 0;
+    uint64_t msec;
+    double seconds;
+
+    if (!wants(name))
+    {
+        return true;
+    }
+
+    do
+    {
+        if (!func(user_data, size))
+        {
+            fprintf(stderr, "%s failed at size %zu\n", name, size);
+            return false;
+        }
+
+        ++iterations;
+        msec = tr_time_msec() - start;
+    }
+    while (msec < duration_msec);
+
+    seconds = MAX(msec, 1U) / 1000.0;
+
+    printf("{\"backend\":\"%s\",\"name\":\"%s\",\"size\":%zu,\"iterations\":%" PRIu64 ",\"msec\":%" PRIu64 ","
+        "\"ops_per_sec\":%.1f,\"bytes_per_sec\":%.0f}\n", TR_CRYPTO_PKG, name, size, iterations, msec,
+        iterations / seconds, (double)iterations * size / seconds);
+    fflush(stdout);
+
+    return true;
+}
+
+/***
+****  SHA1
+***/
+
+static uint8_t* data = NULL;
+
+static bool benchSha1(void* user_data UNUSED, size_t size)
+{
+    uint8_t hash[SHA_DIGEST_LENGTH];
+
+    return tr_sha1(hash, data, (int)size, NULL);
+}
+
+static bool benchSha1Batch(void* user_data UNUSED, size_t size)
+{
+    uint8_t hashes[TR_SHA1_BATCH_SIZE * SHA_DIGEST_LENGTH];
+    void const* datas[TR_SHA1_BATCH_SIZE];
+    size_t lengths[TR_SHA1_BATCH_SIZE];
+
+    /* every lane hashes the same buffer, to keep the memory use down */
+    for (int i = 0; i < TR_SHA1_BATCH_SIZE; ++i)
+    {
+        datas[i] = data;
+        lengths[i] = size / TR_SHA1_BATCH_SIZE;
+    }
+
+    return tr_sha1_batch(hashes, datas, lengths, TR_SHA1_BATCH_SIZE);
+}
+
+static bool runSha1(void)
+{
+    static struct
+    {
+        tr_sha1_impl impl;
+        char const* name;
+    }
+    const impls[] =
+    {
+        { TR_SHA1_IMPL_LIBRARY, "sha1-batch-library" },
+        { TR_SHA1_IMPL_AVX2, "sha1-batch-avx2" },
+        { TR_SHA1_IMPL_SHA_NI, "sha1-batch-sha-ni" }
+    };
+
+    bool ok = true;
+
+    for (size_t i = 0; ok && i < TR_N_ELEMENTS(sha1_sizes); ++i)
+    {
+        ok = measure("sha1", sha1_sizes[i], benchSha1, NULL);
+    }
+
+    /* the sizes are the total of all the buffers in a batch */
+    for (size_t i = 0; ok && i < TR_N_ELEMENTS(impls); ++i)
+    {
+        if (tr_sha1_batch_impl_is_supported(impls[i].impl))
+        {
+            tr_sha1_batch_set_impl(impls[i].impl);
+
+            for (size_t j = 0; ok && j < TR_N_ELEMENTS(sha1_sizes); ++j)
+            {
+                ok = measure(impls[i].name, sha1_sizes[j], benchSha1Batch, NULL);
+            }
+        }
+    }
+
+    tr_sha1_batch_set_impl(TR_SHA1_IMPL_AUTO);
+
+    return ok;
+}
+
+/***
+****  Peer encryption
+***/
+
+static bool makeKeyPair(tr_crypto* a, tr_crypto* b)
+{
+    int len;
+    uint8_t const* a_key = tr_cryptoGetMyPublicKey(a, &len);
+    uint8_t const* b_key = tr_cryptoGetMyPublicKey(b, &len);
+
+    return tr_cryptoComputeSecret(a, b_key) && tr_cryptoComputeSecret(b, a_key);
+}
+
+static bool benchDhKey(void* user_data UNUSED, size_t size UNUSED)
+{
+    tr_crypto crypto;
+    int len;
+    bool ok;
+
+    tr_cryptoConstruct(&crypto, NULL, false);
+    ok = tr_cryptoGetMyPublicKey(&crypto, &len) != NULL;
+    tr_cryptoDestruct(&crypto);
+
+    return ok;
+}
+
+static bool benchDhSecret(void* vpair, size_t size UNUSED)
+{
+    tr_crypto* pair = vpair;
+    int len;
+
+    return tr_cryptoComputeSecret(&pair[0], tr_cryptoGetMyPublicKey(&pair[1], &len));
+}
+
+static bool benchRc4Encrypt(void* vpair, size_t size)
+{
+    tr_crypto* pair = vpair;
+
+    tr_cryptoEncrypt(&pair[0], size, data, data);
+
+    return true;
+}
+
+static bool benchRc4Decrypt(void* vpair, size_t size)
+{
+    tr_crypto* pair = vpair;
+
+    tr_cryptoDecrypt(&pair[1], size, data, data);
+
+    return true;
+}
+
+/* OpenSSL 3 only has RC4 if the legacy provider is loaded */
+static bool isRc4Available(void)
+{
+    tr_rc4_ctx_t rc4 = tr_rc4_new();
+
+    tr_rc4_free(rc4);
+
+    return rc4 != NULL;
+}
+
+static bool runPeerCrypto(void)
+{
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    tr_crypto pair[2];
+    bool const has_rc4 = isRc4Available();
+    bool ok;
+
+    tr_rand_buffer(hash, sizeof(hash));
+    tr_cryptoConstruct(&pair[0], hash, false);
+    tr_cryptoConstruct(&pair[1], hash, true);
+
+    ok = makeKeyPair(&pair[0], &pair[1]);
+
+    if (ok && has_rc4)
+    {
+        tr_cryptoEncryptInit(&pair[0]);
+        tr_cryptoDecryptInit(&pair[1]);
+    }
+
+    ok = ok && measure("dh-key", KEY_LEN, benchDhKey, NULL);
+    ok = ok && measure("dh-secret", KEY_LEN, benchDhSecret, pair);
+
+    if (!has_rc4)
+    {
+        fprintf(stderr, "RC4 isn't available from the crypto library, so rc4-encrypt and rc4-decrypt are skipped\n");
+    }
+    else
+    {
+        ok = ok && measure("rc4-encrypt", PEER_BLOCK_SIZE, benchRc4Encrypt, pair);
+        ok = ok && measure("rc4-decrypt", PEER_BLOCK_SIZE, benchRc4Decrypt, pair);
+    }
+
+    tr_cryptoDestruct(&pair[1]);
+    tr_cryptoDestruct(&pair[0]);
+
+    return ok;
+}
+
+/***
+****  Base64 and SSHA1
+***/
+
+static bool benchBase64Encode(void* user_data UNUSED, size_t size)
+{
+    size_t len;
+    void* out = tr_base64_encode(data, size, &len);
+
+    tr_free(out);
+
+    return out != NULL;
+}
+
+static bool benchBase64Decode(void* encoded, size_t size)
+{
+    size_t len;
+    void* out = tr_base64_decode(encoded, size, &len);
+
+    tr_free(out);
+
+    return out != NULL;
+}
+
+static bool benchSsha1(void* user_data UNUSED, size_t size UNUSED)
+{
+    char* ssha1 = tr_ssha1("a password");
+
+    tr_free(ssha1);
+
+    return ssha1 != NULL;
+}
+
+static bool benchSsha1Matches(void* ssha1, size_t size UNUSED)
+{
+    return tr_ssha1_matches(ssha1, "a password");
+}
+
+static bool runStrings(void)
+{
+    /* small ones like RPC passwords, and big ones like torrents added over RPC */
+    static size_t const sizes[] = { 64, 16 * 1024, 1024 * 1024 };
+
+    bool ok = true;
+    char* ssha1;
+
+    for (size_t i = 0; ok && i < TR_N_ELEMENTS(sizes); ++i)
+    {
+        size_t encoded_size;
+        void* encoded = tr_base64_encode(data, sizes[i], &encoded_size);
+
+        ok = encoded != NULL && measure("base64-encode", sizes[i], benchBase64Encode, NULL) &&
+            measure("base64-decode", encoded_size, benchBase64Decode, encoded);
+
+        tr_free(encoded);
+    }
+
+    ssha1 = tr_ssha1("a password");
+    ok = ok && ssha1 != NULL && measure("ssha1", 0, benchSsha1, NULL) && measure("ssha1-matches", 0, benchSsha1Matches, ssha1);
+    tr_free(ssha1);
+
+    return ok;
+}
+
+/***
+****
+***/
+
+int tr_main(int argc, char* argv[])
+{
+    bool ok;
+
+    if (parseCommandLine(argc, (char const* const*)argv) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (showVersion)
+    {
+        fprintf(stderr, MY_NAME " " LONG_VERSION_STRING "\n");
+        return EXIT_SUCCESS;
+    }
+
+    data = tr_valloc(MAX_SIZE);
+    tr_rand_buffer(data, MAX_SIZE);
+
+    ok = runSha1() && runPeerCrypto() && runStrings();
+
+    tr_free(data);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -11,6 +11,7 @@
 #include "transmission.h"
 #include "crypto.h"
 #include "crypto-utils.h"
+#include "sha1-batch.h"
 #include "utils.h"
 
 #include "libtransmission-test.h"
@@ -118,6 +119,61 @@ static int test_sha1(void)
     return 0;
 }
 
+/* lengths around the padding boundaries, plus some bigger ones, in batches that don't fill all the lanes */
+static int test_sha1_batch_impl(tr_sha1_impl impl)
+{
+    size_t const lengths[] = { 0, 1, 55, 56, 63, 64, 65, 119, 120, 128, 1000, 16384, 16384, 16384, 16384, 16384, 16384,
+        16384, 16384, 16384, 16384, 16384, 16384, 100000 };
+    size_t const count = TR_N_ELEMENTS(lengths);
+    void const* data[TR_N_ELEMENTS(lengths)];
+    uint8_t* hashes = tr_new(uint8_t, count * SHA_DIGEST_LENGTH);
+    uint8_t* buf = tr_new(uint8_t, 100000 + count);
+
+    tr_rand_buffer(buf, 100000 + count);
+
+    /* give each buffer different contents */
+    for (size_t i = 0; i < count; ++i)
+    {
+        data[i] = buf + i;
+    }
+
+    tr_sha1_batch_set_impl(impl);
+
+    for (size_t n = 0; n <= count; ++n)
+    {
+        check(tr_sha1_batch(hashes, data, lengths, n));
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint8_t hash[SHA_DIGEST_LENGTH];
+
+            check(tr_sha1(hash, data[i], (int)lengths[i], NULL));
+            check_mem(hashes + i * SHA_DIGEST_LENGTH, ==, hash, SHA_DIGEST_LENGTH);
+        }
+    }
+
+    tr_sha1_batch_set_impl(TR_SHA1_IMPL_AUTO);
+
+    tr_free(buf);
+    tr_free(hashes);
+    return 0;
+}
+
+static int test_sha1_batch(void)
+{
+    tr_sha1_impl const impls[] = { TR_SHA1_IMPL_LIBRARY, TR_SHA1_IMPL_AVX2, TR_SHA1_IMPL_SHA_NI };
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(impls); ++i)
+    {
+        if (tr_sha1_batch_impl_is_supported(impls[i]))
+        {
+            check_int(test_sha1_batch_impl(impls[i]), ==, 0);
+        }
+    }
+
+    return 0;
+}
+
 static int test_ssha1(void)
 {
     struct
@@ -308,6 +364,7 @@ int main(void)
         test_torrent_hash,
         test_encrypt_decrypt,
         test_sha1,
+        test_sha1_batch,
         test_ssha1,
         test_random,
         test_base64
@@ -0,0 +1,311 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <errno.h>
+#include <string.h> /* memset() */
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "transmission.h"
+#include "diskio-uring.h"
+#include "error.h"
+#include "tr-assert.h"
+#include "utils.h"
+
+/* The rings are used directly through the system calls, which only needs
+ * the kernel headers; liburing isn't required. */
+
+struct tr_uring
+{
+    int ring_fd;
+    int event_fd;
+
+    /* submission queue */
+    void* sq_ring;
+    size_t sq_ring_size;
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_entries;
+    unsigned int* sq_array;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    /* the prepared requests that haven't been submitted yet */
+    unsigned int to_submit;
+
+    /* completion queue */
+    void* cq_ring;
+    size_t cq_ring_size;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void const* arg, unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void* ring_map(int fd, size_t size, off_t offset)
+{
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+
+    return ptr != MAP_FAILED ? ptr : NULL;
+}
+
+tr_uring* tr_uringNew(unsigned int entries, tr_error** error)
+{
+    struct io_uring_params params;
+    tr_uring* ring = tr_new0(tr_uring, 1);
+    uint8_t* sq;
+    uint8_t* cq;
+    int err;
+
+    ring->event_fd = -1;
+    memset(&params, 0, sizeof(params));
+
+    if ((ring->ring_fd = sys_io_uring_setup(entries, &params)) < 0)
+    {
+        ring->ring_fd = -1;
+        goto fail;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if ((ring->sq_ring = ring_map(ring->ring_fd, ring->sq_ring_size, IORING_OFF_SQ_RING)) == NULL ||
+        (ring->cq_ring = ring_map(ring->ring_fd, ring->cq_ring_size, IORING_OFF_CQ_RING)) == NULL ||
+        (ring->sqes = ring_map(ring->ring_fd, ring->sqes_size, IORING_OFF_SQES)) == NULL)
+    {
+        goto fail;
+    }
+
+    sq = ring->sq_ring;
+    ring->sq_head = (unsigned int*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = (unsigned int*)(sq + params.sq_off.ring_entries);
+    ring->sq_array = (unsigned int*)(sq + params.sq_off.array);
+
+    cq = ring->cq_ring;
+    ring->cq_head = (unsigned int*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    if ((ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+        sys_io_uring_register(ring->ring_fd, IORING_REGISTER_EVENTFD, &ring->event_fd, 1) < 0)
+    {
+        goto fail;
+    }
+
+    return ring;
+
+fail:
+    err = errno;
+    tr_error_set_literal(error, err, tr_strerror(err));
+    tr_uringFree(ring);
+    return NULL;
+}
+
+void tr_uringFree(tr_uring* ring)
+{
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    if (ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+
+    if (ring->cq_ring != NULL)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+
+    if (ring->sq_ring != NULL)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+
+    if (ring->event_fd != -1)
+    {
+        close(ring->event_fd);
+    }
+
+    if (ring->ring_fd != -1)
+    {
+        close(ring->ring_fd);
+    }
+
+    tr_free(ring);
+}
+
+int tr_uringGetEventFd(tr_uring const* ring)
+{
+    return ring->event_fd;
+}
+
+void tr_uringClearEventFd(tr_uring* ring)
+{
+    eventfd_t value;
+
+    eventfd_read(ring->event_fd, &value);
+}
+
+/* returns a zeroed submission queue entry, or NULL if the queue is full */
+static struct io_uring_sqe* get_sqe(tr_uring* ring)
+{
+    unsigned int const head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int const tail = *ring->sq_tail;
+    struct io_uring_sqe* sqe;
+
+    if (tail - head >= *ring->sq_entries)
+    {
+        return NULL;
+    }
+
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void push_sqe(tr_uring* ring)
+{
+    unsigned int const tail = *ring->sq_tail;
+    unsigned int const index = tail & *ring->sq_mask;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++ring->to_submit;
+}
+
+bool tr_uringPrepRW(tr_uring* ring, bool is_write, tr_sys_file_t fd, struct iovec const* iov, unsigned int iov_count,
+    uint64_t offset, void* user_data)
+{
+    struct io_uring_sqe* sqe = get_sqe(ring);
+
+    if (sqe == NULL)
+    {
+        return false;
+    }
+
+    sqe->opcode = is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = iov_count;
+    sqe->user_data = (uint64_t)(uintptr_t)user_data;
+
+    push_sqe(ring);
+    return true;
+}
+
+bool tr_uringPrepSync(tr_uring* ring, tr_sys_file_t fd, void* user_data)
+{
+    struct io_uring_sqe* sqe = get_sqe(ring);
+
+    if (sqe == NULL)
+    {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = (uint64_t)(uintptr_t)user_data;
+
+    /* don't start until everything that was submitted before it is done */
+    sqe->flags = IOSQE_IO_DRAIN;
+
+    push_sqe(ring);
+    return true;
+}
+
+int tr_uringSubmit(tr_uring* ring, bool wait)
+{
+    while (ring->to_submit > 0 || wait)
+    {
+        int const n = sys_io_uring_enter(ring->ring_fd, ring->to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return errno;
+        }
+
+        TR_ASSERT((unsigned int)n <= ring->to_submit);
+
+        if (n == 0 && !wait)
+        {
+            break;
+        }
+
+        ring->to_submit -= n;
+        wait = false;
+    }
+
+    return 0;
+}
+
+size_t tr_uringReap(tr_uring* ring, tr_uring_done_func done_func, void* context)
+{
+    size_t reaped = 0;
+    unsigned int head = *ring->cq_head;
+
+    for (;;)
+    {
+        unsigned int const tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail)
+        {
+            break;
+        }
+
+        while (head != tail)
+        {
+            struct io_uring_cqe const* cqe = &ring->cqes[head & *ring->cq_mask];
+            void* const user_data = (void*)(uintptr_t)cqe->user_data;
+            int const result = cqe->res;
+
+            ++head;
+            ++reaped;
+
+            /* let the kernel reuse the slot before calling back, since
+               the callback may prepare and submit more requests */
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+            (*done_func)(user_data, result, context);
+        }
+    }
+
+    return reaped;
+}
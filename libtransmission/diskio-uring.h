@@ -0,0 +1,82 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#pragma once
+
+#ifndef __TRANSMISSION__
+#error only libtransmission should #include this header.
+#endif
+
+#include <sys/uio.h> /* struct iovec */
+
+#include "file.h" /* tr_sys_file_t */
+
+struct tr_error;
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+/**
+ * A thin wrapper around a Linux io_uring instance, used by the disk I/O
+ * queue to batch block reads and writes into a few system calls.
+ *
+ * Completions are signalled on an eventfd, so that they can be picked up
+ * by the libtransmission thread's event loop.
+ */
+typedef struct tr_uring tr_uring;
+
+typedef void (* tr_uring_done_func)(void* user_data, int result, void* context);
+
+/** Returns NULL, and sets `error', if the kernel doesn't support io_uring. */
+tr_uring* tr_uringNew(unsigned int entries, struct tr_error** error);
+
+void tr_uringFree(tr_uring* ring);
+
+/** Returns the eventfd that becomes readable when there are completions to reap. */
+int tr_uringGetEventFd(tr_uring const* ring);
+
+/** Clears the eventfd once it's been seen as readable. */
+void tr_uringClearEventFd(tr_uring* ring);
+
+/**
+ * Prepares a vectored read or write. The iovecs must stay valid until
+ * the request completes.
+ *
+ * @return false if the submission queue is full
+ */
+bool tr_uringPrepRW(tr_uring* ring, bool is_write, tr_sys_file_t fd, struct iovec const* iov, unsigned int iov_count,
+    uint64_t offset, void* user_data);
+
+/**
+ * Prepares an fdatasync(), which waits for all of the requests that were
+ * prepared before it to complete.
+ *
+ * @return false if the submission queue is full
+ */
+bool tr_uringPrepSync(tr_uring* ring, tr_sys_file_t fd, void* user_data);
+
+/**
+ * Submits the prepared requests to the kernel.
+ * If `wait' is true, this blocks until at least one request has completed.
+ *
+ * @return 0 on success, or an errno value on failure
+ */
+int tr_uringSubmit(tr_uring* ring, bool wait);
+
+/**
+ * Calls `done_func' for each completed request, with the result
+ * that the equivalent preadv() or pwritev() would have returned,
+ * or a negated errno value on failure.
+ *
+ * @return the number of requests reaped
+ */
+size_t tr_uringReap(tr_uring* ring, tr_uring_done_func done_func, void* context);
+
+/* @} */
@@ -0,0 +1,1331 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#ifdef WITH_IO_URING
+#include <event2/event.h>
+#endif
+
+#include "transmission.h"
+#include "diskio.h"
+#ifdef WITH_IO_URING
+#include "diskio-uring.h"
+#endif
+#include "error.h"
+#include "file.h"
+#include "inout.h"
+#include "log.h"
+#include "platform.h" /* tr_lock, tr_threadNew() */
+#include "prealloc.h"
+#include "ptrarray.h"
+#include "session.h"
+#include "torrent.h"
+#include "tr-assert.h"
+#include "trevent.h"
+#include "utils.h"
+
+#define MY_NAME "DiskIO"
+
+#define dbgmsg(...) tr_logAddDeepNamed(MY_NAME, __VA_ARGS__)
+
+enum
+{
+    DISKIO_MAX_WORKERS = 32,
+
+    /* the most ops that can run on one device at once */
+    DISKIO_MAX_DEVICE_DEPTH = 32,
+
+    /* a torrent_id that matches every torrent */
+    DISKIO_ALL_TORRENTS = -1,
+
+    /* the number of requests that can be in the io_uring at once */
+    DISKIO_URING_ENTRIES = 256,
+
+    /* the most buffers that one io_uring request can take */
+    DISKIO_URING_MAX_IOV = 1024
+};
+
+struct diskio_torrent
+{
+    int torrent_id;
+
+    /* the device that holds the torrent's files,
+       looked up when its first I/O is queued */
+    uint64_t device;
+
+    /* the number of its ops that are queued or running */
+    int pending;
+};
+
+struct diskio_op
+{
+    struct diskio_op* next;
+
+    bool is_write;
+    bool is_sync;
+    bool is_cancelled;
+    int torrent_id;
+    struct tr_diskio* diskio;
+    struct diskio_torrent* dt;
+    struct diskio_queue* queue;
+
+    tr_piece_index_t piece;
+    uint32_t offset;
+    uint32_t length;
+
+    struct tr_io_span* spans;
+    size_t span_count;
+
+    tr_sys_file_iovec* iov; /* writes */
+    size_t iov_count;
+    uint8_t* buf; /* reads */
+
+    int err;
+    size_t failed_span;
+
+    tr_diskio_done_func done_func;
+    void* user_data;
+
+#ifdef WITH_IO_URING
+    /* the number of its io_uring requests that haven't completed */
+    size_t uring_pending;
+#endif
+};
+
+#ifdef WITH_IO_URING
+
+/* one readv() or writev() of an op, for a single span */
+struct diskio_uring_req
+{
+    struct diskio_uring_req* next;
+    struct diskio_op* op;
+    size_t span;
+
+    uint64_t offset;
+    uint64_t length;
+
+    /* the part of `buffers' that's still to be done */
+    struct iovec* iov;
+    unsigned int iov_count;
+    struct iovec* buffers;
+};
+
+#endif
+
+struct diskio_queue
+{
+    uint64_t device;
+
+    struct diskio_op* head;
+    struct diskio_op* tail;
+    int queued_count;
+
+    /* the ops that workers are running, linked by `next' */
+    struct diskio_op* running;
+    int running_count;
+
+    /* the size of the writes that are queued or running */
+    uint64_t write_bytes;
+
+    /* the number of reads that are queued or running */
+    size_t read_count;
+};
+
+struct tr_diskio
+{
+    tr_session* session;
+
+    /* everything below is protected by `lock' */
+    tr_lock* lock;
+
+    /* broadcast whenever an op finishes or a worker leaves */
+    tr_cond* progress;
+
+    /* with no workers, the writes that are waiting for their
+       files to be preallocated, linked by `next' */
+    struct diskio_op* fill_ops;
+
+    tr_ptrArray queues; /* struct diskio_queue*, sorted by device */
+    tr_ptrArray torrents; /* struct diskio_torrent*, sorted by torrent_id */
+    int next_queue;
+
+    /* ops that have finished and are waiting to be delivered
+       to their callbacks in the libtransmission thread */
+    struct diskio_op* done_head;
+    struct diskio_op* done_tail;
+    bool is_delivery_pending;
+
+    int max_workers;
+    int worker_count;
+    int idle_workers;
+    size_t queue_depth;
+
+    /* how many ops can run on one device at once */
+    int device_depth;
+
+    bool is_uring_wanted;
+
+#ifdef WITH_IO_URING
+    /* everything below is only used in the libtransmission thread */
+    tr_uring* uring;
+    struct event* uring_event;
+    struct event* submit_event;
+    bool is_submit_scheduled;
+
+    /* the ops that are in the ring, linked by `next' */
+    struct diskio_op* uring_ops;
+
+    /* requests that are waiting for room in the ring */
+    struct diskio_uring_req* backlog_head;
+    struct diskio_uring_req* backlog_tail;
+    unsigned int uring_inflight;
+#endif
+};
+
+/***
+****
+***/
+
+static int compareQueueDevice(void const* va, void const* vb)
+{
+    struct diskio_queue const* a = va;
+    struct diskio_queue const* b = vb;
+
+    if (a->device != b->device)
+    {
+        return a->device < b->device ? -1 : 1;
+    }
+
+    return 0;
+}
+
+static struct diskio_queue* getQueue(tr_diskio* d, uint64_t device)
+{
+    struct diskio_queue* q;
+    struct diskio_queue key;
+
+    key.device = device;
+
+    if ((q = tr_ptrArrayFindSorted(&d->queues, &key, compareQueueDevice)) == NULL)
+    {
+        q = tr_new0(struct diskio_queue, 1);
+        q->device = device;
+        tr_ptrArrayInsertSorted(&d->queues, q, compareQueueDevice);
+    }
+
+    return q;
+}
+
+static int compareTorrentId(void const* va, void const* vb)
+{
+    struct diskio_torrent const* a = va;
+    struct diskio_torrent const* b = vb;
+
+    if (a->torrent_id != b->torrent_id)
+    {
+        return a->torrent_id < b->torrent_id ? -1 : 1;
+    }
+
+    return 0;
+}
+
+static struct diskio_torrent* findTorrent(tr_diskio* d, int torrent_id)
+{
+    struct diskio_torrent key;
+    key.torrent_id = torrent_id;
+    return tr_ptrArrayFindSorted(&d->torrents, &key, compareTorrentId);
+}
+
+static uint64_t getSpanDevice(struct tr_io_span const* span)
+{
+    tr_sys_path_info info;
+
+    return tr_sys_file_get_info(span->fd, &info, NULL) ? info.device : 0;
+}
+
+/* the number of the queue's ops that could start now */
+static inline int getQueueReadyCount(tr_diskio const* d, struct diskio_queue const* q)
+{
+    return MAX(0, MIN(q->queued_count, d->device_depth - q->running_count));
+}
+
+/* returns the next queue that has work and room for another worker */
+static struct diskio_queue* getReadyQueue(tr_diskio* d)
+{
+    int const n = tr_ptrArraySize(&d->queues);
+
+    for (int i = 0; i < n; ++i)
+    {
+        int const pos = (d->next_queue + i) % n;
+        struct diskio_queue* q = tr_ptrArrayNth(&d->queues, pos);
+
+        if (getQueueReadyCount(d, q) > 0)
+        {
+            d->next_queue = (pos + 1) % n;
+            return q;
+        }
+    }
+
+    return NULL;
+}
+
+static int countReadyOps(tr_diskio const* d)
+{
+    int ready = 0;
+    int const n = tr_ptrArraySize(&d->queues);
+
+    for (int i = 0; i < n; ++i)
+    {
+        ready += getQueueReadyCount(d, tr_ptrArrayNth((tr_ptrArray*)&d->queues, i));
+    }
+
+    return ready;
+}
+
+/***
+****
+***/
+
+static int syncSpans(struct tr_io_span const* spans, size_t span_count, size_t* setme_failed)
+{
+    for (size_t i = 0; i < span_count; ++i)
+    {
+        tr_error* error = NULL;
+
+        if (!tr_sys_file_flush_data(spans[i].fd, &error))
+        {
+            int const err = error->code;
+
+            tr_error_free(error);
+            *setme_failed = i;
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static void runOp(tr_diskio* d, struct diskio_op* op)
+{
+    if (op->is_sync)
+    {
+        op->err = syncSpans(op->spans, op->span_count, &op->failed_span);
+    }
+    else if (op->is_write)
+    {
+        /* if the files are still being preallocated, this waits
+           for the parts that are being written to */
+        tr_preallocWait(d->session->prealloc, op->torrent_id, op->spans, op->span_count);
+
+        op->err = tr_ioWriteSpans(op->spans, op->span_count, op->iov, op->iov_count, &op->failed_span);
+    }
+    else
+    {
+        op->err = tr_ioReadSpans(op->spans, op->span_count, op->buf, &op->failed_span);
+    }
+}
+
+/* called in the libtransmission thread once the op's I/O is done */
+static void finishOp(tr_diskio* d, struct diskio_op* op)
+{
+    if (op->err != 0 && op->spans != NULL)
+    {
+        tr_torrent* tor = tr_torrentFindFromId(d->session, op->torrent_id);
+
+        if (tor != NULL)
+        {
+            tr_file const* file = &tor->info.files[op->spans[op->failed_span].file_index];
+
+            if (op->is_sync)
+            {
+                tr_logAddTorErr(tor, "sync failed for \"%s\": %s", file->name, tr_strerror(op->err));
+            }
+            else if (!op->is_write)
+            {
+                tr_logAddTorErr(tor, "read failed for \"%s\": %s", file->name, tr_strerror(op->err));
+            }
+            else
+            {
+                tr_logAddTorErr(tor, "write failed for \"%s\": %s", file->name, tr_strerror(op->err));
+
+                if (tor->error != TR_STAT_LOCAL_ERROR)
+                {
+                    char* path = tr_buildPath(tor->downloadDir, file->name, NULL);
+                    tr_torrentSetLocalError(tor, "%s (%s)", tr_strerror(op->err), path);
+                    tr_free(path);
+                }
+            }
+        }
+    }
+
+    tr_ioCloseSpans(d->session, op->spans, op->span_count);
+
+    if (!op->is_cancelled && op->done_func != NULL)
+    {
+        (*op->done_func)(op->user_data, op->err, op->piece, op->offset, op->length, op->buf);
+    }
+
+    tr_free(op->buf);
+    tr_free(op->iov);
+    tr_free(op);
+}
+
+/* deliver the finished ops of one torrent, or of all of them */
+static void deliver(tr_diskio* d, int torrent_id)
+{
+    struct diskio_op* ops = NULL;
+    struct diskio_op** tail = &ops;
+    struct diskio_op* keep = NULL;
+    struct diskio_op* keep_tail = NULL;
+
+    tr_lockLock(d->lock);
+
+    for (struct diskio_op* op = d->done_head; op != NULL;)
+    {
+        struct diskio_op* next = op->next;
+
+        op->next = NULL;
+
+        if (torrent_id == DISKIO_ALL_TORRENTS || op->torrent_id == torrent_id)
+        {
+            *tail = op;
+            tail = &op->next;
+        }
+        else if (keep_tail != NULL)
+        {
+            keep_tail->next = op;
+            keep_tail = op;
+        }
+        else
+        {
+            keep = keep_tail = op;
+        }
+
+        op = next;
+    }
+
+    d->done_head = keep;
+    d->done_tail = keep_tail;
+
+    if (keep == NULL)
+    {
+        d->is_delivery_pending = false;
+    }
+
+    tr_lockUnlock(d->lock);
+
+    while (ops != NULL)
+    {
+        struct diskio_op* next = ops->next;
+        finishOp(d, ops);
+        ops = next;
+    }
+}
+
+static void deliverInEventThread(void* vsession)
+{
+    tr_session* session = vsession;
+
+    if (session->diskio != NULL)
+    {
+        deliver(session->diskio, DISKIO_ALL_TORRENTS);
+    }
+}
+
+/* call with the lock held once an op's I/O is done */
+static void opDone(tr_diskio* d, struct diskio_op* op)
+{
+    --op->dt->pending;
+    --d->queue_depth;
+
+    if (op->is_write)
+    {
+        op->queue->write_bytes -= op->length;
+    }
+    else if (!op->is_sync)
+    {
+        --op->queue->read_count;
+    }
+
+    op->next = NULL;
+
+    if (d->done_tail != NULL)
+    {
+        d->done_tail->next = op;
+    }
+    else
+    {
+        d->done_head = op;
+    }
+
+    d->done_tail = op;
+    tr_condBroadcast(d->progress);
+
+    if (!d->is_delivery_pending)
+    {
+        d->is_delivery_pending = true;
+        tr_runInEventThread(d->session, deliverInEventThread, d->session);
+    }
+}
+
+/***
+****  io_uring
+***/
+
+#ifdef WITH_IO_URING
+
+static inline bool isUringActive(tr_diskio const* d)
+{
+    return d->uring != NULL;
+}
+
+static bool uringPrep(tr_diskio* d, struct diskio_uring_req* req)
+{
+    tr_sys_file_t const fd = req->op->spans[req->span].fd;
+
+    if (req->op->is_sync)
+    {
+        return tr_uringPrepSync(d->uring, fd, req);
+    }
+
+    return tr_uringPrepRW(d->uring, req->op->is_write, fd, req->iov, req->iov_count, req->offset, req);
+}
+
+/* move requests from the backlog into the ring while there's room */
+static void uringFill(tr_diskio* d)
+{
+    while (d->backlog_head != NULL && d->uring_inflight < DISKIO_URING_ENTRIES)
+    {
+        struct diskio_uring_req* req = d->backlog_head;
+
+        if (!uringPrep(d, req))
+        {
+            /* the submission queue is full, so hand it to the kernel first */
+            if (tr_uringSubmit(d->uring, false) != 0 || !uringPrep(d, req))
+            {
+                break;
+            }
+        }
+
+        d->backlog_head = req->next;
+
+        if (d->backlog_head == NULL)
+        {
+            d->backlog_tail = NULL;
+        }
+
+        ++d->uring_inflight;
+    }
+}
+
+static void uringSubmit(tr_diskio* d, bool wait)
+{
+    int err;
+
+    uringFill(d);
+
+    if ((err = tr_uringSubmit(d->uring, wait && d->uring_inflight > 0)) != 0)
+    {
+        /* the requests stay in the ring until the next try */
+        dbgmsg("io_uring submit failed: %s", tr_strerror(err));
+    }
+}
+
+static void onSubmitEvent(evutil_socket_t fd UNUSED, short what UNUSED, void* vd)
+{
+    tr_diskio* d = vd;
+
+    d->is_submit_scheduled = false;
+    uringSubmit(d, false);
+}
+
+/* everything that's queued during this turn of the event loop
+   gets submitted together at the end of it */
+static void uringScheduleSubmit(tr_diskio* d)
+{
+    if (!d->is_submit_scheduled)
+    {
+        d->is_submit_scheduled = true;
+        event_active(d->submit_event, EV_TIMEOUT, 0);
+    }
+}
+
+static void uringPushBacklog(tr_diskio* d, struct diskio_uring_req* req, bool at_front)
+{
+    if (d->backlog_head == NULL)
+    {
+        req->next = NULL;
+        d->backlog_head = d->backlog_tail = req;
+    }
+    else if (at_front)
+    {
+        req->next = d->backlog_head;
+        d->backlog_head = req;
+    }
+    else
+    {
+        req->next = NULL;
+        d->backlog_tail->next = req;
+        d->backlog_tail = req;
+    }
+}
+
+static void onUringDone(void* vreq, int result, void* vd)
+{
+    tr_diskio* d = vd;
+    struct diskio_uring_req* req = vreq;
+    struct diskio_op* op = req->op;
+
+    --d->uring_inflight;
+
+    if (result > 0 && (uint64_t)result < req->length)
+    {
+        /* a short read or write; queue up the rest */
+        size_t done = result;
+
+        req->offset += done;
+        req->length -= done;
+
+        while (done >= req->iov->iov_len)
+        {
+            done -= req->iov->iov_len;
+            ++req->iov;
+            --req->iov_count;
+        }
+
+        req->iov->iov_base = (uint8_t*)req->iov->iov_base + done;
+        req->iov->iov_len -= done;
+
+        uringPushBacklog(d, req, true);
+        return;
+    }
+
+    if (result == 0 && op->is_write && req->length > 0)
+    {
+        result = -EIO;
+    }
+
+    if (result < 0 && op->err == 0)
+    {
+        op->err = -result;
+        op->failed_span = req->span;
+    }
+
+    tr_free(req->buffers);
+    tr_free(req);
+
+    if (--op->uring_pending == 0)
+    {
+        struct diskio_op** walk = &d->uring_ops;
+
+        while (*walk != op)
+        {
+            walk = &(*walk)->next;
+        }
+
+        *walk = op->next;
+
+        tr_lockLock(d->lock);
+        opDone(d, op);
+        tr_lockUnlock(d->lock);
+    }
+}
+
+static void uringReap(tr_diskio* d)
+{
+    if (tr_uringReap(d->uring, onUringDone, d) > 0)
+    {
+        /* there may be room for the backlog now, or short transfers to finish */
+        uringFill(d);
+        uringScheduleSubmit(d);
+    }
+}
+
+static void onUringEvent(evutil_socket_t fd UNUSED, short what UNUSED, void* vd)
+{
+    tr_diskio* d = vd;
+
+    tr_uringClearEventFd(d->uring);
+    uringReap(d);
+    deliver(d, DISKIO_ALL_TORRENTS);
+}
+
+/* split an op into one request per span, in as few buffers as it takes */
+static void uringQueueOp(tr_diskio* d, struct diskio_op* op)
+{
+    uint8_t* buf = op->buf;
+    size_t iov_index = 0;
+    size_t iov_skip = 0;
+
+    for (size_t i = 0; i < op->span_count; ++i)
+    {
+        uint64_t span_offset = 0;
+
+        if (op->is_sync)
+        {
+            struct diskio_uring_req* req = tr_new0(struct diskio_uring_req, 1);
+
+            req->op = op;
+            req->span = i;
+            ++op->uring_pending;
+            uringPushBacklog(d, req, false);
+            continue;
+        }
+
+        while (span_offset < op->spans[i].length)
+        {
+            struct diskio_uring_req* req = tr_new0(struct diskio_uring_req, 1);
+            size_t const max_iov = op->is_write ? MIN(op->iov_count - iov_index, (size_t)DISKIO_URING_MAX_IOV) : 1;
+
+            req->op = op;
+            req->span = i;
+            req->offset = op->spans[i].file_offset + span_offset;
+            req->buffers = tr_new(struct iovec, max_iov);
+            req->iov = req->buffers;
+
+            if (!op->is_write)
+            {
+                req->buffers[0].iov_base = buf;
+                req->buffers[0].iov_len = op->spans[i].length;
+                req->iov_count = 1;
+                buf += op->spans[i].length;
+            }
+            else
+            {
+                while (req->iov_count < max_iov && span_offset + req->length < op->spans[i].length)
+                {
+                    tr_sys_file_iovec const* src = &op->iov[iov_index];
+                    size_t const n = MIN(src->size - iov_skip, op->spans[i].length - span_offset - req->length);
+                    struct iovec* dst = &req->buffers[req->iov_count++];
+
+                    dst->iov_base = (uint8_t*)src->base + iov_skip;
+                    dst->iov_len = n;
+                    req->length += n;
+                    iov_skip += n;
+
+                    if (iov_skip == src->size)
+                    {
+                        ++iov_index;
+                        iov_skip = 0;
+                    }
+                }
+            }
+
+            if (!op->is_write)
+            {
+                req->length = op->spans[i].length;
+            }
+
+            span_offset += req->length;
+            ++op->uring_pending;
+            uringPushBacklog(d, req, false);
+        }
+    }
+
+    op->next = d->uring_ops;
+    d->uring_ops = op;
+
+    uringFill(d);
+    uringScheduleSubmit(d);
+}
+
+static void uringStart(tr_diskio* d)
+{
+    tr_error* error = NULL;
+
+    if ((d->uring = tr_uringNew(DISKIO_URING_ENTRIES, &error)) == NULL)
+    {
+        tr_logAddNamedError(MY_NAME, _("Couldn't set up io_uring, so using disk I/O threads instead: %s"), error->message);
+        tr_error_free(error);
+        return;
+    }
+
+    d->uring_event = event_new(d->session->event_base, tr_uringGetEventFd(d->uring), EV_READ | EV_PERSIST, onUringEvent, d);
+    d->submit_event = event_new(d->session->event_base, -1, 0, onSubmitEvent, d);
+    event_add(d->uring_event, NULL);
+
+    tr_logAddNamedInfo(MY_NAME, "%s", _("Using io_uring for disk I/O"));
+}
+
+static void uringStop(tr_diskio* d)
+{
+    TR_ASSERT(d->uring_ops == NULL);
+    TR_ASSERT(d->backlog_head == NULL);
+
+    event_free(d->submit_event);
+    event_free(d->uring_event);
+    tr_uringFree(d->uring);
+
+    d->submit_event = NULL;
+    d->uring_event = NULL;
+    d->uring = NULL;
+    d->is_submit_scheduled = false;
+}
+
+#else
+
+static inline bool isUringActive(tr_diskio const* d UNUSED)
+{
+    return false;
+}
+
+#endif
+
+/***
+****
+***/
+
+static void maybeStartWorker(tr_diskio* d);
+
+static void workerFunc(void* vd)
+{
+    tr_diskio* d = vd;
+
+    tr_lockLock(d->lock);
+
+    for (;;)
+    {
+        struct diskio_queue* q;
+        struct diskio_op* op;
+        bool is_cancelled;
+
+        if (d->worker_count > d->max_workers || (q = getReadyQueue(d)) == NULL)
+        {
+            break;
+        }
+
+        op = q->head;
+        q->head = op->next;
+        --q->queued_count;
+
+        if (q->head == NULL)
+        {
+            q->tail = NULL;
+        }
+
+        op->next = q->running;
+        q->running = op;
+        ++q->running_count;
+        is_cancelled = op->is_cancelled;
+        --d->idle_workers;
+
+        /* other devices may be waiting for a worker, too */
+        maybeStartWorker(d);
+
+        tr_lockUnlock(d->lock);
+
+        if (!is_cancelled)
+        {
+            runOp(d, op);
+        }
+
+        tr_lockLock(d->lock);
+
+        ++d->idle_workers;
+
+        for (struct diskio_op** walk = &q->running;; walk = &(*walk)->next)
+        {
+            if (*walk == op)
+            {
+                *walk = op->next;
+                break;
+            }
+        }
+
+        --q->running_count;
+        opDone(d, op);
+    }
+
+    --d->idle_workers;
+    --d->worker_count;
+    tr_condBroadcast(d->progress);
+
+    tr_lockUnlock(d->lock);
+}
+
+/* call with the lock held */
+static void maybeStartWorker(tr_diskio* d)
+{
+    if (d->worker_count < d->max_workers && d->idle_workers < countReadyOps(d))
+    {
+        ++d->worker_count;
+        ++d->idle_workers;
+        tr_threadNew(workerFunc, d);
+    }
+}
+
+/* with no workers, a write that has to wait for its files to be
+   preallocated is done by the filler thread once they're ready,
+   so that the libtransmission thread doesn't have to wait */
+static void onFillDone(void* vop)
+{
+    struct diskio_op* op = vop;
+    tr_diskio* d = op->diskio;
+    bool is_cancelled;
+
+    tr_lockLock(d->lock);
+    is_cancelled = op->is_cancelled;
+    tr_lockUnlock(d->lock);
+
+    if (!is_cancelled)
+    {
+        op->err = tr_ioWriteSpans(op->spans, op->span_count, op->iov, op->iov_count, &op->failed_span);
+    }
+
+    tr_lockLock(d->lock);
+
+    for (struct diskio_op** walk = &d->fill_ops;; walk = &(*walk)->next)
+    {
+        if (*walk == op)
+        {
+            *walk = op->next;
+            break;
+        }
+    }
+
+    opDone(d, op);
+    tr_lockUnlock(d->lock);
+}
+
+/***
+****
+***/
+
+static struct diskio_op* opNew(tr_torrent* tor, bool is_write, tr_piece_index_t piece, uint32_t offset, uint32_t length,
+    tr_diskio_done_func done_func, void* user_data)
+{
+    struct diskio_op* op = tr_new0(struct diskio_op, 1);
+
+    op->is_write = is_write;
+    op->torrent_id = tr_torrentId(tor);
+    op->piece = piece;
+    op->offset = offset;
+    op->length = length;
+    op->done_func = done_func;
+    op->user_data = user_data;
+    return op;
+}
+
+static void submit(tr_diskio* d, tr_torrent* tor, struct diskio_op* op)
+{
+    TR_ASSERT(tr_amInEventThread(d->session));
+
+    struct diskio_torrent* dt;
+    struct diskio_queue* q;
+    bool use_uring = isUringActive(d);
+    bool behind_fill = false;
+
+    /* the files are opened here, in the libtransmission thread,
+       so that the workers never have to touch the torrent */
+    if (!op->is_sync)
+    {
+        op->err = tr_ioOpenSpans(tor, op->is_write, op->piece, op->offset, op->length, &op->spans, &op->span_count);
+    }
+
+    /* io_uring can't wait for the files to be preallocated, so leave that to the workers,
+       or if there aren't any, to the preallocation's own thread */
+    if ((use_uring || d->max_workers == 0) && op->err == 0 && op->is_write && op->span_count > 0 &&
+        !tr_preallocIsDone(d->session->prealloc, op->torrent_id, op->spans, op->span_count))
+    {
+        use_uring = false;
+        behind_fill = d->max_workers == 0;
+    }
+
+    if (op->err != 0 || op->span_count == 0 || (d->max_workers == 0 && !use_uring && !behind_fill))
+    {
+        if (op->err == 0)
+        {
+            runOp(d, op);
+        }
+
+        finishOp(d, op);
+        return;
+    }
+
+    tr_lockLock(d->lock);
+
+    if ((dt = findTorrent(d, op->torrent_id)) == NULL)
+    {
+        dt = tr_new0(struct diskio_torrent, 1);
+        dt->torrent_id = op->torrent_id;
+        dt->device = getSpanDevice(&op->spans[0]);
+        tr_ptrArrayInsertSorted(&d->torrents, dt, compareTorrentId);
+    }
+
+    q = getQueue(d, dt->device);
+
+    op->diskio = d;
+    op->dt = dt;
+    op->queue = q;
+    ++dt->pending;
+    ++d->queue_depth;
+
+    if (op->is_write)
+    {
+        q->write_bytes += op->length;
+    }
+    else if (!op->is_sync)
+    {
+        ++q->read_count;
+    }
+
+#ifdef WITH_IO_URING
+
+    if (use_uring)
+    {
+        tr_lockUnlock(d->lock);
+        uringQueueOp(d, op);
+        return;
+    }
+
+#endif
+
+    if (behind_fill)
+    {
+        op->next = d->fill_ops;
+        d->fill_ops = op;
+        tr_lockUnlock(d->lock);
+        tr_preallocWhenDone(d->session->prealloc, op->torrent_id, op->spans, op->span_count, onFillDone, op);
+        return;
+    }
+
+    if (q->tail != NULL)
+    {
+        q->tail->next = op;
+    }
+    else
+    {
+        q->head = op;
+    }
+
+    q->tail = op;
+    ++q->queued_count;
+
+    maybeStartWorker(d);
+
+    tr_lockUnlock(d->lock);
+}
+
+void tr_diskioRead(tr_diskio* d, tr_torrent* tor, tr_piece_index_t piece, uint32_t offset, uint32_t length,
+    tr_diskio_done_func done_func, void* user_data)
+{
+    struct diskio_op* op = opNew(tor, false, piece, offset, length, done_func, user_data);
+
+    op->buf = tr_new(uint8_t, length);
+    submit(d, tor, op);
+}
+
+void tr_diskioWritev(tr_diskio* d, tr_torrent* tor, tr_piece_index_t piece, uint32_t offset, tr_sys_file_iovec const* iov,
+    size_t iov_count, tr_diskio_done_func done_func, void* user_data)
+{
+    uint64_t length = 0;
+    struct diskio_op* op;
+
+    for (size_t i = 0; i < iov_count; ++i)
+    {
+        length += iov[i].size;
+    }
+
+    op = opNew(tor, true, piece, offset, length, done_func, user_data);
+    op->iov = tr_memdup(iov, sizeof(tr_sys_file_iovec) * iov_count);
+    op->iov_count = iov_count;
+    submit(d, tor, op);
+}
+
+void tr_diskioSync(tr_diskio* d, tr_torrent* tor, tr_file_index_t file, tr_diskio_done_func done_func, void* user_data)
+{
+    tr_file const* f = &tor->info.files[file];
+    struct diskio_op* op = opNew(tor, false, f->firstPiece, f->offset - (uint64_t)f->firstPiece * tor->info.pieceSize, 0,
+        done_func, user_data);
+
+    op->is_sync = true;
+    op->err = tr_ioOpenSpans(tor, false, op->piece, op->offset, f->length, &op->spans, &op->span_count);
+    submit(d, tor, op);
+}
+
+/***
+****
+***/
+
+static void cancelOps(struct diskio_op* op, void const* user_data)
+{
+    for (; op != NULL; op = op->next)
+    {
+        if (op->user_data == user_data)
+        {
+            op->is_cancelled = true;
+        }
+    }
+}
+
+void tr_diskioCancel(tr_diskio* d, void const* user_data)
+{
+    TR_ASSERT(tr_amInEventThread(d->session));
+
+    tr_lockLock(d->lock);
+
+    for (int i = 0, n = tr_ptrArraySize(&d->queues); i < n; ++i)
+    {
+        struct diskio_queue* q = tr_ptrArrayNth(&d->queues, i);
+
+        cancelOps(q->head, user_data);
+        cancelOps(q->running, user_data);
+    }
+
+    cancelOps(d->fill_ops, user_data);
+    cancelOps(d->done_head, user_data);
+
+#ifdef WITH_IO_URING
+    cancelOps(d->uring_ops, user_data);
+#endif
+
+    tr_lockUnlock(d->lock);
+}
+
+/* call with the lock held. Blocks until some of the queued I/O has made progress */
+static void waitForProgress(tr_diskio* d)
+{
+#ifdef WITH_IO_URING
+
+    /* the ring's completions are only reaped in this thread, so wait on the ring itself */
+    if (isUringActive(d) && d->uring_inflight > 0)
+    {
+        tr_lockUnlock(d->lock);
+        uringSubmit(d, true);
+        uringReap(d);
+        tr_lockLock(d->lock);
+        return;
+    }
+
+#endif
+
+    tr_condWait(d->progress, d->lock);
+}
+
+void tr_diskioWait(tr_diskio* d, tr_torrent const* tor)
+{
+    TR_ASSERT(tr_amInEventThread(d->session));
+
+    int const torrent_id = tor != NULL ? tr_torrentId(tor) : DISKIO_ALL_TORRENTS;
+
+    tr_lockLock(d->lock);
+
+    for (;;)
+    {
+        struct diskio_torrent* dt = NULL;
+        bool is_idle;
+
+        if (torrent_id == DISKIO_ALL_TORRENTS)
+        {
+            is_idle = d->queue_depth == 0;
+        }
+        else
+        {
+            is_idle = (dt = findTorrent(d, torrent_id)) == NULL || dt->pending == 0;
+        }
+
+        if (is_idle)
+        {
+            /* forget the device, in case the files are about to move */
+            if (dt != NULL)
+            {
+                tr_ptrArrayRemoveSortedPointer(&d->torrents, dt, compareTorrentId);
+                tr_free(dt);
+            }
+            else if (torrent_id == DISKIO_ALL_TORRENTS)
+            {
+                tr_ptrArrayDestruct(&d->torrents, tr_free);
+                d->torrents = TR_PTR_ARRAY_INIT;
+            }
+
+            break;
+        }
+
+        waitForProgress(d);
+    }
+
+    tr_lockUnlock(d->lock);
+
+    deliver(d, torrent_id);
+}
+
+/***
+****
+***/
+
+tr_diskio* tr_diskioNew(tr_session* session, int worker_count)
+{
+    tr_diskio* d = tr_new0(tr_diskio, 1);
+
+    d->session = session;
+    d->lock = tr_lockNew();
+    d->progress = tr_condNew();
+    d->queues = TR_PTR_ARRAY_INIT;
+    d->torrents = TR_PTR_ARRAY_INIT;
+    d->max_workers = MAX(0, MIN(worker_count, DISKIO_MAX_WORKERS));
+    d->device_depth = 1;
+    return d;
+}
+
+void tr_diskioFree(tr_diskio* d)
+{
+    tr_diskioWait(d, NULL);
+
+    /* the workers leave as soon as they run out of work */
+    tr_lockLock(d->lock);
+
+    while (d->worker_count > 0)
+    {
+        tr_condWait(d->progress, d->lock);
+    }
+
+    tr_lockUnlock(d->lock);
+
+#ifdef WITH_IO_URING
+
+    if (isUringActive(d))
+    {
+        uringStop(d);
+    }
+
+#endif
+
+    tr_ptrArrayDestruct(&d->queues, tr_free);
+    tr_ptrArrayDestruct(&d->torrents, tr_free);
+    tr_condFree(d->progress);
+    tr_lockFree(d->lock);
+    tr_free(d);
+}
+
+void tr_diskioSetWorkerCount(tr_diskio* d, int worker_count)
+{
+    worker_count = MAX(0, MIN(worker_count, DISKIO_MAX_WORKERS));
+
+    /* with no workers, I/O is done in place, so nothing may be left queued */
+    if (worker_count == 0)
+    {
+        tr_diskioWait(d, NULL);
+    }
+
+    tr_lockLock(d->lock);
+    d->max_workers = worker_count;
+    maybeStartWorker(d);
+    tr_lockUnlock(d->lock);
+
+    dbgmsg("Using %d disk I/O threads", worker_count);
+}
+
+int tr_diskioGetWorkerCount(tr_diskio const* d)
+{
+    return d->max_workers;
+}
+
+void tr_diskioSetDeviceQueueDepth(tr_diskio* d, int depth)
+{
+    tr_lockLock(d->lock);
+    d->device_depth = MAX(1, MIN(depth, DISKIO_MAX_DEVICE_DEPTH));
+    maybeStartWorker(d);
+    tr_lockUnlock(d->lock);
+
+    dbgmsg("Running up to %d disk I/O operations per device", d->device_depth);
+}
+
+int tr_diskioGetDeviceQueueDepth(tr_diskio const* d)
+{
+    return d->device_depth;
+}
+
+void tr_diskioSetUringEnabled(tr_diskio* d, bool enabled)
+{
+    d->is_uring_wanted = enabled;
+
+#ifdef WITH_IO_URING
+
+    if (enabled != isUringActive(d))
+    {
+        /* nothing may be in flight while we switch */
+        tr_diskioWait(d, NULL);
+
+        if (enabled)
+        {
+            uringStart(d);
+        }
+        else
+        {
+            uringStop(d);
+        }
+    }
+
+#else
+
+    if (enabled)
+    {
+        tr_logAddNamedInfo(MY_NAME, "%s", _("This build doesn't support io_uring, so using disk I/O threads instead"));
+    }
+
+#endif
+}
+
+bool tr_diskioIsUringEnabled(tr_diskio const* d)
+{
+    return d->is_uring_wanted;
+}
+
+uint64_t tr_diskioGetWriteBacklog(tr_diskio* d, tr_torrent const* tor)
+{
+    struct diskio_torrent* dt;
+    struct diskio_queue* q;
+    struct diskio_queue key;
+    uint64_t bytes = 0;
+
+    tr_lockLock(d->lock);
+
+    if ((dt = findTorrent(d, tr_torrentId(tor))) != NULL)
+    {
+        key.device = dt->device;
+
+        if ((q = tr_ptrArrayFindSorted(&d->queues, &key, compareQueueDevice)) != NULL)
+        {
+            bytes = q->write_bytes;
+        }
+    }
+
+    tr_lockUnlock(d->lock);
+
+    return bytes;
+}
+
+size_t tr_diskioGetReadBacklog(tr_diskio* d, uint64_t device)
+{
+    struct diskio_queue* q;
+    struct diskio_queue key;
+    size_t count = 0;
+
+    key.device = device;
+
+    tr_lockLock(d->lock);
+
+    if ((q = tr_ptrArrayFindSorted(&d->queues, &key, compareQueueDevice)) != NULL)
+    {
+        count = q->read_count;
+    }
+
+    tr_lockUnlock(d->lock);
+
+    return count;
+}
+
+size_t tr_diskioGetQueueDepth(tr_diskio* d)
+{
+    size_t depth;
+
+    tr_lockLock(d->lock);
+    depth = d->queue_depth;
+    tr_lockUnlock(d->lock);
+
+    return depth;
+}
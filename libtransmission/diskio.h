@@ -0,0 +1,116 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#pragma once
+
+#ifndef __TRANSMISSION__
+#error only libtransmission should #include this header.
+#endif
+
+#include "file.h" /* tr_sys_file_iovec */
+
+struct tr_torrent;
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+/**
+ * Disk reads and writes that are queued here are run by a small pool of
+ * worker threads, so that a slow disk doesn't stall the libtransmission
+ * thread. Each device gets its own queue, which is started in order, with
+ * up to tr_diskioGetDeviceQueueDepth() of its ops running at once;
+ * different devices are served in parallel.
+ *
+ * Completion callbacks are always called from the libtransmission thread.
+ * With a worker count of zero, the I/O is done (and the callback is called)
+ * before the read or write function returns.
+ */
+typedef struct tr_diskio tr_diskio;
+
+/**
+ * @param err 0 on success, or an errno value on failure
+ * @param data for reads, the block that was read. It's only valid during the callback.
+ */
+typedef void (* tr_diskio_done_func)(void* user_data, int err, tr_piece_index_t piece, uint32_t offset, uint32_t length,
+    uint8_t const* data);
+
+tr_diskio* tr_diskioNew(tr_session* session, int worker_count);
+
+/** Waits for all queued I/O to finish, delivers its callbacks, and frees the pool. */
+void tr_diskioFree(tr_diskio* diskio);
+
+void tr_diskioSetWorkerCount(tr_diskio* diskio, int worker_count);
+
+int tr_diskioGetWorkerCount(tr_diskio const* diskio);
+
+/**
+ * Sets how many ops can run on one device at once. One keeps a spinning
+ * disk from seeking between them; SSDs and RAIDs do better with more.
+ */
+void tr_diskioSetDeviceQueueDepth(tr_diskio* diskio, int depth);
+
+int tr_diskioGetDeviceQueueDepth(tr_diskio const* diskio);
+
+/**
+ * Does the I/O with io_uring instead of the worker threads, if this build
+ * and the kernel support it. Otherwise, the worker threads are still used.
+ */
+void tr_diskioSetUringEnabled(tr_diskio* diskio, bool enabled);
+
+bool tr_diskioIsUringEnabled(tr_diskio const* diskio);
+
+/** Returns the number of reads and writes that are queued or running. */
+size_t tr_diskioGetQueueDepth(tr_diskio* diskio);
+
+/**
+ * Returns the size of the writes that are queued or running on the
+ * device that holds the torrent's files, or 0 if it has no I/O queued.
+ */
+uint64_t tr_diskioGetWriteBacklog(tr_diskio* diskio, struct tr_torrent const* tor);
+
+/**
+ * Returns the number of reads that are queued or running on the device,
+ * as identified by tr_sys_path_info.device.
+ */
+size_t tr_diskioGetReadBacklog(tr_diskio* diskio, uint64_t device);
+
+/**
+ * Queues a read of the block specified by the piece index, offset, and length.
+ * `done_func' is called exactly once, unless the read is cancelled first.
+ */
+void tr_diskioRead(tr_diskio* diskio, struct tr_torrent* tor, tr_piece_index_t piece, uint32_t offset, uint32_t length,
+    tr_diskio_done_func done_func, void* user_data);
+
+/**
+ * Queues a write of the buffers in `iov', in order, starting at the specified
+ * piece index and offset. The buffers must stay valid until `done_func' is called.
+ * Write errors are logged and set as the torrent's local error, as tr_ioWritev() does.
+ */
+void tr_diskioWritev(tr_diskio* diskio, struct tr_torrent* tor, tr_piece_index_t piece, uint32_t offset,
+    tr_sys_file_iovec const* iov, size_t iov_count, tr_diskio_done_func done_func, void* user_data);
+
+/**
+ * Queues an fdatasync() of one of the torrent's files. It runs after
+ * the writes that were queued before it.
+ */
+void tr_diskioSync(tr_diskio* diskio, struct tr_torrent* tor, tr_file_index_t file, tr_diskio_done_func done_func,
+    void* user_data);
+
+/** Keeps the callbacks of any queued I/O with this `user_data' from being called. */
+void tr_diskioCancel(tr_diskio* diskio, void const* user_data);
+
+/**
+ * Waits for all the queued I/O of a torrent, or of every torrent if `tor' is NULL,
+ * to finish and delivers its callbacks. Call this before closing, moving, or
+ * deleting a torrent's files.
+ */
+void tr_diskioWait(tr_diskio* diskio, struct tr_torrent const* tor);
+
+/* @} */
@@ -0,0 +1,99 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include "transmission.h"
+#include "fdlimit.h"
+#include "file.h"
+#include "session.h"
+#include "utils.h"
+
+#include "libtransmission-test.h"
+
+/* the size of the session's file cache */
+#define FILE_CACHE_SIZE 32
+
+static tr_sys_file_t checkout(tr_session* session, int torrent_id, tr_file_index_t i)
+{
+    char name[32];
+    char* path;
+    tr_sys_file_t fd;
+
+    tr_snprintf(name, sizeof(name), "%d-%u", torrent_id, (unsigned int)i);
+    path = tr_buildPath(tr_sessionGetConfigDir(session), name, NULL);
+    fd = tr_fdFileCheckout(session, torrent_id, i, path, true, TR_PREALLOCATE_NONE, 0);
+    tr_free(path);
+
+    return fd;
+}
+
+static int test_file_cache(void)
+{
+    tr_session* session = libttest_session_init(NULL);
+    tr_fd_stats stats;
+    tr_sys_file_t fd;
+    tr_file_index_t const n = FILE_CACHE_SIZE + 8;
+
+    for (tr_file_index_t i = 0; i < n; ++i)
+    {
+        check(checkout(session, 1, i) != TR_BAD_SYS_FILE);
+    }
+
+    /* the oldest files were recycled to make room for the newest ones */
+    tr_fdGetStats(session, &stats);
+    check_uint(stats.opens, ==, n);
+    check_uint(stats.evictions, ==, n - FILE_CACHE_SIZE);
+    check_uint(stats.closes, ==, n - FILE_CACHE_SIZE);
+
+    for (tr_file_index_t i = 0; i < n; ++i)
+    {
+        fd = tr_fdFileGetCached(session, 1, i, false);
+        check_bool(fd != TR_BAD_SYS_FILE, ==, i >= n - FILE_CACHE_SIZE);
+    }
+
+    /* checking out a cached file again doesn't reopen it */
+    fd = tr_fdFileGetCached(session, 1, n - 1, true);
+    check(fd != TR_BAD_SYS_FILE);
+    check(checkout(session, 1, n - 1) == fd);
+    tr_fdGetStats(session, &stats);
+    check_uint(stats.opens, ==, n);
+
+    /* the least recently used file is the next one to go */
+    check(tr_fdFileGetCached(session, 1, n - FILE_CACHE_SIZE, false) != TR_BAD_SYS_FILE);
+    check(checkout(session, 2, 0) != TR_BAD_SYS_FILE);
+    check(tr_fdFileGetCached(session, 1, n - FILE_CACHE_SIZE, false) != TR_BAD_SYS_FILE);
+    check(tr_fdFileGetCached(session, 1, n - FILE_CACHE_SIZE + 1, false) == TR_BAD_SYS_FILE);
+
+    /* closing a torrent's files leaves the other torrents' files alone */
+    tr_sessionLock(session);
+    tr_fdTorrentClose(session, 1);
+    tr_sessionUnlock(session);
+
+    for (tr_file_index_t i = 0; i < n; ++i)
+    {
+        check(tr_fdFileGetCached(session, 1, i, false) == TR_BAD_SYS_FILE);
+    }
+
+    check(tr_fdFileGetCached(session, 2, 0, false) != TR_BAD_SYS_FILE);
+
+    tr_fdGetStats(session, &stats);
+    check_uint(stats.opens, ==, n + 1);
+    check_uint(stats.closes, ==, n);
+
+    libttest_session_close(session);
+    return 0;
+}
+
+int main(void)
+{
+    testFunc const tests[] =
+    {
+        test_file_cache
+    };
+
+    return runTests(tests, NUM_TESTS(tests));
+}
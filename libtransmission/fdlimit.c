@@ -16,6 +16,7 @@
 #include "fdlimit.h"
 #include "file.h"
 #include "log.h"
+#include "prealloc.h"
 #include "session.h"
 #include "torrent.h" /* tr_isTorrent() */
 #include "tr-assert.h"
@@ -63,10 +64,14 @@ static bool preallocate_file_sparse(tr_sys_file_t fd, uint64_t length, tr_error*
     return false;
 }
 
-static bool preallocate_file_full(tr_sys_file_t fd, uint64_t length, tr_error** error)
+/* if the file can't be allocated quickly, `setme_fill' is set
+   and it's up to the caller to fill it with zeros instead */
+static bool preallocate_file_full(tr_sys_file_t fd, uint64_t length, bool* setme_fill, tr_error** error)
 {
     tr_error* my_error = NULL;
 
+    *setme_fill = false;
+
     if (length == 0)
     {
         return true;
@@ -81,27 +86,10 @@ static bool preallocate_file_full(tr_sys_file_t fd, uint64_t length, tr_error**
 
     if (!TR_ERROR_IS_ENOSPC(my_error->code))
     {
-        uint8_t buf[4096];
-        bool success = true;
-
-        memset(buf, 0, sizeof(buf));
-        tr_error_clear(&my_error);
-
-        /* fallback: the old-fashioned way */
-        while (success && length > 0)
-        {
-            uint64_t const thisPass = MIN(length, sizeof(buf));
-            uint64_t bytes_written;
-            success = tr_sys_file_write(fd, buf, thisPass, &bytes_written, &my_error);
-            length -= bytes_written;
-        }
-
-        if (success)
-        {
-            return true;
-        }
-
-        dbgmsg("Preallocating (full, fallback) failed (%d): %s", my_error->code, my_error->message);
+        /* fallback: the old-fashioned way, which is too slow to do here */
+        tr_error_free(my_error);
+        *setme_fill = true;
+        return true;
     }
 
     tr_error_propagate(error, &my_error);
@@ -120,7 +108,16 @@ struct tr_cached_file
     tr_sys_file_t fd;
     int torrent_id;
     tr_file_index_t file_index;
-    time_t used_at;
+
+    /* set while the disk workers are using the fd */
+    struct tr_fd_pin* pin;
+
+    /* the next file in this hash bucket, or the next free slot */
+    struct tr_cached_file* hash_next;
+
+    /* the open files, most recently used first */
+    struct tr_cached_file* lru_prev;
+    struct tr_cached_file* lru_next;
 };
 
 static inline bool cached_file_is_open(struct tr_cached_file const* o)
@@ -130,21 +127,16 @@ static inline bool cached_file_is_open(struct tr_cached_file const* o)
     return o->fd != TR_BAD_SYS_FILE;
 }
 
-static void cached_file_close(struct tr_cached_file* o)
-{
-    TR_ASSERT(cached_file_is_open(o));
-
-    tr_sys_file_close(o->fd, NULL);
-    o->fd = TR_BAD_SYS_FILE;
-}
-
 /**
  * returns 0 on success, or an errno value on failure.
  * errno values include ENOENT if the parent folder doesn't exist,
  * plus the errno values set by tr_sys_dir_create () and tr_sys_file_open ().
+ *
+ * if the file couldn't be fully preallocated quickly, `setme_fill' is set
+ * so that it can be filled in the background from `setme_fill_offset'.
  */
 static int cached_file_open(struct tr_cached_file* o, char const* filename, bool writable, tr_preallocation_mode allocation,
-    uint64_t file_size)
+    uint64_t file_size, bool* setme_fill, uint64_t* setme_fill_offset)
 {
     int flags;
     tr_sys_path_info info;
@@ -153,6 +145,9 @@ static int cached_file_open(struct tr_cached_file* o, char const* filename, bool
     tr_sys_file_t fd = TR_BAD_SYS_FILE;
     tr_error* error = NULL;
 
+    *setme_fill = false;
+    *setme_fill_offset = 0;
+
     /* create subfolders, if any */
     if (writable)
     {
@@ -198,7 +193,7 @@ static int cached_file_open(struct tr_cached_file* o, char const* filename, bool
 
         if (allocation == TR_PREALLOCATE_FULL)
         {
-            success = preallocate_file_full(fd, file_size, &error);
+            success = preallocate_file_full(fd, file_size, setme_fill, &error);
             type = _("full");
         }
         else if (allocation == TR_PREALLOCATE_SPARSE)
@@ -216,7 +211,23 @@ static int cached_file_open(struct tr_cached_file* o, char const* filename, bool
             goto fail;
         }
 
-        tr_logAddDebug(_("Preallocated file \"%1$s\" (%2$s, size: %3$" PRIu64 ")"), filename, type, file_size);
+        if (!*setme_fill)
+        {
+            tr_logAddDebug(_("Preallocated file \"%1$s\" (%2$s, size: %3$" PRIu64 ")"), filename, type, file_size);
+        }
+    }
+    else if (writable && already_existed && allocation == TR_PREALLOCATE_FULL && info.size < file_size)
+    {
+        /* it may have been closed before it was filled, and there's no telling
+           what's been written to it since, so only fill in what comes after */
+        if (!preallocate_file_full(fd, file_size, setme_fill, &error))
+        {
+            tr_logAddError(_("Couldn't preallocate file \"%1$s\" (%2$s, size: %3$" PRIu64 "): %4$s"),
+                filename, _("full"), file_size, error->message);
+            tr_error_clear(&error);
+        }
+
+        *setme_fill_offset = info.size;
     }
 
     /* If the file already exists and it's too large, truncate it.
@@ -252,29 +263,187 @@ fail:
 ****
 ***/
 
+/* an fd that the disk workers are using. If its file gets closed in the
+ * meantime, `owner' is cleared and the fd itself stays open until the
+ * last worker releases it */
+struct tr_fd_pin
+{
+    tr_sys_file_t fd;
+    int pin_count;
+    struct tr_cached_file* owner;
+};
+
+/* The open files are indexed by a hash of (torrent_id, file_index) and kept
+ * on an LRU list, so checkouts and recycling don't have to scan the set. */
 struct tr_fileset
 {
     struct tr_cached_file* begin;
     struct tr_cached_file const* end;
+    struct tr_cached_file* free_slots;
+
+    struct tr_cached_file** buckets;
+    size_t bucket_count;
+
+    struct tr_cached_file* lru_head;
+    struct tr_cached_file* lru_tail;
+
+    int pinned_count;
+
+    tr_fd_stats stats;
 };
 
-static void fileset_construct(struct tr_fileset* set, int n)
+static inline size_t fileset_bucket(struct tr_fileset const* set, int torrent_id, tr_file_index_t i)
+{
+    uint64_t const key = ((uint64_t)(uint32_t)torrent_id << 32) | i;
+
+    return (size_t)((key * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & (set->bucket_count - 1);
+}
+
+static void fileset_lru_unlink(struct tr_fileset* set, struct tr_cached_file* o)
 {
-    struct tr_cached_file const TR_CACHED_FILE_INIT =
+    if (o->lru_prev != NULL)
     {
-        .is_writable = false,
-        .fd = TR_BAD_SYS_FILE,
-        .torrent_id = 0,
-        .file_index = 0,
-        .used_at = 0
-    };
+        o->lru_prev->lru_next = o->lru_next;
+    }
+    else
+    {
+        set->lru_head = o->lru_next;
+    }
+
+    if (o->lru_next != NULL)
+    {
+        o->lru_next->lru_prev = o->lru_prev;
+    }
+    else
+    {
+        set->lru_tail = o->lru_prev;
+    }
+}
+
+static void fileset_lru_push(struct tr_fileset* set, struct tr_cached_file* o)
+{
+    o->lru_prev = NULL;
+    o->lru_next = set->lru_head;
+
+    if (set->lru_head != NULL)
+    {
+        set->lru_head->lru_prev = o;
+    }
+    else
+    {
+        set->lru_tail = o;
+    }
+
+    set->lru_head = o;
+}
+
+/* a newly-opened file goes into the index */
+static void fileset_add(struct tr_fileset* set, struct tr_cached_file* o)
+{
+    size_t const bucket = fileset_bucket(set, o->torrent_id, o->file_index);
+
+    o->hash_next = set->buckets[bucket];
+    set->buckets[bucket] = o;
+    fileset_lru_push(set, o);
+    ++set->stats.opens;
+}
+
+static void fileset_remove(struct tr_fileset* set, struct tr_cached_file* o)
+{
+    struct tr_cached_file** walk = &set->buckets[fileset_bucket(set, o->torrent_id, o->file_index)];
+
+    while (*walk != o)
+    {
+        walk = &(*walk)->hash_next;
+    }
+
+    *walk = o->hash_next;
+    fileset_lru_unlink(set, o);
+}
+
+static void fileset_free_slot(struct tr_fileset* set, struct tr_cached_file* o)
+{
+    o->fd = TR_BAD_SYS_FILE;
+    o->pin = NULL;
+    o->hash_next = set->free_slots;
+    set->free_slots = o;
+}
+
+/* closes the file and gives its slot back to the set */
+static void cached_file_close(struct tr_fileset* set, struct tr_cached_file* o)
+{
+    TR_ASSERT(cached_file_is_open(o));
+
+    if (o->pin != NULL)
+    {
+        o->pin->owner = NULL;
+        o->pin = NULL;
+    }
+    else
+    {
+        tr_sys_file_close(o->fd, NULL);
+    }
+
+    fileset_remove(set, o);
+    fileset_free_slot(set, o);
+    ++set->stats.closes;
+}
+
+static struct tr_fd_pin* fileset_pin(struct tr_fileset* set, struct tr_cached_file* o)
+{
+    if (o->pin == NULL)
+    {
+        o->pin = tr_new(struct tr_fd_pin, 1);
+        o->pin->fd = o->fd;
+        o->pin->pin_count = 0;
+        o->pin->owner = o;
+        ++set->pinned_count;
+    }
+
+    ++o->pin->pin_count;
+    return o->pin;
+}
+
+static void fileset_unpin(struct tr_fileset* set, struct tr_fd_pin* pin)
+{
+    TR_ASSERT(pin->pin_count > 0);
+
+    if (--pin->pin_count == 0)
+    {
+        if (pin->owner != NULL)
+        {
+            pin->owner->pin = NULL;
+        }
+        else
+        {
+            tr_sys_file_close(pin->fd, NULL);
+        }
+
+        tr_free(pin);
+        --set->pinned_count;
+    }
+}
+
+static void fileset_construct(struct tr_fileset* set, int n)
+{
+    memset(set, 0, sizeof(struct tr_fileset));
 
     set->begin = tr_new(struct tr_cached_file, n);
     set->end = set->begin + n;
 
-    for (struct tr_cached_file* o = set->begin; o != set->end; ++o)
+    /* keep the load factor at or below 1/2 */
+    set->bucket_count = 1;
+
+    while (set->bucket_count < (size_t)n * 2)
     {
-        *o = TR_CACHED_FILE_INIT;
+        set->bucket_count *= 2;
+    }
+
+    set->buckets = tr_new0(struct tr_cached_file*, set->bucket_count);
+
+    for (int i = n - 1; i >= 0; --i)
+    {
+        fileset_free_slot(set, &set->begin[i]);
     }
 }
 
@@ -282,20 +451,20 @@ static void fileset_close_all(struct tr_fileset* set)
 {
     if (set != NULL)
     {
-        for (struct tr_cached_file* o = set->begin; o != set->end; ++o)
+        while (set->lru_head != NULL)
         {
-            if (cached_file_is_open(o))
-            {
-                cached_file_close(o);
-            }
+            cached_file_close(set, set->lru_head);
         }
     }
 }
 
 static void fileset_destruct(struct tr_fileset* set)
 {
+    TR_ASSERT(set->pinned_count == 0);
+
     fileset_close_all(set);
     tr_free(set->begin);
+    tr_free(set->buckets);
     set->end = set->begin = NULL;
 }
 
@@ -303,11 +472,16 @@ static void fileset_close_torrent(struct tr_fileset* set, int torrent_id)
 {
     if (set != NULL)
     {
-        for (struct tr_cached_file* o = set->begin; o != set->end; ++o)
+        struct tr_cached_file* next;
+
+        /* only the open files are on the LRU list, so this doesn't visit the free slots */
+        for (struct tr_cached_file* o = set->lru_head; o != NULL; o = next)
         {
-            if (o->torrent_id == torrent_id && cached_file_is_open(o))
+            next = o->lru_next;
+
+            if (o->torrent_id == torrent_id)
             {
-                cached_file_close(o);
+                cached_file_close(set, o);
             }
         }
     }
@@ -315,48 +489,49 @@ static void fileset_close_torrent(struct tr_fileset* set, int torrent_id)
 
 static struct tr_cached_file* fileset_lookup(struct tr_fileset* set, int torrent_id, tr_file_index_t i)
 {
+    struct tr_cached_file* o = NULL;
+
     if (set != NULL)
     {
-        for (struct tr_cached_file* o = set->begin; o != set->end; ++o)
+        o = set->buckets[fileset_bucket(set, torrent_id, i)];
+
+        while (o != NULL && (o->torrent_id != torrent_id || o->file_index != i))
         {
-            if (torrent_id == o->torrent_id && i == o->file_index && cached_file_is_open(o))
-            {
-                return o;
-            }
+            o = o->hash_next;
         }
     }
 
-    return NULL;
+    return o;
+}
+
+static void fileset_touch(struct tr_fileset* set, struct tr_cached_file* o)
+{
+    if (set->lru_head != o)
+    {
+        fileset_lru_unlink(set, o);
+        fileset_lru_push(set, o);
+    }
 }
 
 static struct tr_cached_file* fileset_get_empty_slot(struct tr_fileset* set)
 {
-    struct tr_cached_file* cull = NULL;
+    struct tr_cached_file* o;
 
-    if (set->begin != NULL)
+    if (set->begin == NULL)
     {
-        /* try to find an unused slot */
-        for (struct tr_cached_file* o = set->begin; o != set->end; ++o)
-        {
-            if (!cached_file_is_open(o))
-            {
-                return o;
-            }
-        }
-
-        /* all slots are full... recycle the least recently used */
-        for (struct tr_cached_file* o = set->begin; o != set->end; ++o)
-        {
-            if (cull == NULL || o->used_at < cull->used_at)
-            {
-                cull = o;
-            }
-        }
+        return NULL;
+    }
 
-        cached_file_close(cull);
+    /* all slots are full... recycle the least recently used */
+    if (set->free_slots == NULL)
+    {
+        cached_file_close(set, set->lru_tail);
+        ++set->stats.evictions;
     }
 
-    return cull;
+    o = set->free_slots;
+    set->free_slots = o->hash_next;
+    return o;
 }
 
 /***
@@ -415,9 +590,10 @@ static struct tr_fileset* get_fileset(tr_session* session)
 
 void tr_fdFileClose(tr_session* s, tr_torrent const* tor, tr_file_index_t i)
 {
+    struct tr_fileset* set = get_fileset(s);
     struct tr_cached_file* o;
 
-    if ((o = fileset_lookup(get_fileset(s), tr_torrentId(tor), i)) != NULL)
+    if ((o = fileset_lookup(set, tr_torrentId(tor), i)) != NULL)
     {
         /* flush writable files so that their mtimes will be
          * up-to-date when this function returns to the caller... */
@@ -426,20 +602,23 @@ void tr_fdFileClose(tr_session* s, tr_torrent const* tor, tr_file_index_t i)
             tr_sys_file_flush(o->fd, NULL);
         }
 
-        cached_file_close(o);
+        cached_file_close(set, o);
     }
+
+    tr_preallocFileClose(s->prealloc, tr_torrentId(tor), i);
 }
 
 tr_sys_file_t tr_fdFileGetCached(tr_session* s, int torrent_id, tr_file_index_t i, bool writable)
 {
-    struct tr_cached_file* o = fileset_lookup(get_fileset(s), torrent_id, i);
+    struct tr_fileset* set = get_fileset(s);
+    struct tr_cached_file* o = fileset_lookup(set, torrent_id, i);
 
     if (o == NULL || (writable && !o->is_writable))
     {
         return TR_BAD_SYS_FILE;
     }
 
-    o->used_at = tr_time();
+    fileset_touch(set, o);
     return o->fd;
 }
 
@@ -457,11 +636,29 @@ bool tr_fdFileGetCachedMTime(tr_session* s, int torrent_id, tr_file_index_t i, t
     return success;
 }
 
+struct tr_fd_pin* tr_fdFileRetain(tr_session* session, int torrent_id, tr_file_index_t i)
+{
+    struct tr_fileset* set = get_fileset(session);
+    struct tr_cached_file* o = fileset_lookup(set, torrent_id, i);
+
+    TR_ASSERT(o != NULL);
+
+    return fileset_pin(set, o);
+}
+
+void tr_fdFileRelease(tr_session* session, struct tr_fd_pin* pin)
+{
+    TR_ASSERT(pin != NULL);
+
+    fileset_unpin(get_fileset(session), pin);
+}
+
 void tr_fdTorrentClose(tr_session* session, int torrent_id)
 {
     TR_ASSERT(tr_sessionIsLocked(session));
 
     fileset_close_torrent(get_fileset(session), torrent_id);
+    tr_preallocTorrentClose(session->prealloc, torrent_id);
 }
 
 /* returns an fd on success, or a TR_BAD_SYS_FILE on failure and sets errno */
@@ -473,34 +670,64 @@ tr_sys_file_t tr_fdFileCheckout(tr_session* session, int torrent_id, tr_file_ind
 
     if (o != NULL && writable && !o->is_writable)
     {
-        cached_file_close(o); /* close it so we can reopen in rw mode */
-    }
-    else if (o == NULL)
-    {
-        o = fileset_get_empty_slot(set);
+        cached_file_close(set, o); /* close it so we can reopen in rw mode */
+        o = NULL;
     }
 
-    if (!cached_file_is_open(o))
+    if (o == NULL)
     {
-        int const err = cached_file_open(o, filename, writable, allocation, file_size);
+        int err;
+        bool fill;
+        bool fill_ok = true;
+        uint64_t fill_offset;
+        tr_error* error = NULL;
 
-        if (err != 0)
+        o = fileset_get_empty_slot(set);
+
+        if ((err = cached_file_open(o, filename, writable, allocation, file_size, &fill, &fill_offset)) != 0)
         {
+            fileset_free_slot(set, o);
             errno = err;
             return TR_BAD_SYS_FILE;
         }
 
+        /* start filling it, or finish if it was closed partway through */
+        if (fill)
+        {
+            fill_ok = tr_preallocAdd(session->prealloc, torrent_id, i, filename, file_size, fill_offset, &error);
+        }
+        else if (writable)
+        {
+            fill_ok = tr_preallocResume(session->prealloc, torrent_id, i, filename, &error);
+        }
+
+        if (!fill_ok)
+        {
+            tr_logAddError(_("Couldn't preallocate file \"%1$s\" (%2$s, size: %3$" PRIu64 "): %4$s"), filename, _("full"),
+                file_size, error->message);
+            tr_error_free(error);
+        }
+
         dbgmsg("opened '%s' writable %c", filename, writable ? 'y' : 'n');
         o->is_writable = writable;
+        o->torrent_id = torrent_id;
+        o->file_index = i;
+        fileset_add(set, o);
+    }
+    else
+    {
+        fileset_touch(set, o);
     }
 
     dbgmsg("checking out '%s'", filename);
-    o->torrent_id = torrent_id;
-    o->file_index = i;
-    o->used_at = tr_time();
     return o->fd;
 }
 
+void tr_fdGetStats(tr_session* session, tr_fd_stats* setme)
+{
+    *setme = get_fileset(session)->stats;
+}
+
 /***
 ****
 ****  Sockets
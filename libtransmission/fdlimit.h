@@ -57,11 +57,34 @@ bool tr_fdFileGetCachedMTime(tr_session* session, int torrent_id, tr_file_index_
  */
 void tr_fdFileClose(tr_session* session, tr_torrent const* tor, tr_file_index_t file_num);
 
+struct tr_fd_pin;
+
+/**
+ * Keeps the fd of a file that tr_fdFileCheckout() just returned open until
+ * a matching tr_fdFileRelease(), so that another thread can use it safely.
+ *
+ * If the file is closed or recycled meanwhile, it disappears from the
+ * file cache right away but the fd isn't closed until its last release.
+ */
+struct tr_fd_pin* tr_fdFileRetain(tr_session* session, int torrent_id, tr_file_index_t file_num);
+
+void tr_fdFileRelease(tr_session* session, struct tr_fd_pin* pin);
+
 /**
  * Closes all the files associated with a given torrent id
  */
 void tr_fdTorrentClose(tr_session* session, int torrentId);
 
+typedef struct tr_fd_stats
+{
+    uint64_t opens; /* files opened */
+    uint64_t closes; /* files closed, for whatever reason */
+    uint64_t evictions; /* files closed to make room for another one */
+}
+tr_fd_stats;
+
+void tr_fdGetStats(tr_session* session, tr_fd_stats* setme);
+
 /***********************************************************************
  * Sockets
  **********************************************************************/
@@ -19,8 +19,9 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/file.h> /* flock() */
-#include <sys/mman.h> /* mmap(), munmap() */
+#include <sys/mman.h> /* mmap(), munmap(), posix_madvise() */
 #include <sys/stat.h>
+#include <sys/uio.h> /* pwritev(), struct iovec */
 #include <unistd.h> /* lseek(), write(), ftruncate(), pread(), pwrite(), pathconf(), etc */
 
 #ifdef HAVE_XFS_XFS_H
@@ -47,16 +48,24 @@
 #ifndef O_CLOEXEC
 #define O_CLOEXEC 0
 #endif
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
 /* don't use pread/pwrite on old versions of uClibc because they're buggy.
  * https://trac.transmissionbt.com/ticket/3826 */
 #if defined(__UCLIBC__) && !TR_UCLIBC_CHECK_VERSION(0, 9, 28)
 #undef HAVE_PREAD
 #undef HAVE_PWRITE
+#undef HAVE_PWRITEV
 #endif
 
 #ifdef __APPLE__
@@ -106,6 +115,8 @@ static void stat_to_sys_path_info(struct stat const* sb, tr_sys_path_info* info)
 
     info->size = (uint64_t)sb->st_size;
     info->last_modified_at = sb->st_mtime;
+    info->device = (uint64_t)sb->st_dev;
+    info->inode = (uint64_t)sb->st_ino;
 }
 
 static void set_file_for_single_pass(tr_sys_file_t handle)
@@ -502,6 +513,7 @@ tr_sys_file_t tr_sys_file_open(char const* path, int flags, int permissions, tr_
         ((flags & TR_SYS_FILE_APPEND) != 0 ? O_APPEND : 0) |
         ((flags & TR_SYS_FILE_TRUNCATE) != 0 ? O_TRUNC : 0) |
         ((flags & TR_SYS_FILE_SEQUENTIAL) != 0 ? O_SEQUENTIAL : 0) |
+        ((flags & TR_SYS_FILE_DIRECT) != 0 ? O_DIRECT : 0) |
         O_BINARY | O_LARGEFILE | O_CLOEXEC;
 
     ret = open(path, native_flags, permissions);
@@ -512,6 +524,16 @@ tr_sys_file_t tr_sys_file_open(char const* path, int flags, int permissions, tr_
         {
             set_file_for_single_pass(ret);
         }
+
+#ifdef __APPLE__
+
+        /* there's no O_DIRECT, but this skips the cache too */
+        if ((flags & TR_SYS_FILE_DIRECT) != 0)
+        {
+            (void)fcntl(ret, F_NOCACHE, 1);
+        }
+
+#endif
     }
     else
     {
@@ -756,6 +778,92 @@ bool tr_sys_file_write_at(tr_sys_file_t handle, void const* buffer, uint64_t siz
     return ret;
 }
 
+bool tr_sys_file_write_at_v(tr_sys_file_t handle, tr_sys_file_iovec const* iov, size_t iov_count, uint64_t offset,
+    uint64_t* bytes_written, tr_error** error)
+{
+    TR_ASSERT(handle != TR_BAD_SYS_FILE);
+    TR_ASSERT(iov != NULL || iov_count == 0);
+    /* seek requires signed offset, so it should be in mod range */
+    TR_ASSERT(offset < UINT64_MAX / 2);
+
+    bool ret = true;
+    uint64_t total_written = 0;
+    size_t skip = 0; /* bytes of iov[0] that were already written */
+
+    while (ret && iov_count > 0)
+    {
+#ifdef HAVE_PWRITEV
+
+        struct iovec vec[IOV_MAX];
+        size_t const n = MIN(iov_count, (size_t)IOV_MAX);
+        ssize_t my_bytes_written;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            vec[i].iov_base = (void*)iov[i].base;
+            vec[i].iov_len = iov[i].size;
+        }
+
+        vec[0].iov_base = (uint8_t*)vec[0].iov_base + skip;
+        vec[0].iov_len -= skip;
+
+        my_bytes_written = pwritev(handle, vec, n, offset);
+
+#else
+
+        ssize_t my_bytes_written;
+        uint64_t n;
+
+        /* errno is left untouched when no error object is passed */
+        if (tr_sys_file_write_at(handle, (uint8_t const*)iov[0].base + skip, iov[0].size - skip, offset, &n, NULL))
+        {
+            my_bytes_written = n;
+        }
+        else
+        {
+            my_bytes_written = -1;
+        }
+
+#endif
+
+        if (my_bytes_written == -1)
+        {
+            set_system_error(error, errno);
+            ret = false;
+        }
+        else if (my_bytes_written == 0 && iov[0].size > skip)
+        {
+            set_system_error(error, EIO);
+            ret = false;
+        }
+        else
+        {
+            uint64_t left = my_bytes_written;
+
+            total_written += left;
+            offset += left;
+
+            /* skip past the buffers that were fully written */
+            while (iov_count > 0 && left >= iov[0].size - skip)
+            {
+                left -= iov[0].size - skip;
+                skip = 0;
+                ++iov;
+                --iov_count;
+            }
+
+            skip += left;
+        }
+    }
+
+    if (bytes_written != NULL)
+    {
+        *bytes_written = total_written;
+    }
+
+    return ret;
+}
+
 bool tr_sys_file_flush(tr_sys_file_t handle, tr_error** error)
 {
     TR_ASSERT(handle != TR_BAD_SYS_FILE);
@@ -770,6 +878,28 @@ bool tr_sys_file_flush(tr_sys_file_t handle, tr_error** error)
     return ret;
 }
 
+bool tr_sys_file_flush_data(tr_sys_file_t handle, tr_error** error)
+{
+    TR_ASSERT(handle != TR_BAD_SYS_FILE);
+
+#ifdef HAVE_FDATASYNC
+
+    bool ret = fdatasync(handle) != -1;
+
+    if (!ret)
+    {
+        set_system_error(error, errno);
+    }
+
+    return ret;
+
+#else
+
+    return tr_sys_file_flush(handle, error);
+
+#endif
+}
+
 bool tr_sys_file_truncate(tr_sys_file_t handle, uint64_t size, tr_error** error)
 {
     TR_ASSERT(handle != TR_BAD_SYS_FILE);
@@ -977,6 +1107,65 @@ bool tr_sys_file_unmap(void const* address, uint64_t size, tr_error** error)
     return ret;
 }
 
+bool tr_sys_file_advise_map(void const* address, uint64_t size, tr_sys_file_map_advice_t advice, tr_error** error)
+{
+    TR_ASSERT(address != NULL);
+    TR_ASSERT(size > 0);
+
+    bool ret = true;
+
+#ifdef POSIX_MADV_WILLNEED
+
+    static uintptr_t page_mask = 0;
+
+    if (page_mask == 0)
+    {
+        page_mask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+    }
+
+    uintptr_t const begin = (uintptr_t)address & ~page_mask;
+    uintptr_t const end = (uintptr_t)address + size;
+    int native_advice;
+
+    switch (advice)
+    {
+    case TR_SYS_FILE_MAP_ADVICE_RANDOM:
+        native_advice = POSIX_MADV_RANDOM;
+        break;
+
+    case TR_SYS_FILE_MAP_ADVICE_SEQUENTIAL:
+        native_advice = POSIX_MADV_SEQUENTIAL;
+        break;
+
+    case TR_SYS_FILE_MAP_ADVICE_WILL_NEED:
+        native_advice = POSIX_MADV_WILLNEED;
+        break;
+
+    default:
+        native_advice = POSIX_MADV_NORMAL;
+        break;
+    }
+
+    int const code = posix_madvise((void*)begin, end - begin, native_advice);
+
+    if (code != 0)
+    {
+        set_system_error(error, code);
+        ret = false;
+    }
+
+#else
+
+    (void)address;
+    (void)size;
+    (void)advice;
+    (void)error;
+
+#endif
+
+    return ret;
+}
+
 bool tr_sys_file_lock(tr_sys_file_t handle, int operation, tr_error** error)
 {
     TR_ASSERT(handle != TR_BAD_SYS_FILE);
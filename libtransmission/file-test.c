@@ -1214,6 +1214,142 @@ static int test_file_read_write_seek(void)
     return 0;
 }
 
+static int test_file_write_vectored(void)
+{
+    char* const test_dir = create_test_dir(__FUNCTION__);
+    tr_error* err = NULL;
+    char* path1;
+    tr_sys_file_t fd;
+    uint64_t n;
+    char buf[100];
+    tr_sys_file_iovec iov[4];
+
+    path1 = tr_buildPath(test_dir, "a", NULL);
+
+    fd = tr_sys_file_open(path1, TR_SYS_FILE_READ | TR_SYS_FILE_WRITE | TR_SYS_FILE_CREATE, 0600, NULL);
+
+    iov[0].base = "test";
+    iov[0].size = 4;
+    iov[1].base = "";
+    iov[1].size = 0;
+    iov[2].base = " vec";
+    iov[2].size = 4;
+    iov[3].base = "tored";
+    iov[3].size = 5;
+
+    check(tr_sys_file_write_at_v(fd, iov, 4, 0, &n, &err));
+    check_ptr(err, ==, NULL);
+    check_uint(n, ==, 13);
+
+    check(tr_sys_file_read_at(fd, buf, sizeof(buf), 0, &n, &err));
+    check_ptr(err, ==, NULL);
+    check_uint(n, ==, 13);
+
+    check_mem(buf, ==, "test vectored", 13);
+
+    /* write in the middle, past a sparse gap, and with no buffers at all */
+    check(tr_sys_file_write_at_v(fd, iov + 2, 2, 2, &n, &err));
+    check_ptr(err, ==, NULL);
+    check_uint(n, ==, 9);
+
+    check(tr_sys_file_write_at_v(fd, iov, 1, 16, &n, &err));
+    check_ptr(err, ==, NULL);
+    check_uint(n, ==, 4);
+
+    check(tr_sys_file_write_at_v(fd, iov, 0, 0, &n, &err));
+    check_ptr(err, ==, NULL);
+    check_uint(n, ==, 0);
+
+    check(tr_sys_file_read_at(fd, buf, sizeof(buf), 0, &n, &err));
+    check_ptr(err, ==, NULL);
+    check_uint(n, ==, 20);
+
+    check_mem(buf, ==, "te vectoreded\0\0\0test", 20);
+
+    tr_sys_file_close(fd, NULL);
+
+    tr_sys_path_remove(path1, NULL);
+
+    tr_free(path1);
+
+    tr_free(test_dir);
+    return 0;
+}
+
+static int test_file_read_at_direct(void)
+{
+    char* const test_dir = create_test_dir(__FUNCTION__);
+    size_t const size = TR_SYS_FILE_DIRECT_ALIGNMENT * 4 + 100;
+    uint8_t* const contents = tr_new(uint8_t, size);
+    uint8_t* const buf = tr_sys_file_alloc_direct_buffer(size + 1);
+    uint8_t* const bounce = tr_sys_file_alloc_direct_buffer(TR_SYS_FILE_DIRECT_ALIGNMENT);
+    char* path1;
+    tr_sys_file_t fd;
+    tr_sys_file_t direct_fd;
+    tr_error* err = NULL;
+    uint64_t n;
+
+    struct
+    {
+        uint64_t offset;
+        uint64_t size;
+        size_t buf_offset;
+    }
+    const tests[] =
+    {
+        { 0, size, 0 }, /* straight into the buffer, then a buffered tail */
+        { 0, size, 1 }, /* through the bounce buffer */
+        { 100, TR_SYS_FILE_DIRECT_ALIGNMENT * 2, 0 }, /* a buffered head too */
+        { 1, 10, 0 }, /* nothing aligned to read directly */
+        { TR_SYS_FILE_DIRECT_ALIGNMENT, size, 0 }, /* a direct read past the end */
+        { size - 10, 100, 1 } /* a buffered read past the end */
+    };
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        contents[i] = (uint8_t)(i * 7);
+    }
+
+    path1 = tr_buildPath(test_dir, "a", NULL);
+    libtest_create_file_with_contents(path1, contents, size);
+    fd = tr_sys_file_open(path1, TR_SYS_FILE_READ, 0, NULL);
+
+    /* not every filesystem supports direct I/O, but the splitting works the same with a plain handle */
+    if ((direct_fd = tr_sys_file_open(path1, TR_SYS_FILE_READ | TR_SYS_FILE_DIRECT, 0, NULL)) == TR_BAD_SYS_FILE)
+    {
+        direct_fd = tr_sys_file_open(path1, TR_SYS_FILE_READ, 0, NULL);
+    }
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(tests); ++i)
+    {
+        uint64_t const expected = MIN(tests[i].size, size - tests[i].offset);
+
+        memset(buf, 0, size + 1);
+        check(tr_sys_file_read_at_direct(fd, direct_fd, buf + tests[i].buf_offset, tests[i].size, tests[i].offset, bounce,
+            TR_SYS_FILE_DIRECT_ALIGNMENT, &n, &err));
+        check_ptr(err, ==, NULL);
+        check_uint(n, ==, expected);
+        check_mem(buf + tests[i].buf_offset, ==, contents + tests[i].offset, expected);
+    }
+
+    /* without a direct handle, it's a plain read */
+    check(tr_sys_file_read_at_direct(fd, TR_BAD_SYS_FILE, buf, size, 0, NULL, 0, &n, &err));
+    check_ptr(err, ==, NULL);
+    check_uint(n, ==, size);
+    check_mem(buf, ==, contents, size);
+
+    tr_sys_file_close(direct_fd, NULL);
+    tr_sys_file_close(fd, NULL);
+    tr_sys_path_remove(path1, NULL);
+
+    tr_free(path1);
+    tr_free(bounce);
+    tr_free(buf);
+    tr_free(contents);
+    tr_free(test_dir);
+    return 0;
+}
+
 static int test_file_truncate(void)
 {
     char* const test_dir = create_test_dir(__FUNCTION__);
@@ -1341,6 +1477,23 @@ static int test_file_map(void)
 
     check_mem(view, ==, "test", 4);
 
+#ifdef _WIN32
+
+    /* Windows has no access pattern hints for views */
+    check(!tr_sys_file_advise_map(view + 1, 3, TR_SYS_FILE_MAP_ADVICE_SEQUENTIAL, &err));
+    check_ptr(err, !=, NULL);
+    tr_error_clear(&err);
+
+#else
+
+    check(tr_sys_file_advise_map(view + 1, 3, TR_SYS_FILE_MAP_ADVICE_SEQUENTIAL, &err));
+    check_ptr(err, ==, NULL);
+
+#endif
+
+    check(tr_sys_file_advise_map(view, 4, TR_SYS_FILE_MAP_ADVICE_WILL_NEED, &err));
+    check_ptr(err, ==, NULL);
+
 #ifdef HAVE_UNIFIED_BUFFER_CACHE
 
     tr_sys_file_write_at(fd, "E", 1, 1, NULL, NULL);
@@ -1633,6 +1786,8 @@ int main(void)
         test_path_native_separators,
         test_file_open,
         test_file_read_write_seek,
+        test_file_write_vectored,
+        test_file_read_at_direct,
         test_file_truncate,
         test_file_preallocate,
         test_file_map,
@@ -82,7 +82,7 @@ static time_t filetime_to_unix_time(FILETIME const* t)
 }
 
 static void stat_to_sys_path_info(DWORD attributes, DWORD size_low, DWORD size_high, FILETIME const* mtime,
-    tr_sys_path_info* info)
+    DWORD volume_serial, DWORD index_low, DWORD index_high, tr_sys_path_info* info)
 {
     TR_ASSERT(mtime != NULL);
     TR_ASSERT(info != NULL);
@@ -105,6 +105,10 @@ static void stat_to_sys_path_info(DWORD attributes, DWORD size_low, DWORD size_h
     info->size |= size_low;
 
     info->last_modified_at = filetime_to_unix_time(mtime);
+    info->device = volume_serial;
+    info->inode = index_high;
+    info->inode <<= 32;
+    info->inode |= index_low;
 }
 
 static inline bool is_slash(char c)
@@ -429,7 +433,7 @@ bool tr_sys_path_get_info(char const* path, int flags, tr_sys_path_info* info, t
         if (ret)
         {
             stat_to_sys_path_info(attributes.dwFileAttributes, attributes.nFileSizeLow, attributes.nFileSizeHigh,
-                &attributes.ftLastWriteTime, info);
+                &attributes.ftLastWriteTime, 0, 0, 0, info);
         }
         else
         {
@@ -859,6 +863,11 @@ tr_sys_file_t tr_sys_file_open(char const* path, int flags, int permissions, tr_
         native_flags |= FILE_FLAG_SEQUENTIAL_SCAN;
     }
 
+    if ((flags & TR_SYS_FILE_DIRECT) != 0)
+    {
+        native_flags |= FILE_FLAG_NO_BUFFERING;
+    }
+
     ret = open_file(path, native_access, native_disposition, native_flags, error);
 
     success = ret != TR_BAD_SYS_FILE;
@@ -927,7 +936,8 @@ bool tr_sys_file_get_info(tr_sys_file_t handle, tr_sys_path_info* info, tr_error
     if (ret)
     {
         stat_to_sys_path_info(attributes.dwFileAttributes, attributes.nFileSizeLow, attributes.nFileSizeHigh,
-            &attributes.ftLastWriteTime, info);
+            &attributes.ftLastWriteTime, attributes.dwVolumeSerialNumber, attributes.nFileIndexLow, attributes.nFileIndexHigh,
+            info);
     }
     else
     {
@@ -1107,6 +1117,50 @@ bool tr_sys_file_write_at(tr_sys_file_t handle, void const* buffer, uint64_t siz
     return ret;
 }
 
+bool tr_sys_file_write_at_v(tr_sys_file_t handle, tr_sys_file_iovec const* iov, size_t iov_count, uint64_t offset,
+    uint64_t* bytes_written, tr_error** error)
+{
+    TR_ASSERT(handle != TR_BAD_SYS_FILE);
+    TR_ASSERT(iov != NULL || iov_count == 0);
+
+    bool ret = true;
+    uint64_t total_written = 0;
+
+    for (size_t i = 0; ret && i < iov_count; ++i)
+    {
+        uint8_t const* walk = iov[i].base;
+        uint64_t left = iov[i].size;
+
+        while (ret && left > 0)
+        {
+            uint64_t my_bytes_written;
+
+            ret = tr_sys_file_write_at(handle, walk, left, offset, &my_bytes_written, error);
+
+            if (ret && my_bytes_written == 0)
+            {
+                set_system_error(error, ERROR_WRITE_FAULT);
+                ret = false;
+            }
+
+            if (ret)
+            {
+                walk += my_bytes_written;
+                left -= my_bytes_written;
+                offset += my_bytes_written;
+                total_written += my_bytes_written;
+            }
+        }
+    }
+
+    if (bytes_written != NULL)
+    {
+        *bytes_written = total_written;
+    }
+
+    return ret;
+}
+
 bool tr_sys_file_flush(tr_sys_file_t handle, tr_error** error)
 {
     TR_ASSERT(handle != TR_BAD_SYS_FILE);
@@ -1121,6 +1175,11 @@ bool tr_sys_file_flush(tr_sys_file_t handle, tr_error** error)
     return ret;
 }
 
+bool tr_sys_file_flush_data(tr_sys_file_t handle, tr_error** error)
+{
+    return tr_sys_file_flush(handle, error);
+}
+
 bool tr_sys_file_truncate(tr_sys_file_t handle, uint64_t size, tr_error** error)
 {
     TR_ASSERT(handle != TR_BAD_SYS_FILE);
@@ -1225,6 +1284,77 @@ bool tr_sys_file_unmap(void const* address, uint64_t size, tr_error** error)
     return ret;
 }
 
+static BOOL tr_prefetch_virtual_memory(void const* address, SIZE_T size)
+{
+    /* WIN32_MEMORY_RANGE_ENTRY, which older SDKs don't have */
+    struct memory_range_entry
+    {
+        PVOID VirtualAddress;
+        SIZE_T NumberOfBytes;
+    };
+
+    typedef BOOL (WINAPI* impl_t)(HANDLE, ULONG_PTR, struct memory_range_entry*, ULONG);
+
+    static impl_t real_impl = NULL;
+    static bool is_real_impl_valid = false;
+
+    if (!is_real_impl_valid)
+    {
+        real_impl = (impl_t)GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "PrefetchVirtualMemory");
+        is_real_impl_valid = true;
+    }
+
+    if (real_impl == NULL)
+    {
+        /* before Windows 8 */
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return FALSE;
+    }
+
+    struct memory_range_entry range = { .VirtualAddress = (PVOID)address, .NumberOfBytes = size };
+
+    return (*real_impl)(GetCurrentProcess(), 1, &range, 0);
+}
+
+bool tr_sys_file_advise_map(void const* address, uint64_t size, tr_sys_file_map_advice_t advice, tr_error** error)
+{
+    TR_ASSERT(address != NULL);
+    TR_ASSERT(size > 0);
+
+    bool ret;
+
+    if (size > MAXSIZE_T)
+    {
+        set_system_error(error, ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    switch (advice)
+    {
+    case TR_SYS_FILE_MAP_ADVICE_NORMAL:
+        /* that's how the view is accessed unless told otherwise */
+        ret = true;
+        break;
+
+    case TR_SYS_FILE_MAP_ADVICE_WILL_NEED:
+        ret = tr_prefetch_virtual_memory(address, (SIZE_T)size);
+        break;
+
+    default:
+        /* views have no access pattern hints */
+        SetLastError(ERROR_NOT_SUPPORTED);
+        ret = false;
+        break;
+    }
+
+    if (!ret)
+    {
+        set_system_error(error, GetLastError());
+    }
+
+    return ret;
+}
+
 bool tr_sys_file_lock(tr_sys_file_t handle, int operation, tr_error** error)
 {
     TR_ASSERT(handle != TR_BAD_SYS_FILE);
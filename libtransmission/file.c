@@ -6,7 +6,7 @@
  *
  */
 
-#include <string.h> /* strlen() */
+#include <string.h> /* memcpy(), strlen() */
 
 #include "transmission.h"
 #include "error.h"
@@ -118,3 +118,110 @@ bool tr_sys_file_write_fmt(tr_sys_file_t handle, char const* format, tr_error**
 
     return ret;
 }
+
+/***
+****
+***/
+
+#define DIRECT_ALIGN_DOWN(n) ((n) / TR_SYS_FILE_DIRECT_ALIGNMENT * TR_SYS_FILE_DIRECT_ALIGNMENT)
+#define DIRECT_ALIGN_UP(n) DIRECT_ALIGN_DOWN((n) + TR_SYS_FILE_DIRECT_ALIGNMENT - 1)
+
+static bool is_direct_aligned(void const* ptr)
+{
+    return (uintptr_t)ptr % TR_SYS_FILE_DIRECT_ALIGNMENT == 0;
+}
+
+void* tr_sys_file_alloc_direct_buffer(size_t size)
+{
+    /* tr_valloc() aligns to the page size, which is at least this on anything we run on */
+    return tr_valloc(DIRECT_ALIGN_UP(size));
+}
+
+/* reads until `size' bytes are read or the end of the file is reached */
+static bool read_at_fully(tr_sys_file_t handle, uint8_t* buffer, uint64_t size, uint64_t offset, uint64_t* bytes_read,
+    tr_error** error)
+{
+    uint64_t n = 0;
+
+    *bytes_read = 0;
+
+    while (*bytes_read < size)
+    {
+        if (!tr_sys_file_read_at(handle, buffer + *bytes_read, size - *bytes_read, offset + *bytes_read, &n, error))
+        {
+            return false;
+        }
+
+        if (n == 0)
+        {
+            break;
+        }
+
+        *bytes_read += n;
+    }
+
+    return true;
+}
+
+bool tr_sys_file_read_at_direct(tr_sys_file_t handle, tr_sys_file_t direct_handle, void* buffer, uint64_t size,
+    uint64_t offset, void* bounce_buffer, size_t bounce_size, uint64_t* bytes_read, tr_error** error)
+{
+    TR_ASSERT(handle != TR_BAD_SYS_FILE);
+    TR_ASSERT(buffer != NULL);
+    TR_ASSERT(bounce_size % TR_SYS_FILE_DIRECT_ALIGNMENT == 0);
+
+    uint8_t* const buf = buffer;
+    uint64_t const end = offset + size;
+    uint64_t const mid_begin = MIN(DIRECT_ALIGN_UP(offset), end);
+    uint64_t const mid_end = MAX(DIRECT_ALIGN_DOWN(end), mid_begin);
+    bool const use_bounce = bounce_buffer != NULL && bounce_size > 0 && is_direct_aligned(bounce_buffer);
+    uint64_t pos = offset;
+    uint64_t n;
+    bool ret;
+
+    if (direct_handle == TR_BAD_SYS_FILE || mid_begin == mid_end ||
+        (!is_direct_aligned(buf + (mid_begin - offset)) && !use_bounce))
+    {
+        return tr_sys_file_read_at(handle, buffer, size, offset, bytes_read, error);
+    }
+
+    /* the unaligned head */
+    ret = read_at_fully(handle, buf, mid_begin - offset, offset, &n, error);
+    pos += n;
+
+    /* the aligned middle, straight into `buffer' if it lines up */
+    while (ret && pos >= mid_begin && pos < mid_end)
+    {
+        uint8_t* const dst = buf + (pos - offset);
+        bool const is_aligned = is_direct_aligned(dst);
+        uint64_t const len = is_aligned ? mid_end - pos : MIN(mid_end - pos, (uint64_t)bounce_size);
+
+        ret = read_at_fully(direct_handle, is_aligned ? dst : bounce_buffer, len, pos, &n, error);
+
+        if (ret && !is_aligned)
+        {
+            memcpy(dst, bounce_buffer, n);
+        }
+
+        pos += n;
+
+        if (n < len)
+        {
+            break;
+        }
+    }
+
+    /* the unaligned tail */
+    if (ret && pos == mid_end)
+    {
+        ret = read_at_fully(handle, buf + (pos - offset), end - pos, pos, &n, error);
+        pos += n;
+    }
+
+    if (bytes_read != NULL)
+    {
+        *bytes_read = pos - offset;
+    }
+
+    return ret;
+}
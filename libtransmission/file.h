@@ -69,10 +69,16 @@ typedef enum
     TR_SYS_FILE_CREATE_NEW = (1 << 3),
     TR_SYS_FILE_APPEND = (1 << 4),
     TR_SYS_FILE_TRUNCATE = (1 << 5),
-    TR_SYS_FILE_SEQUENTIAL = (1 << 6)
+    TR_SYS_FILE_SEQUENTIAL = (1 << 6),
+    /* bypass the page cache. Offsets, sizes and buffers of reads from the
+       file must then be multiples of TR_SYS_FILE_DIRECT_ALIGNMENT */
+    TR_SYS_FILE_DIRECT = (1 << 7)
 }
 tr_sys_file_open_flags_t;
 
+/** @brief Alignment that's enough for reads from a @ref TR_SYS_FILE_DIRECT file on any device. */
+#define TR_SYS_FILE_DIRECT_ALIGNMENT 4096
+
 typedef enum
 {
     TR_SEEK_SET,
@@ -103,6 +109,15 @@ typedef enum
 }
 tr_sys_file_advice_t;
 
+typedef enum
+{
+    TR_SYS_FILE_MAP_ADVICE_NORMAL,
+    TR_SYS_FILE_MAP_ADVICE_RANDOM,
+    TR_SYS_FILE_MAP_ADVICE_SEQUENTIAL,
+    TR_SYS_FILE_MAP_ADVICE_WILL_NEED
+}
+tr_sys_file_map_advice_t;
+
 typedef enum
 {
     TR_SYS_FILE_PREALLOC_SPARSE = (1 << 0)
@@ -123,11 +138,22 @@ typedef enum
 }
 tr_sys_path_type_t;
 
+typedef struct tr_sys_file_iovec
+{
+    void const* base;
+    size_t size;
+}
+tr_sys_file_iovec;
+
 typedef struct tr_sys_path_info
 {
     tr_sys_path_type_t type;
     uint64_t size;
     time_t last_modified_at;
+    /* identifies the device or volume holding the file, or 0 if unknown */
+    uint64_t device;
+    /* identifies the file on its device, or 0 if unknown */
+    uint64_t inode;
 }
 tr_sys_path_info;
 
@@ -427,6 +453,27 @@ bool tr_sys_file_write(tr_sys_file_t handle, void const* buffer, uint64_t size,
 bool tr_sys_file_write_at(tr_sys_file_t handle, void const* buffer, uint64_t size, uint64_t offset, uint64_t* bytes_written,
     struct tr_error** error);
 
+/**
+ * @brief Like `pwritev()`, except that the position is undefined afterwards.
+ *        Not thread-safe.
+ *
+ * Unlike @ref tr_sys_file_write_at, this keeps writing until either all the
+ * buffers have been written or an error occurs.
+ *
+ * @param[in]  handle        Valid file descriptor.
+ * @param[in]  iov           Buffers to get data being written from, in order.
+ * @param[in]  iov_count     Number of buffers in `iov`.
+ * @param[in]  offset        File offset in bytes to start writing from.
+ * @param[out] bytes_written Number of bytes actually written. Optional, pass
+ *                           `NULL` if you are not interested.
+ * @param[out] error         Pointer to error object. Optional, pass `NULL` if you
+ *                           are not interested in error details.
+ *
+ * @return `True` on success, `false` otherwise (with `error` set accordingly).
+ */
+bool tr_sys_file_write_at_v(tr_sys_file_t handle, tr_sys_file_iovec const* iov, size_t iov_count, uint64_t offset,
+    uint64_t* bytes_written, struct tr_error** error);
+
 /**
  * @brief Portability wrapper for `fsync()`.
  *
@@ -438,6 +485,20 @@ bool tr_sys_file_write_at(tr_sys_file_t handle, void const* buffer, uint64_t siz
  */
 bool tr_sys_file_flush(tr_sys_file_t handle, struct tr_error** error);
 
+/**
+ * @brief Portability wrapper for `fdatasync()`.
+ *
+ * Like @ref tr_sys_file_flush, but metadata that isn't needed to read the
+ * data back (such as the modification time) may be left unwritten.
+ *
+ * @param[in]  handle Valid file descriptor.
+ * @param[out] error  Pointer to error object. Optional, pass `NULL` if you are
+ *                    not interested in error details.
+ *
+ * @return `True` on success, `false` otherwise (with `error` set accordingly).
+ */
+bool tr_sys_file_flush_data(tr_sys_file_t handle, struct tr_error** error);
+
 /**
  * @brief Portability wrapper for `ftruncate()`.
  *
@@ -503,6 +564,26 @@ void* tr_sys_file_map_for_reading(tr_sys_file_t handle, uint64_t offset, uint64_
  */
 bool tr_sys_file_unmap(void const* address, uint64_t size, struct tr_error** error);
 
+/**
+ * @brief Portability wrapper for `madvise()` for mapped file data.
+ *
+ * The range doesn't need to be page-aligned. On POSIX platforms without
+ * `posix_madvise()`, this does nothing and succeeds. On Windows, only
+ * `TR_SYS_FILE_MAP_ADVICE_WILL_NEED` can be given, with
+ * `PrefetchVirtualMemory()` on Windows 8 and later; other advice fails
+ * with `ERROR_NOT_SUPPORTED`. The advice is only a hint, so callers are
+ * free to ignore failures.
+ *
+ * @param[in]  address Pointer into mapped file data.
+ * @param[in]  size    Number of bytes to give advice about.
+ * @param[in]  advice  Advice to give.
+ * @param[out] error   Pointer to error object. Optional, pass `NULL` if you are
+ *                     not interested in error details.
+ *
+ * @return `True` on success, `false` otherwise (with `error` set accordingly).
+ */
+bool tr_sys_file_advise_map(void const* address, uint64_t size, tr_sys_file_map_advice_t advice, struct tr_error** error);
+
 /**
  * @brief Portability wrapper for `flock()`.
  *
@@ -580,6 +661,43 @@ bool tr_sys_file_write_line(tr_sys_file_t handle, char const* buffer, struct tr_
  */
 bool tr_sys_file_write_fmt(tr_sys_file_t handle, char const* format, struct tr_error** error, ...) TR_GNUC_PRINTF(2, 4);
 
+/**
+ * @brief Allocate a buffer for reads from a @ref TR_SYS_FILE_DIRECT file.
+ *
+ * @param[in] size Buffer size in bytes. It's rounded up to a multiple of
+ *                 @ref TR_SYS_FILE_DIRECT_ALIGNMENT.
+ *
+ * @return Aligned buffer, to be freed with @ref tr_free.
+ */
+void* tr_sys_file_alloc_direct_buffer(size_t size);
+
+/**
+ * @brief Like @ref tr_sys_file_read_at, except that the aligned middle of the
+ *        range is read through a @ref TR_SYS_FILE_DIRECT handle.
+ *
+ * The unaligned head and tail are read through `handle'. So is all of it if
+ * `direct_handle' is `TR_BAD_SYS_FILE'. Where `buffer' isn't aligned for a
+ * direct read, the data goes through `bounce_buffer' first.
+ *
+ * @param[in]  handle        Valid file descriptor, opened without
+ *                           @ref TR_SYS_FILE_DIRECT.
+ * @param[in]  direct_handle The same file, opened with @ref TR_SYS_FILE_DIRECT.
+ * @param[out] buffer        Buffer to store read data to.
+ * @param[in]  size          Number of bytes to read.
+ * @param[in]  offset        File offset in bytes to start reading from.
+ * @param[in]  bounce_buffer Buffer from @ref tr_sys_file_alloc_direct_buffer.
+ * @param[in]  bounce_size   Size of `bounce_buffer', a multiple of
+ *                           @ref TR_SYS_FILE_DIRECT_ALIGNMENT.
+ * @param[out] bytes_read    Number of bytes actually read. Optional, pass
+ *                           `NULL` if you are not interested.
+ * @param[out] error         Pointer to error object. Optional, pass `NULL` if
+ *                           you are not interested in error details.
+ *
+ * @return `True` on success, `false` otherwise (with `error` set accordingly).
+ */
+bool tr_sys_file_read_at_direct(tr_sys_file_t handle, tr_sys_file_t direct_handle, void* buffer, uint64_t size,
+    uint64_t offset, void* bounce_buffer, size_t bounce_size, uint64_t* bytes_read, struct tr_error** error);
+
 /* Directory-related wrappers */
 
 /**
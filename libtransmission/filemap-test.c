@@ -0,0 +1,127 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <string.h> /* memcmp() */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "filemap.h"
+#include "inout.h"
+#include "session.h"
+#include "torrent.h"
+#include "utils.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+/* the zero torrent's first file is 1 MiB, and is followed by a 4 KiB one */
+#define BIG_FILE_SIZE (1024 * 1024)
+#define SMALL_FILE_SIZE 4096
+#define SMALL_FILE_PIECE (BIG_FILE_SIZE / (32 * 1024))
+
+static bool buffer_matches_disk(tr_torrent* tor, struct evbuffer* buf, tr_piece_index_t piece, uint32_t offset,
+    uint32_t len)
+{
+    bool matches;
+    uint8_t* expected = tr_new(uint8_t, len);
+
+    matches = evbuffer_get_length(buf) == len && tr_ioRead(tor, piece, offset, len, expected) == 0 &&
+        memcmp(evbuffer_pullup(buf, -1), expected, len) == 0;
+
+    tr_free(expected);
+    return matches;
+}
+
+static int test_filemap(void)
+{
+    tr_session* session;
+    tr_variant settings;
+    tr_torrent* tor;
+    tr_filemap* map;
+    tr_filemap_stats stats;
+    struct evbuffer* buf;
+    struct evbuffer* buf2;
+
+    /* room for the big file's window, and nothing else */
+    tr_variantInitDict(&settings, 1);
+    tr_variantDictAddInt(&settings, TR_KEY_mmap_size_mb, 1);
+    session = libttest_session_init(&settings);
+    tr_variantFree(&settings);
+    check_int(tr_sessionGetMmapLimit_MB(session), ==, 1);
+
+    tor = libttest_zero_torrent_init(session);
+    libttest_zero_torrent_populate(tor, true);
+    map = session->filemap;
+
+    tr_sessionLock(session);
+
+    /* blocks are added by reference, and read back the same as from disk */
+    buf = evbuffer_new();
+    check_int(tr_filemapAddBlock(map, tor, 1, 0, 16384, buf), ==, 0);
+    check(buffer_matches_disk(tor, buf, 1, 0, 16384));
+    evbuffer_drain(buf, 16384);
+    check_int(tr_filemapAddBlock(map, tor, 1, 16384, 16384, buf), ==, 0);
+    check(buffer_matches_disk(tor, buf, 1, 16384, 16384));
+
+    tr_filemapGetStats(map, &stats);
+    check_uint(stats.maps, ==, 1);
+    check_uint(stats.hits, ==, 1);
+    check_uint(stats.mapped_bytes, ==, BIG_FILE_SIZE);
+
+    /* a block that straddles two files can't be mapped */
+    buf2 = evbuffer_new();
+    check_int(tr_filemapAddBlock(map, tor, SMALL_FILE_PIECE, 0, SMALL_FILE_SIZE + 16, buf2), !=, 0);
+
+    /* while the big file's window is still referenced, there's no room for another */
+    check_int(tr_filemapAddBlock(map, tor, SMALL_FILE_PIECE, 0, SMALL_FILE_SIZE, buf2), !=, 0);
+    check_uint(evbuffer_get_length(buf2), ==, 0);
+
+    /* but once it's released, it gets recycled */
+    evbuffer_free(buf);
+    check_int(tr_filemapAddBlock(map, tor, SMALL_FILE_PIECE, 0, SMALL_FILE_SIZE, buf2), ==, 0);
+    check(buffer_matches_disk(tor, buf2, SMALL_FILE_PIECE, 0, SMALL_FILE_SIZE));
+
+    tr_filemapGetStats(map, &stats);
+    check_uint(stats.maps, ==, 2);
+    check_uint(stats.unmaps, ==, 1);
+    check_uint(stats.mapped_bytes, ==, SMALL_FILE_SIZE);
+
+    /* closing the torrent keeps a referenced window mapped until it's released */
+    tr_filemapTorrentClose(map, tr_torrentId(tor));
+    check(buffer_matches_disk(tor, buf2, SMALL_FILE_PIECE, 0, SMALL_FILE_SIZE));
+    tr_filemapGetStats(map, &stats);
+    check_uint(stats.unmaps, ==, 1);
+
+    evbuffer_free(buf2);
+    tr_filemapGetStats(map, &stats);
+    check_uint(stats.unmaps, ==, 2);
+    check_uint(stats.mapped_bytes, ==, 0);
+
+    /* a limit of zero turns it off */
+    tr_sessionSetMmapLimit_MB(session, 0);
+    buf = evbuffer_new();
+    check_int(tr_filemapAddBlock(map, tor, 1, 0, 16384, buf), !=, 0);
+    evbuffer_free(buf);
+
+    tr_sessionUnlock(session);
+
+    tr_torrentRemove(tor, true, tr_sys_path_remove);
+    libttest_session_close(session);
+    return 0;
+}
+
+int main(void)
+{
+    testFunc const tests[] =
+    {
+        test_filemap
+    };
+
+    return runTests(tests, NUM_TESTS(tests));
+}
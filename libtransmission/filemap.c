@@ -0,0 +1,400 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <errno.h>
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "error.h"
+#include "file.h"
+#include "filemap.h"
+#include "inout.h"
+#include "log.h"
+#include "peer-common.h" /* MAX_BLOCK_SIZE */
+#include "ptrarray.h"
+#include "torrent.h"
+#include "tr-assert.h"
+#include "utils.h"
+
+#define MY_NAME "Filemap"
+
+#define dbgmsg(...) tr_logAddDeepNamed(MY_NAME, __VA_ARGS__)
+
+enum
+{
+    /* Files are mapped in windows of this size, aligned to it. Each window
+     * also maps the start of the next one, so that any block which starts
+     * in a window can be served from it. */
+    WINDOW_SIZE = 8 * 1024 * 1024,
+
+    /* how far ahead of a sequential reader to ask for pages to be read in */
+    READAHEAD_SIZE = 1024 * 1024,
+
+    /* how many back-to-back requests until a window counts as being read sequentially */
+    SEQUENTIAL_THRESHOLD = 4
+};
+
+struct tr_filemap_window
+{
+    tr_filemap* map; /* NULL if the map was freed while this was still referenced */
+    int torrent_id;
+    tr_file_index_t file_index;
+    uint64_t file_offset;
+    uint8_t const* data;
+    uint64_t length;
+
+    int ref_count; /* how many output buffers refer to the window */
+    bool is_dropped; /* unmap it as soon as it's no longer referenced */
+    uint64_t used_at;
+
+    /* the recent request pattern, which picks the madvise() hints */
+    uint64_t next_offset;
+    int sequential_count;
+    uint64_t readahead_end;
+    tr_sys_file_map_advice_t advice;
+};
+
+struct tr_filemap
+{
+    tr_ptrArray windows; /* sorted by compareWindows() */
+    uint64_t max_bytes;
+    uint64_t use_count;
+    tr_filemap_stats stats;
+};
+
+static int compareWindows(void const* va, void const* vb)
+{
+    struct tr_filemap_window const* a = va;
+    struct tr_filemap_window const* b = vb;
+
+    if (a->torrent_id != b->torrent_id)
+    {
+        return a->torrent_id < b->torrent_id ? -1 : 1;
+    }
+
+    if (a->file_index != b->file_index)
+    {
+        return a->file_index < b->file_index ? -1 : 1;
+    }
+
+    if (a->file_offset != b->file_offset)
+    {
+        return a->file_offset < b->file_offset ? -1 : 1;
+    }
+
+    return 0;
+}
+
+static void unmapWindow(struct tr_filemap_window* w)
+{
+    TR_ASSERT(w->ref_count == 0);
+
+    tr_sys_file_unmap(w->data, w->length, NULL);
+
+    if (w->map != NULL)
+    {
+        w->map->stats.mapped_bytes -= w->length;
+        ++w->map->stats.unmaps;
+    }
+
+    tr_free(w);
+}
+
+/* the caller has already removed `w' from the map's windows */
+static void dropWindow(struct tr_filemap_window* w)
+{
+    w->is_dropped = true;
+
+    if (w->ref_count == 0)
+    {
+        unmapWindow(w);
+    }
+}
+
+/* unmap the least recently used windows until there's `room' to spare.
+   windows that are still referenced can't go, so this can come up short */
+static bool trimWindows(tr_filemap* map, uint64_t room)
+{
+    while (map->stats.mapped_bytes + room > map->max_bytes)
+    {
+        int oldest_pos = -1;
+        struct tr_filemap_window* oldest = NULL;
+        int const n = tr_ptrArraySize(&map->windows);
+
+        for (int i = 0; i < n; ++i)
+        {
+            struct tr_filemap_window* w = tr_ptrArrayNth(&map->windows, i);
+
+            if (w->ref_count == 0 && (oldest == NULL || w->used_at < oldest->used_at))
+            {
+                oldest = w;
+                oldest_pos = i;
+            }
+        }
+
+        if (oldest == NULL)
+        {
+            return false;
+        }
+
+        tr_ptrArrayRemove(&map->windows, oldest_pos);
+        dropWindow(oldest);
+    }
+
+    return true;
+}
+
+static void onReferenceDone(void const* data UNUSED, size_t len UNUSED, void* vw)
+{
+    struct tr_filemap_window* w = vw;
+
+    TR_ASSERT(w->ref_count > 0);
+
+    if (--w->ref_count == 0)
+    {
+        if (w->is_dropped)
+        {
+            unmapWindow(w);
+        }
+        else if (w->map->stats.mapped_bytes > w->map->max_bytes)
+        {
+            trimWindows(w->map, 0);
+        }
+    }
+}
+
+static int mapWindow(tr_filemap* map, tr_torrent* tor, tr_piece_index_t piece, uint32_t offset, uint32_t len,
+    struct tr_filemap_window const* key, struct tr_filemap_window** setme)
+{
+    int err;
+    void* data = NULL;
+    tr_sys_path_info info;
+    tr_error* error = NULL;
+    struct tr_io_span* spans;
+    size_t span_count;
+    struct tr_filemap_window* w;
+    uint64_t const length = MIN(tor->info.files[key->file_index].length - key->file_offset,
+        (uint64_t)WINDOW_SIZE + MAX_BLOCK_SIZE);
+
+    if (!trimWindows(map, length))
+    {
+        return ENOMEM;
+    }
+
+    if ((err = tr_ioOpenSpans(tor, false, piece, offset, len, &spans, &span_count)) != 0)
+    {
+        return err;
+    }
+
+    TR_ASSERT(span_count == 1);
+
+    /* touching a mapped page past the end of the file raises SIGBUS,
+       so make sure that the file is as big as it's supposed to be */
+    if (!tr_sys_file_get_info(spans[0].fd, &info, &error))
+    {
+        err = error->code;
+        tr_error_free(error);
+    }
+    else if (info.size < key->file_offset + length)
+    {
+        err = EIO;
+    }
+    else if ((data = tr_sys_file_map_for_reading(spans[0].fd, key->file_offset, length, &error)) == NULL)
+    {
+        dbgmsg("couldn't map \"%s\": %s", tor->info.files[key->file_index].name, error->message);
+        err = error->code;
+        tr_error_free(error);
+    }
+
+    tr_ioCloseSpans(tor->session, spans, span_count);
+
+    if (err != 0)
+    {
+        return err;
+    }
+
+    w = tr_new0(struct tr_filemap_window, 1);
+    w->map = map;
+    w->torrent_id = key->torrent_id;
+    w->file_index = key->file_index;
+    w->file_offset = key->file_offset;
+    w->data = data;
+    w->length = length;
+    w->next_offset = UINT64_MAX;
+
+    /* peers' requests are mostly scattered, so don't read ahead until it looks worthwhile */
+    w->advice = TR_SYS_FILE_MAP_ADVICE_RANDOM;
+    tr_sys_file_advise_map(w->data, w->length, w->advice, NULL);
+
+    tr_ptrArrayInsertSorted(&map->windows, w, compareWindows);
+    map->stats.mapped_bytes += length;
+    ++map->stats.maps;
+
+    *setme = w;
+    return 0;
+}
+
+/* ask for the block to be paged in, and for readahead if the window's being read sequentially */
+static void adviseWindow(struct tr_filemap_window* w, uint64_t file_offset, uint32_t len)
+{
+    uint64_t const begin = file_offset - w->file_offset;
+    uint64_t const end = begin + len;
+    tr_sys_file_map_advice_t advice;
+
+    if (file_offset == w->next_offset)
+    {
+        w->sequential_count = MIN(w->sequential_count + 1, SEQUENTIAL_THRESHOLD);
+    }
+    else
+    {
+        w->sequential_count = 0;
+    }
+
+    w->next_offset = file_offset + len;
+
+    advice = w->sequential_count >= SEQUENTIAL_THRESHOLD ? TR_SYS_FILE_MAP_ADVICE_SEQUENTIAL : TR_SYS_FILE_MAP_ADVICE_RANDOM;
+
+    if (advice != w->advice)
+    {
+        tr_sys_file_advise_map(w->data, w->length, advice, NULL);
+        w->advice = advice;
+        w->readahead_end = 0;
+    }
+
+    if (advice != TR_SYS_FILE_MAP_ADVICE_SEQUENTIAL)
+    {
+        tr_sys_file_advise_map(w->data + begin, len, TR_SYS_FILE_MAP_ADVICE_WILL_NEED, NULL);
+    }
+    else if (end + READAHEAD_SIZE / 2 > w->readahead_end)
+    {
+        uint64_t const ra_begin = MAX(begin, w->readahead_end);
+        uint64_t const ra_end = MIN(w->length, end + READAHEAD_SIZE);
+
+        if (ra_begin < ra_end)
+        {
+            tr_sys_file_advise_map(w->data + ra_begin, ra_end - ra_begin, TR_SYS_FILE_MAP_ADVICE_WILL_NEED, NULL);
+        }
+
+        w->readahead_end = ra_end;
+    }
+}
+
+/***
+****
+***/
+
+tr_filemap* tr_filemapNew(uint64_t max_bytes)
+{
+    tr_filemap* map = tr_new0(tr_filemap, 1);
+
+    map->windows = TR_PTR_ARRAY_INIT;
+    map->max_bytes = max_bytes;
+
+    return map;
+}
+
+static void freeWindow(void* vw)
+{
+    struct tr_filemap_window* w = vw;
+
+    if (w->ref_count > 0)
+    {
+        /* it'll be unmapped when the last output buffer lets go of it */
+        w->map = NULL;
+    }
+
+    dropWindow(w);
+}
+
+void tr_filemapFree(tr_filemap* map)
+{
+    tr_ptrArrayDestruct(&map->windows, freeWindow);
+    tr_free(map);
+}
+
+void tr_filemapSetLimit(tr_filemap* map, uint64_t max_bytes)
+{
+    map->max_bytes = max_bytes;
+
+    trimWindows(map, 0);
+}
+
+uint64_t tr_filemapGetLimit(tr_filemap const* map)
+{
+    return map->max_bytes;
+}
+
+int tr_filemapAddBlock(tr_filemap* map, tr_torrent* tor, tr_piece_index_t piece, uint32_t offset, uint32_t len,
+    struct evbuffer* buf)
+{
+    TR_ASSERT(len > 0);
+    TR_ASSERT(len <= MAX_BLOCK_SIZE);
+
+    int err;
+    uint64_t file_offset;
+    struct tr_filemap_window key;
+    struct tr_filemap_window* w;
+
+    if (map->max_bytes == 0)
+    {
+        return ENOTSUP;
+    }
+
+    key.torrent_id = tr_torrentId(tor);
+    tr_ioFindFileLocation(tor, piece, offset, &key.file_index, &file_offset);
+
+    /* blocks that straddle files have to be read the usual way */
+    if (file_offset + len > tor->info.files[key.file_index].length)
+    {
+        return EINVAL;
+    }
+
+    key.file_offset = file_offset - file_offset % WINDOW_SIZE;
+
+    if ((w = tr_ptrArrayFindSorted(&map->windows, &key, compareWindows)) != NULL)
+    {
+        ++map->stats.hits;
+    }
+    else if ((err = mapWindow(map, tor, piece, offset, len, &key, &w)) != 0)
+    {
+        return err;
+    }
+
+    TR_ASSERT(file_offset + len <= w->file_offset + w->length);
+
+    w->used_at = ++map->use_count;
+    adviseWindow(w, file_offset, len);
+
+    if (evbuffer_add_reference(buf, w->data + (file_offset - w->file_offset), len, onReferenceDone, w) != 0)
+    {
+        return ENOMEM;
+    }
+
+    ++w->ref_count;
+    return 0;
+}
+
+void tr_filemapTorrentClose(tr_filemap* map, int torrent_id)
+{
+    for (int i = tr_ptrArraySize(&map->windows) - 1; i >= 0; --i)
+    {
+        struct tr_filemap_window* w = tr_ptrArrayNth(&map->windows, i);
+
+        if (w->torrent_id == torrent_id)
+        {
+            tr_ptrArrayRemove(&map->windows, i);
+            dropWindow(w);
+        }
+    }
+}
+
+void tr_filemapGetStats(tr_filemap const* map, tr_filemap_stats* setme)
+{
+    *setme = map->stats;
+}
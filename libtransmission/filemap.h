@@ -0,0 +1,69 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#pragma once
+
+#ifndef __TRANSMISSION__
+#error only libtransmission should #include this header.
+#endif
+
+struct evbuffer;
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+/**
+ * Read-only memory maps of seeding torrents' files, so that blocks can be
+ * added to a peer's output buffer by reference instead of being copied.
+ *
+ * Files are mapped in fixed-size windows, which are recycled least recently
+ * used first to keep the total mapped size under the limit. A window that's
+ * still referenced by an output buffer stays mapped until it's released.
+ */
+typedef struct tr_filemap tr_filemap;
+
+typedef struct tr_filemap_stats
+{
+    uint64_t hits; /* blocks served from a window that was already mapped */
+    uint64_t maps; /* windows mapped */
+    uint64_t unmaps; /* windows unmapped */
+    uint64_t mapped_bytes; /* the size of the windows that are mapped now */
+}
+tr_filemap_stats;
+
+/** A `max_bytes' of zero disables mapping. */
+tr_filemap* tr_filemapNew(uint64_t max_bytes);
+
+void tr_filemapFree(tr_filemap* map);
+
+void tr_filemapSetLimit(tr_filemap* map, uint64_t max_bytes);
+
+uint64_t tr_filemapGetLimit(tr_filemap const* map);
+
+/**
+ * Adds the block to `buf' by reference, mapping its file if needed.
+ * Only use this for torrents that are complete, since a mapped file
+ * mustn't be written to or truncated.
+ *
+ * @return 0 on success, or an errno value if the block couldn't be mapped,
+ *         in which case it should be read the usual way.
+ */
+int tr_filemapAddBlock(tr_filemap* map, tr_torrent* tor, tr_piece_index_t piece, uint32_t offset, uint32_t len,
+    struct evbuffer* buf);
+
+/**
+ * Drops the torrent's windows. Call this before its files are
+ * closed, moved, or deleted.
+ */
+void tr_filemapTorrentClose(tr_filemap* map, int torrent_id);
+
+void tr_filemapGetStats(tr_filemap const* map, tr_filemap_stats* setme);
+
+/* @} */
@@ -0,0 +1,147 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <string.h> /* memcmp(), memcpy(), memset() */
+
+#include "transmission.h"
+#include "crypto-utils.h"
+#include "file.h"
+#include "fingerprint.h"
+#include "utils.h"
+#include "variant.h"
+
+enum
+{
+    /* the sample is this many chunks of this size, spread from the start of the file to the end */
+    SAMPLE_CHUNK_COUNT = 4,
+    SAMPLE_CHUNK_SIZE = 4096
+};
+
+static bool takeSample(uint8_t* setme, char const* filename, uint64_t size)
+{
+    bool ok;
+    uint8_t buf[SAMPLE_CHUNK_SIZE];
+    tr_sha1_ctx_t sha;
+    tr_sys_file_t const fd = tr_sys_file_open(filename, TR_SYS_FILE_READ, 0, NULL);
+
+    if (fd == TR_BAD_SYS_FILE)
+    {
+        return false;
+    }
+
+    ok = true;
+    sha = tr_sha1_init();
+
+    for (int i = 0; ok && i < SAMPLE_CHUNK_COUNT; ++i)
+    {
+        uint64_t const len = MIN(size, (uint64_t)SAMPLE_CHUNK_SIZE);
+        uint64_t const offset = (size - len) / (SAMPLE_CHUNK_COUNT - 1) * i;
+        uint64_t n_read;
+
+        ok = tr_sys_file_read_at(fd, buf, len, offset, &n_read, NULL) && n_read == len &&
+            tr_sha1_update(sha, buf, len);
+    }
+
+    tr_sha1_final(sha, ok ? setme : NULL);
+    tr_sys_file_close(fd, NULL);
+
+    return ok;
+}
+
+bool tr_fingerprintTake(tr_fingerprint* setme, char const* filename, bool with_sample)
+{
+    tr_sys_path_info info;
+
+    memset(setme, 0, sizeof(tr_fingerprint));
+
+    if (filename == NULL || !tr_sys_path_get_info(filename, 0, &info, NULL) || info.type != TR_SYS_PATH_IS_FILE)
+    {
+        return false;
+    }
+
+    setme->size = info.size;
+    setme->mtime = info.last_modified_at;
+    setme->inode = info.inode;
+
+    if (with_sample)
+    {
+        setme->has_sample = takeSample(setme->sample, filename, info.size);
+    }
+
+    return true;
+}
+
+bool tr_fingerprintMatches(tr_fingerprint const* fingerprint, char const* filename, bool use_sample)
+{
+    tr_fingerprint now;
+
+    use_sample = use_sample && fingerprint->has_sample;
+
+    if (!tr_fingerprintTake(&now, filename, false) || now.size != fingerprint->size || now.mtime != fingerprint->mtime)
+    {
+        return false;
+    }
+
+    if (use_sample)
+    {
+        return takeSample(now.sample, filename, now.size) &&
+            memcmp(now.sample, fingerprint->sample, SHA_DIGEST_LENGTH) == 0;
+    }
+
+    return now.inode != 0 && now.inode == fingerprint->inode;
+}
+
+/***
+****
+***/
+
+/* [ size, mtime, inode, sample ], where the sample is optional */
+
+void tr_fingerprintToVariant(tr_fingerprint const* fingerprint, tr_variant* setme)
+{
+    tr_variantInitList(setme, 4);
+    tr_variantListAddInt(setme, (int64_t)fingerprint->size);
+    tr_variantListAddInt(setme, fingerprint->mtime);
+    tr_variantListAddInt(setme, (int64_t)fingerprint->inode);
+
+    if (fingerprint->has_sample)
+    {
+        tr_variantListAddRaw(setme, fingerprint->sample, SHA_DIGEST_LENGTH);
+    }
+}
+
+bool tr_fingerprintFromVariant(tr_fingerprint* setme, tr_variant* v)
+{
+    int64_t size;
+    int64_t mtime;
+    int64_t inode;
+    uint8_t const* raw;
+    size_t raw_len;
+
+    memset(setme, 0, sizeof(tr_fingerprint));
+
+    if (!tr_variantIsList(v) ||
+        !tr_variantGetInt(tr_variantListChild(v, 0), &size) ||
+        !tr_variantGetInt(tr_variantListChild(v, 1), &mtime) ||
+        !tr_variantGetInt(tr_variantListChild(v, 2), &inode))
+    {
+        return false;
+    }
+
+    setme->size = (uint64_t)size;
+    setme->mtime = (time_t)mtime;
+    setme->inode = (uint64_t)inode;
+
+    if (tr_variantGetRaw(tr_variantListChild(v, 3), &raw, &raw_len) && raw_len == SHA_DIGEST_LENGTH)
+    {
+        memcpy(setme->sample, raw, SHA_DIGEST_LENGTH);
+        setme->has_sample = true;
+    }
+
+    return true;
+}
@@ -0,0 +1,59 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#pragma once
+
+#ifndef __TRANSMISSION__
+#error only libtransmission should #include this header.
+#endif
+
+#include <time.h> /* time_t */
+
+#include "crypto-utils.h" /* SHA_DIGEST_LENGTH */
+
+struct tr_variant;
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+/**
+ * What a file looked like on disk when its pieces were last known to be
+ * right. If it still looks the same, a smart verify can skip rehashing it.
+ */
+typedef struct tr_fingerprint
+{
+    uint64_t size;
+    time_t mtime;
+    uint64_t inode;
+
+    /* a hash of a few small chunks spread across the file */
+    uint8_t sample[SHA_DIGEST_LENGTH];
+    bool has_sample;
+}
+tr_fingerprint;
+
+/** @brief Look at `filename' on disk. Returns false if it can't be read. */
+bool tr_fingerprintTake(tr_fingerprint* setme, char const* filename, bool with_sample);
+
+/**
+ * @brief Check whether `filename' looks the same as it did.
+ *
+ * The size and mtime have to match. If `use_sample' is set and there's a
+ * sample, it has to match too, but the inode can differ, so files that
+ * were moved to another filesystem still match. Otherwise, the inode has
+ * to match.
+ */
+bool tr_fingerprintMatches(tr_fingerprint const* fingerprint, char const* filename, bool use_sample);
+
+void tr_fingerprintToVariant(tr_fingerprint const* fingerprint, struct tr_variant* setme);
+
+bool tr_fingerprintFromVariant(tr_fingerprint* setme, struct tr_variant* v);
+
+/** @} */
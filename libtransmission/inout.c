@@ -19,6 +19,8 @@
 #include "inout.h"
 #include "log.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
+#include "prealloc.h"
+#include "session.h"
 #include "stats.h" /* tr_statsFileCreated() */
 #include "torrent.h"
 #include "tr-assert.h"
@@ -37,27 +39,11 @@ enum
 };
 
 /* returns 0 on success, or an errno on failure */
-static int readOrWriteBytes(tr_session* session, tr_torrent* tor, int ioMode, tr_file_index_t fileIndex, uint64_t fileOffset,
-    void* buf, size_t buflen)
+static int getFileForIo(tr_session* session, tr_torrent* tor, bool doWrite, tr_file_index_t fileIndex, tr_sys_file_t* setme)
 {
     tr_sys_file_t fd;
     int err = 0;
-    bool const doWrite = ioMode >= TR_IO_WRITE;
-    tr_info const* const info = &tor->info;
-    tr_file const* const file = &info->files[fileIndex];
-
-    TR_ASSERT(fileIndex < info->fileCount);
-    TR_ASSERT(file->length == 0 || fileOffset < file->length);
-    TR_ASSERT(fileOffset + buflen <= file->length);
-
-    if (file->length == 0)
-    {
-        return 0;
-    }
-
-    /***
-    ****  Find the fd
-    ***/
+    tr_file const* const file = &tor->info.files[fileIndex];
 
     fd = tr_fdFileGetCached(session, tr_torrentId(tor), fileIndex, doWrite);
 
@@ -106,6 +92,35 @@ static int readOrWriteBytes(tr_session* session, tr_torrent* tor, int ioMode, tr
         tr_free(subpath);
     }
 
+    *setme = fd;
+    return err;
+}
+
+/* returns 0 on success, or an errno on failure */
+static int readOrWriteBytes(tr_session* session, tr_torrent* tor, int ioMode, tr_file_index_t fileIndex, uint64_t fileOffset,
+    void* buf, size_t buflen)
+{
+    tr_sys_file_t fd;
+    int err = 0;
+    bool const doWrite = ioMode >= TR_IO_WRITE;
+    tr_info const* const info = &tor->info;
+    tr_file const* const file = &info->files[fileIndex];
+
+    TR_ASSERT(fileIndex < info->fileCount);
+    TR_ASSERT(file->length == 0 || fileOffset < file->length);
+    TR_ASSERT(fileOffset + buflen <= file->length);
+
+    if (file->length == 0)
+    {
+        return 0;
+    }
+
+    /***
+    ****  Find the fd
+    ***/
+
+    err = getFileForIo(session, tor, doWrite, fileIndex, &fd);
+
     /***
     ****  Use the fd
     ***/
@@ -125,6 +140,10 @@ static int readOrWriteBytes(tr_session* session, tr_torrent* tor, int ioMode, tr
         }
         else if (ioMode == TR_IO_WRITE)
         {
+            struct tr_io_span const span = { fd, NULL, fileIndex, fileOffset, buflen };
+
+            tr_preallocWait(session->prealloc, tor->uniqueId, &span, 1);
+
             if (!tr_sys_file_write_at(fd, buf, buflen, fileOffset, NULL, &error))
             {
                 err = error->code;
@@ -237,6 +256,226 @@ int tr_ioWrite(tr_torrent* tor, tr_piece_index_t pieceIndex, uint32_t begin, uin
     return readOrWritePiece(tor, TR_IO_WRITE, pieceIndex, begin, (uint8_t*)buf, len);
 }
 
+/****
+*****  Spans
+****/
+
+int tr_ioOpenSpans(tr_torrent* tor, bool doWrite, tr_piece_index_t pieceIndex, uint32_t begin, uint64_t len,
+    struct tr_io_span** setme_spans, size_t* setme_count)
+{
+    int err = 0;
+    tr_file_index_t fileIndex;
+    uint64_t fileOffset;
+    tr_info const* info = &tor->info;
+    struct tr_io_span* spans;
+    size_t n = 0;
+
+    *setme_spans = NULL;
+    *setme_count = 0;
+
+    if (pieceIndex >= tor->info.pieceCount)
+    {
+        return EINVAL;
+    }
+
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    tr_ioFindFileLocation(tor, pieceIndex, begin, &fileIndex, &fileOffset);
+
+    /* count the files first; a small range of a torrent with
+     * lots of tiny files can touch an unbounded number of them */
+    for (uint64_t left = len, first = fileOffset, i = fileIndex; left != 0; ++i, first = 0)
+    {
+        uint64_t const bytesThisPass = MIN(left, info->files[i].length - first);
+
+        if (bytesThisPass != 0)
+        {
+            ++n;
+        }
+
+        left -= bytesThisPass;
+    }
+
+    spans = tr_new(struct tr_io_span, n);
+    n = 0;
+
+    while (len != 0 && err == 0)
+    {
+        tr_file const* file = &info->files[fileIndex];
+        uint64_t const bytesThisPass = MIN(len, file->length - fileOffset);
+
+        if (bytesThisPass != 0)
+        {
+            tr_sys_file_t fd;
+
+            if ((err = getFileForIo(tor->session, tor, doWrite, fileIndex, &fd)) == 0)
+            {
+                struct tr_io_span* span = &spans[n++];
+
+                span->fd = fd;
+                span->pin = tr_fdFileRetain(tor->session, tr_torrentId(tor), fileIndex);
+                span->file_index = fileIndex;
+                span->file_offset = fileOffset;
+                span->length = bytesThisPass;
+            }
+            else if (doWrite && tor->error != TR_STAT_LOCAL_ERROR)
+            {
+                char* path = tr_buildPath(tor->downloadDir, file->name, NULL);
+                tr_torrentSetLocalError(tor, "%s (%s)", tr_strerror(err), path);
+                tr_free(path);
+            }
+        }
+
+        len -= bytesThisPass;
+        fileIndex++;
+        fileOffset = 0;
+    }
+
+    if (err != 0)
+    {
+        tr_ioCloseSpans(tor->session, spans, n);
+    }
+    else
+    {
+        *setme_spans = spans;
+        *setme_count = n;
+    }
+
+    return err;
+}
+
+void tr_ioCloseSpans(tr_session* session, struct tr_io_span* spans, size_t span_count)
+{
+    for (size_t i = 0; i < span_count; ++i)
+    {
+        tr_fdFileRelease(session, spans[i].pin);
+    }
+
+    tr_free(spans);
+}
+
+int tr_ioReadSpans(struct tr_io_span const* spans, size_t span_count, uint8_t* buf, size_t* setme_failed)
+{
+    for (size_t i = 0; i < span_count; ++i)
+    {
+        tr_error* error = NULL;
+
+        if (!tr_sys_file_read_at(spans[i].fd, buf, spans[i].length, spans[i].file_offset, NULL, &error))
+        {
+            int const err = error->code;
+            tr_error_free(error);
+            *setme_failed = i;
+            return err;
+        }
+
+        buf += spans[i].length;
+    }
+
+    return 0;
+}
+
+int tr_ioWriteSpans(struct tr_io_span const* spans, size_t span_count, tr_sys_file_iovec const* iov, size_t iov_count,
+    size_t* setme_failed)
+{
+    int err = 0;
+    tr_sys_file_iovec* buffers;
+    tr_sys_file_iovec* walk;
+    tr_sys_file_iovec* segments;
+
+    if (span_count == 0)
+    {
+        return 0;
+    }
+
+    /* `walk' is a mutable copy of `iov' that we consume as we go,
+     * and `segments' holds the buffers (or parts of them) for one span */
+    buffers = tr_memdup(iov, sizeof(tr_sys_file_iovec) * iov_count);
+    walk = buffers;
+    segments = tr_new(tr_sys_file_iovec, iov_count);
+
+    for (size_t i = 0; err == 0 && i < span_count; ++i)
+    {
+        uint64_t const bytesThisPass = spans[i].length;
+        uint64_t segmentBytes = 0;
+        size_t segmentCount = 0;
+        tr_error* error = NULL;
+
+        while (segmentBytes < bytesThisPass)
+        {
+            tr_sys_file_iovec* seg = &segments[segmentCount++];
+
+            *seg = *walk;
+
+            if (segmentBytes + seg->size > bytesThisPass)
+            {
+                /* this buffer straddles a file boundary */
+                seg->size = bytesThisPass - segmentBytes;
+                walk->base = (uint8_t const*)walk->base + seg->size;
+                walk->size -= seg->size;
+            }
+            else
+            {
+                ++walk;
+            }
+
+            segmentBytes += seg->size;
+        }
+
+        if (!tr_sys_file_write_at_v(spans[i].fd, segments, segmentCount, spans[i].file_offset, NULL, &error))
+        {
+            err = error->code;
+            tr_error_free(error);
+            *setme_failed = i;
+        }
+    }
+
+    tr_free(segments);
+    tr_free(buffers);
+    return err;
+}
+
+int tr_ioWritev(tr_torrent* tor, tr_piece_index_t pieceIndex, uint32_t begin, tr_sys_file_iovec const* iov,
+    size_t iov_count)
+{
+    int err;
+    size_t failed;
+    struct tr_io_span* spans;
+    size_t span_count;
+    uint64_t buflen = 0;
+
+    for (size_t i = 0; i < iov_count; ++i)
+    {
+        buflen += iov[i].size;
+    }
+
+    err = tr_ioOpenSpans(tor, true, pieceIndex, begin, buflen, &spans, &span_count);
+
+    if (err == 0)
+    {
+        tr_preallocWait(tor->session->prealloc, tor->uniqueId, spans, span_count);
+    }
+
+    if (err == 0 && (err = tr_ioWriteSpans(spans, span_count, iov, iov_count, &failed)) != 0)
+    {
+        tr_file const* file = &tor->info.files[spans[failed].file_index];
+
+        tr_logAddTorErr(tor, "write failed for \"%s\": %s", file->name, tr_strerror(err));
+
+        if (tor->error != TR_STAT_LOCAL_ERROR)
+        {
+            char* path = tr_buildPath(tor->downloadDir, file->name, NULL);
+            tr_torrentSetLocalError(tor, "%s (%s)", tr_strerror(err), path);
+            tr_free(path);
+        }
+    }
+
+    tr_ioCloseSpans(tor->session, spans, span_count);
+    return err;
+}
+
 /****
 *****
 ****/
@@ -248,7 +487,7 @@ static bool recalculateHash(tr_torrent* tor, tr_piece_index_t pieceIndex, uint8_
     TR_ASSERT(setme != NULL);
 
     size_t bytesLeft;
-    uint32_t offset = 0;
+    uint32_t offset;
     bool success = true;
     size_t const buflen = tor->blockSize;
     void* buffer = tr_valloc(buflen);
@@ -257,10 +496,18 @@ static bool recalculateHash(tr_torrent* tor, tr_piece_index_t pieceIndex, uint8_
     TR_ASSERT(buffer != NULL);
     TR_ASSERT(buflen > 0);
 
-    sha = tr_sha1_init();
-    bytesLeft = tr_torPieceCountBytes(tor, pieceIndex);
+    /* whatever the cache hashed as it was written doesn't need to be read back */
+    if ((sha = tr_cacheTakePieceHash(tor->session->cache, tor, pieceIndex, &offset)) == NULL)
+    {
+        sha = tr_sha1_init();
+    }
+
+    bytesLeft = tr_torPieceCountBytes(tor, pieceIndex) - offset;
 
-    tr_ioPrefetch(tor, pieceIndex, offset, bytesLeft);
+    if (bytesLeft != 0)
+    {
+        tr_ioPrefetch(tor, pieceIndex, offset, bytesLeft);
+    }
 
     while (bytesLeft != 0)
     {
@@ -12,6 +12,9 @@
 #error only libtransmission should #include this header.
 #endif
 
+#include "file.h" /* tr_sys_file_t, tr_sys_file_iovec */
+
+struct tr_fd_pin;
 struct tr_torrent;
 
 /**
@@ -33,6 +36,53 @@ int tr_ioPrefetch(tr_torrent* tor, tr_piece_index_t pieceIndex, uint32_t begin,
  */
 int tr_ioWrite(struct tr_torrent* tor, tr_piece_index_t pieceIndex, uint32_t offset, uint32_t len, uint8_t const* writeme);
 
+/**
+ * Writes the buffers in `iov', in order, starting at the specified piece index and offset.
+ * Buffers that straddle a file boundary are split between the files.
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioWritev(struct tr_torrent* tor, tr_piece_index_t pieceIndex, uint32_t offset, tr_sys_file_iovec const* iov,
+    size_t iov_count);
+
+/**
+ * One file's share of a range of torrent data, as found by tr_ioOpenSpans().
+ */
+struct tr_io_span
+{
+    tr_sys_file_t fd;
+    struct tr_fd_pin* pin;
+    tr_file_index_t file_index;
+    uint64_t file_offset;
+    uint64_t length;
+};
+
+/**
+ * Finds the files that hold `len' bytes starting at the specified piece index
+ * and offset, opening them (and creating them, if `doWrite' is true) as needed.
+ * The fds are retained so that they stay valid outside of the libtransmission
+ * thread until tr_ioCloseSpans() is called. Zero-length files are skipped.
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioOpenSpans(struct tr_torrent* tor, bool doWrite, tr_piece_index_t pieceIndex, uint32_t offset, uint64_t len,
+    struct tr_io_span** setme_spans, size_t* setme_count);
+
+void tr_ioCloseSpans(tr_session* session, struct tr_io_span* spans, size_t span_count);
+
+/**
+ * Reads the spans' contents into `buf'. Only the spans' fds are used,
+ * so this is safe to call from any thread.
+ * @return 0 on success, or an errno value on failure, in which case
+ *         `setme_failed' is set to the index of the span that failed.
+ */
+int tr_ioReadSpans(struct tr_io_span const* spans, size_t span_count, uint8_t* buf, size_t* setme_failed);
+
+/**
+ * Writes the buffers in `iov', in order, across the spans.
+ * Like tr_ioReadSpans(), this is safe to call from any thread.
+ */
+int tr_ioWriteSpans(struct tr_io_span const* spans, size_t span_count, tr_sys_file_iovec const* iov, size_t iov_count,
+    size_t* setme_failed);
+
 /**
  * @brief Test to see if the piece matches its metainfo's SHA1 checksum.
  */
@@ -500,13 +500,18 @@ static void onVerifyDone(tr_torrent* tor UNUSED, bool aborted UNUSED, void* done
 }
 
 void libttest_blockingTorrentVerify(tr_torrent* tor)
+{
+    libttest_blockingTorrentVerifyPieces(tor, NULL);
+}
+
+void libttest_blockingTorrentVerifyPieces(tr_torrent* tor, tr_bitfield const* pieces)
 {
     TR_ASSERT(tor->session != NULL);
     TR_ASSERT(!tr_amInEventThread(tor->session));
 
     bool done = false;
 
-    tr_torrentVerify(tor, onVerifyDone, &done);
+    tr_torrentVerifyPieces(tor, pieces, onVerifyDone, &done);
 
     while (!done)
     {
@@ -174,6 +174,8 @@ int runTests(testFunc const* const tests, int numTests);
         return runTests(tests, 1); \
     }
 
+struct tr_bitfield;
+
 tr_session* libttest_session_init(struct tr_variant* settings);
 void libttest_session_close(tr_session* session);
 
@@ -182,6 +184,8 @@ tr_torrent* libttest_zero_torrent_init(tr_session* session);
 
 void libttest_blockingTorrentVerify(tr_torrent* tor);
 
+void libttest_blockingTorrentVerifyPieces(tr_torrent* tor, struct tr_bitfield const* pieces);
+
 void libtest_create_file_with_contents(char const* path, void const* contents, size_t n);
 void libtest_create_tmpfile_with_contents(char* tmpl, void const* payload, size_t n);
 void libtest_create_file_with_string_contents(char const* path, char const* str);
@@ -12,6 +12,7 @@
 #include "crypto-utils.h"
 #include "file.h"
 #include "makemeta.h"
+#include "utils.h"
 
 #include <stdlib.h> /* mktemp() */
 #include <string.h> /* strlen() */
@@ -276,12 +277,87 @@ static int test_single_directory_random_payload(void)
     return 0;
 }
 
+/* build a .torrent for `input_file' and check that its piece hashes match `payload' */
+static int test_threads_impl(char const* input_file, uint8_t const* payload, size_t payloadSize, uint32_t pieceSize,
+    uint32_t threadCount, bool directIO)
+{
+    char* torrent_file;
+    tr_metainfo_builder* builder;
+    tr_ctor* ctor;
+    tr_info inf;
+
+    builder = tr_metaInfoBuilderCreate(input_file);
+    check(tr_metaInfoBuilderSetPieceSize(builder, pieceSize));
+    tr_metaInfoBuilderSetThreadCount(builder, threadCount);
+    check_uint(builder->threadCount, ==, threadCount);
+    tr_metaInfoBuilderSetDirectIO(builder, directIO);
+
+    torrent_file = tr_strdup_printf("%s.%u%s.torrent", input_file, threadCount, directIO ? ".direct" : "");
+    tr_makeMetaInfo(builder, torrent_file, NULL, 0, NULL, false);
+
+    while (!builder->isDone)
+    {
+        tr_wait_msec(100);
+    }
+
+    check_int(builder->result, ==, TR_MAKEMETA_OK);
+    check_uint(builder->pieceIndex, ==, builder->pieceCount);
+
+    ctor = tr_ctorNew(NULL);
+    libttest_sync();
+    tr_ctorSetMetainfoFromFile(ctor, torrent_file);
+    check_int(tr_torrentParse(ctor, &inf), ==, TR_PARSE_OK);
+    check_uint(inf.pieceCount, ==, (payloadSize + pieceSize - 1) / pieceSize);
+
+    for (tr_piece_index_t i = 0; i < inf.pieceCount; ++i)
+    {
+        uint8_t hash[SHA_DIGEST_LENGTH];
+        size_t const offset = (size_t)i * pieceSize;
+
+        tr_sha1(hash, payload + offset, (int)MIN(payloadSize - offset, pieceSize), NULL);
+        check(memcmp(hash, inf.pieces[i].hash, SHA_DIGEST_LENGTH) == 0);
+    }
+
+    tr_free(torrent_file);
+    tr_ctorFree(ctor);
+    tr_metainfoFree(&inf);
+    tr_metaInfoBuilderFree(builder);
+    return 0;
+}
+
+static int test_threads(void)
+{
+    uint32_t const pieceSize = 16 * 1024;
+    size_t const payloadSize = pieceSize * 37 + 100;
+    uint8_t* payload = tr_new(uint8_t, payloadSize);
+    char* sandbox = libtest_sandbox_create();
+    char* input_file = tr_buildPath(sandbox, "test.XXXXXX", NULL);
+
+    tr_rand_buffer(payload, payloadSize);
+    libtest_create_tmpfile_with_contents(input_file, payload, payloadSize);
+
+    /* hashed by the reader, by one hasher, and by several at once */
+    check_int(test_threads_impl(input_file, payload, payloadSize, pieceSize, 0, false), ==, 0);
+    check_int(test_threads_impl(input_file, payload, payloadSize, pieceSize, 1, false), ==, 0);
+    check_int(test_threads_impl(input_file, payload, payloadSize, pieceSize, 8, false), ==, 0);
+
+    /* and read around the page cache */
+    check_int(test_threads_impl(input_file, payload, payloadSize, pieceSize, 8, true), ==, 0);
+
+    tr_free(input_file);
+    libtest_sandbox_destroy(sandbox);
+    tr_free(sandbox);
+    tr_free(payload);
+    return 0;
+}
+
 int main(void)
 {
     testFunc const tests[] =
     {
         test_single_file,
-        test_single_directory_random_payload
+        test_single_directory_random_payload,
+        test_threads
     };
 
     return runTests(tests, NUM_TESTS(tests));
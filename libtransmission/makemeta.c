@@ -20,11 +20,27 @@
 #include "session.h"
 #include "makemeta.h"
 #include "platform.h" /* threads, locks */
+#include "sha1-batch.h"
 #include "tr-assert.h"
 #include "utils.h" /* buildpath */
 #include "variant.h"
 #include "version.h"
 
+enum
+{
+    MAKEMETA_DEFAULT_THREADS = 4,
+    MAKEMETA_MAX_THREADS = 32,
+
+    /* the most memory that the piece buffers can take */
+    MAKEMETA_MAX_BUFFER_BYTES = 64 * 1024 * 1024,
+
+    /* with direct I/O, reads that don't line up in a piece buffer go through this */
+    MAKEMETA_BOUNCE_BYTES = 256 * 1024,
+
+    /* how long the reader and the hashers sleep when they're waiting on each other */
+    MAKEMETA_WAIT_MSEC = 1
+};
+
 /****
 *****
 ****/
@@ -187,6 +203,7 @@ tr_metainfo_builder* tr_metaInfoBuilderCreate(char const* topFileArg)
     qsort(ret->files, ret->fileCount, sizeof(tr_metainfo_builder_file), builderFileCompare);
 
     tr_metaInfoBuilderSetPieceSize(ret, bestPieceSize(ret->totalSize));
+    ret->threadCount = MAKEMETA_DEFAULT_THREADS;
 
     return ret;
 }
@@ -221,6 +238,16 @@ bool tr_metaInfoBuilderSetPieceSize(tr_metainfo_builder* b, uint32_t bytes)
     return true;
 }
 
+void tr_metaInfoBuilderSetThreadCount(tr_metainfo_builder* b, uint32_t count)
+{
+    b->threadCount = MIN(count, (uint32_t)MAKEMETA_MAX_THREADS);
+}
+
+void tr_metaInfoBuilderSetDirectIO(tr_metainfo_builder* b, bool enabled)
+{
+    b->useDirectIO = enabled;
+}
+
 void tr_metaInfoBuilderFree(tr_metainfo_builder* builder)
 {
     if (builder != NULL)
@@ -249,43 +276,249 @@ void tr_metaInfoBuilderFree(tr_metainfo_builder* builder)
 *****
 ****/
 
+/* Pieces are read in order by one thread, into a ring of piece-sized
+ * slots, and hashed by a pool of hasher threads, which write each hash
+ * straight into its place in the piece-hash array. */
+
+enum
+{
+    HASH_SLOT_EMPTY, /* the reader can fill it */
+    HASH_SLOT_READ, /* waiting for a hasher */
+    HASH_SLOT_HASHING
+};
+
+struct hash_slot
+{
+    int state;
+    uint32_t piece;
+    uint32_t length;
+    uint8_t* buf;
+};
+
+struct hash_run
+{
+    tr_metainfo_builder* b;
+    uint8_t* hashes;
+
+    /* everything below is protected by `lock' */
+    tr_lock* lock;
+
+    struct hash_slot* slots;
+    int slot_count;
+    int hasher_count;
+    bool is_reading_done;
+};
+
+static void hashSlots(struct hash_run* run, struct hash_slot** slots, int n)
+{
+    uint8_t hashes[TR_SHA1_BATCH_SIZE * SHA_DIGEST_LENGTH];
+    void const* data[TR_SHA1_BATCH_SIZE];
+    size_t lengths[TR_SHA1_BATCH_SIZE];
+
+    for (int i = 0; i < n; ++i)
+    {
+        data[i] = slots[i]->buf;
+        lengths[i] = slots[i]->length;
+    }
+
+    tr_sha1_batch(hashes, data, lengths, n);
+
+    for (int i = 0; i < n; ++i)
+    {
+        memcpy(run->hashes + (size_t)slots[i]->piece * SHA_DIGEST_LENGTH, hashes + i * SHA_DIGEST_LENGTH,
+            SHA_DIGEST_LENGTH);
+    }
+}
+
+static void hasherFunc(void* vrun)
+{
+    struct hash_run* run = vrun;
+
+    tr_lockLock(run->lock);
+
+    for (;;)
+    {
+        struct hash_slot* batch[TR_SHA1_BATCH_SIZE];
+        int ready = 0;
+        int n = 0;
+
+        for (int i = 0; i < run->slot_count; ++i)
+        {
+            if (run->slots[i].state == HASH_SLOT_READ)
+            {
+                ++ready;
+            }
+        }
+
+        if (ready == 0)
+        {
+            if (run->is_reading_done)
+            {
+                break;
+            }
+
+            tr_lockUnlock(run->lock);
+            tr_wait_msec(MAKEMETA_WAIT_MSEC);
+            tr_lockLock(run->lock);
+            continue;
+        }
+
+        /* leave some for the other hashers */
+        ready = MIN(MAX(ready / run->hasher_count, 1), TR_SHA1_BATCH_SIZE);
+
+        for (int i = 0; n < ready && i < run->slot_count; ++i)
+        {
+            if (run->slots[i].state == HASH_SLOT_READ)
+            {
+                batch[n] = &run->slots[i];
+                batch[n++]->state = HASH_SLOT_HASHING;
+            }
+        }
+
+        tr_lockUnlock(run->lock);
+
+        hashSlots(run, batch, n);
+
+        tr_lockLock(run->lock);
+
+        for (int i = 0; i < n; ++i)
+        {
+            batch[i]->state = HASH_SLOT_EMPTY;
+        }
+
+        run->b->pieceIndex += n;
+    }
+
+    --run->hasher_count;
+    tr_lockUnlock(run->lock);
+}
+
+/* wait for a slot that the reader can fill */
+static struct hash_slot* getEmptySlot(struct hash_run* run)
+{
+    struct hash_slot* slot = NULL;
+
+    tr_lockLock(run->lock);
+
+    while (slot == NULL)
+    {
+        for (int i = 0; slot == NULL && i < run->slot_count; ++i)
+        {
+            if (run->slots[i].state == HASH_SLOT_EMPTY)
+            {
+                slot = &run->slots[i];
+            }
+        }
+
+        if (slot == NULL)
+        {
+            tr_lockUnlock(run->lock);
+            tr_wait_msec(MAKEMETA_WAIT_MSEC);
+            tr_lockLock(run->lock);
+        }
+    }
+
+    tr_lockUnlock(run->lock);
+
+    return slot;
+}
+
+static int getSlotCount(tr_metainfo_builder const* b, int hasher_count)
+{
+    int const max_slots = MAX(1, MAKEMETA_MAX_BUFFER_BYTES / (int)MIN(b->pieceSize, (uint32_t)MAKEMETA_MAX_BUFFER_BYTES));
+
+    /* enough to keep every hasher busy with a batch while the reader fills the next one */
+    return MIN(hasher_count * (TR_SHA1_BATCH_SIZE + 1), MAX(max_slots, 2));
+}
+
+/* also opens the file for direct I/O if that's wanted and possible */
+static tr_sys_file_t openFile(tr_metainfo_builder const* b, uint32_t fileIndex, tr_sys_file_t* direct_fd,
+    tr_error** error)
+{
+    char const* filename = b->files[fileIndex].filename;
+    tr_sys_file_t const fd = tr_sys_file_open(filename, TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0, error);
+
+    *direct_fd = TR_BAD_SYS_FILE;
+
+    if (fd != TR_BAD_SYS_FILE && b->useDirectIO)
+    {
+        *direct_fd = tr_sys_file_open(filename, TR_SYS_FILE_READ | TR_SYS_FILE_DIRECT, 0, NULL);
+    }
+
+    return fd;
+}
+
+static void closeFile(tr_sys_file_t fd, tr_sys_file_t direct_fd)
+{
+    if (direct_fd != TR_BAD_SYS_FILE)
+    {
+        tr_sys_file_close(direct_fd, NULL);
+    }
+
+    if (fd != TR_BAD_SYS_FILE)
+    {
+        tr_sys_file_close(fd, NULL);
+    }
+}
+
 static uint8_t* getHashInfo(tr_metainfo_builder* b)
 {
     uint32_t fileIndex = 0;
     uint8_t* ret = tr_new0(uint8_t, SHA_DIGEST_LENGTH * b->pieceCount);
-    uint8_t* walk = ret;
-    uint8_t* buf;
     uint64_t totalRemain;
     uint64_t off = 0;
     tr_sys_file_t fd;
+    tr_sys_file_t direct_fd;
+    uint8_t* bounce;
     tr_error* error = NULL;
+    struct hash_run run;
+    uint32_t piece = 0;
 
     if (b->totalSize == 0)
     {
         return ret;
     }
 
-    buf = tr_valloc(b->pieceSize);
     b->pieceIndex = 0;
     totalRemain = b->totalSize;
-    fd = tr_sys_file_open(b->files[fileIndex].filename, TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0, &error);
+    fd = openFile(b, fileIndex, &direct_fd, &error);
 
     if (fd == TR_BAD_SYS_FILE)
     {
         b->my_errno = error->code;
         tr_strlcpy(b->errfile, b->files[fileIndex].filename, sizeof(b->errfile));
         b->result = TR_MAKEMETA_IO_READ;
-        tr_free(buf);
         tr_free(ret);
         tr_error_free(error);
         return NULL;
     }
 
+    memset(&run, 0, sizeof(run));
+    run.b = b;
+    run.hashes = ret;
+    run.lock = tr_lockNew();
+    run.hasher_count = (int)MIN(b->threadCount, (uint32_t)MAKEMETA_MAX_THREADS);
+    run.slot_count = run.hasher_count > 0 ? getSlotCount(b, run.hasher_count) : 1;
+    run.slots = tr_new0(struct hash_slot, run.slot_count);
+    bounce = b->useDirectIO ? tr_sys_file_alloc_direct_buffer(MAKEMETA_BOUNCE_BYTES) : NULL;
+
+    for (int i = 0; i < run.slot_count; ++i)
+    {
+        /* aligned, so that direct reads can go straight into it */
+        run.slots[i].buf = tr_sys_file_alloc_direct_buffer(b->pieceSize);
+    }
+
+    for (int i = 0; i < run.hasher_count; ++i)
+    {
+        tr_threadNew(hasherFunc, &run);
+    }
+
     while (totalRemain != 0)
     {
-        TR_ASSERT(b->pieceIndex < b->pieceCount);
+        TR_ASSERT(piece < b->pieceCount);
 
-        uint8_t* bufptr = buf;
+        struct hash_slot* slot = getEmptySlot(&run);
+        uint8_t* bufptr = slot->buf;
         uint32_t const thisPieceSize = (uint32_t)MIN(b->pieceSize, totalRemain);
         uint64_t leftInPiece = thisPieceSize;
 
@@ -293,7 +526,7 @@ static uint8_t* getHashInfo(tr_metainfo_builder* b)
         {
             uint64_t const n_this_pass = MIN(b->files[fileIndex].size - off, leftInPiece);
             uint64_t n_read = 0;
-            tr_sys_file_read(fd, bufptr, n_this_pass, &n_read, NULL);
+            tr_sys_file_read_at_direct(fd, direct_fd, bufptr, n_this_pass, off, bounce, MAKEMETA_BOUNCE_BYTES, &n_read, NULL);
             bufptr += n_read;
             off += n_read;
             leftInPiece -= n_read;
@@ -301,31 +534,48 @@ static uint8_t* getHashInfo(tr_metainfo_builder* b)
             if (off == b->files[fileIndex].size)
             {
                 off = 0;
-                tr_sys_file_close(fd, NULL);
+                closeFile(fd, direct_fd);
                 fd = TR_BAD_SYS_FILE;
+                direct_fd = TR_BAD_SYS_FILE;
 
                 if (++fileIndex < b->fileCount)
                 {
-                    fd = tr_sys_file_open(b->files[fileIndex].filename, TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0, &error);
+                    fd = openFile(b, fileIndex, &direct_fd, &error);
 
                     if (fd == TR_BAD_SYS_FILE)
                     {
                         b->my_errno = error->code;
                         tr_strlcpy(b->errfile, b->files[fileIndex].filename, sizeof(b->errfile));
                         b->result = TR_MAKEMETA_IO_READ;
-                        tr_free(buf);
-                        tr_free(ret);
                         tr_error_free(error);
-                        return NULL;
+                        break;
                     }
                 }
             }
         }
 
-        TR_ASSERT(bufptr - buf == (int)thisPieceSize);
+        if (b->result != TR_MAKEMETA_OK)
+        {
+            break;
+        }
+
+        TR_ASSERT(bufptr - slot->buf == (int)thisPieceSize);
         TR_ASSERT(leftInPiece == 0);
-        tr_sha1(walk, buf, (int)thisPieceSize, NULL);
-        walk += SHA_DIGEST_LENGTH;
+
+        slot->piece = piece;
+        slot->length = thisPieceSize;
+
+        if (run.hasher_count == 0)
+        {
+            tr_sha1(ret + (size_t)piece * SHA_DIGEST_LENGTH, slot->buf, (int)thisPieceSize, NULL);
+            ++b->pieceIndex;
+        }
+        else
+        {
+            tr_lockLock(run.lock);
+            slot->state = HASH_SLOT_READ;
+            tr_lockUnlock(run.lock);
+        }
 
         if (b->abortFlag)
         {
@@ -334,18 +584,42 @@ static uint8_t* getHashInfo(tr_metainfo_builder* b)
         }
 
         totalRemain -= thisPieceSize;
-        ++b->pieceIndex;
+        ++piece;
     }
 
-    TR_ASSERT(b->abortFlag || walk - ret == (int)(SHA_DIGEST_LENGTH * b->pieceCount));
-    TR_ASSERT(b->abortFlag || !totalRemain);
+    /* wait for the hashers to finish what's been read */
+    tr_lockLock(run.lock);
+    run.is_reading_done = true;
 
-    if (fd != TR_BAD_SYS_FILE)
+    while (run.hasher_count > 0)
     {
-        tr_sys_file_close(fd, NULL);
+        tr_lockUnlock(run.lock);
+        tr_wait_msec(MAKEMETA_WAIT_MSEC);
+        tr_lockLock(run.lock);
+    }
+
+    tr_lockUnlock(run.lock);
+
+    TR_ASSERT(b->result != TR_MAKEMETA_OK || b->pieceIndex == b->pieceCount);
+    TR_ASSERT(b->result != TR_MAKEMETA_OK || totalRemain == 0);
+
+    closeFile(fd, direct_fd);
+    tr_free(bounce);
+
+    for (int i = 0; i < run.slot_count; ++i)
+    {
+        tr_free(run.slots[i].buf);
+    }
+
+    tr_free(run.slots);
+    tr_lockFree(run.lock);
+
+    if (b->result == TR_MAKEMETA_IO_READ)
+    {
+        tr_free(ret);
+        ret = NULL;
     }
 
-    tr_free(buf);
     return ret;
 }
 
@@ -43,6 +43,8 @@ typedef struct tr_metainfo_builder
     uint32_t fileCount;
     uint32_t pieceSize;
     uint32_t pieceCount;
+    uint32_t threadCount;
+    bool useDirectIO;
     bool isFolder;
 
     /**
@@ -95,6 +97,20 @@ tr_metainfo_builder* tr_metaInfoBuilderCreate(char const* topFile);
  */
 bool tr_metaInfoBuilderSetPieceSize(tr_metainfo_builder* builder, uint32_t bytes);
 
+/**
+ * Call this before tr_makeMetaInfo() to override how many threads hash
+ * the pieces while another one reads them. Zero means the pieces are
+ * hashed by the thread that reads them.
+ */
+void tr_metaInfoBuilderSetThreadCount(tr_metainfo_builder* builder, uint32_t count);
+
+/**
+ * Call this before tr_makeMetaInfo() to read the files around the page
+ * cache, where the filesystem allows it, so that hashing a lot of data
+ * doesn't push everything else out of the cache.
+ */
+void tr_metaInfoBuilderSetDirectIO(tr_metainfo_builder* builder, bool enabled);
+
 void tr_metaInfoBuilderFree(tr_metainfo_builder*);
 
 /**
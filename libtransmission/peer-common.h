@@ -107,6 +107,10 @@ typedef struct tr_peer
     /* how many requests we've made and are currently awaiting a response for */
     int pendingReqsToPeer;
 
+    /* the requests that make up pendingReqsToPeer.
+       NOTE: private to peer-mgr.c */
+    struct block_request* requests;
+
     /* Hook to private peer-mgr information */
     struct peer_atom* atom;
 
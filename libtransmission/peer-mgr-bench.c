@@ -0,0 +1,445 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+/* Measures how fast the peer manager picks blocks to request from a peer,
+ * and how long a small simulated swarm takes to send us the first piece.
+ * It prints one JSON object per line, like transmission-bench-crypto:
+ *
+ * {"name":"blocks-fresh","blocks":1048576,"numwant":64,"iterations":52161,"msec":500,...}
+ * {"name":"ttfb-sequential","blocks":1048576,"peers":8,"ttfb_msec":2100,...}
+ */
+
+#include <stdio.h> /* printf() */
+#include <stdlib.h> /* strtoul(), EXIT_FAILURE */
+#include <string.h> /* strcmp() */
+
+#include "transmission.h"
+#include "completion.h"
+#include "crypto-utils.h" /* SHA_DIGEST_LENGTH */
+#include "libtransmission-test.h"
+#include "peer-common.h" /* tr_peer, struct tr_peer_virtual_funcs */
+#include "peer-mgr.h"
+#include "session.h"
+#include "torrent.h"
+#include "tr-getopt.h"
+#include "utils.h"
+#include "variant.h"
+#include "version.h"
+
+#define MY_NAME "transmission-bench-peer-mgr"
+
+#define PIECE_SIZE (4 * 1024 * 1024)
+
+/* by default, a 16 GiB torrent, which is 1M blocks of 16 KiB */
+static uint32_t piece_count = 4096;
+static uint64_t duration_msec = 500;
+static char const* only_name = NULL;
+static bool showVersion = false;
+
+static tr_option options[] =
+{
+    { 'd', "duration", "Run each measurement for this many milliseconds", "d", true, "<msec>" },
+    { 'n', "name", "Only run the measurements with this name, e.g. \"blocks-fresh\"", "n", true, "<name>" },
+    { 'p', "pieces", "Use a torrent with this many 4 MiB pieces", "p", true, "<count>" },
+    { 'V', "version", "Show version number and exit", "V", false, NULL },
+    { 0, NULL, NULL, NULL, false, NULL }
+};
+
+static char const* getUsage(void)
+{
+    return "Usage: " MY_NAME " [options]";
+}
+
+static int parseCommandLine(int argc, char const* const* argv)
+{
+    int c;
+    char const* optarg;
+
+    while ((c = tr_getopt(getUsage(), argc, argv, options, &optarg)) != TR_OPT_DONE)
+    {
+        switch (c)
+        {
+        case 'd':
+            duration_msec = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'n':
+            only_name = optarg;
+            break;
+
+        case 'p':
+            piece_count = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'V':
+            showVersion = true;
+            break;
+
+        default:
+            fprintf(stderr, "Invalid option\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/***
+****
+***/
+
+static tr_torrent* makeTorrent(tr_session* session)
+{
+    int err = 0;
+    size_t benc_len;
+    char* benc;
+    uint8_t* hashes;
+    tr_variant top;
+    tr_variant* info;
+    tr_ctor* ctor;
+    tr_torrent* tor;
+
+    /* the hashes don't matter, since nothing's ever downloaded */
+    hashes = tr_new0(uint8_t, piece_count * SHA_DIGEST_LENGTH);
+
+    tr_variantInitDict(&top, 1);
+    info = tr_variantDictAddDict(&top, TR_KEY_info, 4);
+    tr_variantDictAddInt(info, TR_KEY_length, (int64_t)PIECE_SIZE * piece_count);
+    tr_variantDictAddStr(info, TR_KEY_name, MY_NAME);
+    tr_variantDictAddInt(info, TR_KEY_piece_length, PIECE_SIZE);
+    tr_variantDictAddRaw(info, TR_KEY_pieces, hashes, piece_count * SHA_DIGEST_LENGTH);
+    benc = tr_variantToStr(&top, TR_VARIANT_FMT_BENC, &benc_len);
+
+    ctor = tr_ctorNew(session);
+    tr_ctorSetMetainfo(ctor, (uint8_t const*)benc, benc_len);
+    tr_ctorSetPaused(ctor, TR_FORCE, true);
+    tor = tr_torrentNew(ctor, &err, NULL);
+
+    tr_ctorFree(ctor);
+    tr_free(benc);
+    tr_variantFree(&top);
+    tr_free(hashes);
+
+    return tor;
+}
+
+/* a peer that has everything, and no requests yet */
+static void resetPeer(tr_torrent* tor, tr_peer* peer, bool constructed)
+{
+    if (constructed)
+    {
+        tr_peerDestruct(peer);
+    }
+
+    tr_peerConstruct(peer, tor);
+    tr_bitfieldSetHasAll(&peer->have);
+}
+
+/* asks for `numwant' blocks over and over until the duration's up, then prints what it did.
+   When the peer's been asked for everything it can be, its requests are dropped to start
+   over. That can take a while, so it's left out of the time */
+static void measure(char const* name, tr_torrent* tor, tr_peer* peer, int numwant, bool get_intervals)
+{
+    uint64_t start;
+    uint64_t iterations = 0;
+    uint64_t picked = 0;
+    uint64_t msec;
+    double seconds;
+    tr_block_index_t* blocks;
+
+    if (only_name != NULL && strcmp(only_name, name) != 0)
+    {
+        return;
+    }
+
+    blocks = tr_new(tr_block_index_t, numwant * 2);
+    resetPeer(tor, peer, true);
+    start = tr_time_msec();
+
+    do
+    {
+        int got;
+
+        tr_peerMgrGetNextRequests(tor, peer, numwant, blocks, &got, get_intervals);
+
+        if (got < numwant)
+        {
+            uint64_t const reset_start = tr_time_msec();
+            resetPeer(tor, peer, true);
+            start += tr_time_msec() - reset_start;
+        }
+
+        if (!get_intervals)
+        {
+            picked += got;
+        }
+        else
+        {
+            for (int i = 0; i < got; ++i)
+            {
+                picked += blocks[2 * i + 1] - blocks[2 * i] + 1;
+            }
+        }
+
+        ++iterations;
+        msec = tr_time_msec() - start;
+    }
+    while (msec < duration_msec);
+
+    seconds = MAX(msec, 1U) / 1000.0;
+
+    printf("{\"name\":\"%s\",\"blocks\":%" PRIu32 ",\"numwant\":%d,\"iterations\":%" PRIu64 ",\"msec\":%" PRIu64 ","
+        "\"picks_per_sec\":%.1f,\"blocks_per_sec\":%.0f}\n", name, tor->blockCount, numwant, iterations, msec,
+        iterations / seconds, picked / seconds);
+    fflush(stdout);
+
+    tr_free(blocks);
+}
+
+/***
+****  A tiny swarm simulator
+***/
+
+enum
+{
+    /* how often the simulated peers send us blocks */
+    SIM_STEP_MSEC = 100,
+    /* like peer-msgs, ask each peer for about this many seconds' worth of blocks */
+    SIM_REQUEST_SECS = 10,
+    SIM_MIN_REQUESTS = 4,
+    SIM_MAX_REQUESTS = 250,
+    /* half of them are slow, and half are fast */
+    SIM_PEER_COUNT = 8,
+    SIM_SLOW_BPS = 100 * 1024,
+    SIM_FAST_BPS = 1024 * 1024
+};
+
+struct sim_peer
+{
+    tr_peer peer; /* first, so that the tr_peer is the sim_peer */
+    unsigned int Bps;
+
+    /* the blocks it's been asked for and hasn't sent yet, in order */
+    tr_block_index_t blocks[SIM_MAX_REQUESTS];
+    int blockCount;
+    uint64_t credit;
+};
+
+static bool simIsTransferringPieces(tr_peer const* peer, uint64_t now UNUSED, tr_direction direction, unsigned int* Bps)
+{
+    unsigned int const rate = direction == TR_PEER_TO_CLIENT ? ((struct sim_peer const*)peer)->Bps : 0;
+
+    if (Bps != NULL)
+    {
+        *Bps = rate;
+    }
+
+    return rate > 0;
+}
+
+static struct tr_peer_virtual_funcs const sim_peer_funcs =
+{
+    .destruct = NULL,
+    .is_transferring_pieces = simIsTransferringPieces
+};
+
+/* like peer-msgs' pulse, keep the peer's pipeline full. Returns how many blocks were asked for */
+static int simTopUpPeer(tr_torrent* tor, struct sim_peer* p)
+{
+    int const desired = MAX(SIM_MIN_REQUESTS, MIN(SIM_MAX_REQUESTS, (int)(p->Bps * SIM_REQUEST_SECS / tor->blockSize)));
+    int got = 0;
+
+    if (p->blockCount < desired)
+    {
+        tr_peerMgrGetNextRequests(tor, &p->peer, desired - p->blockCount, p->blocks + p->blockCount, &got, false);
+        p->blockCount += got;
+    }
+
+    return got;
+}
+
+/* send as many of the peer's blocks as its rate allows in one step */
+static void simSendBlocks(tr_torrent* tor, struct sim_peer* p, uint64_t* cancelled)
+{
+    int sent = 0;
+
+    p->credit += (uint64_t)p->Bps * SIM_STEP_MSEC / 1000;
+
+    while (sent < p->blockCount)
+    {
+        tr_block_index_t const b = p->blocks[sent];
+        tr_piece_index_t const piece = tr_torBlockPiece(tor, b);
+
+        /* another peer sent it first, so it would have been cancelled */
+        if (tr_torrentBlockIsComplete(tor, b))
+        {
+            ++*cancelled;
+            ++sent;
+            continue;
+        }
+
+        if (p->credit < tr_torBlockCountBytes(tor, b))
+        {
+            break;
+        }
+
+        p->credit -= tr_torBlockCountBytes(tor, b);
+        ++sent;
+        tr_cpBlockAdd(&tor->completion, b);
+
+        if (tr_torrentPieceIsComplete(tor, piece))
+        {
+            tr_peerMgrPieceCompleted(tor, piece);
+        }
+    }
+
+    if (p->blockCount == sent)
+    {
+        p->credit = 0;
+    }
+
+    p->blockCount -= sent;
+    memmove(p->blocks, p->blocks + sent, p->blockCount * sizeof(tr_block_index_t));
+}
+
+/* Starting from nothing, downloads from the simulated peers until the first
+   piece is done, which is when a player could start. The slow peers ask
+   first, so they're the ones who'd get the first piece if nothing stopped
+   them. The time's simulated, and so is tr_time() while this runs */
+static void simulate(char const* name, tr_torrent* tor, bool sequential)
+{
+    struct sim_peer* peers;
+    time_t const start = tr_time();
+    uint64_t msec = 0;
+    uint64_t requested = 0;
+    uint64_t cancelled = 0;
+    bool busy = true;
+
+    if (only_name != NULL && strcmp(only_name, name) != 0)
+    {
+        return;
+    }
+
+    for (tr_piece_index_t i = 0; i < tor->info.pieceCount; ++i)
+    {
+        tr_cpPieceRem(&tor->completion, i);
+    }
+
+    tr_torrentSetSequentialDownload(tor, sequential);
+    tr_peerMgrRebuildRequests(tor);
+
+    peers = tr_new0(struct sim_peer, SIM_PEER_COUNT);
+
+    for (int i = 0; i < SIM_PEER_COUNT; ++i)
+    {
+        peers[i].Bps = i < SIM_PEER_COUNT / 2 ? SIM_SLOW_BPS : SIM_FAST_BPS;
+        resetPeer(tor, &peers[i].peer, false);
+        peers[i].peer.funcs = &sim_peer_funcs;
+    }
+
+    while (busy && !tr_torrentPieceIsComplete(tor, 0))
+    {
+        busy = false;
+        tr_timeUpdate(start + msec / 1000);
+
+        for (int i = 0; i < SIM_PEER_COUNT; ++i)
+        {
+            requested += simTopUpPeer(tor, &peers[i]);
+        }
+
+        for (int i = 0; i < SIM_PEER_COUNT; ++i)
+        {
+            simSendBlocks(tor, &peers[i], &cancelled);
+            busy = busy || peers[i].blockCount > 0;
+        }
+
+        msec += SIM_STEP_MSEC;
+    }
+
+    printf("{\"name\":\"%s\",\"blocks\":%" PRIu32 ",\"peers\":%d,\"ttfb_msec\":%" PRId64 ",\"requested\":%" PRIu64 ","
+        "\"cancelled\":%" PRIu64 "}\n", name, tor->blockCount, SIM_PEER_COUNT,
+        tr_torrentPieceIsComplete(tor, 0) ? (int64_t)msec : -1, requested, cancelled);
+    fflush(stdout);
+
+    for (int i = 0; i < SIM_PEER_COUNT; ++i)
+    {
+        tr_peerDestruct(&peers[i].peer);
+    }
+
+    tr_free(peers);
+    tr_timeUpdate(time(NULL));
+}
+
+/***
+****
+***/
+
+int tr_main(int argc, char* argv[])
+{
+    tr_session* session;
+    tr_torrent* tor;
+    tr_peer peer;
+
+    if (parseCommandLine(argc, (char const* const*)argv) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (showVersion)
+    {
+        fprintf(stderr, MY_NAME " " LONG_VERSION_STRING "\n");
+        return EXIT_SUCCESS;
+    }
+
+    session = libttest_session_init(NULL);
+    tor = makeTorrent(session);
+
+    if (tor == NULL)
+    {
+        fprintf(stderr, "couldn't create the torrent\n");
+        libttest_session_close(session);
+        return EXIT_FAILURE;
+    }
+
+    /* keep the session's own timers away from the swarm while we use it */
+    tr_sessionLock(session);
+
+    resetPeer(tor, &peer, false);
+
+    /* a batch of requests for a peer, and a few ranges for the webseeds */
+    measure("blocks-fresh", tor, &peer, 64, false);
+    measure("intervals-fresh", tor, &peer, 4, true);
+
+    /* most of every piece is done, so most of the blocks get skipped */
+    for (tr_block_index_t b = 0; b < tor->blockCount; ++b)
+    {
+        if (b % tor->blockCountInPiece < tor->blockCountInPiece * 15 / 16)
+        {
+            tr_cpBlockAdd(&tor->completion, b);
+        }
+    }
+
+    tr_peerMgrRebuildRequests(tor);
+
+    measure("blocks-mostly-done", tor, &peer, 64, false);
+    measure("intervals-mostly-done", tor, &peer, 4, true);
+
+    /* drop its requests so that the simulated peers have the swarm to themselves */
+    tr_peerDestruct(&peer);
+
+    /* how long it takes to get the start of the torrent, with and without sequential mode */
+    simulate("ttfb-rarest-first", tor, false);
+    simulate("ttfb-sequential", tor, true);
+
+    tr_sessionUnlock(session);
+
+    tr_torrentRemove(tor, false, NULL);
+    libttest_session_close(session);
+
+    return EXIT_SUCCESS;
+}
@@ -18,6 +18,7 @@
 #include "transmission.h"
 #include "announcer.h"
 #include "bandwidth.h"
+#include "bitfield.h"
 #include "blocklist.h"
 #include "cache.h"
 #include "clients.h"
@@ -80,7 +81,15 @@ enum
     /* */
     NO_BLOCKS_CANCEL_HISTORY = 120,
     /* */
-    CANCEL_HISTORY_SEC = 60
+    CANCEL_HISTORY_SEC = 60,
+    /* in sequential mode, the pieces this far past a playhead get deadlines... */
+    STREAMING_WINDOW_BYTES = (16 * 1024 * 1024),
+    /* ...and the ones this close are due soon, so only fast peers get them */
+    STREAMING_DUE_BYTES = (4 * 1024 * 1024),
+    /* how long a block that's due soon can wait on one peer before we ask another too */
+    STREAMING_STUCK_SECS = 5,
+    /* a fast peer gets no more of the blocks that are due soon than it can send in this long */
+    STREAMING_DUE_SECS = 2
 };
 
 tr_peer_event const TR_PEER_EVENT_INIT =
@@ -164,6 +173,17 @@ struct block_request
     tr_block_index_t block;
     tr_peer* peer;
     time_t sentAt;
+
+    /* the swarm's other requests for the same block */
+    struct block_request* nextForBlock;
+
+    /* the same peer's requests */
+    struct block_request* prevForPeer;
+    struct block_request* nextForPeer;
+
+    /* all of the swarm's requests */
+    struct block_request* prev;
+    struct block_request* next;
 };
 
 struct weighted_piece
@@ -171,13 +191,33 @@ struct weighted_piece
     tr_piece_index_t index;
     int16_t salt;
     int16_t requestCount;
+
+    /* the bucket it's queued in, or NULL if we don't want it */
+    struct piece_bucket* bucket;
+    struct weighted_piece* prev;
+    struct weighted_piece* next;
+
+    /* used by tr_peerMgrGetNextRequests() to remember which pieces it changed */
+    struct weighted_piece* nextTouched;
+
+    /* how many pieces past a playhead this is, or -1 if it has no deadline.
+       The lower it is, the sooner it's due */
+    int deadline;
 };
 
-enum piece_sort_state
+enum
+{
+    /* how many random tie-breakers there are for pieces that are otherwise equal */
+    PIECE_SALT_COUNT = 64
+};
+
+/* the queued pieces that have the same key, listed by salt */
+struct piece_bucket
 {
-    PIECES_UNSORTED,
-    PIECES_SORTED_BY_INDEX,
-    PIECES_SORTED_BY_WEIGHT
+    uint64_t key;
+    int pieceCount;
+    struct weighted_piece* pieces[PIECE_SALT_COUNT];
+    struct piece_bucket* nextFree;
 };
 
 /** @brief Opaque, per-torrent data structure for peer connection information */
@@ -199,13 +239,45 @@ typedef struct tr_swarm
     bool isRunning;
     bool needsCompletenessCheck;
 
-    struct block_request* requests;
+    /* An open-addressing hash table of the blocks we've requested.
+       Each slot is NULL or the first of one block's requests */
+    struct block_request** requestTable;
+    int requestTableBits;
+    int requestTableUsed;
+
+    struct block_request* requests; /* all of them, newest first */
+    struct block_request* freeRequests; /* recycled, linked by `next' */
     int requestCount;
-    int requestAlloc;
 
+    /* the blocks that have at least one request, so that the picker
+       can skip over them a word at a time */
+    tr_bitfield requestedBlocks;
+
+    /* Every piece, by index, or NULL if we haven't needed them yet.
+       The ones we want are queued in pieceBuckets, which is sorted by key,
+       so walking it gives them in the order we want to request them */
     struct weighted_piece* pieces;
-    int pieceCount;
-    enum piece_sort_state pieceSortState;
+    int pieceCount; /* how many are queued */
+    struct piece_bucket** pieceBuckets; /* the ones that aren't empty */
+    int pieceBucketCount;
+    int pieceBucketAlloc;
+    struct piece_bucket* freePieceBuckets; /* recycled, linked by `nextFree' */
+
+    /* set when the keys can't be trusted, e.g. because
+       pieceReplication's gone, so that the queue is rebuilt */
+    bool pieceQueueIsStale;
+
+    /* The queued pieces that have deadlines, soonest first.
+       See streamingRebuild() */
+    struct weighted_piece** streamingPieces;
+    int streamingPieceCount;
+    int streamingPieceAlloc;
+    bool streamingIsStale;
+
+    /* peers who send us blocks at least this fast get the pieces that are
+       due soon. It's updated once a second, at streamingFastBpsAt */
+    unsigned int streamingFastBps;
+    time_t streamingFastBpsAt;
 
     /* An array of pieceCount items stating how many peers have each piece.
        This is used to help us for downloading pieces "rarest first."
@@ -436,24 +508,17 @@ static void replicationNew(tr_swarm* s)
     s->pieceReplicationSize = piece_count;
     s->pieceReplication = tr_new0(uint16_t, piece_count);
 
-    for (tr_piece_index_t piece_i = 0; piece_i < piece_count; ++piece_i)
+    for (int peer_i = 0; peer_i < n; ++peer_i)
     {
-        uint16_t r = 0;
+        tr_peer const* peer = tr_ptrArrayNth(&s->peers, peer_i);
 
-        for (int peer_i = 0; peer_i < n; ++peer_i)
-        {
-            tr_peer* peer = tr_ptrArrayNth(&s->peers, peer_i);
-
-            if (tr_bitfieldHas(&peer->have, piece_i))
-            {
-                ++r;
-            }
-        }
-
-        s->pieceReplication[piece_i] = r;
+        tr_bitfieldAddToCounts(&peer->have, s->pieceReplication, piece_count, 1);
     }
 }
 
+static void requestListFree(tr_swarm*);
+static void pieceQueueFree(tr_swarm*);
+
 static void swarmFree(void* vs)
 {
     tr_swarm* s = vs;
@@ -472,8 +537,8 @@ static void swarmFree(void* vs)
 
     replicationFree(s);
 
-    tr_free(s->requests);
-    tr_free(s->pieces);
+    requestListFree(s);
+    pieceQueueFree(s);
     tr_free(s);
 }
 
@@ -507,6 +572,7 @@ static tr_swarm* swarmNew(tr_peerMgr* manager, tr_torrent* tor)
     s->peers = TR_PTR_ARRAY_INIT;
     s->webseeds = TR_PTR_ARRAY_INIT;
     s->outgoingHandshakes = TR_PTR_ARRAY_INIT;
+    s->requestedBlocks = TR_BITFIELD_INIT;
 
     rebuildWebseedArray(s, tor);
 
@@ -669,79 +735,187 @@ void tr_peerMgrSetUtpFailed(tr_torrent* tor, tr_address const* addr, bool failed
 ***
 *** There are two data structures associated with managing block requests:
 ***
-*** 1. tr_swarm::requests, an array of "struct block_request" which keeps
+*** 1. tr_swarm::requests, a list of "struct block_request" which keeps
 ***    track of which blocks have been requested, and when, and by which peers.
 ***    This is list is used for (a) cancelling requests that have been pending
 ***    for too long and (b) avoiding duplicate requests before endgame.
+***    The requests are also hashed by block in tr_swarm::requestTable, and
+***    each peer's are linked from tr_peer::requests, so that finding them
+***    doesn't mean walking the whole list.
 ***
-*** 2. tr_swarm::pieces, an array of "struct weighted_piece" which lists the
-***    pieces that we want to request. It's used to decide which blocks to
-***    return next when tr_peerMgrGetBlockRequests() is called.
+*** 2. tr_swarm::pieces, an array of "struct weighted_piece" for each piece.
+***    The ones that we want to request are kept in order in a queue of
+***    buckets, tr_swarm::pieceBuckets. It's used to decide which blocks
+***    to return next when tr_peerMgrGetBlockRequests() is called.
 **/
 
 /**
 *** struct block_request
 **/
 
-static int compareReqByBlock(void const* va, void const* vb)
+enum
+{
+    /* the request table's smallest size, as a power of two */
+    REQUEST_TABLE_MIN_BITS = 6
+};
+
+static size_t requestTableHome(tr_swarm const* s, tr_block_index_t block)
+{
+    /* Fibonacci hashing, which spreads out runs of consecutive blocks */
+    return (uint32_t)(block * 2654435769U) >> (32 - s->requestTableBits);
+}
+
+/* the slot holding the requests for `block', or the empty slot where they'd go */
+static size_t requestTableFind(tr_swarm const* s, tr_block_index_t block)
 {
-    struct block_request const* a = va;
-    struct block_request const* b = vb;
+    size_t const mask = ((size_t)1 << s->requestTableBits) - 1;
+    size_t i = requestTableHome(s, block);
 
-    /* primary key: block */
-    if (a->block < b->block)
+    while (s->requestTable[i] != NULL && s->requestTable[i]->block != block)
     {
-        return -1;
+        i = (i + 1) & mask;
     }
 
-    if (a->block > b->block)
+    return i;
+}
+
+/* keep the table at most half full, so that probes stay short */
+static void requestTableReserve(tr_swarm* s, int used)
+{
+    struct block_request** old_table = s->requestTable;
+    size_t const old_size = old_table != NULL ? (size_t)1 << s->requestTableBits : 0;
+
+    if (old_table != NULL && (size_t)used * 2 <= old_size)
     {
-        return 1;
+        return;
     }
 
-    /* secondary key: peer */
-    if (a->peer < b->peer)
+    s->requestTableBits = MAX(s->requestTableBits + 1, REQUEST_TABLE_MIN_BITS);
+    s->requestTable = tr_new0(struct block_request*, (size_t)1 << s->requestTableBits);
+
+    for (size_t i = 0; i < old_size; ++i)
     {
-        return -1;
+        if (old_table[i] != NULL)
+        {
+            s->requestTable[requestTableFind(s, old_table[i]->block)] = old_table[i];
+        }
+    }
+
+    tr_free(old_table);
+}
+
+/* empty slot `i', moving later entries back so that none of them
+   is cut off from its home slot */
+static void requestTableErase(tr_swarm* s, size_t i)
+{
+    size_t const mask = ((size_t)1 << s->requestTableBits) - 1;
+    size_t j = i;
+
+    s->requestTable[i] = NULL;
+    --s->requestTableUsed;
+
+    for (;;)
+    {
+        size_t home;
+
+        j = (j + 1) & mask;
+
+        if (s->requestTable[j] == NULL)
+        {
+            break;
+        }
+
+        home = requestTableHome(s, s->requestTable[j]->block);
+
+        /* leave it if its home is cyclically in (i, j] */
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+        {
+            continue;
+        }
+
+        s->requestTable[i] = s->requestTable[j];
+        s->requestTable[j] = NULL;
+        i = j;
     }
+}
 
-    if (a->peer > b->peer)
+static struct block_request* requestListLookup(tr_swarm* s, tr_block_index_t block, tr_peer const* peer)
+{
+    if (s->requestTable != NULL)
     {
-        return 1;
+        for (struct block_request* r = s->requestTable[requestTableFind(s, block)]; r != NULL; r = r->nextForBlock)
+        {
+            if (r->peer == peer)
+            {
+                return r;
+            }
+        }
     }
 
-    return 0;
+    return NULL;
 }
 
 static void requestListAdd(tr_swarm* s, tr_block_index_t block, tr_peer* peer)
 {
-    struct block_request key;
+    struct block_request* req;
+    size_t slot;
+
+    TR_ASSERT(requestListLookup(s, block, peer) == NULL);
+
+    /* reuse an old record if there is one */
+    if ((req = s->freeRequests) != NULL)
+    {
+        s->freeRequests = req->next;
+    }
+    else
+    {
+        req = tr_new(struct block_request, 1);
+    }
 
-    /* ensure enough room is available... */
-    if (s->requestCount + 1 >= s->requestAlloc)
+    req->block = block;
+    req->peer = peer;
+    req->sentAt = tr_time();
+
+    /* add it to its block's requests... */
+    requestTableReserve(s, s->requestTableUsed + 1);
+    slot = requestTableFind(s, block);
+
+    if (s->requestTable[slot] == NULL)
     {
-        int const CHUNK_SIZE = 128;
-        s->requestAlloc += CHUNK_SIZE;
-        s->requests = tr_renew(struct block_request, s->requests, s->requestAlloc);
+        ++s->requestTableUsed;
+        tr_bitfieldAdd(&s->requestedBlocks, block);
     }
 
-    /* populate the record we're inserting */
-    key.block = block;
-    key.peer = peer;
-    key.sentAt = tr_time();
+    req->nextForBlock = s->requestTable[slot];
+    s->requestTable[slot] = req;
+
+    /* ...to the swarm's... */
+    req->prev = NULL;
+    req->next = s->requests;
 
-    /* insert the request to our array... */
+    if (s->requests != NULL)
     {
-        bool exact;
-        int const pos = tr_lowerBound(&key, s->requests, s->requestCount, sizeof(struct block_request), compareReqByBlock,
-            &exact);
-        TR_ASSERT(!exact);
-        memmove(s->requests + pos + 1, s->requests + pos, sizeof(struct block_request) * (s->requestCount++ - pos));
-        s->requests[pos] = key;
+        s->requests->prev = req;
     }
 
+    s->requests = req;
+    ++s->requestCount;
+
+    /* ...and to the peer's */
+    req->prevForPeer = NULL;
+    req->nextForPeer = NULL;
+
     if (peer != NULL)
     {
+        req->nextForPeer = peer->requests;
+
+        if (peer->requests != NULL)
+        {
+            peer->requests->prevForPeer = req;
+        }
+
+        peer->requests = req;
+
         ++peer->pendingReqsToPeer;
         TR_ASSERT(peer->pendingReqsToPeer >= 0);
     }
@@ -750,72 +924,113 @@ static void requestListAdd(tr_swarm* s, tr_block_index_t block, tr_peer* peer)
     //     tr_atomAddrStr(peer->atom), s->requestCount);
 }
 
-static struct block_request* requestListLookup(tr_swarm* s, tr_block_index_t block, tr_peer const* peer)
+/* the newest of the requests for `block', linked by `nextForBlock', or NULL if there are none */
+static struct block_request const* getBlockRequests(tr_swarm const* s, tr_block_index_t block)
 {
-    struct block_request key;
-    key.block = block;
-    key.peer = (tr_peer*)peer;
+    return s->requestTable != NULL ? s->requestTable[requestTableFind(s, block)] : NULL;
+}
 
-    return bsearch(&key, s->requests, s->requestCount, sizeof(struct block_request), compareReqByBlock);
+static void decrementPendingReqCount(struct block_request const* b)
+{
+    if (b->peer != NULL)
+    {
+        if (b->peer->pendingReqsToPeer > 0)
+        {
+            --b->peer->pendingReqsToPeer;
+        }
+    }
 }
 
-/**
- * Find the peers are we currently requesting the block
- * with index @a block from and append them to @a peerArr.
- */
-static void getBlockRequestPeers(tr_swarm* s, tr_block_index_t block, tr_ptrArray* peerArr)
+/* unlink `req' from all of the lists and recycle it */
+static void requestListRemoveRequest(tr_swarm* s, struct block_request* req)
 {
-    bool exact;
-    int pos;
-    struct block_request key;
+    size_t const slot = requestTableFind(s, req->block);
+    struct block_request** walk = &s->requestTable[slot];
 
-    key.block = block;
-    key.peer = NULL;
-    pos = tr_lowerBound(&key, s->requests, s->requestCount, sizeof(struct block_request), compareReqByBlock, &exact);
+    while (*walk != req)
+    {
+        TR_ASSERT(*walk != NULL);
+        walk = &(*walk)->nextForBlock;
+    }
 
-    TR_ASSERT(!exact); /* shouldn't have a request with .peer == NULL */
+    *walk = req->nextForBlock;
 
-    for (int i = pos; i < s->requestCount; ++i)
+    if (s->requestTable[slot] == NULL)
     {
-        if (s->requests[i].block != block)
-        {
-            break;
-        }
+        requestTableErase(s, slot);
+        tr_bitfieldRem(&s->requestedBlocks, req->block);
+    }
 
-        tr_ptrArrayAppend(peerArr, s->requests[i].peer);
+    if (req->prev != NULL)
+    {
+        req->prev->next = req->next;
+    }
+    else
+    {
+        s->requests = req->next;
     }
-}
 
-static void decrementPendingReqCount(struct block_request const* b)
-{
-    if (b->peer != NULL)
+    if (req->next != NULL)
     {
-        if (b->peer->pendingReqsToPeer > 0)
+        req->next->prev = req->prev;
+    }
+
+    --s->requestCount;
+
+    if (req->peer != NULL)
+    {
+        if (req->prevForPeer != NULL)
         {
-            --b->peer->pendingReqsToPeer;
+            req->prevForPeer->nextForPeer = req->nextForPeer;
+        }
+        else
+        {
+            req->peer->requests = req->nextForPeer;
         }
+
+        if (req->nextForPeer != NULL)
+        {
+            req->nextForPeer->prevForPeer = req->prevForPeer;
+        }
+
+        decrementPendingReqCount(req);
     }
+
+    req->next = s->freeRequests;
+    s->freeRequests = req;
 }
 
 static void requestListRemove(tr_swarm* s, tr_block_index_t block, tr_peer const* peer)
 {
-    struct block_request const* b = requestListLookup(s, block, peer);
+    struct block_request* b = requestListLookup(s, block, peer);
 
     if (b != NULL)
     {
-        int const pos = b - s->requests;
-        TR_ASSERT(pos < s->requestCount);
-
-        decrementPendingReqCount(b);
-
-        tr_removeElementFromArray(s->requests, pos, sizeof(struct block_request), s->requestCount);
-        --s->requestCount;
+        requestListRemoveRequest(s, b);
 
         // fprintf(stderr, "removing request of block %lu from peer %s... there are now %d block requests left\n", (unsigned long)block,
         //     tr_atomAddrStr(peer->atom), t->requestCount);
     }
 }
 
+static void freeRequestList(struct block_request* list)
+{
+    while (list != NULL)
+    {
+        struct block_request* next = list->next;
+        tr_free(list);
+        list = next;
+    }
+}
+
+static void requestListFree(tr_swarm* s)
+{
+    freeRequestList(s->requests);
+    freeRequestList(s->freeRequests);
+    tr_free(s->requestTable);
+    tr_bitfieldDestruct(&s->requestedBlocks);
+}
+
 static int countActiveWebseeds(tr_swarm* s)
 {
     int activeCount = 0;
@@ -881,133 +1096,194 @@ static void updateEndgame(tr_swarm* s)
 *****
 ****/
 
-static inline void invalidatePieceSorting(tr_swarm* s)
+/* The order that we want to request pieces in. Pieces with lower keys go first:
+ *
+ * 1. weight, so that partially-complete pieces come before empty ones.
+ *    Pieces that have had all of their missing blocks requested go last.
+ * 2. higher priorities go first.
+ * 3. rarest first.
+ *
+ * Pieces with the same key are put in a random order by their salts. */
+static uint64_t getPieceKey(tr_swarm const* s, struct weighted_piece const* p)
 {
-    s->pieceSortState = PIECES_UNSORTED;
+    tr_torrent const* tor = s->tor;
+    int const missing = tr_torrentMissingBlocksInPiece(tor, p->index);
+    int const pending = p->requestCount;
+    uint64_t const weight = (uint64_t)(missing > pending ? missing - pending : tor->blockCountInPiece + pending);
+    uint64_t const priority = (uint64_t)(TR_PRI_HIGH - tor->info.pieces[p->index].priority);
+    uint64_t const rarity = s->pieceReplication[p->index];
+
+    return weight << 32 | priority << 16 | rarity;
 }
 
-static tr_torrent const* weightTorrent;
+static int compareKeyToPieceBucket(void const* vkey, void const* vbucket)
+{
+    uint64_t const key = *(uint64_t const*)vkey;
+    struct piece_bucket const* bucket = *(struct piece_bucket* const*)vbucket;
 
-static uint16_t const* weightReplication;
+    if (key < bucket->key)
+    {
+        return -1;
+    }
 
-static void setComparePieceByWeightTorrent(tr_swarm* s)
-{
-    if (!replicationExists(s))
+    if (key > bucket->key)
     {
-        replicationNew(s);
+        return 1;
     }
 
-    weightTorrent = s->tor;
-    weightReplication = s->pieceReplication;
+    return 0;
 }
 
-/* we try to create a "weight" s.t. high-priority pieces come before others,
- * and that partially-complete pieces come before empty ones. */
-static int comparePieceByWeight(void const* va, void const* vb)
+/* find the bucket for `key', adding it if it isn't there yet */
+static struct piece_bucket* pieceBucketGet(tr_swarm* s, uint64_t key)
 {
-    struct weighted_piece const* a = va;
-    struct weighted_piece const* b = vb;
-    int ia;
-    int ib;
-    int missing;
-    int pending;
-    tr_torrent const* tor = weightTorrent;
-    uint16_t const* rep = weightReplication;
-
-    /* primary key: weight */
-    missing = tr_torrentMissingBlocksInPiece(tor, a->index);
-    pending = a->requestCount;
-    ia = missing > pending ? missing - pending : tor->blockCountInPiece + pending;
-    missing = tr_torrentMissingBlocksInPiece(tor, b->index);
-    pending = b->requestCount;
-    ib = missing > pending ? missing - pending : tor->blockCountInPiece + pending;
+    bool exact;
+    struct piece_bucket* bucket;
+    int const pos = tr_lowerBound(&key, s->pieceBuckets, s->pieceBucketCount, sizeof(struct piece_bucket*),
+        compareKeyToPieceBucket, &exact);
 
-    if (ia < ib)
+    if (exact)
     {
-        return -1;
+        return s->pieceBuckets[pos];
     }
 
-    if (ia > ib)
+    /* reuse an old bucket if there is one */
+    if ((bucket = s->freePieceBuckets) != NULL)
     {
-        return 1;
+        s->freePieceBuckets = bucket->nextFree;
+    }
+    else
+    {
+        bucket = tr_new(struct piece_bucket, 1);
     }
 
-    /* secondary key: higher priorities go first */
-    ia = tor->info.pieces[a->index].priority;
-    ib = tor->info.pieces[b->index].priority;
+    memset(bucket, 0, sizeof(struct piece_bucket));
+    bucket->key = key;
 
-    if (ia > ib)
+    if (s->pieceBucketCount == s->pieceBucketAlloc)
     {
-        return -1;
+        s->pieceBucketAlloc = MAX(s->pieceBucketAlloc * 2, 16);
+        s->pieceBuckets = tr_renew(struct piece_bucket*, s->pieceBuckets, s->pieceBucketAlloc);
     }
 
-    if (ia < ib)
+    memmove(&s->pieceBuckets[pos + 1], &s->pieceBuckets[pos], sizeof(struct piece_bucket*) * (s->pieceBucketCount - pos));
+    s->pieceBuckets[pos] = bucket;
+    ++s->pieceBucketCount;
+
+    return bucket;
+}
+
+static void pieceBucketFree(tr_swarm* s, struct piece_bucket* bucket)
+{
+    bool exact;
+    int const pos = tr_lowerBound(&bucket->key, s->pieceBuckets, s->pieceBucketCount, sizeof(struct piece_bucket*),
+        compareKeyToPieceBucket, &exact);
+
+    TR_ASSERT(exact);
+    TR_ASSERT(s->pieceBuckets[pos] == bucket);
+
+    tr_removeElementFromArray(s->pieceBuckets, pos, sizeof(struct piece_bucket*), s->pieceBucketCount);
+    --s->pieceBucketCount;
+
+    bucket->nextFree = s->freePieceBuckets;
+    s->freePieceBuckets = bucket;
+}
+
+static void pieceQueueAdd(tr_swarm* s, struct weighted_piece* p)
+{
+    struct piece_bucket* bucket = pieceBucketGet(s, getPieceKey(s, p));
+    struct weighted_piece** head = &bucket->pieces[p->salt];
+
+    TR_ASSERT(p->bucket == NULL);
+
+    p->bucket = bucket;
+    p->prev = NULL;
+    p->next = *head;
+
+    if (*head != NULL)
     {
-        return 1;
+        (*head)->prev = p;
     }
 
-    /* tertiary key: rarest first. */
-    ia = rep[a->index];
-    ib = rep[b->index];
+    *head = p;
+    ++bucket->pieceCount;
+    ++s->pieceCount;
+}
 
-    if (ia < ib)
+static void pieceQueueRemove(tr_swarm* s, struct weighted_piece* p)
+{
+    struct piece_bucket* bucket = p->bucket;
+
+    TR_ASSERT(bucket != NULL);
+
+    if (p->prev != NULL)
     {
-        return -1;
+        p->prev->next = p->next;
     }
-
-    if (ia > ib)
+    else
     {
-        return 1;
+        bucket->pieces[p->salt] = p->next;
     }
 
-    /* quaternary key: random */
-    if (a->salt < b->salt)
+    if (p->next != NULL)
     {
-        return -1;
+        p->next->prev = p->prev;
     }
 
-    if (a->salt > b->salt)
+    p->bucket = NULL;
+    --s->pieceCount;
+
+    if (--bucket->pieceCount == 0)
     {
-        return 1;
+        pieceBucketFree(s, bucket);
     }
-
-    /* okay, they're equal */
-    return 0;
 }
 
-static int comparePieceByIndex(void const* va, void const* vb)
+static void pieceQueueFree(tr_swarm* s)
 {
-    struct weighted_piece const* a = va;
-    struct weighted_piece const* b = vb;
+    struct piece_bucket* bucket;
 
-    if (a->index < b->index)
+    for (int i = 0; i < s->pieceBucketCount; ++i)
     {
-        return -1;
+        tr_free(s->pieceBuckets[i]);
     }
 
-    if (a->index > b->index)
+    while ((bucket = s->freePieceBuckets) != NULL)
     {
-        return 1;
+        s->freePieceBuckets = bucket->nextFree;
+        tr_free(bucket);
     }
 
-    return 0;
+    tr_free(s->pieceBuckets);
+    tr_free(s->pieces);
+    tr_free(s->streamingPieces);
 }
 
-static void pieceListSort(tr_swarm* s, enum piece_sort_state state)
+/* Every queued piece's replication count just went up or down by one.
+ * That doesn't change their order, so just fix the keys */
+static void pieceQueueShiftReplication(tr_swarm* s, int delta)
 {
-    TR_ASSERT(state == PIECES_SORTED_BY_INDEX || state == PIECES_SORTED_BY_WEIGHT);
-
-    if (state == PIECES_SORTED_BY_WEIGHT)
+    if (s->pieceQueueIsStale)
     {
-        setComparePieceByWeightTorrent(s);
-        qsort(s->pieces, s->pieceCount, sizeof(struct weighted_piece), comparePieceByWeight);
+        return;
     }
-    else
+
+    for (int i = 0; i < s->pieceBucketCount; ++i)
     {
-        qsort(s->pieces, s->pieceCount, sizeof(struct weighted_piece), comparePieceByIndex);
+        uint16_t const rarity = s->pieceBuckets[i]->key & UINT16_MAX;
+
+        /* unless it wrapped around, which would take a buggy peer */
+        if (delta > 0 ? rarity == UINT16_MAX : rarity == 0)
+        {
+            s->pieceQueueIsStale = true;
+            return;
+        }
     }
 
-    s->pieceSortState = state;
+    for (int i = 0; i < s->pieceBucketCount; ++i)
+    {
+        s->pieceBuckets[i]->key += delta;
+    }
 }
 
 /**
@@ -1021,20 +1297,32 @@ static void pieceListSort(tr_swarm* s, enum piece_sort_state state)
 
 #else
 
-static void assertWeightedPiecesAreSorted(Torrent* t)
+static void assertWeightedPiecesAreSorted(tr_swarm* s)
 {
-    if (t->endgame == 0)
+    int pieceCount = 0;
+
+    for (int i = 0; i < s->pieceBucketCount; ++i)
     {
-        setComparePieceByWeightTorrent(t);
+        struct piece_bucket const* bucket = s->pieceBuckets[i];
+
+        TR_ASSERT(i == 0 || s->pieceBuckets[i - 1]->key < bucket->key);
 
-        for (int i = 0; i < t->pieceCount - 1; ++i)
+        for (int salt = 0; salt < PIECE_SALT_COUNT; ++salt)
         {
-            TR_ASSERT(comparePieceByWeight(&t->pieces[i], &t->pieces[i + 1]) <= 0);
+            for (struct weighted_piece const* p = bucket->pieces[salt]; p != NULL; p = p->next)
+            {
+                TR_ASSERT(p->bucket == bucket);
+                TR_ASSERT(p->salt == salt);
+                TR_ASSERT(s->pieceQueueIsStale || getPieceKey(s, p) == bucket->key);
+                ++pieceCount;
+            }
         }
     }
+
+    TR_ASSERT(pieceCount == s->pieceCount);
 }
 
-static void assertReplicationCountIsExact(Torrent* t)
+static void assertReplicationCountIsExact(tr_swarm* t)
 {
     /* This assert might fail due to errors of implementations in other
      * clients. It happens when receiving duplicate bitfields/HaveAll/HaveNone
@@ -1054,7 +1342,7 @@ static void assertReplicationCountIsExact(Torrent* t)
 
         for (int peer_i = 0; peer_i < peer_count; ++peer_i)
         {
-            if (tr_bitsetHas(&peers[peer_i]->have, piece_i))
+            if (tr_bitfieldHas(&peers[peer_i]->have, piece_i))
             {
                 ++r;
             }
@@ -1066,268 +1354,441 @@ static void assertReplicationCountIsExact(Torrent* t)
 
 #endif
 
+/* the piece, if it's one that we want */
 static struct weighted_piece* pieceListLookup(tr_swarm* s, tr_piece_index_t index)
 {
-    for (int i = 0; i < s->pieceCount; ++i)
+    if (s->pieces != NULL && s->pieces[index].bucket != NULL)
     {
-        if (s->pieces[i].index == index)
-        {
-            return &s->pieces[i];
-        }
+        return &s->pieces[index];
     }
 
     return NULL;
 }
 
+/* Queue the pieces that we want and drop the ones we don't, and make sure
+ * the queued ones are where they should be. The requestCounts of the pieces
+ * that were already queued are kept */
 static void pieceListRebuild(tr_swarm* s)
 {
-    if (!tr_torrentIsSeed(s->tor))
+    tr_torrent const* tor = s->tor;
+    tr_info const* inf = tr_torrentInfo(tor);
+
+    if (tr_torrentIsSeed(tor) || inf->pieceCount == 0)
     {
-        tr_piece_index_t* pool;
-        tr_piece_index_t poolCount = 0;
-        tr_torrent const* tor = s->tor;
-        tr_info const* inf = tr_torrentInfo(tor);
-        struct weighted_piece* pieces;
-        int pieceCount;
+        return;
+    }
 
-        /* build the new list */
-        pool = tr_new(tr_piece_index_t, inf->pieceCount);
+    if (!replicationExists(s))
+    {
+        replicationNew(s);
+    }
+
+    if (s->pieces == NULL)
+    {
+        s->pieces = tr_new0(struct weighted_piece, inf->pieceCount);
 
         for (tr_piece_index_t i = 0; i < inf->pieceCount; ++i)
         {
-            if (!inf->pieces[i].dnd)
-            {
-                if (!tr_torrentPieceIsComplete(tor, i))
-                {
-                    pool[poolCount++] = i;
-                }
-            }
+            s->pieces[i].index = i;
+            s->pieces[i].deadline = -1;
         }
+    }
+
+    s->pieceQueueIsStale = false;
 
-        pieceCount = poolCount;
-        pieces = tr_new0(struct weighted_piece, pieceCount);
+    for (tr_piece_index_t i = 0; i < inf->pieceCount; ++i)
+    {
+        struct weighted_piece* p = &s->pieces[i];
+        bool const wanted = !inf->pieces[i].dnd && !tr_torrentPieceIsComplete(tor, i);
 
-        for (tr_piece_index_t i = 0; i < poolCount; ++i)
+        if (p->bucket == NULL)
+        {
+            if (wanted)
+            {
+                p->salt = tr_rand_int_weak(PIECE_SALT_COUNT);
+                p->requestCount = 0;
+                pieceQueueAdd(s, p);
+            }
+        }
+        else if (!wanted)
         {
-            struct weighted_piece* piece = pieces + i;
-            piece->index = pool[i];
-            piece->requestCount = 0;
-            piece->salt = tr_rand_int_weak(4096);
+            pieceQueueRemove(s, p);
         }
-
-        /* if we already had a list of pieces, merge it into
-         * the new list so we don't lose its requestCounts */
-        if (s->pieces != NULL)
+        else if (getPieceKey(s, p) != p->bucket->key)
         {
-            struct weighted_piece* o = s->pieces;
-            struct weighted_piece* oend = o + s->pieceCount;
-            struct weighted_piece* n = pieces;
-            struct weighted_piece* nend = n + pieceCount;
+            pieceQueueRemove(s, p);
+            pieceQueueAdd(s, p);
+        }
+    }
 
-            pieceListSort(s, PIECES_SORTED_BY_INDEX);
+    s->streamingIsStale = true;
 
-            while (o != oend && n != nend)
-            {
-                if (o->index < n->index)
-                {
-                    ++o;
-                }
-                else if (o->index > n->index)
-                {
-                    ++n;
-                }
-                else
-                {
-                    *n++ = *o++;
-                }
-            }
+    assertWeightedPiecesAreSorted(s);
+}
 
-            tr_free(s->pieces);
+static void pieceListRemovePiece(tr_swarm* s, tr_piece_index_t piece)
+{
+    struct weighted_piece* p;
+
+    if ((p = pieceListLookup(s, piece)) != NULL)
+    {
+        /* the playhead may have moved */
+        if (p->deadline >= 0)
+        {
+            s->streamingIsStale = true;
         }
 
-        s->pieces = pieces;
-        s->pieceCount = pieceCount;
+        pieceQueueRemove(s, p);
+    }
+}
 
-        pieceListSort(s, PIECES_SORTED_BY_WEIGHT);
+/* move the piece to the right bucket, if its key has changed */
+static void pieceListResortPiece(tr_swarm* s, struct weighted_piece* p)
+{
+    if (p == NULL || s->pieceQueueIsStale)
+    {
+        return;
+    }
 
-        /* cleanup */
-        tr_free(pool);
+    if (getPieceKey(s, p) != p->bucket->key)
+    {
+        pieceQueueRemove(s, p);
+        pieceQueueAdd(s, p);
     }
 }
 
-static void pieceListRemovePiece(tr_swarm* s, tr_piece_index_t piece)
+static void pieceListRemoveRequest(tr_swarm* s, tr_block_index_t block)
 {
     struct weighted_piece* p;
+    tr_piece_index_t const index = tr_torBlockPiece(s->tor, block);
+
+    if ((p = pieceListLookup(s, index)) != NULL && p->requestCount > 0)
+    {
+        --p->requestCount;
+        pieceListResortPiece(s, p);
+    }
+}
+
+/****
+*****
+*****  Replication count (for rarest first policy)
+*****
+****/
+
+/**
+ * Increase the replication count of this piece and move it in the piece queue
+ */
+static void tr_incrReplicationOfPiece(tr_swarm* s, size_t const index)
+{
+    TR_ASSERT(replicationExists(s));
+    TR_ASSERT(s->pieceReplicationSize == s->tor->info.pieceCount);
+
+    /* One more replication of this piece is present in the swarm */
+    ++s->pieceReplication[index];
+
+    pieceListResortPiece(s, pieceListLookup(s, index));
+}
+
+/**
+ * Increase the replication count of every piece
+ */
+static void tr_incrReplication(tr_swarm* s)
+{
+    TR_ASSERT(replicationExists(s));
+    TR_ASSERT(s->pieceReplicationSize == s->tor->info.pieceCount);
+
+    for (size_t i = 0; i < s->pieceReplicationSize; ++i)
+    {
+        ++s->pieceReplication[i];
+    }
+
+    pieceQueueShiftReplication(s, 1);
+}
+
+/**
+ * Move the queued pieces in the bitfield after their replication counts changed
+ */
+static void pieceQueueResortPieces(tr_swarm* s, tr_bitfield const* b)
+{
+    size_t const n = s->pieceReplicationSize;
+
+    /* nothing's queued while seeding, and a stale queue is rebuilt anyway */
+    if (s->pieces == NULL || s->pieceCount == 0 || s->pieceQueueIsStale)
+    {
+        return;
+    }
+
+    for (size_t i = tr_bitfieldFindNextSet(b, NULL, 0, n); i < n; i = tr_bitfieldFindNextSet(b, NULL, i + 1, n))
+    {
+        pieceListResortPiece(s, pieceListLookup(s, i));
+    }
+}
+
+/**
+ * Increases the replication count of pieces present in the bitfield
+ */
+static void tr_incrReplicationFromBitfield(tr_swarm* s, tr_bitfield const* b)
+{
+    TR_ASSERT(replicationExists(s));
+    TR_ASSERT(s->pieceReplicationSize == s->tor->info.pieceCount);
+
+    if (tr_bitfieldHasAll(b))
+    {
+        tr_incrReplication(s);
+    }
+    else if (!tr_bitfieldHasNone(b))
+    {
+        tr_bitfieldAddToCounts(b, s->pieceReplication, s->pieceReplicationSize, 1);
+        pieceQueueResortPieces(s, b);
+    }
+}
+
+/**
+ * Decrease the replication count of pieces present in the bitset.
+ */
+static void tr_decrReplicationFromBitfield(tr_swarm* s, tr_bitfield const* b)
+{
+    TR_ASSERT(replicationExists(s));
+    TR_ASSERT(s->pieceReplicationSize == s->tor->info.pieceCount);
+
+    tr_bitfieldAddToCounts(b, s->pieceReplication, s->pieceReplicationSize, -1);
+
+    if (tr_bitfieldHasAll(b))
+    {
+        pieceQueueShiftReplication(s, -1);
+    }
+    else if (!tr_bitfieldHasNone(b))
+    {
+        pieceQueueResortPieces(s, b);
+    }
+}
+
+/****
+*****
+*****  Sequential download
+*****
+****/
+
+static int compareStreamingPieces(void const* va, void const* vb)
+{
+    struct weighted_piece const* a = *(struct weighted_piece const* const*)va;
+    struct weighted_piece const* b = *(struct weighted_piece const* const*)vb;
+
+    if (a->deadline != b->deadline)
+    {
+        return a->deadline < b->deadline ? -1 : 1;
+    }
+
+    return a->index < b->index ? -1 : (a->index > b->index ? 1 : 0);
+}
+
+/* The playhead of [begin, end] is the first piece in it that we still want.
+ * Give deadlines to the ones that are less than `window' pieces past it */
+static void streamingAddRange(tr_swarm* s, tr_piece_index_t begin, tr_piece_index_t end, tr_piece_index_t window)
+{
+    tr_piece_index_t playhead = begin;
+
+    while (playhead <= end && s->pieces[playhead].bucket == NULL)
+    {
+        ++playhead;
+    }
 
-    if ((p = pieceListLookup(s, piece)) != NULL)
+    for (tr_piece_index_t i = playhead; i <= end && i - playhead < window; ++i)
     {
-        int const pos = p - s->pieces;
+        struct weighted_piece* p = &s->pieces[i];
+        int const deadline = i - playhead;
+
+        if (p->bucket == NULL)
+        {
+            continue;
+        }
 
-        tr_removeElementFromArray(s->pieces, pos, sizeof(struct weighted_piece), s->pieceCount);
-        --s->pieceCount;
+        if (p->deadline < 0)
+        {
+            if (s->streamingPieceCount == s->streamingPieceAlloc)
+            {
+                s->streamingPieceAlloc = MAX(16, s->streamingPieceAlloc * 2);
+                s->streamingPieces = tr_renew(struct weighted_piece*, s->streamingPieces, s->streamingPieceAlloc);
+            }
 
-        if (s->pieceCount == 0)
+            s->streamingPieces[s->streamingPieceCount++] = p;
+            p->deadline = deadline;
+        }
+        else if (p->deadline > deadline)
         {
-            tr_free(s->pieces);
-            s->pieces = NULL;
+            p->deadline = deadline;
         }
     }
 }
 
-static void pieceListResortPiece(tr_swarm* s, struct weighted_piece* p)
+/* Find the pieces near the playheads of the torrent, if it's sequential,
+ * and of its sequential files. Without knowing how fast they're being
+ * played, a piece's deadline is how far past its playhead it is */
+static void streamingRebuild(tr_swarm* s)
 {
-    int pos;
-    bool isSorted = true;
+    tr_info const* inf = tr_torrentInfo(s->tor);
+    tr_piece_index_t const window = MAX(1U, STREAMING_WINDOW_BYTES / inf->pieceSize);
 
-    if (p == NULL)
+    for (int i = 0; i < s->streamingPieceCount; ++i)
     {
-        return;
+        s->streamingPieces[i]->deadline = -1;
     }
 
-    /* is the torrent already sorted? */
-    pos = p - s->pieces;
-    setComparePieceByWeightTorrent(s);
-
-    if (isSorted && pos > 0 && comparePieceByWeight(p - 1, p) > 0)
-    {
-        isSorted = false;
-    }
+    s->streamingPieceCount = 0;
+    s->streamingIsStale = false;
 
-    if (isSorted && pos < s->pieceCount - 1 && comparePieceByWeight(p, p + 1) > 0)
+    if (s->pieces == NULL || s->pieceCount == 0)
     {
-        isSorted = false;
+        return;
     }
 
-    if (s->pieceSortState != PIECES_SORTED_BY_WEIGHT)
+    if (s->tor->sequentialDownload)
     {
-        pieceListSort(s, PIECES_SORTED_BY_WEIGHT);
-        isSorted = true;
+        streamingAddRange(s, 0, inf->pieceCount - 1, window);
     }
 
-    /* if it's not sorted, move it around */
-    if (!isSorted)
+    for (tr_file_index_t i = 0; i < inf->fileCount; ++i)
     {
-        bool exact;
-        struct weighted_piece const tmp = *p;
-
-        tr_removeElementFromArray(s->pieces, pos, sizeof(struct weighted_piece), s->pieceCount);
-        --s->pieceCount;
+        tr_file const* file = &inf->files[i];
 
-        pos = tr_lowerBound(&tmp, s->pieces, s->pieceCount, sizeof(struct weighted_piece), comparePieceByWeight, &exact);
-
-        memmove(&s->pieces[pos + 1], &s->pieces[pos], sizeof(struct weighted_piece) * (s->pieceCount - pos));
-        ++s->pieceCount;
-
-        s->pieces[pos] = tmp;
+        if (file->sequential && !file->dnd)
+        {
+            streamingAddRange(s, file->firstPiece, file->lastPiece, window);
+        }
     }
 
-    assertWeightedPiecesAreSorted(s);
+    qsort(s->streamingPieces, s->streamingPieceCount, sizeof(struct weighted_piece*), compareStreamingPieces);
 }
 
-static void pieceListRemoveRequest(tr_swarm* s, tr_block_index_t block)
+static int compareBps(void const* va, void const* vb)
 {
-    struct weighted_piece* p;
-    tr_piece_index_t const index = tr_torBlockPiece(s->tor, block);
+    unsigned int const a = *(unsigned int const*)va;
+    unsigned int const b = *(unsigned int const*)vb;
 
-    if ((p = pieceListLookup(s, index)) != NULL && p->requestCount > 0)
-    {
-        --p->requestCount;
-        pieceListResortPiece(s, p);
-    }
+    return a < b ? -1 : (a > b ? 1 : 0);
 }
 
-/****
-*****
-*****  Replication count (for rarest first policy)
-*****
-****/
-
-/**
- * Increase the replication count of this piece and sort it if the
- * piece list is already sorted
- */
-static void tr_incrReplicationOfPiece(tr_swarm* s, size_t const index)
+/* The fast peers are the faster half of the ones we're waiting on for blocks */
+static void streamingUpdateFastBps(tr_swarm* s, uint64_t now_msec)
 {
-    TR_ASSERT(replicationExists(s));
-    TR_ASSERT(s->pieceReplicationSize == s->tor->info.pieceCount);
+    int n = 0;
+    unsigned int* rates;
 
-    /* One more replication of this piece is present in the swarm */
-    ++s->pieceReplication[index];
+    s->streamingFastBpsAt = tr_time();
 
-    /* we only resort the piece if the list is already sorted */
-    if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
+    /* a peer's newest request is the head of its list, so this counts each peer once */
+    for (struct block_request const* r = s->requests; r != NULL; r = r->next)
     {
-        pieceListResortPiece(s, pieceListLookup(s, index));
+        if (r->peer != NULL && r->prevForPeer == NULL)
+        {
+            ++n;
+        }
     }
-}
 
-/**
- * Increases the replication count of pieces present in the bitfield
- */
-static void tr_incrReplicationFromBitfield(tr_swarm* s, tr_bitfield const* b)
-{
-    TR_ASSERT(replicationExists(s));
+    if (n == 0)
+    {
+        s->streamingFastBps = 0;
+        return;
+    }
 
-    uint16_t* rep = s->pieceReplication;
+    rates = tr_new(unsigned int, n);
+    n = 0;
 
-    for (size_t i = 0, n = s->tor->info.pieceCount; i < n; ++i)
+    for (struct block_request const* r = s->requests; r != NULL; r = r->next)
     {
-        if (tr_bitfieldHas(b, i))
+        if (r->peer != NULL && r->prevForPeer == NULL)
         {
-            ++rep[i];
+            rates[n++] = tr_peerGetPieceSpeed_Bps(r->peer, now_msec, TR_PEER_TO_CLIENT);
         }
     }
 
-    if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
-    {
-        invalidatePieceSorting(s);
-    }
+    qsort(rates, n, sizeof(unsigned int), compareBps);
+    s->streamingFastBps = rates[n / 2];
+
+    tr_free(rates);
 }
 
-/**
- * Increase the replication count of every piece
- */
-static void tr_incrReplication(tr_swarm* s)
+static bool streamingPeerIsFast(tr_swarm* s, tr_peer const* peer)
 {
-    TR_ASSERT(replicationExists(s));
-    TR_ASSERT(s->pieceReplicationSize == s->tor->info.pieceCount);
+    uint64_t const now_msec = tr_time_msec();
 
-    for (size_t i = 0; i < s->pieceReplicationSize; ++i)
+    if (s->streamingFastBpsAt != tr_time())
     {
-        ++s->pieceReplication[i];
+        streamingUpdateFastBps(s, now_msec);
     }
+
+    return tr_peerGetPieceSpeed_Bps(peer, now_msec, TR_PEER_TO_CLIENT) >= s->streamingFastBps;
 }
 
-/**
- * Decrease the replication count of pieces present in the bitset.
- */
-static void tr_decrReplicationFromBitfield(tr_swarm* s, tr_bitfield const* b)
+/* How many more of the blocks that are due soon `peer' can be asked for:
+ * what it can send in STREAMING_DUE_SECS, less what it's already been asked for */
+static int streamingDueBudget(tr_swarm* s, tr_peer const* peer, int due)
 {
-    TR_ASSERT(replicationExists(s));
-    TR_ASSERT(s->pieceReplicationSize == s->tor->info.pieceCount);
+    tr_torrent const* tor = s->tor;
+    unsigned int const Bps = tr_peerGetPieceSpeed_Bps(peer, tr_time_msec(), TR_PEER_TO_CLIENT);
+    int budget = (int)MAX(1U, Bps * STREAMING_DUE_SECS / tor->blockSize);
 
-    if (tr_bitfieldHasAll(b))
+    for (struct block_request const* r = peer->requests; r != NULL && budget > 0; r = r->nextForPeer)
     {
-        for (size_t i = 0; i < s->pieceReplicationSize; ++i)
+        struct weighted_piece const* const p = pieceListLookup(s, tr_torBlockPiece(tor, r->block));
+
+        if (p != NULL && p->deadline >= 0 && p->deadline < due && !tr_torrentBlockIsComplete(tor, r->block))
         {
-            --s->pieceReplication[i];
+            --budget;
         }
     }
-    else if (!tr_bitfieldHasNone(b))
+
+    return budget;
+}
+
+/* Ask `peer' for the blocks in piece `p' that only one other peer's been asked for,
+ * if that peer is slow or is taking too long, as tr_peerMgrGetNextRequests() describes.
+ * Returns the new size of the table. */
+static int getStuckRequestsFromPiece(tr_swarm* s, tr_peer* peer, struct weighted_piece* p, int numwant,
+    tr_block_index_t* setme, int got, bool get_intervals)
+{
+    tr_torrent const* tor = s->tor;
+    uint64_t const now_msec = tr_time_msec();
+    time_t const too_old = tr_time() - STREAMING_STUCK_SECS;
+    tr_block_index_t first;
+    tr_block_index_t last;
+
+    tr_torGetPieceBlockRange(tor, p->index, &first, &last);
+
+    for (tr_block_index_t b = first; b <= last && got < numwant; ++b)
     {
-        for (size_t i = 0; i < s->pieceReplicationSize; ++i)
+        struct block_request const* const r = getBlockRequests(s, b);
+
+        if (r == NULL || r->nextForBlock != NULL || r->peer == peer || tr_torrentBlockIsComplete(tor, b))
         {
-            if (tr_bitfieldHas(b, i))
-            {
-                --s->pieceReplication[i];
-            }
+            continue;
+        }
+
+        if (r->sentAt > too_old && tr_peerGetPieceSpeed_Bps(r->peer, now_msec, TR_PEER_TO_CLIENT) >= s->streamingFastBps)
+        {
+            continue;
         }
 
-        if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
+        if (!get_intervals)
+        {
+            setme[got++] = b;
+        }
+        else if (got != 0 && b != first && setme[2 * got - 1] == b - 1)
+        {
+            setme[2 * got - 1] = b;
+        }
+        else
         {
-            invalidatePieceSorting(s);
+            setme[2 * got] = b;
+            setme[2 * got + 1] = b;
+            ++got;
         }
+
+        requestListAdd(s, b, peer);
+        ++p->requestCount;
     }
+
+    return got;
 }
 
 /**
@@ -1341,6 +1802,104 @@ void tr_peerMgrRebuildRequests(tr_torrent* tor)
     pieceListRebuild(tor->swarm);
 }
 
+/* Pick blocks from piece `p' for `peer', adding them to the caller's table
+ * as tr_peerMgrGetNextRequests() describes. `requested' is the blocks to
+ * skip because they've already been requested, or NULL in the endgame.
+ * Returns the new size of the table. */
+static int getNextRequestsFromPiece(tr_swarm* s, tr_peer* peer, struct weighted_piece* p, tr_bitfield const* requested,
+    int numwant, tr_block_index_t* setme, int got, bool get_intervals)
+{
+    tr_torrent const* tor = s->tor;
+    tr_bitfield const* const complete = &tor->completion.blockBitfield;
+    tr_block_index_t first;
+    tr_block_index_t last;
+    tr_block_index_t b;
+
+    tr_torGetPieceBlockRange(tor, p->index, &first, &last);
+
+    b = first;
+
+    for (;;)
+    {
+        tr_block_index_t end;
+        bool extends;
+
+        /* don't request blocks we've already got */
+        b = tr_bitfieldFindNextUnset(complete, requested, b, last + 1);
+
+        if (b > last)
+        {
+            break;
+        }
+
+        /* once we've got enough, only keep going to finish the last interval */
+        extends = get_intervals && got != 0 && b != first && setme[2 * got - 1] == b - 1;
+
+        if (got >= numwant && !extends)
+        {
+            break;
+        }
+
+        if (requested != NULL)
+        {
+            /* nobody's been asked for any of the blocks in [b, end) */
+            end = tr_bitfieldFindNextSet(complete, requested, b + 1, last + 1);
+
+            if (!get_intervals)
+            {
+                end = MIN(end, b + (tr_block_index_t)(numwant - got));
+            }
+        }
+        else
+        {
+            struct block_request const* const r = getBlockRequests(s, b);
+
+            end = b + 1;
+
+            /* always add peer if this block has no peers yet.
+               Otherwise, don't have more than two peers requesting
+               this block, don't send the same request to the same
+               peer twice, and only allow the second peer if it seems
+               to be handling requests relatively fast */
+            if (r != NULL &&
+                (r->nextForBlock != NULL || r->peer == peer ||
+                peer->pendingReqsToPeer + numwant - got < s->endgame))
+            {
+                b = end;
+                continue;
+            }
+        }
+
+        /* update the caller's table. If intervals are requested, two
+           array entries are necessary: one for the interval's starting
+           block and one for its end block */
+        if (get_intervals)
+        {
+            if (!extends)
+            {
+                setme[2 * got] = b;
+                ++got;
+            }
+
+            setme[2 * got - 1] = end - 1;
+        }
+
+        /* update our own tables */
+        for (; b < end; ++b)
+        {
+            if (!get_intervals)
+            {
+                setme[got++] = b;
+            }
+
+            requestListAdd(s, b, peer);
+            ++p->requestCount;
+        }
+    }
+
+    return got;
+}
+
 void tr_peerMgrGetNextRequests(tr_torrent* tor, tr_peer* peer, int numwant, tr_block_index_t* setme, int* numgot,
     bool get_intervals)
 {
@@ -1351,18 +1910,25 @@ void tr_peerMgrGetNextRequests(tr_torrent* tor, tr_peer* peer, int numwant, tr_b
     tr_swarm* s;
     tr_bitfield const* const have = &peer->have;
 
+    /* the disk's behind, so hold off until the blocks we've got are written */
+    if (tr_cacheIsWriteBacklogged(tor->session->cache, tor))
+    {
+        *numgot = 0;
+        return;
+    }
+
     /* walk through the pieces and find blocks that should be requested */
     s = tor->swarm;
 
     /* prep the pieces list */
-    if (s->pieces == NULL)
+    if (s->pieces == NULL || s->pieceQueueIsStale)
     {
         pieceListRebuild(s);
     }
 
-    if (s->pieceSortState != PIECES_SORTED_BY_WEIGHT)
+    if (s->streamingIsStale)
     {
-        pieceListSort(s, PIECES_SORTED_BY_WEIGHT);
+        streamingRebuild(s);
     }
 
     assertReplicationCountIsExact(s);
@@ -1370,129 +1936,87 @@ void tr_peerMgrGetNextRequests(tr_torrent* tor, tr_peer* peer, int numwant, tr_b
 
     updateEndgame(s);
 
-    struct weighted_piece* pieces = s->pieces;
+    /* don't make a second block request until the endgame */
+    tr_bitfield const* const requested = s->endgame == 0 ? &s->requestedBlocks : NULL;
+    struct weighted_piece* touched = NULL;
     int got = 0;
-    int checkedPieceCount = 0;
 
-    for (int i = 0; i < s->pieceCount && got < numwant; ++i, ++checkedPieceCount)
+    /* The pieces with deadlines come first, soonest first. Only fast peers
+     * get the ones that are due soon, no more than they can send quickly,
+     * and they're also asked for blocks of those that are stuck with slow peers */
+    if (s->streamingPieceCount > 0)
     {
-        struct weighted_piece* p = pieces + i;
+        int const due = (int)MAX(1U, STREAMING_DUE_BYTES / tor->info.pieceSize);
+        int budget = streamingPeerIsFast(s, peer) ? streamingDueBudget(s, peer, due) : 0;
 
-        /* if the peer has this piece that we want... */
-        if (tr_bitfieldHas(have, p->index))
+        for (int i = 0; i < s->streamingPieceCount && got < numwant; ++i)
         {
-            tr_block_index_t first;
-            tr_block_index_t last;
-            tr_ptrArray peerArr = TR_PTR_ARRAY_INIT;
+            struct weighted_piece* p = s->streamingPieces[i];
+            int16_t const oldRequestCount = p->requestCount;
 
-            tr_torGetPieceBlockRange(tor, p->index, &first, &last);
+            if ((p->deadline < due && budget <= 0) || !tr_bitfieldHas(have, p->index))
+            {
+                continue;
+            }
 
-            for (tr_block_index_t b = first; b <= last && (got < numwant || (get_intervals && setme[2 * got - 1] == b - 1));
-                ++b)
+            if (p->deadline < due)
             {
-                int peerCount;
-                tr_peer** peers;
+                int const limit = MIN(numwant, got + budget);
+                int const oldGot = got;
 
-                /* don't request blocks we've already got */
-                if (tr_torrentBlockIsComplete(tor, b))
-                {
-                    continue;
-                }
+                got = getNextRequestsFromPiece(s, peer, p, requested, limit, setme, got, get_intervals);
+                got = getStuckRequestsFromPiece(s, peer, p, limit, setme, got, get_intervals);
+                budget -= got - oldGot;
+            }
+            else
+            {
+                got = getNextRequestsFromPiece(s, peer, p, requested, numwant, setme, got, get_intervals);
+            }
 
-                /* always add peer if this block has no peers yet */
-                tr_ptrArrayClear(&peerArr);
-                getBlockRequestPeers(s, b, &peerArr);
-                peers = (tr_peer**)tr_ptrArrayPeek(&peerArr, &peerCount);
+            if (p->requestCount != oldRequestCount)
+            {
+                p->nextTouched = touched;
+                touched = p;
+            }
+        }
+    }
 
-                if (peerCount != 0)
-                {
-                    /* don't make a second block request until the endgame */
-                    if (s->endgame == 0)
-                    {
-                        continue;
-                    }
+    /* then the rest, rarest first */
+    for (int i = 0; i < s->pieceBucketCount && got < numwant; ++i)
+    {
+        struct piece_bucket const* const bucket = s->pieceBuckets[i];
 
-                    /* don't have more than two peers requesting this block */
-                    if (peerCount > 1)
-                    {
-                        continue;
-                    }
+        for (int salt = 0; salt < PIECE_SALT_COUNT && got < numwant; ++salt)
+        {
+            for (struct weighted_piece* p = bucket->pieces[salt]; p != NULL && got < numwant; p = p->next)
+            {
+                /* if the peer has this piece that we want... */
+                if (p->deadline < 0 && tr_bitfieldHas(have, p->index))
+                {
+                    int16_t const oldRequestCount = p->requestCount;
 
-                    /* don't send the same request to the same peer twice */
-                    if (peer == peers[0])
-                    {
-                        continue;
-                    }
+                    got = getNextRequestsFromPiece(s, peer, p, requested, numwant, setme, got, get_intervals);
 
-                    /* in the endgame allow an additional peer to download a
-                       block but only if the peer seems to be handling requests
-                       relatively fast */
-                    if (peer->pendingReqsToPeer + numwant - got < s->endgame)
+                    if (p->requestCount != oldRequestCount)
                     {
-                        continue;
+                        p->nextTouched = touched;
+                        touched = p;
                     }
                 }
-
-                /* update the caller's table */
-                if (!get_intervals)
-                {
-                    setme[got++] = b;
-                }
-                /* if intervals are requested two array entries are necessarry:
-                   one for the interval's starting block and one for its end block */
-                else if (got != 0 && setme[2 * got - 1] == b - 1 && b != first)
-                {
-                    /* expand the last interval */
-                    ++setme[2 * got - 1];
-                }
-                else
-                {
-                    /* begin a new interval */
-                    setme[2 * got] = b;
-                    setme[2 * got + 1] = b;
-                    ++got;
-                }
-
-                /* update our own tables */
-                requestListAdd(s, b, peer);
-                ++p->requestCount;
             }
-
-            tr_ptrArrayDestruct(&peerArr, NULL);
         }
     }
 
-    /* In most cases we've just changed the weights of a small number of pieces.
-     * So rather than qsort()ing the entire array, it's faster to apply an
-     * adaptive insertion sort algorithm. */
-    if (got > 0)
+    /* Now that we're done walking the queue, move the pieces whose
+     * weights we changed. There are only a few, so this is cheap. */
+    while (touched != NULL)
     {
-        /* not enough requests || last piece modified */
-        if (checkedPieceCount == s->pieceCount)
-        {
-            --checkedPieceCount;
-        }
-
-        setComparePieceByWeightTorrent(s);
-
-        for (int i = checkedPieceCount - 1; i >= 0; --i)
-        {
-            bool exact;
-
-            /* relative position! */
-            int const newpos = tr_lowerBound(&s->pieces[i], &s->pieces[i + 1], s->pieceCount - (i + 1),
-                sizeof(struct weighted_piece), comparePieceByWeight, &exact);
-
-            if (newpos > 0)
-            {
-                struct weighted_piece const piece = s->pieces[i];
-                memmove(&s->pieces[i], &s->pieces[i + 1], sizeof(struct weighted_piece) * newpos);
-                s->pieces[i + newpos] = piece;
-            }
-        }
+        struct weighted_piece* p = touched;
+        touched = p->nextTouched;
+        pieceListResortPiece(s, p);
     }
 
-    assertWeightedPiecesAreSorted(t);
+    assertWeightedPiecesAreSorted(s);
     *numgot = got;
 }
 
@@ -1506,92 +2030,37 @@ static void refillUpkeep(evutil_socket_t foo UNUSED, short bar UNUSED, void* vmg
 {
     time_t now;
     time_t too_old;
-    tr_torrent* tor;
-    int cancel_buflen = 0;
-    struct block_request* cancel = NULL;
+    tr_torrent* tor = NULL;
     tr_peerMgr* mgr = vmgr;
     managerLock(mgr);
 
     now = tr_time();
     too_old = now - REQUEST_TTL_SECS;
 
-    /* alloc the temporary "cancel" buffer */
-    tor = NULL;
-
-    while ((tor = tr_torrentNext(mgr->session, tor)) != NULL)
-    {
-        cancel_buflen = MAX(cancel_buflen, tor->swarm->requestCount);
-    }
-
-    if (cancel_buflen > 0)
-    {
-        cancel = tr_new(struct block_request, cancel_buflen);
-    }
-
     /* prune requests that are too old */
-    tor = NULL;
-
     while ((tor = tr_torrentNext(mgr->session, tor)) != NULL)
     {
         tr_swarm* s = tor->swarm;
-        int const n = s->requestCount;
+        struct block_request* next;
 
-        if (n > 0)
+        for (struct block_request* request = s->requests; request != NULL; request = next)
         {
-            int keepCount = 0;
-            int cancelCount = 0;
-
-            for (int i = 0; i < n; ++i)
-            {
-                struct block_request const* const request = &s->requests[i];
-                tr_peerMsgs* msgs = PEER_MSGS(request->peer);
-
-                if (msgs != NULL && request->sentAt <= too_old && !tr_peerMsgsIsReadingBlock(msgs, request->block))
-                {
-                    TR_ASSERT(cancel != NULL);
-                    TR_ASSERT(cancelCount < cancel_buflen);
-
-                    cancel[cancelCount++] = *request;
-                }
-                else
-                {
-                    if (i != keepCount)
-                    {
-                        s->requests[keepCount] = *request;
-                    }
-
-                    keepCount++;
-                }
-            }
+            tr_peerMsgs* msgs = PEER_MSGS(request->peer);
 
-            /* prune out the ones we aren't keeping */
-            s->requestCount = keepCount;
+            next = request->next;
 
-            /* send cancel messages for all the "cancel" ones */
-            for (int i = 0; i < cancelCount; ++i)
+            if (msgs != NULL && request->sentAt <= too_old && !tr_peerMsgsIsReadingBlock(msgs, request->block))
             {
-                struct block_request const* const request = &cancel[i];
-                tr_peerMsgs* msgs = PEER_MSGS(request->peer);
+                tr_block_index_t const block = request->block;
 
-                if (msgs != NULL)
-                {
-                    tr_historyAdd(&request->peer->cancelsSentToPeer, now, 1);
-                    tr_peerMsgsCancel(msgs, request->block);
-                    decrementPendingReqCount(request);
-                }
-            }
-
-            /* decrement the pending request counts for the timed-out blocks */
-            for (int i = 0; i < cancelCount; ++i)
-            {
-                struct block_request const* const request = &cancel[i];
-
-                pieceListRemoveRequest(s, request->block);
+                tr_historyAdd(&request->peer->cancelsSentToPeer, now, 1);
+                tr_peerMsgsCancel(msgs, block);
+                requestListRemoveRequest(s, request);
+                pieceListRemoveRequest(s, block);
             }
         }
     }
 
-    tr_free(cancel);
     tr_timerAddMsec(mgr->refillUpkeepTimer, REFILL_UPKEEP_PERIOD_MSEC);
     managerUnlock(mgr);
 }
@@ -1675,38 +2144,22 @@ static void removeRequestFromTables(tr_swarm* s, tr_block_index_t block, tr_peer
    either way we need to remove all its requests */
 static void peerDeclinedAllRequests(tr_swarm* s, tr_peer const* peer)
 {
-    int n = 0;
-    tr_block_index_t* blocks = tr_new(tr_block_index_t, s->requestCount);
-
-    for (int i = 0; i < s->requestCount; ++i)
+    while (peer->requests != NULL)
     {
-        if (peer == s->requests[i].peer)
-        {
-            blocks[n++] = s->requests[i].block;
-        }
-    }
+        tr_block_index_t const block = peer->requests->block;
 
-    for (int i = 0; i < n; ++i)
-    {
-        removeRequestFromTables(s, blocks[i], peer);
+        requestListRemoveRequest(s, peer->requests);
+        pieceListRemoveRequest(s, block);
     }
-
-    tr_free(blocks);
 }
 
 static void cancelAllRequestsForBlock(tr_swarm* s, tr_block_index_t block, tr_peer* no_notify)
 {
-    int peerCount;
-    tr_peer** peers;
-    tr_ptrArray peerArr;
-
-    peerArr = TR_PTR_ARRAY_INIT;
-    getBlockRequestPeers(s, block, &peerArr);
-    peers = (tr_peer**)tr_ptrArrayPeek(&peerArr, &peerCount);
+    struct block_request const* r;
 
-    for (int i = 0; i < peerCount; ++i)
+    while ((r = getBlockRequests(s, block)) != NULL)
     {
-        tr_peer* p = peers[i];
+        tr_peer* p = r->peer;
 
         if (p != no_notify && tr_isPeerMsgs(p))
         {
@@ -1716,8 +2169,6 @@ static void cancelAllRequestsForBlock(tr_swarm* s, tr_block_index_t block, tr_pe
 
         removeRequestFromTables(s, block, p);
     }
-
-    tr_ptrArrayDestruct(&peerArr, NULL);
 }
 
 void tr_peerMgrPieceCompleted(tr_torrent* tor, tr_piece_index_t p)
@@ -1873,8 +2324,8 @@ static void peerCallbackFunc(tr_peer* peer, tr_peer_event const* e, void* vs)
             tr_block_index_t const block = _tr_block(tor, p, e->offset);
             cancelAllRequestsForBlock(s, block, peer);
             tr_historyAdd(&peer->blocksSentToClient, tr_time(), 1);
-            pieceListResortPiece(s, pieceListLookup(s, p));
             tr_torrentGotBlock(tor, block);
+            pieceListResortPiece(s, pieceListLookup(s, p));
             break;
         }
 
@@ -2276,6 +2727,9 @@ void tr_peerMgrGotBadPiece(tr_torrent* tor, tr_piece_index_t pieceIndex)
     }
 
     tr_announcerAddBytes(tor, TR_ANN_CORRUPT, byteCount);
+
+    /* its blocks are missing again */
+    pieceListResortPiece(s, pieceListLookup(s, pieceIndex));
 }
 
 int tr_pexCompare(void const* va, void const* vb)
@@ -2482,7 +2936,7 @@ void tr_peerMgrStartTorrent(tr_torrent* tor)
 
     s->isRunning = true;
     s->maxPeers = tor->maxConnectedPeers;
-    s->pieceSortState = PIECES_UNSORTED;
+    s->pieceQueueIsStale = true;
 
     // rechoke soon
     tr_timerAddMsec(s->manager->rechokeTimer, 100);
@@ -2495,7 +2949,7 @@ static void stopSwarm(tr_swarm* swarm)
     swarm->isRunning = false;
 
     replicationFree(swarm);
-    invalidatePieceSorting(swarm);
+    swarm->pieceQueueIsStale = true;
 
     removeAllPeers(swarm);
 
@@ -2904,7 +3358,7 @@ void tr_peerMgrClearInterest(tr_torrent* tor)
 }
 
 /* does this peer have any pieces that we want? */
-static bool isPeerInteresting(tr_torrent* const tor, bool const* const piece_is_interesting, tr_peer const* const peer)
+static bool isPeerInteresting(tr_torrent* const tor, tr_bitfield const* const interesting_pieces, tr_peer const* const peer)
 {
     /* these cases should have already been handled by the calling code... */
     TR_ASSERT(!tr_torrentIsSeed(tor));
@@ -2915,15 +3369,7 @@ static bool isPeerInteresting(tr_torrent* const tor, bool const* const piece_is_
         return true;
     }
 
-    for (tr_piece_index_t i = 0; i < tor->info.pieceCount; ++i)
-    {
-        if (piece_is_interesting[i] && tr_bitfieldHas(&peer->have, i))
-        {
-            return true;
-        }
-    }
-
-    return false;
+    return tr_bitfieldIntersects(interesting_pieces, &peer->have, tor->info.pieceCount);
 }
 
 typedef enum
@@ -3051,16 +3497,19 @@ static void rechokeDownloads(tr_swarm* s)
 
     if (peerCount > 0)
     {
-        bool* piece_is_interesting;
+        tr_bitfield interesting_pieces;
         tr_torrent const* const tor = s->tor;
-        int const n = tor->info.pieceCount;
+        tr_piece_index_t const n = tor->info.pieceCount;
 
         /* build a bitfield of interesting pieces... */
-        piece_is_interesting = tr_new(bool, n);
+        tr_bitfieldConstruct(&interesting_pieces, n);
 
-        for (int i = 0; i < n; ++i)
+        for (tr_piece_index_t i = 0; i < n; ++i)
         {
-            piece_is_interesting[i] = !tor->info.pieces[i].dnd && !tr_torrentPieceIsComplete(tor, i);
+            if (!tor->info.pieces[i].dnd && !tr_torrentPieceIsComplete(tor, i))
+            {
+                tr_bitfieldAdd(&interesting_pieces, i);
+            }
         }
 
         /* decide WHICH peers to be interested in (based on their cancel-to-block ratio) */
@@ -3068,7 +3517,7 @@ static void rechokeDownloads(tr_swarm* s)
         {
             tr_peer* peer = tr_ptrArrayNth(&s->peers, i);
 
-            if (!isPeerInteresting(s->tor, piece_is_interesting, peer))
+            if (!isPeerInteresting(s->tor, &interesting_pieces, peer))
             {
                 tr_peerMsgsSetInterested(PEER_MSGS(peer), false);
             }
@@ -3111,7 +3560,7 @@ static void rechokeDownloads(tr_swarm* s)
             }
         }
 
-        tr_free(piece_is_interesting);
+        tr_bitfieldDestruct(&interesting_pieces);
     }
 
     /* now that we know which & how many peers to be interested in... update the peer interest */
@@ -19,6 +19,7 @@
 #include "cache.h"
 #include "completion.h"
 #include "file.h"
+#include "filemap.h"
 #include "log.h"
 #include "peer-io.h"
 #include "peer-mgr.h"
@@ -87,6 +88,9 @@ enum
     MAX_FAST_SET_SIZE = 3,
     /* how many blocks to keep prefetched per peer */
     PREFETCH_SIZE = 18,
+    /* once a peer is walking through the torrent in order,
+       read ahead of it by this many seconds of its upload rate */
+    READAHEAD_SECS = 4,
     /* when we're making requests from another peer,
        batch them together to send enough requests to
        meet our bandwidth goals for the next N seconds */
@@ -186,6 +190,13 @@ struct tr_peerMsgs
 
     int prefetchCount;
 
+    /* the torrent bytes [readAheadBegin...readAheadEnd) that have been read ahead for this peer */
+    uint64_t readAheadBegin;
+    uint64_t readAheadEnd;
+
+    /* blocks that are being read from disk to send to the peer */
+    int pendingBlockReads;
+
     bool is_active[2];
 
     /* how long the outMessages batch should be allowed to grow before
@@ -1339,6 +1350,51 @@ static void updatePeerProgress(tr_peerMsgs* msgs)
     updateInterest(msgs);
 }
 
+/* Read the rest of the requested piece into the cache in one go. If the peer
+ * has moved on to a later piece inside what we've already read ahead for it,
+ * it's walking through the torrent in order, so read as far ahead as we expect
+ * to upload to it in the next READAHEAD_SECS seconds. */
+static void readAhead(tr_peerMsgs* msgs, struct peer_request const* req)
+{
+    tr_torrent* tor = msgs->torrent;
+    uint64_t const begin = tr_pieceOffset(tor, req->index, req->offset, 0);
+    uint64_t end = tr_pieceOffset(tor, req->index, tr_torPieceCountBytes(tor, req->index), 0);
+    uint64_t start = begin;
+
+    if (msgs->readAheadBegin <= begin && begin <= msgs->readAheadEnd)
+    {
+        start = MAX(begin, msgs->readAheadEnd);
+
+        if (req->index > msgs->readAheadBegin / tor->info.pieceSize)
+        {
+            uint64_t const now = tr_time_msec();
+            uint64_t const window = (uint64_t)tr_peerGetPieceSpeed_Bps(&msgs->peer, now, TR_CLIENT_TO_PEER) * READAHEAD_SECS;
+
+            end = MIN(MAX(end, begin + window), tor->info.totalSize);
+        }
+    }
+    else
+    {
+        msgs->readAheadBegin = begin;
+        msgs->readAheadEnd = begin;
+    }
+
+    if (start < end)
+    {
+        tr_piece_index_t const piece = start / tor->info.pieceSize;
+        uint32_t const offset = start - (uint64_t)piece * tor->info.pieceSize;
+        uint64_t const n = tr_cacheReadAhead(getSession(msgs)->cache, tor, piece, offset, end - start);
+
+        if (n == 0 && start == begin)
+        {
+            /* no room to read ahead, so just give the OS a hint */
+            tr_cachePrefetchBlock(getSession(msgs)->cache, tor, req->index, req->offset, req->length);
+        }
+
+        msgs->readAheadEnd = start + n;
+    }
+}
+
 static void prefetchPieces(tr_peerMsgs* msgs)
 {
     if (!getSession(msgs)->isPrefetchEnabled)
@@ -1352,7 +1408,7 @@ static void prefetchPieces(tr_peerMsgs* msgs)
 
         if (requestIsValid(msgs, req))
         {
-            tr_cachePrefetchBlock(getSession(msgs)->cache, msgs->torrent, req->index, req->offset, req->length);
+            readAhead(msgs, req);
             ++msgs->prefetchCount;
         }
     }
@@ -2000,6 +2056,82 @@ static void updateBlockRequests(tr_peerMsgs* msgs)
     }
 }
 
+static struct evbuffer* newBlockMessage(struct peer_request const* req)
+{
+    uint32_t const msglen = 4 + 1 + 4 + 4 + req->length;
+    struct evbuffer* out = evbuffer_new();
+
+    evbuffer_expand(out, msglen - req->length);
+
+    evbuffer_add_uint32(out, sizeof(uint8_t) + 2 * sizeof(uint32_t) + req->length);
+    evbuffer_add_uint8(out, BT_PIECE);
+    evbuffer_add_uint32(out, req->index);
+    evbuffer_add_uint32(out, req->offset);
+
+    return out;
+}
+
+/* `out' holds the whole message, from newBlockMessage() plus the block */
+static void sendBlockMessage(tr_peerMsgs* msgs, struct peer_request const* req, struct evbuffer* out)
+{
+    dbgmsg(msgs, "sending block %u:%u->%u", req->index, req->offset, req->length);
+    TR_ASSERT(evbuffer_get_length(out) == 4 + 1 + 4 + 4 + req->length);
+    tr_peerIoWriteBuf(msgs->io, out, true);
+    msgs->clientSentAnythingAt = tr_time();
+    tr_historyAdd(&msgs->peer.blocksSentToPeer, tr_time(), 1);
+
+    evbuffer_free(out);
+}
+
+/* Send the block straight out of a memory-mapped file, without copying it.
+ * Encrypted peers' data has to be copied to be encrypted anyway, and a
+ * torrent that's still downloading mustn't have its files mapped. */
+static bool sendMappedBlock(tr_peerMsgs* msgs, struct peer_request const* req)
+{
+    struct evbuffer* out;
+
+    if (tr_peerIoIsEncrypted(msgs->io) || !tr_torrentHasAll(msgs->torrent))
+    {
+        return false;
+    }
+
+    out = newBlockMessage(req);
+
+    if (tr_filemapAddBlock(getSession(msgs)->filemap, msgs->torrent, req->index, req->offset, req->length, out) != 0)
+    {
+        evbuffer_free(out);
+        return false;
+    }
+
+    sendBlockMessage(msgs, req, out);
+    return true;
+}
+
+static void blockReadDone(void* vmsgs, int err, tr_piece_index_t piece, uint32_t offset, uint32_t length,
+    uint8_t const* data)
+{
+    tr_peerMsgs* msgs = vmsgs;
+    struct peer_request const req = { .index = piece, .offset = offset, .length = length };
+
+    --msgs->pendingBlockReads;
+
+    if (err != 0)
+    {
+        if (tr_peerIoSupportsFEXT(msgs->io))
+        {
+            protocolSendReject(msgs, &req);
+        }
+    }
+    else
+    {
+        struct evbuffer* out = newBlockMessage(&req);
+
+        evbuffer_expand(out, req.length);
+        evbuffer_add(out, data, req.length);
+        sendBlockMessage(msgs, &req, out);
+    }
+}
+
 static size_t fillOutputBuffer(tr_peerMsgs* msgs, time_t now)
 {
     int piece;
@@ -2099,33 +2231,17 @@ static size_t fillOutputBuffer(tr_peerMsgs* msgs, time_t now)
     ***  Data Blocks
     **/
 
-    if (tr_peerIoGetWriteBufferSpace(msgs->io, now) >= msgs->torrent->blockSize && popNextRequest(msgs, &req))
+    if (tr_peerIoGetWriteBufferSpace(msgs->io, now) >= msgs->torrent->blockSize * (msgs->pendingBlockReads + 1) &&
+        popNextRequest(msgs, &req))
     {
         --msgs->prefetchCount;
 
         if (requestIsValid(msgs, &req) && tr_torrentPieceIsComplete(msgs->torrent, req.index))
         {
-            bool err;
-            uint32_t const msglen = 4 + 1 + 4 + 4 + req.length;
-            struct evbuffer* out;
-            struct evbuffer_iovec iovec[1];
-
-            out = evbuffer_new();
-            evbuffer_expand(out, msglen);
-
-            evbuffer_add_uint32(out, sizeof(uint8_t) + 2 * sizeof(uint32_t) + req.length);
-            evbuffer_add_uint8(out, BT_PIECE);
-            evbuffer_add_uint32(out, req.index);
-            evbuffer_add_uint32(out, req.offset);
-
-            evbuffer_reserve_space(out, req.length, iovec, 1);
-            err = tr_cacheReadBlock(getSession(msgs)->cache, msgs->torrent, req.index, req.offset, req.length,
-                iovec[0].iov_base) != 0;
-            iovec[0].iov_len = req.length;
-            evbuffer_commit_space(out, iovec, 1);
+            bool err = false;
 
             /* check the piece if it needs checking... */
-            if (!err && tr_torrentPieceNeedsCheck(msgs->torrent, req.index))
+            if (tr_torrentPieceNeedsCheck(msgs->torrent, req.index))
             {
                 err = !tr_torrentCheckPiece(msgs->torrent, req.index);
 
@@ -2142,24 +2258,21 @@ static size_t fillOutputBuffer(tr_peerMsgs* msgs, time_t now)
                 {
                     protocolSendReject(msgs, &req);
                 }
+
+                msgs = NULL;
             }
-            else
+            else if (sendMappedBlock(msgs, &req))
             {
-                size_t const n = evbuffer_get_length(out);
-                dbgmsg(msgs, "sending block %u:%u->%u", req.index, req.offset, req.length);
-                TR_ASSERT(n == msglen);
-                tr_peerIoWriteBuf(msgs->io, out, true);
-                bytesWritten += n;
-                msgs->clientSentAnythingAt = now;
-                tr_historyAdd(&msgs->peer.blocksSentToPeer, tr_time(), 1);
+                bytesWritten += req.length;
             }
-
-            evbuffer_free(out);
-
-            if (err)
+            else
             {
-                bytesWritten = 0;
-                msgs = NULL;
+                /* the block gets sent by blockReadDone() once it's been read. Count it
+                 * as written so that our caller keeps the upload pipeline full */
+                ++msgs->pendingBlockReads;
+                bytesWritten += req.length;
+                tr_cacheReadBlockAsync(getSession(msgs)->cache, msgs->torrent, req.index, req.offset, req.length,
+                    blockReadDone, msgs);
             }
         }
         else if (fext) /* peer needs a reject message */
@@ -2599,6 +2712,11 @@ static void peermsgs_destruct(tr_peer* peer)
     tr_peerMsgsSetActive(msgs, TR_UP, false);
     tr_peerMsgsSetActive(msgs, TR_DOWN, false);
 
+    if (msgs->pendingBlockReads != 0)
+    {
+        tr_cacheCancelReads(getSession(msgs)->cache, msgs);
+    }
+
     if (msgs->pexTimer != NULL)
     {
         event_free(msgs->pexTimer);
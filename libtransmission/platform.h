@@ -77,4 +77,19 @@ void tr_lockUnlock(tr_lock*);
 /** @brief return nonzero if the specified lock is locked */
 bool tr_lockHave(tr_lock const*);
 
+typedef struct tr_cond tr_cond;
+
+/** @brief Create a new condition variable, for waiting on a tr_lock */
+tr_cond* tr_condNew(void);
+
+/** @brief Destroy a condition variable */
+void tr_condFree(tr_cond*);
+
+/** @brief Unlock `lock', which must be held exactly once, until `cond' is signalled.
+    Spurious wakeups are possible, so check the condition again afterwards */
+void tr_condWait(tr_cond* cond, tr_lock* lock);
+
+/** @brief Wake up every thread that's waiting on a condition variable */
+void tr_condBroadcast(tr_cond*);
+
 /* @} */
@@ -0,0 +1,235 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <string.h> /* memcmp() */
+
+#include "transmission.h"
+#include "file.h"
+#include "inout.h" /* struct tr_io_span */
+#include "prealloc.h"
+#include "utils.h"
+
+#include "libtransmission-test.h"
+
+/* a bit more than five chunks */
+#define FILE_SIZE (5 * 1024 * 1024 + 1000)
+
+static bool is_file_zeros(char const* path, uint64_t offset, uint64_t size)
+{
+    bool ok;
+    uint8_t buf[4096];
+    tr_sys_file_t fd = tr_sys_file_open(path, TR_SYS_FILE_READ, 0, NULL);
+
+    if (fd == TR_BAD_SYS_FILE)
+    {
+        return false;
+    }
+
+    ok = true;
+
+    while (ok && offset < size)
+    {
+        uint64_t const len = MIN(size - offset, sizeof(buf));
+        uint64_t n_read;
+
+        ok = tr_sys_file_read_at(fd, buf, len, offset, &n_read, NULL) && n_read == len;
+
+        for (uint64_t i = 0; ok && i < len; ++i)
+        {
+            ok = buf[i] == 0;
+        }
+
+        offset += len;
+    }
+
+    tr_sys_file_close(fd, NULL);
+    return ok;
+}
+
+static int test_prealloc_fill(void)
+{
+    char* sandbox = libtest_sandbox_create();
+    char* path = tr_buildPath(sandbox, "file", NULL);
+    tr_prealloc* p = tr_preallocNew();
+    tr_sys_path_info info;
+    uint64_t left;
+
+    /* a write near the end of the file */
+    struct tr_io_span const span = { TR_BAD_SYS_FILE, NULL, 0, FILE_SIZE - 100, 100 };
+
+    libtest_create_file_with_string_contents(path, "");
+    check(tr_preallocAdd(p, 1, 0, path, FILE_SIZE, 0, NULL));
+
+    /* other files aren't affected */
+    check(!tr_preallocGetBytesLeft(p, 1, 1, &left));
+    check(!tr_preallocGetBytesLeft(p, 2, 0, &left));
+
+    /* waiting for the last chunk doesn't mean waiting for the rest of the file */
+    tr_preallocWait(p, 1, &span, 1);
+    check(tr_preallocIsDone(p, 1, &span, 1));
+    check(tr_sys_path_get_info(path, 0, &info, NULL));
+    check_uint(info.size, ==, FILE_SIZE);
+
+    /* once it's all filled, the job goes away */
+    while (tr_preallocGetBytesLeft(p, 1, 0, &left))
+    {
+        check_uint(left, <, FILE_SIZE);
+        tr_wait_msec(10);
+    }
+
+    check(is_file_zeros(path, 0, FILE_SIZE));
+
+    tr_preallocFree(p);
+    tr_free(path);
+    libtest_sandbox_destroy(sandbox);
+    tr_free(sandbox);
+    return 0;
+}
+
+static void on_fill_done(void* vdone)
+{
+    *(bool volatile*)vdone = true;
+}
+
+static int test_prealloc_when_done(void)
+{
+    char* sandbox = libtest_sandbox_create();
+    char* path = tr_buildPath(sandbox, "file", NULL);
+    tr_prealloc* p = tr_preallocNew();
+    bool volatile done = false;
+
+    struct tr_io_span const span = { TR_BAD_SYS_FILE, NULL, 0, FILE_SIZE - 100, 100 };
+
+    libtest_create_file_with_string_contents(path, "");
+    check(tr_preallocAdd(p, 1, 0, path, FILE_SIZE, 0, NULL));
+
+    /* the callback comes once the chunk is filled, without anyone waiting for it */
+    tr_preallocWhenDone(p, 1, &span, 1, on_fill_done, (void*)&done);
+
+    while (!done)
+    {
+        tr_wait_msec(10);
+    }
+
+    check(tr_preallocIsDone(p, 1, &span, 1));
+
+    /* and right away, if it's filled already */
+    done = false;
+    tr_preallocWhenDone(p, 1, &span, 1, on_fill_done, (void*)&done);
+    check(done);
+
+    tr_preallocFree(p);
+    tr_free(path);
+    libtest_sandbox_destroy(sandbox);
+    tr_free(sandbox);
+    return 0;
+}
+
+static void wait_for_fill(tr_prealloc* p, int torrent_id, tr_file_index_t file_index)
+{
+    uint64_t left;
+
+    while (tr_preallocGetBytesLeft(p, torrent_id, file_index, &left))
+    {
+        tr_wait_msec(10);
+    }
+}
+
+static int test_prealloc_offset(void)
+{
+    char* sandbox = libtest_sandbox_create();
+    char* path = tr_buildPath(sandbox, "file", NULL);
+    tr_prealloc* p = tr_preallocNew();
+    tr_sys_path_info info;
+    uint64_t left;
+    size_t contents_len;
+    uint8_t* contents;
+
+    /* a file that was cut short keeps what's in it */
+    libtest_create_file_with_string_contents(path, "hello");
+    check(tr_preallocAdd(p, 1, 0, path, FILE_SIZE, 5, NULL));
+    check(tr_preallocGetBytesLeft(p, 1, 0, &left));
+    check_uint(left, <=, FILE_SIZE - 5);
+    wait_for_fill(p, 1, 0);
+
+    check(tr_sys_path_get_info(path, 0, &info, NULL));
+    check_uint(info.size, ==, FILE_SIZE);
+    check(is_file_zeros(path, 5, FILE_SIZE));
+    contents = tr_loadFile(path, &contents_len, NULL);
+    check(contents != NULL);
+    check_uint(contents_len, ==, FILE_SIZE);
+    check(memcmp(contents, "hello", 5) == 0);
+
+    tr_free(contents);
+    tr_preallocFree(p);
+    tr_free(path);
+    libtest_sandbox_destroy(sandbox);
+    tr_free(sandbox);
+    return 0;
+}
+
+static int test_prealloc_close(void)
+{
+    char* sandbox = libtest_sandbox_create();
+    char* path = tr_buildPath(sandbox, "file", NULL);
+    char* moved = tr_buildPath(sandbox, "moved", NULL);
+    tr_prealloc* p = tr_preallocNew();
+    tr_sys_path_info info;
+    uint64_t left;
+    struct tr_io_span const span = { TR_BAD_SYS_FILE, NULL, 1, 0, FILE_SIZE };
+
+    libtest_create_file_with_string_contents(path, "");
+    check(tr_preallocAdd(p, 1, 0, path, FILE_SIZE, 0, NULL));
+
+    /* once a file's closed, it can be moved */
+    tr_preallocTorrentClose(p, 1);
+    check(!tr_preallocGetBytesLeft(p, 1, 0, &left) || left > 0);
+    check(tr_sys_path_rename(path, moved, NULL));
+
+    /* and when it's opened again, it's finished */
+    check(tr_preallocResume(p, 1, 0, moved, NULL));
+    wait_for_fill(p, 1, 0);
+    check(tr_sys_path_get_info(moved, 0, &info, NULL));
+    check_uint(info.size, ==, FILE_SIZE);
+    check(is_file_zeros(moved, 0, FILE_SIZE));
+
+    /* writes to a closed file don't have to wait, and aren't zeroed afterwards */
+    libtest_create_file_with_string_contents(path, "");
+    check(tr_preallocAdd(p, 1, 1, path, FILE_SIZE, 0, NULL));
+    tr_preallocTorrentClose(p, 1);
+    check(tr_preallocIsDone(p, 1, &span, 1));
+    check(!tr_preallocGetBytesLeft(p, 1, 1, &left));
+
+    /* and once the torrent's gone, so are its files' jobs */
+    check(tr_preallocAdd(p, 1, 2, moved, FILE_SIZE, 0, NULL));
+    tr_preallocTorrentClose(p, 1);
+    tr_preallocTorrentRemove(p, 1);
+    check(!tr_preallocGetBytesLeft(p, 1, 2, &left));
+    check(tr_preallocResume(p, 1, 2, moved, NULL));
+    check(!tr_preallocGetBytesLeft(p, 1, 2, &left));
+
+    tr_preallocFree(p);
+    tr_free(moved);
+    tr_free(path);
+    libtest_sandbox_destroy(sandbox);
+    tr_free(sandbox);
+    return 0;
+}
+
+int main(void)
+{
+    testFunc const tests[] =
+    {
+        test_prealloc_fill,
+        test_prealloc_when_done,
+        test_prealloc_offset,
+        test_prealloc_close
+    };
+
+    return runTests(tests, NUM_TESTS(tests));
+}
@@ -0,0 +1,683 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <inttypes.h>
+
+#include "transmission.h"
+#include "bitfield.h"
+#include "error.h"
+#include "file.h"
+#include "inout.h" /* struct tr_io_span */
+#include "log.h"
+#include "platform.h" /* tr_lock, tr_threadNew() */
+#include "prealloc.h"
+#include "ptrarray.h"
+#include "tr-assert.h"
+#include "utils.h"
+
+#define MY_NAME "Prealloc"
+
+#define dbgmsg(...) tr_logAddDeepNamed(MY_NAME, __VA_ARGS__)
+
+enum
+{
+    /* files are filled a chunk at a time */
+    PREALLOC_CHUNK_SIZE = 1024 * 1024,
+
+    PREALLOC_ALL_FILES = -1
+};
+
+#define NO_CHUNK SIZE_MAX
+
+struct prealloc_job
+{
+    int torrent_id;
+    tr_file_index_t file_index;
+    char* filename;
+    uint64_t length;
+    uint64_t bytes_left;
+
+    /* TR_BAD_SYS_FILE while the file is closed. The job waits for it
+       to be opened again, instead of starting over */
+    tr_sys_file_t fd;
+
+    /* where the filler starts, since there's data in the file before it */
+    uint64_t start;
+
+    /* the chunks that have been filled, or written to by the filler */
+    tr_bitfield filled;
+
+    /* the next chunk to fill, unless a writer is waiting for another one */
+    size_t cursor;
+    size_t urgent_chunk;
+
+    /* the filler is writing to the file right now, so leave it be */
+    bool is_busy;
+    bool is_cancelled;
+};
+
+/* I/O that's queued behind the filler, from tr_preallocWhenDone() */
+struct prealloc_waiter
+{
+    struct prealloc_waiter* next;
+    int torrent_id;
+    struct tr_io_span const* spans;
+    size_t span_count;
+    tr_prealloc_done_func func;
+    void* user_data;
+};
+
+struct tr_prealloc
+{
+    /* everything below is protected by `lock' */
+    tr_lock* lock;
+
+    /* broadcast whenever a chunk is filled or a job goes away */
+    tr_cond* progress;
+
+    tr_ptrArray jobs; /* struct prealloc_job*, oldest first */
+    struct prealloc_waiter* waiters;
+    bool is_filler_running;
+};
+
+static inline size_t getChunk(uint64_t offset)
+{
+    return offset / PREALLOC_CHUNK_SIZE;
+}
+
+static inline bool jobIsParked(struct prealloc_job const* job)
+{
+    return job->fd == TR_BAD_SYS_FILE;
+}
+
+/* the number of bytes the filler writes to this chunk */
+static uint64_t getChunkLength(struct prealloc_job const* job, size_t chunk)
+{
+    uint64_t const begin = MAX((uint64_t)chunk * PREALLOC_CHUNK_SIZE, job->start);
+    uint64_t const end = MIN((uint64_t)(chunk + 1) * PREALLOC_CHUNK_SIZE, job->length);
+
+    return end - begin;
+}
+
+static void jobFree(struct prealloc_job* job)
+{
+    if (!jobIsParked(job))
+    {
+        tr_sys_file_close(job->fd, NULL);
+    }
+
+    tr_bitfieldDestruct(&job->filled);
+    tr_free(job->filename);
+    tr_free(job);
+}
+
+static struct prealloc_job* findJob(tr_prealloc* p, int torrent_id, tr_file_index_t file_index)
+{
+    for (int i = 0, n = tr_ptrArraySize(&p->jobs); i < n; ++i)
+    {
+        struct prealloc_job* job = tr_ptrArrayNth(&p->jobs, i);
+
+        if (job->torrent_id == torrent_id && job->file_index == file_index)
+        {
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+static void removeJob(tr_prealloc* p, struct prealloc_job* job)
+{
+    for (int i = 0, n = tr_ptrArraySize(&p->jobs); i < n; ++i)
+    {
+        if (tr_ptrArrayNth(&p->jobs, i) == job)
+        {
+            tr_ptrArrayRemove(&p->jobs, i);
+            break;
+        }
+    }
+}
+
+static void parkJob(struct prealloc_job* job)
+{
+    TR_ASSERT(!job->is_busy);
+
+    dbgmsg("setting \"%s\" aside with %" PRIu64 " bytes left", job->filename, job->bytes_left);
+
+    tr_sys_file_close(job->fd, NULL);
+    job->fd = TR_BAD_SYS_FILE;
+    job->urgent_chunk = NO_CHUNK;
+    job->is_cancelled = false;
+}
+
+/* call with the lock held. Returns the first chunk the spans need that
+   hasn't been filled yet, and the job it belongs to, or NULL if there's none.
+   The chunks of a parked job are written to as they are, and the filler
+   mustn't zero them later, so they're taken off its list instead */
+static struct prealloc_job* findUnfilled(tr_prealloc* p, int torrent_id, struct tr_io_span const* spans,
+    size_t span_count, size_t* setme_chunk)
+{
+    if (tr_ptrArrayEmpty(&p->jobs))
+    {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < span_count; ++i)
+    {
+        struct prealloc_job* job = findJob(p, torrent_id, spans[i].file_index);
+
+        if (job != NULL && spans[i].length > 0)
+        {
+            size_t const end = getChunk(spans[i].file_offset + spans[i].length - 1) + 1;
+
+            for (size_t chunk = getChunk(spans[i].file_offset); chunk < end; ++chunk)
+            {
+                if (tr_bitfieldHas(&job->filled, chunk))
+                {
+                    continue;
+                }
+
+                if (!jobIsParked(job))
+                {
+                    *setme_chunk = chunk;
+                    return job;
+                }
+
+                tr_bitfieldAdd(&job->filled, chunk);
+                job->bytes_left -= getChunkLength(job, chunk);
+            }
+
+            if (jobIsParked(job) && job->bytes_left == 0)
+            {
+                removeJob(p, job);
+                jobFree(job);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* call with the lock held. Takes the waiters whose spans are ready, and
+   moves the chunks that the others are waiting for to the front of the line */
+static struct prealloc_waiter* takeReadyWaiters(tr_prealloc* p)
+{
+    struct prealloc_waiter* ready = NULL;
+    struct prealloc_waiter** walk = &p->waiters;
+
+    while (*walk != NULL)
+    {
+        size_t chunk;
+        struct prealloc_waiter* w = *walk;
+        struct prealloc_job* job = findUnfilled(p, w->torrent_id, w->spans, w->span_count, &chunk);
+
+        if (job == NULL)
+        {
+            *walk = w->next;
+            w->next = ready;
+            ready = w;
+        }
+        else
+        {
+            if (job->urgent_chunk == NO_CHUNK)
+            {
+                job->urgent_chunk = chunk;
+            }
+
+            walk = &w->next;
+        }
+    }
+
+    return ready;
+}
+
+/* call without the lock, since the callbacks may do I/O */
+static void runWaiters(struct prealloc_waiter* ready)
+{
+    while (ready != NULL)
+    {
+        struct prealloc_waiter* next = ready->next;
+
+        (*ready->func)(ready->user_data);
+        tr_free(ready);
+        ready = next;
+    }
+}
+
+/***
+****
+***/
+
+/* call with the lock held */
+static struct prealloc_job* getNextJob(tr_prealloc* p, size_t* setme_chunk)
+{
+    int const n = tr_ptrArraySize(&p->jobs);
+
+    /* chunks that writers are waiting for go first */
+    for (int i = 0; i < n; ++i)
+    {
+        struct prealloc_job* job = tr_ptrArrayNth(&p->jobs, i);
+        size_t const chunk = job->urgent_chunk;
+
+        if (chunk != NO_CHUNK)
+        {
+            job->urgent_chunk = NO_CHUNK;
+
+            if (!tr_bitfieldHas(&job->filled, chunk))
+            {
+                *setme_chunk = chunk;
+                return job;
+            }
+        }
+    }
+
+    /* otherwise, fill the oldest open file from start to end */
+    for (int i = 0; i < n; ++i)
+    {
+        struct prealloc_job* job = tr_ptrArrayNth(&p->jobs, i);
+
+        if (jobIsParked(job))
+        {
+            continue;
+        }
+
+        while (tr_bitfieldHas(&job->filled, job->cursor))
+        {
+            ++job->cursor;
+        }
+
+        *setme_chunk = job->cursor;
+        return job;
+    }
+
+    return NULL;
+}
+
+static void fillerFunc(void* vp)
+{
+    tr_prealloc* p = vp;
+    uint8_t* zeros = tr_new0(uint8_t, PREALLOC_CHUNK_SIZE);
+
+    tr_lockLock(p->lock);
+
+    for (;;)
+    {
+        size_t chunk;
+        uint64_t offset;
+        uint64_t len;
+        bool success;
+        tr_error* error = NULL;
+        struct prealloc_waiter* ready;
+        struct prealloc_job* job = getNextJob(p, &chunk);
+
+        if (job == NULL)
+        {
+            break;
+        }
+
+        offset = MAX((uint64_t)chunk * PREALLOC_CHUNK_SIZE, job->start);
+        len = getChunkLength(job, chunk);
+        job->is_busy = true;
+
+        tr_lockUnlock(p->lock);
+
+        success = tr_sys_file_write_at(job->fd, zeros, len, offset, NULL, &error);
+
+        tr_lockLock(p->lock);
+
+        job->is_busy = false;
+
+        if (success)
+        {
+            tr_bitfieldAdd(&job->filled, chunk);
+            job->bytes_left -= len;
+        }
+        else
+        {
+            tr_logAddError(_("Couldn't preallocate file \"%1$s\" (%2$s, size: %3$" PRIu64 "): %4$s"), job->filename,
+                _("full"), job->length, error->message);
+            tr_error_free(error);
+        }
+
+        if (!success || job->bytes_left == 0)
+        {
+            if (job->bytes_left == 0)
+            {
+                tr_logAddDebug(_("Preallocated file \"%1$s\" (%2$s, size: %3$" PRIu64 ")"), job->filename, _("full"),
+                    job->length);
+            }
+
+            removeJob(p, job);
+            jobFree(job);
+        }
+        else if (job->is_cancelled)
+        {
+            parkJob(job);
+        }
+
+        tr_condBroadcast(p->progress);
+
+        if ((ready = takeReadyWaiters(p)) != NULL)
+        {
+            tr_lockUnlock(p->lock);
+            runWaiters(ready);
+            tr_lockLock(p->lock);
+        }
+    }
+
+    p->is_filler_running = false;
+    tr_condBroadcast(p->progress);
+
+    tr_lockUnlock(p->lock);
+
+    tr_free(zeros);
+}
+
+/***
+****
+***/
+
+tr_prealloc* tr_preallocNew(void)
+{
+    tr_prealloc* p = tr_new0(tr_prealloc, 1);
+
+    p->lock = tr_lockNew();
+    p->progress = tr_condNew();
+    p->jobs = TR_PTR_ARRAY_INIT;
+
+    return p;
+}
+
+static void closeMatching(tr_prealloc* p, int torrent_id, tr_file_index_t file_index)
+{
+    bool is_busy = false;
+    struct prealloc_waiter* ready;
+
+    tr_lockLock(p->lock);
+
+    for (int i = tr_ptrArraySize(&p->jobs) - 1; i >= 0; --i)
+    {
+        struct prealloc_job* job = tr_ptrArrayNth(&p->jobs, i);
+
+        if ((torrent_id == -1 || job->torrent_id == torrent_id) &&
+            (file_index == (tr_file_index_t)PREALLOC_ALL_FILES || job->file_index == file_index))
+        {
+            if (job->is_busy)
+            {
+                /* the filler will park it once it's done with this chunk */
+                job->is_cancelled = true;
+                is_busy = true;
+            }
+            else if (!jobIsParked(job))
+            {
+                parkJob(job);
+            }
+        }
+    }
+
+    /* the caller may be about to move or delete the file, so wait until it's closed */
+    while (is_busy)
+    {
+        is_busy = false;
+
+        for (int i = 0, n = tr_ptrArraySize(&p->jobs); !is_busy && i < n; ++i)
+        {
+            struct prealloc_job const* job = tr_ptrArrayNth(&p->jobs, i);
+            is_busy = job->is_cancelled;
+        }
+
+        if (is_busy)
+        {
+            tr_condWait(p->progress, p->lock);
+        }
+    }
+
+    /* I/O that was waiting for those files can go ahead now */
+    ready = takeReadyWaiters(p);
+
+    tr_lockUnlock(p->lock);
+
+    runWaiters(ready);
+}
+
+void tr_preallocFree(tr_prealloc* p)
+{
+    closeMatching(p, -1, (tr_file_index_t)PREALLOC_ALL_FILES);
+
+    tr_lockLock(p->lock);
+
+    while (p->is_filler_running)
+    {
+        tr_condWait(p->progress, p->lock);
+    }
+
+    TR_ASSERT(p->waiters == NULL);
+
+    tr_lockUnlock(p->lock);
+
+    tr_ptrArrayDestruct(&p->jobs, (PtrArrayForeachFunc)jobFree);
+    tr_condFree(p->progress);
+    tr_lockFree(p->lock);
+    tr_free(p);
+}
+
+/* call with the lock held */
+static void startFiller(tr_prealloc* p)
+{
+    if (!p->is_filler_running)
+    {
+        p->is_filler_running = true;
+        tr_threadNew(fillerFunc, p);
+    }
+}
+
+/* call with the lock held */
+static bool resumeJob(tr_prealloc* p, struct prealloc_job* job, char const* filename, tr_error** error)
+{
+    TR_ASSERT(jobIsParked(job));
+
+    if ((job->fd = tr_sys_file_open(filename, TR_SYS_FILE_WRITE, 0666, error)) == TR_BAD_SYS_FILE)
+    {
+        removeJob(p, job);
+        jobFree(job);
+        return false;
+    }
+
+    /* it may have been moved while it was closed */
+    if (tr_strcmp0(job->filename, filename) != 0)
+    {
+        tr_free(job->filename);
+        job->filename = tr_strdup(filename);
+    }
+
+    dbgmsg("filling \"%s\" again, with %" PRIu64 " bytes left", filename, job->bytes_left);
+
+    startFiller(p);
+    return true;
+}
+
+bool tr_preallocAdd(tr_prealloc* p, int torrent_id, tr_file_index_t file_index, char const* filename, uint64_t length,
+    uint64_t offset, tr_error** error)
+{
+    TR_ASSERT(offset < length);
+
+    bool success = true;
+    struct prealloc_job* job;
+
+    tr_lockLock(p->lock);
+
+    job = findJob(p, torrent_id, file_index);
+
+    if (job != NULL && jobIsParked(job) && offset == 0)
+    {
+        /* the file was made anew since it was closed, so start over */
+        removeJob(p, job);
+        jobFree(job);
+        job = NULL;
+    }
+
+    if (job != NULL)
+    {
+        /* it knows better than `offset' which chunks are left */
+        if (jobIsParked(job))
+        {
+            success = resumeJob(p, job, filename, error);
+        }
+    }
+    else
+    {
+        tr_sys_file_t const fd = tr_sys_file_open(filename, TR_SYS_FILE_WRITE, 0666, error);
+
+        if (fd == TR_BAD_SYS_FILE)
+        {
+            success = false;
+        }
+        else
+        {
+            job = tr_new0(struct prealloc_job, 1);
+            job->torrent_id = torrent_id;
+            job->file_index = file_index;
+            job->filename = tr_strdup(filename);
+            job->fd = fd;
+            job->length = length;
+            job->bytes_left = length - offset;
+            job->start = offset;
+            job->cursor = getChunk(offset);
+            job->urgent_chunk = NO_CHUNK;
+            tr_bitfieldConstruct(&job->filled, getChunk(length - 1) + 1);
+            tr_bitfieldAddRange(&job->filled, 0, getChunk(offset));
+
+            dbgmsg("filling \"%s\" (%" PRIu64 " bytes, from %" PRIu64 ") in the background", filename, length, offset);
+
+            tr_ptrArrayAppend(&p->jobs, job);
+            startFiller(p);
+        }
+    }
+
+    tr_lockUnlock(p->lock);
+
+    return success;
+}
+
+bool tr_preallocResume(tr_prealloc* p, int torrent_id, tr_file_index_t file_index, char const* filename, tr_error** error)
+{
+    bool success = true;
+    struct prealloc_job* job;
+
+    tr_lockLock(p->lock);
+
+    if ((job = findJob(p, torrent_id, file_index)) != NULL && jobIsParked(job))
+    {
+        success = resumeJob(p, job, filename, error);
+    }
+
+    tr_lockUnlock(p->lock);
+
+    return success;
+}
+
+bool tr_preallocGetBytesLeft(tr_prealloc* p, int torrent_id, tr_file_index_t file_index, uint64_t* setme)
+{
+    struct prealloc_job const* job;
+
+    tr_lockLock(p->lock);
+
+    if ((job = findJob(p, torrent_id, file_index)) != NULL)
+    {
+        *setme = job->bytes_left;
+    }
+
+    tr_lockUnlock(p->lock);
+
+    return job != NULL;
+}
+
+bool tr_preallocIsDone(tr_prealloc* p, int torrent_id, struct tr_io_span const* spans, size_t span_count)
+{
+    size_t chunk;
+    bool is_done;
+
+    tr_lockLock(p->lock);
+    is_done = findUnfilled(p, torrent_id, spans, span_count, &chunk) == NULL;
+    tr_lockUnlock(p->lock);
+
+    return is_done;
+}
+
+void tr_preallocWait(tr_prealloc* p, int torrent_id, struct tr_io_span const* spans, size_t span_count)
+{
+    size_t chunk;
+    struct prealloc_job* job;
+
+    tr_lockLock(p->lock);
+
+    while ((job = findUnfilled(p, torrent_id, spans, span_count, &chunk)) != NULL)
+    {
+        /* move it to the front of the line */
+        if (job->urgent_chunk == NO_CHUNK)
+        {
+            job->urgent_chunk = chunk;
+        }
+
+        tr_condWait(p->progress, p->lock);
+    }
+
+    tr_lockUnlock(p->lock);
+}
+
+void tr_preallocWhenDone(tr_prealloc* p, int torrent_id, struct tr_io_span const* spans, size_t span_count,
+    tr_prealloc_done_func func, void* user_data)
+{
+    struct prealloc_waiter* w = tr_new(struct prealloc_waiter, 1);
+    struct prealloc_waiter* ready;
+
+    w->torrent_id = torrent_id;
+    w->spans = spans;
+    w->span_count = span_count;
+    w->func = func;
+    w->user_data = user_data;
+
+    tr_lockLock(p->lock);
+    w->next = p->waiters;
+    p->waiters = w;
+    ready = takeReadyWaiters(p);
+    tr_lockUnlock(p->lock);
+
+    /* if the filler finished those chunks just now, it's called right here */
+    runWaiters(ready);
+}
+
+void tr_preallocFileClose(tr_prealloc* p, int torrent_id, tr_file_index_t file_index)
+{
+    closeMatching(p, torrent_id, file_index);
+}
+
+void tr_preallocTorrentClose(tr_prealloc* p, int torrent_id)
+{
+    closeMatching(p, torrent_id, (tr_file_index_t)PREALLOC_ALL_FILES);
+}
+
+void tr_preallocTorrentRemove(tr_prealloc* p, int torrent_id)
+{
+    closeMatching(p, torrent_id, (tr_file_index_t)PREALLOC_ALL_FILES);
+
+    tr_lockLock(p->lock);
+
+    for (int i = tr_ptrArraySize(&p->jobs) - 1; i >= 0; --i)
+    {
+        struct prealloc_job* job = tr_ptrArrayNth(&p->jobs, i);
+
+        if (job->torrent_id == torrent_id)
+        {
+            tr_ptrArrayRemove(&p->jobs, i);
+            jobFree(job);
+        }
+    }
+
+    tr_lockUnlock(p->lock);
+}
@@ -0,0 +1,94 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#pragma once
+
+#ifndef __TRANSMISSION__
+#error only libtransmission should #include this header.
+#endif
+
+struct tr_io_span;
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+/**
+ * Full preallocation of files by writing zeros to them, for filesystems
+ * that can't allocate space any other way.
+ *
+ * That can take minutes for a big file, so it's done by a background
+ * thread, a chunk at a time. Writes to a file that's being filled only
+ * have to wait for the chunks they touch, which are filled ahead of the
+ * rest of the file.
+ *
+ * Closing a file, e.g. when its torrent is paused, sets its job aside
+ * until the file's opened for writing again. A file that's reopened
+ * short, e.g. after a restart, is filled from where it ends.
+ */
+typedef struct tr_prealloc tr_prealloc;
+
+tr_prealloc* tr_preallocNew(void);
+
+/** Stops filling any files that aren't done yet, and forgets about them. */
+void tr_preallocFree(tr_prealloc* p);
+
+/**
+ * Starts filling the file in the background, from `offset' to `length'.
+ * If its job was set aside, that's picked up again instead, unless
+ * `offset' is 0 and so the file is new.
+ *
+ * @return true on success, or false if the file couldn't be opened.
+ */
+bool tr_preallocAdd(tr_prealloc* p, int torrent_id, tr_file_index_t file_index, char const* filename, uint64_t length,
+    uint64_t offset, struct tr_error** error);
+
+/**
+ * Picks up filling the file again if it was closed before it was done.
+ *
+ * @return true on success, or false if the file couldn't be opened.
+ */
+bool tr_preallocResume(tr_prealloc* p, int torrent_id, tr_file_index_t file_index, char const* filename,
+    struct tr_error** error);
+
+/** Returns true if the file is being filled or waiting to be, and how much of it is left. */
+bool tr_preallocGetBytesLeft(tr_prealloc* p, int torrent_id, tr_file_index_t file_index, uint64_t* setme);
+
+/**
+ * Returns true if the spans can be written without waiting. Chunks of a
+ * closed file are never waited for, and won't be zeroed afterwards.
+ */
+bool tr_preallocIsDone(tr_prealloc* p, int torrent_id, struct tr_io_span const* spans, size_t span_count);
+
+/** Waits until the spans can be written. This blocks, so the libtransmission thread uses tr_preallocWhenDone() instead. */
+void tr_preallocWait(tr_prealloc* p, int torrent_id, struct tr_io_span const* spans, size_t span_count);
+
+typedef void (* tr_prealloc_done_func)(void* user_data);
+
+/**
+ * Calls `func' once the spans can be written, without waiting for it.
+ * That's from the filler thread, or from here if they're ready already.
+ * The spans have to stay valid until then.
+ */
+void tr_preallocWhenDone(tr_prealloc* p, int torrent_id, struct tr_io_span const* spans, size_t span_count,
+    tr_prealloc_done_func func, void* user_data);
+
+/**
+ * Stops filling the file, and closes it until tr_preallocResume().
+ * If it's being written to right now, this waits for that chunk to finish.
+ */
+void tr_preallocFileClose(tr_prealloc* p, int torrent_id, tr_file_index_t file_index);
+
+/** Like tr_preallocFileClose(), for all of the torrent's files. */
+void tr_preallocTorrentClose(tr_prealloc* p, int torrent_id);
+
+/** Like tr_preallocTorrentClose(), and forgets about the torrent's files. */
+void tr_preallocTorrentRemove(tr_prealloc* p, int torrent_id);
+
+/* @} */
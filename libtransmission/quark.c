@@ -60,6 +60,10 @@ static struct tr_key_struct const my_static[] =
     Q("blocks"),
     Q("bytesCompleted"),
     Q("cache-size-mb"),
+    Q("cache-sync-enabled"),
+    Q("cacheReadEvictions"),
+    Q("cacheReadHits"),
+    Q("cacheReadMisses"),
     Q("clientIsChoked"),
     Q("clientIsInterested"),
     Q("clientName"),
@@ -85,6 +89,9 @@ static struct tr_key_struct const my_static[] =
     Q("details-window-height"),
     Q("details-window-width"),
     Q("dht-enabled"),
+    Q("disk-io-queue-depth"),
+    Q("disk-io-threads"),
+    Q("diskQueueDepth"),
     Q("display-name"),
     Q("dnd"),
     Q("done-date"),
@@ -116,16 +123,22 @@ static struct tr_key_struct const my_static[] =
     Q("etaIdle"),
     Q("failure reason"),
     Q("fields"),
+    Q("fileCacheCloses"),
+    Q("fileCacheEvictions"),
+    Q("fileCacheOpens"),
     Q("fileStats"),
     Q("filename"),
     Q("files"),
     Q("files-added"),
+    Q("files-sequential"),
+    Q("files-unsequential"),
     Q("files-unwanted"),
     Q("files-wanted"),
     Q("filesAdded"),
     Q("filter-mode"),
     Q("filter-text"),
     Q("filter-trackers"),
+    Q("fingerprints"),
     Q("flagStr"),
     Q("flags"),
     Q("format"),
@@ -157,6 +170,7 @@ static struct tr_key_struct const my_static[] =
     Q("info_hash"),
     Q("inhibit-desktop-hibernation"),
     Q("interval"),
+    Q("io-uring-enabled"),
     Q("ip"),
     Q("ipv4"),
     Q("ipv6"),
@@ -207,6 +221,7 @@ static struct tr_key_struct const my_static[] =
     Q("method"),
     Q("min interval"),
     Q("min_request_interval"),
+    Q("mmap-size-mb"),
     Q("move"),
     Q("msg_type"),
     Q("mtimes"),
@@ -323,6 +338,9 @@ static struct tr_key_struct const my_static[] =
     Q("seedRatioMode"),
     Q("seederCount"),
     Q("seeding-time-seconds"),
+    Q("sequential"),
+    Q("sequential-download"),
+    Q("sequentialDownload"),
     Q("session-count"),
     Q("session-id"),
     Q("sessionCount"),
@@ -402,6 +420,15 @@ static struct tr_key_struct const my_static[] =
     Q("ut_recommend"),
     Q("utp-enabled"),
     Q("v"),
+    Q("verify-direct-io"),
+    Q("verify-full-speed"),
+    Q("verify-max-concurrent"),
+    Q("verify-per-device"),
+    Q("verify-smart"),
+    Q("verify-smart-sample"),
+    Q("verify-speed-limit"),
+    Q("verify-threads"),
+    Q("verifyQueuePosition"),
     Q("version"),
     Q("wanted"),
     Q("warning message"),
@@ -60,6 +60,10 @@ enum
     TR_KEY_blocks,
     TR_KEY_bytesCompleted,
     TR_KEY_cache_size_mb,
+    TR_KEY_cache_sync_enabled,
+    TR_KEY_cacheReadEvictions,
+    TR_KEY_cacheReadHits,
+    TR_KEY_cacheReadMisses,
     TR_KEY_clientIsChoked,
     TR_KEY_clientIsInterested,
     TR_KEY_clientName,
@@ -85,6 +89,9 @@ enum
     TR_KEY_details_window_height,
     TR_KEY_details_window_width,
     TR_KEY_dht_enabled,
+    TR_KEY_disk_io_queue_depth,
+    TR_KEY_disk_io_threads,
+    TR_KEY_diskQueueDepth,
     TR_KEY_display_name,
     TR_KEY_dnd,
     TR_KEY_done_date,
@@ -116,16 +123,22 @@ enum
     TR_KEY_etaIdle,
     TR_KEY_failure_reason,
     TR_KEY_fields,
+    TR_KEY_fileCacheCloses,
+    TR_KEY_fileCacheEvictions,
+    TR_KEY_fileCacheOpens,
     TR_KEY_fileStats,
     TR_KEY_filename,
     TR_KEY_files,
     TR_KEY_files_added,
+    TR_KEY_files_sequential,
+    TR_KEY_files_unsequential,
     TR_KEY_files_unwanted,
     TR_KEY_files_wanted,
     TR_KEY_filesAdded,
     TR_KEY_filter_mode,
     TR_KEY_filter_text,
     TR_KEY_filter_trackers,
+    TR_KEY_fingerprints,
     TR_KEY_flagStr,
     TR_KEY_flags,
     TR_KEY_format,
@@ -157,6 +170,7 @@ enum
     TR_KEY_info_hash,
     TR_KEY_inhibit_desktop_hibernation,
     TR_KEY_interval,
+    TR_KEY_io_uring_enabled,
     TR_KEY_ip,
     TR_KEY_ipv4,
     TR_KEY_ipv6,
@@ -207,6 +221,7 @@ enum
     TR_KEY_method,
     TR_KEY_min_interval,
     TR_KEY_min_request_interval,
+    TR_KEY_mmap_size_mb,
     TR_KEY_move,
     TR_KEY_msg_type,
     TR_KEY_mtimes,
@@ -323,6 +338,9 @@ enum
     TR_KEY_seedRatioMode,
     TR_KEY_seederCount,
     TR_KEY_seeding_time_seconds,
+    TR_KEY_sequential,
+    TR_KEY_sequential_download,
+    TR_KEY_sequentialDownload,
     TR_KEY_session_count,
     TR_KEY_session_id,
     TR_KEY_sessionCount,
@@ -402,6 +420,15 @@ enum
     TR_KEY_ut_recommend,
     TR_KEY_utp_enabled,
     TR_KEY_v,
+    TR_KEY_verify_direct_io,
+    TR_KEY_verify_full_speed,
+    TR_KEY_verify_max_concurrent,
+    TR_KEY_verify_per_device,
+    TR_KEY_verify_smart,
+    TR_KEY_verify_smart_sample,
+    TR_KEY_verify_speed_limit,
+    TR_KEY_verify_threads,
+    TR_KEY_verifyQueuePosition,
     TR_KEY_version,
     TR_KEY_wanted,
     TR_KEY_warning_message,
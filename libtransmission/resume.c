@@ -12,6 +12,7 @@
 #include "completion.h"
 #include "error.h"
 #include "file.h"
+#include "fingerprint.h"
 #include "log.h"
 #include "metainfo.h" /* tr_metainfoGetBasename() */
 #include "peer-mgr.h" /* pex */
@@ -149,6 +150,55 @@ static uint64_t loadLabels(tr_variant* dict, tr_torrent* tor)
 ****
 ***/
 
+static void saveSequential(tr_variant* dict, tr_torrent const* tor)
+{
+    tr_variant* list;
+    tr_info const* const inf = tr_torrentInfo(tor);
+    tr_file_index_t const n = inf->fileCount;
+
+    tr_variantDictAddBool(dict, TR_KEY_sequential_download, tor->sequentialDownload);
+
+    list = tr_variantDictAddList(dict, TR_KEY_sequential, n);
+
+    for (tr_file_index_t i = 0; i < n; ++i)
+    {
+        tr_variantListAddBool(list, inf->files[i].sequential);
+    }
+}
+
+static uint64_t loadSequential(tr_variant* dict, tr_torrent* tor)
+{
+    uint64_t ret = 0;
+    bool boolVal;
+    tr_variant* list;
+    tr_file_index_t const n = tor->info.fileCount;
+
+    if (tr_variantDictFindBool(dict, TR_KEY_sequential_download, &boolVal))
+    {
+        tor->sequentialDownload = boolVal;
+        ret = TR_FR_SEQUENTIAL;
+    }
+
+    if (tr_variantDictFindList(dict, TR_KEY_sequential, &list) && tr_variantListSize(list) == n)
+    {
+        for (tr_file_index_t i = 0; i < n; ++i)
+        {
+            if (tr_variantGetBool(tr_variantListChild(list, i), &boolVal))
+            {
+                tor->info.files[i].sequential = boolVal;
+            }
+        }
+
+        ret = TR_FR_SEQUENTIAL;
+    }
+
+    return ret;
+}
+
+/***
+****
+***/
+
 static void saveDND(tr_variant* dict, tr_torrent const* tor)
 {
     tr_variant* list;
@@ -500,7 +550,7 @@ static void saveProgress(tr_variant* dict, tr_torrent* tor)
     tr_info const* inf = tr_torrentInfo(tor);
     time_t const now = tr_time();
 
-    prog = tr_variantDictAddDict(dict, TR_KEY_progress, 3);
+    prog = tr_variantDictAddDict(dict, TR_KEY_progress, 4);
 
     /* add the file/piece check timestamps... */
     l = tr_variantDictAddList(prog, TR_KEY_time_checked, inf->fileCount);
@@ -565,6 +615,17 @@ static void saveProgress(tr_variant* dict, tr_torrent* tor)
         }
     }
 
+    /* add the files' fingerprints, for smart verify */
+    if (tor->fingerprints != NULL)
+    {
+        l = tr_variantDictAddList(prog, TR_KEY_fingerprints, inf->fileCount);
+
+        for (tr_file_index_t fi = 0; fi < inf->fileCount; ++fi)
+        {
+            tr_fingerprintToVariant(&tor->fingerprints[fi], tr_variantListAdd(l));
+        }
+    }
+
     /* add the progress */
     if (tor->completeness == TR_SEED)
     {
@@ -664,6 +725,19 @@ static uint64_t loadProgress(tr_variant* dict, tr_torrent* tor)
             }
         }
 
+        tr_free(tor->fingerprints);
+        tor->fingerprints = NULL;
+
+        if (tr_variantDictFindList(prog, TR_KEY_fingerprints, &l) && tr_variantListSize(l) == inf->fileCount)
+        {
+            tor->fingerprints = tr_new0(tr_fingerprint, inf->fileCount);
+
+            for (tr_file_index_t fi = 0; fi < inf->fileCount; ++fi)
+            {
+                tr_fingerprintFromVariant(&tor->fingerprints[fi], tr_variantListChild(l, fi));
+            }
+        }
+
         err = NULL;
         tr_bitfieldConstruct(&blocks, tor->blockCount);
 
@@ -774,6 +848,7 @@ void tr_torrentSaveResume(tr_torrent* tor)
     saveFilenames(&top, tor);
     saveName(&top, tor);
     saveLabels(&top, tor);
+    saveSequential(&top, tor);
 
     filename = getResumeFilename(tor, TR_METAINFO_BASENAME_HASH);
 
@@ -987,6 +1062,11 @@ static uint64_t loadFromFile(tr_torrent* tor, uint64_t fieldsToLoad, bool* didRe
         fieldsLoaded |= loadLabels(&top, tor);
     }
 
+    if ((fieldsToLoad & TR_FR_SEQUENTIAL) != 0)
+    {
+        fieldsLoaded |= loadSequential(&top, tor);
+    }
+
     /* loading the resume file triggers of a lot of changes,
      * but none of them needs to trigger a re-saving of the
      * same resume information... */
@@ -16,8 +16,10 @@
 #include <event2/buffer.h>
 
 #include "transmission.h"
+#include "cache.h" /* tr_cacheGetStats() */
 #include "completion.h"
 #include "crypto-utils.h"
+#include "diskio.h"
 #include "error.h"
 #include "fdlimit.h"
 #include "file.h"
@@ -382,23 +384,95 @@ static char const* torrentReannounce(tr_session* session, tr_variant* args_in, t
     return NULL;
 }
 
+/* adds the pieces of the files listed in `files', and the pieces listed in
+   `pieces', to `setme'. Each entry in `pieces' is either a piece index or an
+   inclusive [first, last] range of them */
+static char const* getPiecesToVerify(tr_torrent const* tor, tr_variant* files, tr_variant* pieces, tr_bitfield* setme)
+{
+    int64_t tmp;
+    tr_info const* inf = &tor->info;
+
+    for (size_t i = 0, n = tr_variantListSize(files); i < n; ++i)
+    {
+        if (!tr_variantGetInt(tr_variantListChild(files, i), &tmp) || tmp < 0 || tmp >= inf->fileCount)
+        {
+            return "file index out of range";
+        }
+
+        if (inf->files[tmp].length > 0)
+        {
+            tr_bitfieldAddRange(setme, inf->files[tmp].firstPiece, inf->files[tmp].lastPiece + 1);
+        }
+    }
+
+    for (size_t i = 0, n = tr_variantListSize(pieces); i < n; ++i)
+    {
+        int64_t first;
+        int64_t last;
+        tr_variant* child = tr_variantListChild(pieces, i);
+
+        if (tr_variantGetInt(child, &tmp))
+        {
+            first = last = tmp;
+        }
+        else if (tr_variantListSize(child) != 2 || !tr_variantGetInt(tr_variantListChild(child, 0), &first) ||
+            !tr_variantGetInt(tr_variantListChild(child, 1), &last))
+        {
+            return "invalid argument";
+        }
+
+        if (first < 0 || first > last || last >= inf->pieceCount)
+        {
+            return "piece index out of range";
+        }
+
+        tr_bitfieldAddRange(setme, first, last + 1);
+    }
+
+    return NULL;
+}
+
 static char const* torrentVerify(tr_session* session, tr_variant* args_in, tr_variant* args_out UNUSED,
     struct tr_rpc_idle_data* idle_data UNUSED)
 {
     TR_ASSERT(idle_data == NULL);
 
     int torrentCount;
+    tr_variant* files = NULL;
+    tr_variant* pieces = NULL;
+    char const* errmsg = NULL;
     tr_torrent** torrents = getTorrents(session, args_in, &torrentCount);
 
-    for (int i = 0; i < torrentCount; ++i)
+    tr_variantDictFindList(args_in, TR_KEY_files, &files);
+    tr_variantDictFindList(args_in, TR_KEY_pieces, &pieces);
+
+    for (int i = 0; errmsg == NULL && i < torrentCount; ++i)
     {
         tr_torrent* tor = torrents[i];
-        tr_torrentVerify(tor, NULL, NULL);
+
+        if ((files == NULL && pieces == NULL) || !tr_torrentHasMetadata(tor))
+        {
+            tr_torrentVerify(tor, NULL, NULL);
+        }
+        else
+        {
+            tr_bitfield selected;
+
+            tr_bitfieldConstruct(&selected, tor->info.pieceCount);
+
+            if ((errmsg = getPiecesToVerify(tor, files, pieces, &selected)) == NULL)
+            {
+                tr_torrentVerifyPieces(tor, &selected, NULL, NULL);
+            }
+
+            tr_bitfieldDestruct(&selected);
+        }
+
         notify(session, TR_RPC_TORRENT_CHANGED, tor);
     }
 
     tr_free(torrents);
-    return NULL;
+    return errmsg;
 }
 
 /***
@@ -425,9 +499,10 @@ static void addFileStats(tr_torrent const* tor, tr_variant* list)
     for (tr_file_index_t i = 0; i < info->fileCount; ++i)
     {
         tr_file const* file = &info->files[i];
-        tr_variant* d = tr_variantListAddDict(list, 3);
+        tr_variant* d = tr_variantListAddDict(list, 4);
         tr_variantDictAddInt(d, TR_KEY_bytesCompleted, files[i].bytesCompleted);
         tr_variantDictAddInt(d, TR_KEY_priority, file->priority);
+        tr_variantDictAddBool(d, TR_KEY_sequential, file->sequential);
         tr_variantDictAddBool(d, TR_KEY_wanted, !file->dnd);
     }
 
@@ -795,6 +870,10 @@ static void initField(tr_torrent* const tor, tr_info const* const inf, tr_stat c
         tr_variantInitInt(initme, tr_torrentGetRatioMode(tor));
         break;
 
+    case TR_KEY_sequentialDownload:
+        tr_variantInitBool(initme, tr_torrentGetSequentialDownload(tor));
+        break;
+
     case TR_KEY_sizeWhenDone:
         tr_variantInitInt(initme, st->sizeWhenDone);
         break;
@@ -854,6 +933,10 @@ static void initField(tr_torrent* const tor, tr_info const* const inf, tr_stat c
         tr_variantInitReal(initme, st->ratio);
         break;
 
+    case TR_KEY_verifyQueuePosition:
+        tr_variantInitInt(initme, st->verifyQueuePosition);
+        break;
+
     case TR_KEY_wanted:
         tr_variantInitList(initme, inf->fileCount);
 
@@ -1141,6 +1224,48 @@ static char const* setFileDLs(tr_torrent* tor, bool do_download, tr_variant* lis
     return errmsg;
 }
 
+static char const* setFileSequential(tr_torrent* tor, bool sequential, tr_variant* list)
+{
+    int64_t tmp;
+    int fileCount = 0;
+    int const n = tr_variantListSize(list);
+    char const* errmsg = NULL;
+    tr_file_index_t* files = tr_new0(tr_file_index_t, tor->info.fileCount);
+
+    if (n != 0) /* if argument list, process them */
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            if (tr_variantGetInt(tr_variantListChild(list, i), &tmp))
+            {
+                if (0 <= tmp && tmp < tor->info.fileCount)
+                {
+                    files[fileCount++] = tmp;
+                }
+                else
+                {
+                    errmsg = "file index out of range";
+                }
+            }
+        }
+    }
+    else /* if empty set, apply to all */
+    {
+        for (tr_file_index_t t = 0; t < tor->info.fileCount; ++t)
+        {
+            files[fileCount++] = t;
+        }
+    }
+
+    if (fileCount != 0)
+    {
+        tr_torrentSetFileSequential(tor, files, fileCount, sequential);
+    }
+
+    tr_free(files);
+    return errmsg;
+}
+
 static bool findAnnounceUrl(tr_tracker_info const* t, int n, char const* url, int* pos)
 {
     bool found = false;
@@ -1386,6 +1511,16 @@ static char const* torrentSet(tr_session* session, tr_variant* args_in, tr_varia
             errmsg = setFileDLs(tor, true, tmp_variant);
         }
 
+        if (errmsg == NULL && tr_variantDictFindList(args_in, TR_KEY_files_unsequential, &tmp_variant))
+        {
+            errmsg = setFileSequential(tor, false, tmp_variant);
+        }
+
+        if (errmsg == NULL && tr_variantDictFindList(args_in, TR_KEY_files_sequential, &tmp_variant))
+        {
+            errmsg = setFileSequential(tor, true, tmp_variant);
+        }
+
         if (tr_variantDictFindInt(args_in, TR_KEY_peer_limit, &tmp))
         {
             tr_torrentSetPeerLimit(tor, tmp);
@@ -1431,6 +1566,11 @@ static char const* torrentSet(tr_session* session, tr_variant* args_in, tr_varia
             tr_torrentUseSpeedLimit(tor, TR_UP, boolVal);
         }
 
+        if (tr_variantDictFindBool(args_in, TR_KEY_sequentialDownload, &boolVal))
+        {
+            tr_torrentSetSequentialDownload(tor, boolVal);
+        }
+
         if (tr_variantDictFindInt(args_in, TR_KEY_seedIdleLimit, &tmp))
         {
             tr_torrentSetIdleLimit(tor, tmp);
@@ -2100,6 +2240,71 @@ static char const* sessionSet(tr_session* session, tr_variant* args_in, tr_varia
         tr_sessionSetPexEnabled(session, boolVal);
     }
 
+    if (tr_variantDictFindBool(args_in, TR_KEY_cache_sync_enabled, &boolVal))
+    {
+        tr_sessionSetCacheSyncEnabled(session, boolVal);
+    }
+
+    if (tr_variantDictFindInt(args_in, TR_KEY_disk_io_queue_depth, &i))
+    {
+        tr_sessionSetDiskIOQueueDepth(session, i);
+    }
+
+    if (tr_variantDictFindInt(args_in, TR_KEY_disk_io_threads, &i))
+    {
+        tr_sessionSetDiskIOThreads(session, i);
+    }
+
+    if (tr_variantDictFindBool(args_in, TR_KEY_io_uring_enabled, &boolVal))
+    {
+        tr_sessionSetIOUringEnabled(session, boolVal);
+    }
+
+    if (tr_variantDictFindInt(args_in, TR_KEY_mmap_size_mb, &i))
+    {
+        tr_sessionSetMmapLimit_MB(session, i);
+    }
+
+    if (tr_variantDictFindInt(args_in, TR_KEY_verify_threads, &i))
+    {
+        tr_sessionSetVerifyThreads(session, i);
+    }
+
+    if (tr_variantDictFindBool(args_in, TR_KEY_verify_per_device, &boolVal))
+    {
+        tr_sessionSetVerifyPerDevice(session, boolVal);
+    }
+
+    if (tr_variantDictFindInt(args_in, TR_KEY_verify_max_concurrent, &i))
+    {
+        tr_sessionSetVerifyMaxConcurrent(session, i);
+    }
+
+    if (tr_variantDictFindBool(args_in, TR_KEY_verify_direct_io, &boolVal))
+    {
+        tr_sessionSetVerifyDirectIO(session, boolVal);
+    }
+
+    if (tr_variantDictFindInt(args_in, TR_KEY_verify_speed_limit, &i))
+    {
+        tr_sessionSetVerifySpeedLimit_KBps(session, i);
+    }
+
+    if (tr_variantDictFindBool(args_in, TR_KEY_verify_full_speed, &boolVal))
+    {
+        tr_sessionSetVerifyFullSpeed(session, boolVal);
+    }
+
+    if (tr_variantDictFindBool(args_in, TR_KEY_verify_smart, &boolVal))
+    {
+        tr_sessionSetVerifySmart(session, boolVal);
+    }
+
+    if (tr_variantDictFindBool(args_in, TR_KEY_verify_smart_sample, &boolVal))
+    {
+        tr_sessionSetVerifySmartSample(session, boolVal);
+    }
+
     if (tr_variantDictFindBool(args_in, TR_KEY_dht_enabled, &boolVal))
     {
         tr_sessionSetDHTEnabled(session, boolVal);
@@ -2236,6 +2441,8 @@ static char const* sessionStats(tr_session* session, tr_variant* args_in UNUSED,
     tr_variant* d;
     tr_session_stats currentStats = TR_SESSION_STATS_INIT;
     tr_session_stats cumulativeStats = TR_SESSION_STATS_INIT;
+    tr_cache_stats cacheStats;
+    tr_fd_stats fdStats;
     tr_torrent* tor = NULL;
 
     while ((tor = tr_torrentNext(session, tor)) != NULL)
@@ -2250,9 +2457,18 @@ static char const* sessionStats(tr_session* session, tr_variant* args_in UNUSED,
 
     tr_sessionGetStats(session, &currentStats);
     tr_sessionGetCumulativeStats(session, &cumulativeStats);
+    tr_cacheGetStats(session->cache, &cacheStats);
+    tr_fdGetStats(session, &fdStats);
 
     tr_variantDictAddInt(args_out, TR_KEY_activeTorrentCount, running);
+    tr_variantDictAddInt(args_out, TR_KEY_cacheReadEvictions, cacheStats.read_evictions);
+    tr_variantDictAddInt(args_out, TR_KEY_cacheReadHits, cacheStats.read_hits);
+    tr_variantDictAddInt(args_out, TR_KEY_cacheReadMisses, cacheStats.read_misses);
+    tr_variantDictAddInt(args_out, TR_KEY_diskQueueDepth, tr_diskioGetQueueDepth(session->diskio));
     tr_variantDictAddReal(args_out, TR_KEY_downloadSpeed, tr_sessionGetPieceSpeed_Bps(session, TR_DOWN));
+    tr_variantDictAddInt(args_out, TR_KEY_fileCacheCloses, fdStats.closes);
+    tr_variantDictAddInt(args_out, TR_KEY_fileCacheEvictions, fdStats.evictions);
+    tr_variantDictAddInt(args_out, TR_KEY_fileCacheOpens, fdStats.opens);
     tr_variantDictAddInt(args_out, TR_KEY_pausedTorrentCount, total - running);
     tr_variantDictAddInt(args_out, TR_KEY_torrentCount, total);
     tr_variantDictAddReal(args_out, TR_KEY_uploadSpeed, tr_sessionGetPieceSpeed_Bps(session, TR_UP));
@@ -2318,6 +2534,10 @@ static void addSessionField(tr_session* s, tr_variant* d, tr_quark key)
         tr_variantDictAddInt(d, key, tr_sessionGetCacheLimit_MB(s));
         break;
 
+    case TR_KEY_cache_sync_enabled:
+        tr_variantDictAddBool(d, key, tr_sessionIsCacheSyncEnabled(s));
+        break;
+
     case TR_KEY_blocklist_size:
         tr_variantDictAddInt(d, key, tr_blocklistGetRuleCount(s));
         break;
@@ -2370,6 +2590,54 @@ static void addSessionField(tr_session* s, tr_variant* d, tr_quark key)
         tr_variantDictAddBool(d, key, tr_sessionIsDHTEnabled(s));
         break;
 
+    case TR_KEY_disk_io_queue_depth:
+        tr_variantDictAddInt(d, key, tr_sessionGetDiskIOQueueDepth(s));
+        break;
+
+    case TR_KEY_disk_io_threads:
+        tr_variantDictAddInt(d, key, tr_sessionGetDiskIOThreads(s));
+        break;
+
+    case TR_KEY_io_uring_enabled:
+        tr_variantDictAddBool(d, key, tr_sessionIsIOUringEnabled(s));
+        break;
+
+    case TR_KEY_mmap_size_mb:
+        tr_variantDictAddInt(d, key, tr_sessionGetMmapLimit_MB(s));
+        break;
+
+    case TR_KEY_verify_direct_io:
+        tr_variantDictAddBool(d, key, tr_sessionIsVerifyDirectIO(s));
+        break;
+
+    case TR_KEY_verify_full_speed:
+        tr_variantDictAddBool(d, key, tr_sessionIsVerifyFullSpeed(s));
+        break;
+
+    case TR_KEY_verify_max_concurrent:
+        tr_variantDictAddInt(d, key, tr_sessionGetVerifyMaxConcurrent(s));
+        break;
+
+    case TR_KEY_verify_per_device:
+        tr_variantDictAddBool(d, key, tr_sessionIsVerifyPerDevice(s));
+        break;
+
+    case TR_KEY_verify_smart:
+        tr_variantDictAddBool(d, key, tr_sessionIsVerifySmart(s));
+        break;
+
+    case TR_KEY_verify_smart_sample:
+        tr_variantDictAddBool(d, key, tr_sessionIsVerifySmartSample(s));
+        break;
+
+    case TR_KEY_verify_speed_limit:
+        tr_variantDictAddInt(d, key, tr_sessionGetVerifySpeedLimit_KBps(s));
+        break;
+
+    case TR_KEY_verify_threads:
+        tr_variantDictAddInt(d, key, tr_sessionGetVerifyThreads(s));
+        break;
+
     case TR_KEY_lpd_enabled:
         tr_variantDictAddBool(d, key, tr_sessionIsLPDEnabled(s));
         break;
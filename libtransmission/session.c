@@ -29,11 +29,13 @@
 #include "bandwidth.h"
 #include "blocklist.h"
 #include "cache.h"
+#include "diskio.h"
 #include "crypto-utils.h"
 #include "error.h"
 #include "error-types.h"
 #include "fdlimit.h"
 #include "file.h"
+#include "filemap.h"
 #include "list.h"
 #include "log.h"
 #include "net.h"
@@ -42,6 +44,7 @@
 #include "platform.h" /* tr_lock, tr_getTorrentDir() */
 #include "platform-quota.h" /* tr_device_info_free() */
 #include "port-forwarding.h"
+#include "prealloc.h"
 #include "ptrarray.h"
 #include "rpc-server.h"
 #include "session.h"
@@ -64,11 +67,18 @@ enum
 {
 #ifdef TR_LIGHTWEIGHT
     DEFAULT_CACHE_SIZE_MB = 2,
+    DEFAULT_DISK_IO_THREADS = 1,
     DEFAULT_PREFETCH_ENABLED = false,
+    DEFAULT_VERIFY_THREADS = 0,
+    DEFAULT_VERIFY_MAX_CONCURRENT = 2,
 #else
     DEFAULT_CACHE_SIZE_MB = 4,
+    DEFAULT_DISK_IO_THREADS = 4,
     DEFAULT_PREFETCH_ENABLED = true,
+    DEFAULT_VERIFY_THREADS = 4,
+    DEFAULT_VERIFY_MAX_CONCURRENT = 4,
 #endif
+    DEFAULT_DISK_IO_QUEUE_DEPTH = 1,
     SAVE_INTERVAL_SECS = 360
 };
 
@@ -330,12 +340,25 @@ void tr_sessionGetDefaultSettings(tr_variant* d)
 {
     TR_ASSERT(tr_variantIsDict(d));
 
-    tr_variantDictReserve(d, 63);
+    tr_variantDictReserve(d, 75);
     tr_variantDictAddBool(d, TR_KEY_blocklist_enabled, false);
     tr_variantDictAddStr(d, TR_KEY_blocklist_url, "http://www.example.com/blocklist");
     tr_variantDictAddInt(d, TR_KEY_cache_size_mb, DEFAULT_CACHE_SIZE_MB);
+    tr_variantDictAddBool(d, TR_KEY_cache_sync_enabled, false);
     tr_variantDictAddBool(d, TR_KEY_dht_enabled, true);
+    tr_variantDictAddInt(d, TR_KEY_disk_io_queue_depth, DEFAULT_DISK_IO_QUEUE_DEPTH);
+    tr_variantDictAddInt(d, TR_KEY_disk_io_threads, DEFAULT_DISK_IO_THREADS);
+    tr_variantDictAddBool(d, TR_KEY_io_uring_enabled, false);
+    tr_variantDictAddInt(d, TR_KEY_mmap_size_mb, 0);
     tr_variantDictAddBool(d, TR_KEY_utp_enabled, true);
+    tr_variantDictAddBool(d, TR_KEY_verify_direct_io, false);
+    tr_variantDictAddBool(d, TR_KEY_verify_full_speed, false);
+    tr_variantDictAddInt(d, TR_KEY_verify_max_concurrent, DEFAULT_VERIFY_MAX_CONCURRENT);
+    tr_variantDictAddBool(d, TR_KEY_verify_per_device, true);
+    tr_variantDictAddBool(d, TR_KEY_verify_smart, false);
+    tr_variantDictAddBool(d, TR_KEY_verify_smart_sample, true);
+    tr_variantDictAddInt(d, TR_KEY_verify_speed_limit, 0);
+    tr_variantDictAddInt(d, TR_KEY_verify_threads, DEFAULT_VERIFY_THREADS);
     tr_variantDictAddBool(d, TR_KEY_lpd_enabled, false);
     tr_variantDictAddStr(d, TR_KEY_download_dir, tr_getDefaultDownloadDir());
     tr_variantDictAddInt(d, TR_KEY_speed_limit_down, 100);
@@ -402,12 +425,25 @@ void tr_sessionGetSettings(tr_session* s, tr_variant* d)
 {
     TR_ASSERT(tr_variantIsDict(d));
 
-    tr_variantDictReserve(d, 63);
+    tr_variantDictReserve(d, 75);
     tr_variantDictAddBool(d, TR_KEY_blocklist_enabled, tr_blocklistIsEnabled(s));
     tr_variantDictAddStr(d, TR_KEY_blocklist_url, tr_blocklistGetURL(s));
     tr_variantDictAddInt(d, TR_KEY_cache_size_mb, tr_sessionGetCacheLimit_MB(s));
+    tr_variantDictAddBool(d, TR_KEY_cache_sync_enabled, tr_sessionIsCacheSyncEnabled(s));
     tr_variantDictAddBool(d, TR_KEY_dht_enabled, s->isDHTEnabled);
+    tr_variantDictAddInt(d, TR_KEY_disk_io_queue_depth, tr_sessionGetDiskIOQueueDepth(s));
+    tr_variantDictAddInt(d, TR_KEY_disk_io_threads, tr_sessionGetDiskIOThreads(s));
+    tr_variantDictAddBool(d, TR_KEY_io_uring_enabled, tr_sessionIsIOUringEnabled(s));
+    tr_variantDictAddInt(d, TR_KEY_mmap_size_mb, tr_sessionGetMmapLimit_MB(s));
     tr_variantDictAddBool(d, TR_KEY_utp_enabled, s->isUTPEnabled);
+    tr_variantDictAddBool(d, TR_KEY_verify_direct_io, tr_sessionIsVerifyDirectIO(s));
+    tr_variantDictAddBool(d, TR_KEY_verify_full_speed, tr_sessionIsVerifyFullSpeed(s));
+    tr_variantDictAddInt(d, TR_KEY_verify_max_concurrent, tr_sessionGetVerifyMaxConcurrent(s));
+    tr_variantDictAddBool(d, TR_KEY_verify_per_device, tr_sessionIsVerifyPerDevice(s));
+    tr_variantDictAddBool(d, TR_KEY_verify_smart, tr_sessionIsVerifySmart(s));
+    tr_variantDictAddBool(d, TR_KEY_verify_smart_sample, tr_sessionIsVerifySmartSample(s));
+    tr_variantDictAddInt(d, TR_KEY_verify_speed_limit, tr_sessionGetVerifySpeedLimit_KBps(s));
+    tr_variantDictAddInt(d, TR_KEY_verify_threads, tr_sessionGetVerifyThreads(s));
     tr_variantDictAddBool(d, TR_KEY_lpd_enabled, s->isLPDEnabled);
     tr_variantDictAddStr(d, TR_KEY_download_dir, tr_sessionGetDownloadDir(s));
     tr_variantDictAddInt(d, TR_KEY_download_queue_size, tr_sessionGetQueueSize(s, TR_DOWN));
@@ -612,7 +648,11 @@ tr_session* tr_sessionInit(char const* configDir, bool messageQueuingEnabled, tr
     session->udp_socket = TR_BAD_SOCKET;
     session->udp6_socket = TR_BAD_SOCKET;
     session->lock = tr_lockNew();
+    session->verifyBucketLock = tr_lockNew();
     session->cache = tr_cacheNew(1024 * 1024 * 2);
+    session->diskio = tr_diskioNew(session, DEFAULT_DISK_IO_THREADS);
+    session->filemap = tr_filemapNew(0);
+    session->prealloc = tr_preallocNew();
     session->magicNumber = SESSION_MAGIC_NUMBER;
     session->session_id = tr_session_id_new();
     session->torrentsSortedByHash = TR_PTR_ARRAY_INIT;
@@ -672,6 +712,11 @@ static void onNowTimer(evutil_socket_t foo UNUSED, short bar UNUSED, void* vsess
 
     tr_dhtUpkeep(session);
 
+    if (tr_cacheFlushPulse(session->cache, session) != 0)
+    {
+        tr_logAddError("Error while flushing the cache");
+    }
+
     if (session->turtle.isClockEnabled)
     {
         turtleCheckClock(session, &session->turtle);
@@ -831,6 +876,71 @@ static void sessionSetImpl(void* vdata)
         tr_sessionSetCacheLimit_MB(session, i);
     }
 
+    if (tr_variantDictFindBool(settings, TR_KEY_cache_sync_enabled, &boolVal))
+    {
+        tr_sessionSetCacheSyncEnabled(session, boolVal);
+    }
+
+    if (tr_variantDictFindInt(settings, TR_KEY_disk_io_queue_depth, &i))
+    {
+        tr_sessionSetDiskIOQueueDepth(session, i);
+    }
+
+    if (tr_variantDictFindInt(settings, TR_KEY_disk_io_threads, &i))
+    {
+        tr_sessionSetDiskIOThreads(session, i);
+    }
+
+    if (tr_variantDictFindBool(settings, TR_KEY_io_uring_enabled, &boolVal))
+    {
+        tr_sessionSetIOUringEnabled(session, boolVal);
+    }
+
+    if (tr_variantDictFindInt(settings, TR_KEY_mmap_size_mb, &i))
+    {
+        tr_sessionSetMmapLimit_MB(session, i);
+    }
+
+    if (tr_variantDictFindInt(settings, TR_KEY_verify_threads, &i))
+    {
+        tr_sessionSetVerifyThreads(session, i);
+    }
+
+    if (tr_variantDictFindBool(settings, TR_KEY_verify_per_device, &boolVal))
+    {
+        tr_sessionSetVerifyPerDevice(session, boolVal);
+    }
+
+    if (tr_variantDictFindInt(settings, TR_KEY_verify_max_concurrent, &i))
+    {
+        tr_sessionSetVerifyMaxConcurrent(session, i);
+    }
+
+    if (tr_variantDictFindBool(settings, TR_KEY_verify_direct_io, &boolVal))
+    {
+        tr_sessionSetVerifyDirectIO(session, boolVal);
+    }
+
+    if (tr_variantDictFindInt(settings, TR_KEY_verify_speed_limit, &i))
+    {
+        tr_sessionSetVerifySpeedLimit_KBps(session, i);
+    }
+
+    if (tr_variantDictFindBool(settings, TR_KEY_verify_full_speed, &boolVal))
+    {
+        tr_sessionSetVerifyFullSpeed(session, boolVal);
+    }
+
+    if (tr_variantDictFindBool(settings, TR_KEY_verify_smart, &boolVal))
+    {
+        tr_sessionSetVerifySmart(session, boolVal);
+    }
+
+    if (tr_variantDictFindBool(settings, TR_KEY_verify_smart_sample, &boolVal))
+    {
+        tr_sessionSetVerifySmartSample(session, boolVal);
+    }
+
     if (tr_variantDictFindInt(settings, TR_KEY_peer_limit_per_torrent, &i))
     {
         tr_sessionSetPeerLimitPerTorrent(session, i);
@@ -1962,9 +2072,19 @@ static void sessionCloseImplStart(tr_session* session)
        it won't be idle until the announce events are sent... */
     tr_webClose(session, TR_WEB_CLOSE_WHEN_IDLE);
 
+    tr_diskioFree(session->diskio);
+    session->diskio = NULL;
+
     tr_cacheFree(session->cache);
     session->cache = NULL;
 
+    tr_filemapFree(session->filemap);
+    session->filemap = NULL;
+
+    /* after the disk workers, since they may be waiting on it */
+    tr_preallocFree(session->prealloc);
+    session->prealloc = NULL;
+
     /* saveTimer is not used at this point, reusing for UDP shutdown wait */
     TR_ASSERT(session->saveTimer == NULL);
     session->saveTimer = evtimer_new(session->event_base, sessionCloseImplWaitForIdleUdp, session);
@@ -2089,6 +2209,7 @@ void tr_sessionClose(tr_session* session)
     tr_bandwidthDestruct(&session->bandwidth);
     tr_bitfieldDestruct(&session->turtle.minutes);
     tr_session_id_free(session->session_id);
+    tr_lockFree(session->verifyBucketLock);
     tr_lockFree(session->lock);
 
     if (session->metainfoLookup != NULL)
@@ -2360,6 +2481,188 @@ int tr_sessionGetCacheLimit_MB(tr_session const* session)
     return toMemMB(tr_cacheGetLimit(session->cache));
 }
 
+void tr_sessionSetCacheSyncEnabled(tr_session* session, bool enabled)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    tr_cacheSetSyncEnabled(session->cache, enabled);
+}
+
+bool tr_sessionIsCacheSyncEnabled(tr_session const* session)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    return tr_cacheIsSyncEnabled(session->cache);
+}
+
+void tr_sessionSetDiskIOThreads(tr_session* session, int count)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    tr_diskioSetWorkerCount(session->diskio, count);
+}
+
+int tr_sessionGetDiskIOThreads(tr_session const* session)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    return tr_diskioGetWorkerCount(session->diskio);
+}
+
+void tr_sessionSetDiskIOQueueDepth(tr_session* session, int depth)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    tr_diskioSetDeviceQueueDepth(session->diskio, depth);
+}
+
+int tr_sessionGetDiskIOQueueDepth(tr_session const* session)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    return tr_diskioGetDeviceQueueDepth(session->diskio);
+}
+
+void tr_sessionSetIOUringEnabled(tr_session* session, bool enabled)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    tr_diskioSetUringEnabled(session->diskio, enabled);
+}
+
+bool tr_sessionIsIOUringEnabled(tr_session const* session)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    return tr_diskioIsUringEnabled(session->diskio);
+}
+
+void tr_sessionSetMmapLimit_MB(tr_session* session, int mb)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    tr_filemapSetLimit(session->filemap, mb > 0 ? toMemBytes(mb) : 0);
+}
+
+int tr_sessionGetMmapLimit_MB(tr_session const* session)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    return toMemMB(tr_filemapGetLimit(session->filemap));
+}
+
+void tr_sessionSetVerifyThreads(tr_session* session, int count)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    session->verifyThreads = MAX(count, 0);
+}
+
+int tr_sessionGetVerifyThreads(tr_session const* session)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    return session->verifyThreads;
+}
+
+void tr_sessionSetVerifyPerDevice(tr_session* session, bool enabled)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    session->isVerifyPerDevice = enabled;
+}
+
+bool tr_sessionIsVerifyPerDevice(tr_session const* session)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    return session->isVerifyPerDevice;
+}
+
+void tr_sessionSetVerifyMaxConcurrent(tr_session* session, int count)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    session->verifyMaxConcurrent = MAX(count, 1);
+}
+
+int tr_sessionGetVerifyMaxConcurrent(tr_session const* session)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    return session->verifyMaxConcurrent;
+}
+
+void tr_sessionSetVerifyDirectIO(tr_session* session, bool enabled)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    session->isVerifyDirectIO = enabled;
+}
+
+bool tr_sessionIsVerifyDirectIO(tr_session const* session)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    return session->isVerifyDirectIO;
+}
+
+void tr_sessionSetVerifySpeedLimit_KBps(tr_session* session, int KBps)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    session->verifySpeedLimit_KBps = MAX(KBps, 0);
+}
+
+int tr_sessionGetVerifySpeedLimit_KBps(tr_session const* session)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    return session->verifySpeedLimit_KBps;
+}
+
+void tr_sessionSetVerifyFullSpeed(tr_session* session, bool enabled)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    session->isVerifyFullSpeed = enabled;
+}
+
+bool tr_sessionIsVerifyFullSpeed(tr_session const* session)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    return session->isVerifyFullSpeed;
+}
+
+void tr_sessionSetVerifySmart(tr_session* session, bool enabled)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    session->isVerifySmart = enabled;
+}
+
+bool tr_sessionIsVerifySmart(tr_session const* session)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    return session->isVerifySmart;
+}
+
+void tr_sessionSetVerifySmartSample(tr_session* session, bool enabled)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    session->isVerifySmartSample = enabled;
+}
+
+bool tr_sessionIsVerifySmartSample(tr_session const* session)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    return session->isVerifySmartSample;
+}
+
 /***
 ****
 ***/
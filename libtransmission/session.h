@@ -53,6 +53,8 @@ struct tr_announcer_udp;
 struct tr_bindsockets;
 struct tr_cache;
 struct tr_fdInfo;
+struct tr_filemap;
+struct tr_prealloc;
 struct tr_device_info;
 
 struct tr_turtle_info
@@ -139,6 +141,20 @@ struct tr_session
 
     tr_preallocation_mode preallocationMode;
 
+    int verifyThreads;
+    int verifyMaxConcurrent;
+    int verifySpeedLimit_KBps;
+    bool isVerifyPerDevice;
+    bool isVerifyDirectIO;
+    bool isVerifyFullSpeed;
+    bool isVerifySmart;
+    bool isVerifySmartSample;
+
+    /* the token bucket that all the verify threads share, if there's a speed limit */
+    struct tr_lock* verifyBucketLock;
+    double verifyBucketTokens;
+    uint64_t verifyBucketTime;
+
     struct event_base* event_base;
     struct evdns_base* evdns_base;
     struct tr_event_handle* events;
@@ -198,6 +214,9 @@ struct tr_session
     struct tr_shared* shared;
 
     struct tr_cache* cache;
+    struct tr_diskio* diskio;
+    struct tr_filemap* filemap;
+    struct tr_prealloc* prealloc;
 
     struct tr_lock* lock;
 
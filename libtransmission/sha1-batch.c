@@ -0,0 +1,631 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <string.h> /* memcpy(), memset() */
+
+#include "transmission.h"
+#include "crypto-utils.h" /* tr_sha1() */
+#include "sha1-batch.h"
+#include "tr-assert.h"
+#include "utils.h"
+
+/* The accelerated implementations need GCC or clang on x86, which can
+ * compile functions for instruction sets that the rest of the build
+ * doesn't assume, and the CPU is checked before they're called. */
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    ((defined(__clang__) && __clang_major__ >= 4) || (!defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 5))
+#define TR_SHA1_X86
+#endif
+
+#ifdef TR_SHA1_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define SHA1_BLOCK_SIZE 64
+
+typedef void (* sha1_blocks_func)(uint32_t* state, uint8_t const* data, size_t block_count);
+
+static uint32_t const sha1_init_state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+static inline uint32_t loadBE32(uint8_t const* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void storeBE32(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline uint32_t rotl32(uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+/***
+****  Scalar
+***/
+
+static void sha1ScalarBlocks(uint32_t* state, uint8_t const* data, size_t block_count)
+{
+    for (size_t i = 0; i < block_count; ++i, data += SHA1_BLOCK_SIZE)
+    {
+        uint32_t w[16];
+        uint32_t a = state[0];
+        uint32_t b = state[1];
+        uint32_t c = state[2];
+        uint32_t d = state[3];
+        uint32_t e = state[4];
+
+        for (int t = 0; t < 80; ++t)
+        {
+            uint32_t f;
+            uint32_t k;
+            uint32_t tmp;
+
+            if (t < 16)
+            {
+                w[t] = loadBE32(data + 4 * t);
+            }
+            else
+            {
+                w[t & 15] = rotl32(w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15], 1);
+            }
+
+            if (t < 20)
+            {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            }
+            else if (t < 40)
+            {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            }
+            else if (t < 60)
+            {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            }
+            else
+            {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+
+            tmp = rotl32(a, 5) + f + e + k + w[t & 15];
+            e = d;
+            d = c;
+            c = rotl32(b, 30);
+            b = a;
+            a = tmp;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+}
+
+/* hash the last `len' bytes of a `total_len'-byte message, pad it, and export the digest */
+static void sha1Finish(sha1_blocks_func blocks, uint32_t* state, uint8_t const* data, size_t len, uint64_t total_len,
+    uint8_t* hash)
+{
+    uint8_t tail[2 * SHA1_BLOCK_SIZE];
+    size_t const full = len / SHA1_BLOCK_SIZE;
+    size_t const rest = len % SHA1_BLOCK_SIZE;
+    size_t const tail_len = rest + 1 + 8 <= SHA1_BLOCK_SIZE ? SHA1_BLOCK_SIZE : 2 * SHA1_BLOCK_SIZE;
+
+    if (full > 0)
+    {
+        (*blocks)(state, data, full);
+    }
+
+    memcpy(tail, data + full * SHA1_BLOCK_SIZE, rest);
+    tail[rest] = 0x80;
+    memset(tail + rest + 1, 0, tail_len - rest - 1);
+    storeBE32(tail + tail_len - 8, (uint32_t)(total_len >> 29));
+    storeBE32(tail + tail_len - 4, (uint32_t)(total_len << 3));
+    (*blocks)(state, tail, tail_len / SHA1_BLOCK_SIZE);
+
+    for (int i = 0; i < 5; ++i)
+    {
+        storeBE32(hash + 4 * i, state[i]);
+    }
+}
+
+#ifdef TR_SHA1_X86
+
+/***
+****  SHA extensions
+***/
+
+#define SHA1_NI_LOAD(m, i) \
+    m = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)(data + 16 * (i))), mask)
+
+/* four rounds, with `e_cur' holding the next four message words plus E */
+#define SHA1_NI_ROUNDS(e_cur, e_next, m, f) \
+    do \
+    { \
+        e_cur = _mm_sha1nexte_epu32(e_cur, m); \
+        e_next = abcd; \
+        abcd = _mm_sha1rnds4_epu32(abcd, e_cur, f); \
+    } \
+    while (0)
+
+__attribute__((target("sha,sse4.1"))) static void sha1NiBlocks(uint32_t* state, uint8_t const* data, size_t block_count)
+{
+    __m128i const mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((__m128i const*)state), 0x1B);
+    __m128i e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+    __m128i e1;
+    __m128i m0;
+    __m128i m1;
+    __m128i m2;
+    __m128i m3;
+
+    for (size_t i = 0; i < block_count; ++i, data += SHA1_BLOCK_SIZE)
+    {
+        __m128i const abcd_save = abcd;
+        __m128i const e0_save = e0;
+
+        /* rounds 0-15 */
+        SHA1_NI_LOAD(m0, 0);
+        e0 = _mm_add_epi32(e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        SHA1_NI_LOAD(m1, 1);
+        SHA1_NI_ROUNDS(e1, e0, m1, 0);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+
+        SHA1_NI_LOAD(m2, 2);
+        SHA1_NI_ROUNDS(e0, e1, m2, 0);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        SHA1_NI_LOAD(m3, 3);
+        m0 = _mm_sha1msg2_epu32(m0, m3);
+        SHA1_NI_ROUNDS(e1, e0, m3, 0);
+        m2 = _mm_sha1msg1_epu32(m2, m3);
+        m1 = _mm_xor_si128(m1, m3);
+
+        /* rounds 16-63 */
+        m1 = _mm_sha1msg2_epu32(m1, m0);
+        SHA1_NI_ROUNDS(e0, e1, m0, 0);
+        m3 = _mm_sha1msg1_epu32(m3, m0);
+        m2 = _mm_xor_si128(m2, m0);
+
+        m2 = _mm_sha1msg2_epu32(m2, m1);
+        SHA1_NI_ROUNDS(e1, e0, m1, 1);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+        m3 = _mm_xor_si128(m3, m1);
+
+        m3 = _mm_sha1msg2_epu32(m3, m2);
+        SHA1_NI_ROUNDS(e0, e1, m2, 1);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        m0 = _mm_sha1msg2_epu32(m0, m3);
+        SHA1_NI_ROUNDS(e1, e0, m3, 1);
+        m2 = _mm_sha1msg1_epu32(m2, m3);
+        m1 = _mm_xor_si128(m1, m3);
+
+        m1 = _mm_sha1msg2_epu32(m1, m0);
+        SHA1_NI_ROUNDS(e0, e1, m0, 1);
+        m3 = _mm_sha1msg1_epu32(m3, m0);
+        m2 = _mm_xor_si128(m2, m0);
+
+        m2 = _mm_sha1msg2_epu32(m2, m1);
+        SHA1_NI_ROUNDS(e1, e0, m1, 1);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+        m3 = _mm_xor_si128(m3, m1);
+
+        m3 = _mm_sha1msg2_epu32(m3, m2);
+        SHA1_NI_ROUNDS(e0, e1, m2, 2);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        m0 = _mm_sha1msg2_epu32(m0, m3);
+        SHA1_NI_ROUNDS(e1, e0, m3, 2);
+        m2 = _mm_sha1msg1_epu32(m2, m3);
+        m1 = _mm_xor_si128(m1, m3);
+
+        m1 = _mm_sha1msg2_epu32(m1, m0);
+        SHA1_NI_ROUNDS(e0, e1, m0, 2);
+        m3 = _mm_sha1msg1_epu32(m3, m0);
+        m2 = _mm_xor_si128(m2, m0);
+
+        m2 = _mm_sha1msg2_epu32(m2, m1);
+        SHA1_NI_ROUNDS(e1, e0, m1, 2);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+        m3 = _mm_xor_si128(m3, m1);
+
+        m3 = _mm_sha1msg2_epu32(m3, m2);
+        SHA1_NI_ROUNDS(e0, e1, m2, 2);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        m0 = _mm_sha1msg2_epu32(m0, m3);
+        SHA1_NI_ROUNDS(e1, e0, m3, 3);
+        m2 = _mm_sha1msg1_epu32(m2, m3);
+        m1 = _mm_xor_si128(m1, m3);
+
+        /* rounds 64-79 */
+        m1 = _mm_sha1msg2_epu32(m1, m0);
+        SHA1_NI_ROUNDS(e0, e1, m0, 3);
+        m3 = _mm_sha1msg1_epu32(m3, m0);
+        m2 = _mm_xor_si128(m2, m0);
+
+        m2 = _mm_sha1msg2_epu32(m2, m1);
+        SHA1_NI_ROUNDS(e1, e0, m1, 3);
+        m3 = _mm_xor_si128(m3, m1);
+
+        m3 = _mm_sha1msg2_epu32(m3, m2);
+        SHA1_NI_ROUNDS(e0, e1, m2, 3);
+
+        SHA1_NI_ROUNDS(e1, e0, m3, 3);
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+/***
+****  AVX2, eight buffers at once
+***/
+
+/* Each 32-bit lane of the vectors works on a different buffer, so one pass
+ * of the rounds hashes a block of each of them. The buffers are hashed in
+ * step for as many blocks as the shortest one has, and each is finished by
+ * itself from there. */
+
+#define SHA1_LANES 8
+
+typedef uint32_t sha1_v8 __attribute__((vector_size(32)));
+
+#define V8_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define V8_ROUND(f, k) \
+    do \
+    { \
+        sha1_v8 const tmp = V8_ROTL(a, 5) + (f) + e + (k) + w[t & 15]; \
+        e = d; \
+        d = c; \
+        c = V8_ROTL(b, 30); \
+        b = a; \
+        a = tmp; \
+    } \
+    while (0)
+
+#define V8_SCHEDULE() \
+    (w[t & 15] = V8_ROTL(w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15], 1))
+
+__attribute__((target("avx2"))) static void sha1Avx2Blocks(uint32_t (* states)[5], uint8_t const* const* data,
+    size_t block_count)
+{
+    sha1_v8 s[5];
+
+    for (int i = 0; i < 5; ++i)
+    {
+        for (int lane = 0; lane < SHA1_LANES; ++lane)
+        {
+            s[i][lane] = states[lane][i];
+        }
+    }
+
+    for (size_t blk = 0; blk < block_count; ++blk)
+    {
+        sha1_v8 const k0 = { 0x5A827999, 0x5A827999, 0x5A827999, 0x5A827999, 0x5A827999, 0x5A827999, 0x5A827999, 0x5A827999 };
+        sha1_v8 const k1 = { 0x6ED9EBA1, 0x6ED9EBA1, 0x6ED9EBA1, 0x6ED9EBA1, 0x6ED9EBA1, 0x6ED9EBA1, 0x6ED9EBA1, 0x6ED9EBA1 };
+        sha1_v8 const k2 = { 0x8F1BBCDC, 0x8F1BBCDC, 0x8F1BBCDC, 0x8F1BBCDC, 0x8F1BBCDC, 0x8F1BBCDC, 0x8F1BBCDC, 0x8F1BBCDC };
+        sha1_v8 const k3 = { 0xCA62C1D6, 0xCA62C1D6, 0xCA62C1D6, 0xCA62C1D6, 0xCA62C1D6, 0xCA62C1D6, 0xCA62C1D6, 0xCA62C1D6 };
+        sha1_v8 w[16];
+        sha1_v8 a = s[0];
+        sha1_v8 b = s[1];
+        sha1_v8 c = s[2];
+        sha1_v8 d = s[3];
+        sha1_v8 e = s[4];
+        int t;
+
+        for (t = 0; t < 16; ++t)
+        {
+            for (int lane = 0; lane < SHA1_LANES; ++lane)
+            {
+                w[t][lane] = loadBE32(data[lane] + blk * SHA1_BLOCK_SIZE + 4 * t);
+            }
+        }
+
+        for (t = 0; t < 16; ++t)
+        {
+            V8_ROUND(d ^ (b & (c ^ d)), k0);
+        }
+
+        for (; t < 20; ++t)
+        {
+            V8_SCHEDULE();
+            V8_ROUND(d ^ (b & (c ^ d)), k0);
+        }
+
+        for (; t < 40; ++t)
+        {
+            V8_SCHEDULE();
+            V8_ROUND(b ^ c ^ d, k1);
+        }
+
+        for (; t < 60; ++t)
+        {
+            V8_SCHEDULE();
+            V8_ROUND((b & c) | (d & (b | c)), k2);
+        }
+
+        for (; t < 80; ++t)
+        {
+            V8_SCHEDULE();
+            V8_ROUND(b ^ c ^ d, k3);
+        }
+
+        s[0] += a;
+        s[1] += b;
+        s[2] += c;
+        s[3] += d;
+        s[4] += e;
+    }
+
+    for (int i = 0; i < 5; ++i)
+    {
+        for (int lane = 0; lane < SHA1_LANES; ++lane)
+        {
+            states[lane][i] = s[i][lane];
+        }
+    }
+}
+
+/* hash up to eight buffers, repeating the last one to fill the lanes */
+static void sha1Avx2Group(uint8_t* hashes, void const* const* data, size_t const* lengths, size_t count)
+{
+    uint32_t states[SHA1_LANES][5];
+    uint8_t const* lane_data[SHA1_LANES];
+    size_t common_blocks = SIZE_MAX;
+
+    TR_ASSERT(count > 0);
+    TR_ASSERT(count <= SHA1_LANES);
+
+    for (int lane = 0; lane < SHA1_LANES; ++lane)
+    {
+        size_t const i = MIN((size_t)lane, count - 1);
+
+        memcpy(states[lane], sha1_init_state, sizeof(sha1_init_state));
+        lane_data[lane] = data[i];
+        common_blocks = MIN(common_blocks, lengths[i] / SHA1_BLOCK_SIZE);
+    }
+
+    if (common_blocks > 0)
+    {
+        sha1Avx2Blocks(states, lane_data, common_blocks);
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t const done = common_blocks * SHA1_BLOCK_SIZE;
+
+        sha1Finish(sha1ScalarBlocks, states[i], lane_data[i] + done, lengths[i] - done, lengths[i],
+            hashes + i * SHA_DIGEST_LENGTH);
+    }
+}
+
+/***
+****  CPU detection
+***/
+
+static bool cpuHasShaNi(void)
+{
+    unsigned int eax;
+    unsigned int ebx;
+    unsigned int ecx;
+    unsigned int edx;
+
+    if (__get_cpuid_max(0, NULL) < 7)
+    {
+        return false;
+    }
+
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+    return (ebx & (1u << 29)) != 0 && __builtin_cpu_supports("sse4.1");
+}
+
+static bool cpuHasAvx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif /* TR_SHA1_X86 */
+
+/***
+****
+***/
+
+static tr_sha1_impl forced_impl = TR_SHA1_IMPL_AUTO;
+
+bool tr_sha1_batch_impl_is_supported(tr_sha1_impl impl)
+{
+    switch (impl)
+    {
+    case TR_SHA1_IMPL_AUTO:
+    case TR_SHA1_IMPL_LIBRARY:
+        return true;
+
+#ifdef TR_SHA1_X86
+
+    case TR_SHA1_IMPL_AVX2:
+        return cpuHasAvx2();
+
+    case TR_SHA1_IMPL_SHA_NI:
+        return cpuHasShaNi();
+
+#endif
+
+    default:
+        return false;
+    }
+}
+
+void tr_sha1_batch_set_impl(tr_sha1_impl impl)
+{
+    TR_ASSERT(tr_sha1_batch_impl_is_supported(impl));
+
+    forced_impl = impl;
+}
+
+static bool sha1BatchWith(tr_sha1_impl impl, uint8_t* hashes, void const* const* data, size_t const* lengths, size_t count)
+{
+    size_t i = 0;
+
+#ifdef TR_SHA1_X86
+
+    if (impl == TR_SHA1_IMPL_SHA_NI)
+    {
+        for (; i < count; ++i)
+        {
+            uint32_t state[5];
+
+            memcpy(state, sha1_init_state, sizeof(state));
+            sha1Finish(sha1NiBlocks, state, data[i], lengths[i], lengths[i], hashes + i * SHA_DIGEST_LENGTH);
+        }
+    }
+    else if (impl == TR_SHA1_IMPL_AVX2)
+    {
+        /* a group filling fewer than half of the lanes would waste most of them, so those go to the library */
+        for (; count - i >= SHA1_LANES / 2; i += MIN(count - i, (size_t)SHA1_LANES))
+        {
+            sha1Avx2Group(hashes + i * SHA_DIGEST_LENGTH, data + i, lengths + i, MIN(count - i, (size_t)SHA1_LANES));
+        }
+    }
+
+#else
+
+    (void)impl;
+
+#endif
+
+    for (; i < count; ++i)
+    {
+        if (!tr_sha1(hashes + i * SHA_DIGEST_LENGTH, data[i], (int)lengths[i], NULL))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#ifdef TR_SHA1_X86
+
+#define SHA1_MEASURE_BUFFER_SIZE (16 * 1024)
+#define SHA1_MEASURE_MSEC 10
+
+/* how many groups of SHA1_LANES buffers the implementation hashes in SHA1_MEASURE_MSEC */
+static uint64_t measureImpl(tr_sha1_impl impl, void const* const* data, size_t const* lengths)
+{
+    uint8_t hashes[SHA1_LANES * SHA_DIGEST_LENGTH];
+    uint64_t const begin = tr_time_msec();
+    uint64_t rounds = 0;
+
+    do
+    {
+        sha1BatchWith(impl, hashes, data, lengths, SHA1_LANES);
+        ++rounds;
+    }
+    while (tr_time_msec() - begin < SHA1_MEASURE_MSEC);
+
+    return rounds * 1000 / MAX(tr_time_msec() - begin, (uint64_t)1);
+}
+
+/* Whether eight lanes in AVX2 beat the crypto library depends on the library:
+ * OpenSSL's own SIMD code is faster, the others' plain C isn't. So the CPU
+ * support only narrows the candidates, and a short measurement picks one. */
+static tr_sha1_impl findFastestImpl(void)
+{
+    tr_sha1_impl const candidates[] = { TR_SHA1_IMPL_LIBRARY, TR_SHA1_IMPL_AVX2, TR_SHA1_IMPL_SHA_NI };
+    uint8_t* buffer = tr_malloc0(SHA1_LANES * SHA1_MEASURE_BUFFER_SIZE);
+    void const* data[SHA1_LANES];
+    size_t lengths[SHA1_LANES];
+    tr_sha1_impl best = TR_SHA1_IMPL_LIBRARY;
+    uint64_t best_rate = 0;
+
+    for (int lane = 0; lane < SHA1_LANES; ++lane)
+    {
+        data[lane] = buffer + lane * SHA1_MEASURE_BUFFER_SIZE;
+        lengths[lane] = SHA1_MEASURE_BUFFER_SIZE;
+    }
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(candidates); ++i)
+    {
+        if (tr_sha1_batch_impl_is_supported(candidates[i]))
+        {
+            uint64_t const rate = measureImpl(candidates[i], data, lengths);
+
+            if (rate > best_rate)
+            {
+                best = candidates[i];
+                best_rate = rate;
+            }
+        }
+    }
+
+    tr_free(buffer);
+    return best;
+}
+
+#endif /* TR_SHA1_X86 */
+
+tr_sha1_impl tr_sha1_batch_get_impl(void)
+{
+#ifdef TR_SHA1_X86
+
+    /* verify threads can get here together; they'd only measure twice */
+    static tr_sha1_impl best = TR_SHA1_IMPL_AUTO;
+    tr_sha1_impl impl;
+
+    if (forced_impl != TR_SHA1_IMPL_AUTO)
+    {
+        return forced_impl;
+    }
+
+    impl = __atomic_load_n(&best, __ATOMIC_ACQUIRE);
+
+    if (impl == TR_SHA1_IMPL_AUTO)
+    {
+        impl = findFastestImpl();
+        __atomic_store_n(&best, impl, __ATOMIC_RELEASE);
+    }
+
+    return impl;
+
+#else
+
+    return forced_impl != TR_SHA1_IMPL_AUTO ? forced_impl : TR_SHA1_IMPL_LIBRARY;
+
+#endif
+}
+
+bool tr_sha1_batch(uint8_t* hashes, void const* const* data, size_t const* lengths, size_t count)
+{
+    return sha1BatchWith(tr_sha1_batch_get_impl(), hashes, data, lengths, count);
+}
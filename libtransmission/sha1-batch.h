@@ -0,0 +1,52 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#pragma once
+
+#ifndef __TRANSMISSION__
+#error only libtransmission should #include this header.
+#endif
+
+/**
+ * @addtogroup utils Utilities
+ * @{
+ */
+
+/** How many buffers tr_sha1_batch() can hash at the same time. Callers should batch at least this many. */
+#define TR_SHA1_BATCH_SIZE 8
+
+typedef enum
+{
+    TR_SHA1_IMPL_AUTO, /* whichever measures fastest here, tried once */
+    TR_SHA1_IMPL_LIBRARY, /* tr_sha1(), one buffer at a time */
+    TR_SHA1_IMPL_AVX2, /* eight buffers at a time, one in each lane */
+    TR_SHA1_IMPL_SHA_NI /* the SHA extensions, one buffer at a time */
+}
+tr_sha1_impl;
+
+/**
+ * @brief Generate the SHA1 hashes of several independent buffers.
+ *
+ * Unlike tr_sha1(), this uses the CPU's SHA extensions, or hashes several
+ * buffers at once with AVX2, if it has them. It's meant for bulk callers
+ * such as verification, which have lots of pieces to hash.
+ *
+ * @param hashes gets `count' digests, one after another
+ */
+bool tr_sha1_batch(uint8_t* hashes, void const* const* data, size_t const* lengths, size_t count);
+
+/** Returns true if the CPU and the compiler support the implementation. */
+bool tr_sha1_batch_impl_is_supported(tr_sha1_impl impl);
+
+/** Forces tr_sha1_batch() to use one implementation. For tests and benchmarks. */
+void tr_sha1_batch_set_impl(tr_sha1_impl impl);
+
+/** Returns the implementation that tr_sha1_batch() is using. */
+tr_sha1_impl tr_sha1_batch_get_impl(void);
+
+/** @} */
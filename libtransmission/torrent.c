@@ -32,7 +32,9 @@
 #include "crypto-utils.h" /* for tr_sha1 */
 #include "error.h"
 #include "fdlimit.h" /* tr_fdTorrentClose */
+#include "filemap.h"
 #include "file.h"
+#include "fingerprint.h"
 #include "inout.h" /* tr_ioTestPiece() */
 #include "log.h"
 #include "magnet.h"
@@ -40,6 +42,7 @@
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
 #include "peer-mgr.h"
 #include "platform.h" /* TR_PATH_DELIMITER_STR */
+#include "prealloc.h"
 #include "ptrarray.h"
 #include "resume.h"
 #include "session.h"
@@ -1299,7 +1302,8 @@ static double getVerifyProgress(tr_torrent const* tor)
 {
     double d = 0;
 
-    if (tr_torrentHasMetadata(tor))
+    /* a partial verify only counts the pieces it's verifying */
+    if (!tr_verifyGetProgress(tor, &d) && tr_torrentHasMetadata(tor))
     {
         tr_piece_index_t checked = 0;
 
@@ -1348,6 +1352,7 @@ tr_stat const* tr_torrentStat(tr_torrent* tor)
     s->activity = tr_torrentGetActivity(tor);
     s->error = tor->error;
     s->queuePosition = tor->queuePosition;
+    s->verifyQueuePosition = tor->verifyState == TR_VERIFY_WAIT ? tr_verifyGetQueuePosition(tor) : -1;
     s->isStalled = tr_torrentIsStalled(tor);
     tr_strlcpy(s->errorString, tor->errorString, sizeof(s->errorString));
 
@@ -1675,7 +1680,10 @@ static void freeTorrent(tr_torrent* tor)
 
     tr_announcerRemoveTorrent(session->announcer, tor);
 
+    tr_preallocTorrentRemove(session->prealloc, tor->uniqueId);
+
     tr_cpDestruct(&tor->completion);
+    tr_free(tor->fingerprints);
 
     tr_free(tor->downloadDir);
     tr_free(tor->incompleteDir);
@@ -1855,6 +1863,7 @@ struct verify_data
 {
     bool aborted;
     tr_torrent* tor;
+    tr_bitfield* pieces; /* NULL for all of them */
     tr_verify_done_func callback_func;
     void* callback_data;
 };
@@ -1910,6 +1919,7 @@ static void verifyTorrent(void* vdata)
     bool startAfter;
     struct verify_data* data = vdata;
     tr_torrent* tor = data->tor;
+    tr_bitfield* pieces = data->pieces;
     tr_sessionLock(tor->session);
 
     if (tor->isDeleting)
@@ -1936,25 +1946,46 @@ static void verifyTorrent(void* vdata)
     }
     else
     {
-        tr_verifyAdd(tor, onVerifyDone, data);
+        tr_verifyAdd(tor, pieces, onVerifyDone, data);
     }
 
 unlock:
     tr_sessionUnlock(tor->session);
+
+    if (pieces != NULL)
+    {
+        tr_bitfieldDestruct(pieces);
+        tr_free(pieces);
+    }
 }
 
-void tr_torrentVerify(tr_torrent* tor, tr_verify_done_func callback_func, void* callback_data)
+void tr_torrentVerifyPieces(tr_torrent* tor, tr_bitfield const* pieces, tr_verify_done_func callback_func,
+    void* callback_data)
 {
     struct verify_data* data;
 
     data = tr_new(struct verify_data, 1);
     data->tor = tor;
     data->aborted = false;
+    data->pieces = NULL;
     data->callback_func = callback_func;
     data->callback_data = callback_data;
+
+    if (pieces != NULL)
+    {
+        data->pieces = tr_new0(tr_bitfield, 1);
+        tr_bitfieldConstruct(data->pieces, tor->info.pieceCount);
+        tr_bitfieldSetFromBitfield(data->pieces, pieces);
+    }
+
     tr_runInEventThread(tor->session, verifyTorrent, data);
 }
 
+void tr_torrentVerify(tr_torrent* tor, tr_verify_done_func callback_func, void* callback_data)
+{
+    tr_torrentVerifyPieces(tor, NULL, callback_func, callback_data);
+}
+
 void tr_torrentSave(tr_torrent* tor)
 {
     TR_ASSERT(tr_isTorrent(tor));
@@ -1981,6 +2012,7 @@ static void stopTorrent(void* vtor)
     tr_announcerTorrentStopped(tor);
     tr_cacheFlushTorrent(tor->session->cache, tor);
 
+    tr_filemapTorrentClose(tor->session->filemap, tor->uniqueId);
     tr_fdTorrentClose(tor->session, tor->uniqueId);
 
     if (!tor->isDeleting)
@@ -2257,6 +2289,7 @@ void tr_torrentRecheckCompleteness(tr_torrent* tor)
         }
 
         tor->completeness = completeness;
+        tr_filemapTorrentClose(tor->session->filemap, tor->uniqueId);
         tr_fdTorrentClose(tor->session, tor->uniqueId);
 
         if (tr_torrentIsSeed(tor))
@@ -2480,6 +2513,59 @@ void tr_torrentSetFileDLs(tr_torrent* tor, tr_file_index_t const* files, tr_file
     tr_torrentUnlock(tor);
 }
 
+/***
+****  Sequential download
+***/
+
+void tr_torrentSetSequentialDownload(tr_torrent* tor, bool sequential)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+
+    tr_torrentLock(tor);
+
+    if (tor->sequentialDownload != sequential)
+    {
+        tor->sequentialDownload = sequential;
+        tr_torrentSetDirty(tor);
+        tr_peerMgrRebuildRequests(tor);
+    }
+
+    tr_torrentUnlock(tor);
+}
+
+bool tr_torrentGetSequentialDownload(tr_torrent const* tor)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+
+    return tor->sequentialDownload;
+}
+
+void tr_torrentSetFileSequential(tr_torrent* tor, tr_file_index_t const* files, tr_file_index_t fileCount, bool sequential)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+
+    bool changed = false;
+
+    tr_torrentLock(tor);
+
+    for (tr_file_index_t i = 0; i < fileCount; ++i)
+    {
+        if (files[i] < tor->info.fileCount && tor->info.files[files[i]].sequential != sequential)
+        {
+            tor->info.files[files[i]].sequential = sequential;
+            changed = true;
+        }
+    }
+
+    if (changed)
+    {
+        tr_torrentSetDirty(tor);
+        tr_peerMgrRebuildRequests(tor);
+    }
+
+    tr_torrentUnlock(tor);
+}
+
 /***
 ****
 ***/
@@ -2701,6 +2787,66 @@ time_t tr_torrentGetFileMTime(tr_torrent const* tor, tr_file_index_t i)
     return mtime;
 }
 
+void tr_torrentGetFingerprint(tr_torrent const* tor, tr_file_index_t i, tr_fingerprint* setme)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+    TR_ASSERT(i < tor->info.fileCount);
+
+    char* filename = tr_torrentFindFile(tor, i);
+
+    tr_fingerprintTake(setme, filename, tr_sessionIsVerifySmartSample(tor->session));
+    tr_free(filename);
+}
+
+void tr_torrentSetFingerprint(tr_torrent* tor, tr_file_index_t i, tr_fingerprint const* fingerprint)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+    TR_ASSERT(i < tor->info.fileCount);
+    TR_ASSERT(tr_sessionIsLocked(tor->session));
+
+    if (tor->fingerprints == NULL)
+    {
+        tor->fingerprints = tr_new0(tr_fingerprint, tor->info.fileCount);
+    }
+
+    if (memcmp(&tor->fingerprints[i], fingerprint, sizeof(tr_fingerprint)) != 0)
+    {
+        tor->fingerprints[i] = *fingerprint;
+        tr_torrentSetDirty(tor);
+    }
+}
+
+void tr_torrentTakeFingerprint(tr_torrent* tor, tr_file_index_t i)
+{
+    tr_fingerprint fingerprint;
+
+    tr_torrentGetFingerprint(tor, i, &fingerprint);
+
+    tr_sessionLock(tor->session);
+    tr_torrentSetFingerprint(tor, i, &fingerprint);
+    tr_sessionUnlock(tor->session);
+}
+
+bool tr_torrentFingerprintMatches(tr_torrent const* tor, tr_file_index_t i)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+    TR_ASSERT(i < tor->info.fileCount);
+
+    bool matches;
+    char* filename;
+
+    if (tor->fingerprints == NULL || tor->fingerprints[i].mtime == 0)
+    {
+        return false;
+    }
+
+    filename = tr_torrentFindFile(tor, i);
+    matches = tr_fingerprintMatches(&tor->fingerprints[i], filename, tr_sessionIsVerifySmartSample(tor->session));
+    tr_free(filename);
+
+    return matches;
+}
+
 bool tr_torrentPieceNeedsCheck(tr_torrent const* tor, tr_piece_index_t p)
 {
     uint64_t unused;
@@ -2909,7 +3055,14 @@ uint64_t tr_torrentGetBytesLeftToAllocate(tr_torrent const* tor)
 
     for (tr_file_index_t i = 0; i < tor->info.fileCount; ++i)
     {
-        if (!tor->info.files[i].dnd)
+        uint64_t fillLeft;
+
+        if (tr_preallocGetBytesLeft(tor->session->prealloc, tor->uniqueId, i, &fillLeft))
+        {
+            /* it's being filled in the background */
+            bytesLeft += fillLeft;
+        }
+        else if (!tor->info.files[i].dnd)
         {
             tr_sys_path_info info;
             uint64_t const length = tor->info.files[i].length;
@@ -3183,6 +3336,7 @@ static void tr_torrentDeleteLocalData(tr_torrent* tor, tr_fileFunc func)
 
     /* close all the files because we're about to delete them */
     tr_cacheFlushTorrent(tor->session->cache, tor);
+    tr_filemapTorrentClose(tor->session->filemap, tor->uniqueId);
     tr_fdTorrentClose(tor->session, tor->uniqueId);
 
     deleteLocalData(tor, func);
@@ -3214,6 +3368,7 @@ static void setLocation(void* vdata)
     bool const do_move = data->move_from_old_location;
     char const* location = data->location;
     double bytesHandled = 0;
+    tr_bitfield moved = TR_BITFIELD_INIT;
 
     tr_logAddDebug("Moving \"%s\" location from currentDir \"%s\" to \"%s\"", tr_torrentName(tor), tor->currentDir, location);
 
@@ -3224,6 +3379,12 @@ static void setLocation(void* vdata)
         /* bad idea to move files while they're being verified... */
         tr_verifyRemove(tor);
 
+        /* ...or while they're being read or written */
+        tr_diskioWait(tor->session->diskio, tor);
+        tr_filemapTorrentClose(tor->session->filemap, tor->uniqueId);
+
+        tr_bitfieldConstruct(&moved, tor->info.fileCount);
+
         /* try to move the files.
          * FIXME: there are still all kinds of nasty cases, like what
          * if the target directory runs out of space halfway through... */
@@ -3244,6 +3405,10 @@ static void setLocation(void* vdata)
                 {
                     tr_error* error = NULL;
 
+                    /* a copy of an unchanged file is unchanged too, even though
+                       it probably has a new inode, and maybe a new mtime */
+                    bool const was_unchanged = tr_torrentFingerprintMatches(tor, i);
+
                     tr_logAddTorInfo(tor, "moving \"%s\" to \"%s\"", oldpath, newpath);
 
                     if (!tr_moveFile(oldpath, newpath, &error))
@@ -3252,6 +3417,10 @@ static void setLocation(void* vdata)
                         tr_logAddTorErr(tor, "error moving \"%s\" to \"%s\": %s", oldpath, newpath, error->message);
                         tr_error_free(error);
                     }
+                    else if (was_unchanged)
+                    {
+                        tr_bitfieldAdd(&moved, i);
+                    }
                 }
 
                 tr_free(newpath);
@@ -3284,8 +3453,18 @@ static void setLocation(void* vdata)
             tor->incompleteDir = NULL;
             tor->currentDir = tor->downloadDir;
         }
+
+        for (tr_file_index_t i = 0; i < tor->info.fileCount; ++i)
+        {
+            if (tr_bitfieldHas(&moved, i))
+            {
+                tr_torrentTakeFingerprint(tor, i);
+            }
+        }
     }
 
+    tr_bitfieldDestruct(&moved);
+
     if (data->setme_state != NULL)
     {
         *data->setme_state = err ? TR_LOC_ERROR : TR_LOC_DONE;
@@ -3368,6 +3547,9 @@ static void tr_torrentFileCompleted(tr_torrent* tor, tr_file_index_t fileIndex)
 
         tr_free(sub);
     }
+
+    /* the file's been checked piece by piece, and won't be written to again */
+    tr_torrentTakeFingerprint(tor, fileIndex);
 }
 
 static void tr_torrentPieceCompleted(tr_torrent* tor, tr_piece_index_t pieceIndex)
@@ -14,6 +14,7 @@
 
 #include "bandwidth.h" /* tr_bandwidth */
 #include "completion.h" /* tr_completion */
+#include "fingerprint.h" /* tr_fingerprint */
 #include "session.h" /* tr_sessionLock(), tr_sessionUnlock() */
 #include "tr-assert.h"
 #include "utils.h" /* TR_GNUC_PRINTF */
@@ -168,6 +169,10 @@ struct tr_torrent
 
     struct tr_completion completion;
 
+    /* what each file looked like when its pieces were last checked, or NULL.
+       A fingerprint with no mtime is one that couldn't be taken. */
+    tr_fingerprint* fingerprints;
+
     tr_completeness completeness;
 
     struct tr_torrent_tiers* tiers;
@@ -251,6 +256,8 @@ struct tr_torrent
     tr_idlelimit idleLimitMode;
     bool finishedSeedingByIdle;
 
+    bool sequentialDownload;
+
     tr_ptrArray labels;
 };
 
@@ -393,6 +400,25 @@ void tr_torrentGotNewInfoDict(tr_torrent* tor);
 void tr_torrentSetSpeedLimit_Bps(tr_torrent*, tr_direction, unsigned int Bps);
 unsigned int tr_torrentGetSpeedLimit_Bps(tr_torrent const*, tr_direction);
 
+/**
+ * @brief Like tr_torrentVerify(), but only verifies some of the pieces.
+ * @param pieces the pieces to verify, or NULL for all of them. It's copied.
+ */
+void tr_torrentVerifyPieces(tr_torrent* tor, tr_bitfield const* pieces, tr_verify_done_func callback_func,
+    void* callback_data);
+
+/** @brief Fingerprint a file as it is on disk now, without remembering it. Safe from any thread */
+void tr_torrentGetFingerprint(tr_torrent const* tor, tr_file_index_t fileIndex, tr_fingerprint* setme);
+
+/** @brief Remember a file's fingerprint, for smart verify. Call with the session locked */
+void tr_torrentSetFingerprint(tr_torrent* tor, tr_file_index_t fileIndex, tr_fingerprint const* fingerprint);
+
+/** @brief Remember what a file looks like on disk now, for smart verify */
+void tr_torrentTakeFingerprint(tr_torrent* tor, tr_file_index_t fileIndex);
+
+/** @return true if a file looks the same as when it was last fingerprinted */
+bool tr_torrentFingerprintMatches(tr_torrent const* tor, tr_file_index_t fileIndex);
+
 /**
  * @return true if this piece needs to be tested
  */
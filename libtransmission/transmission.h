@@ -488,6 +488,118 @@ void tr_sessionSetLPDEnabled(tr_session* session, bool enabled);
 void tr_sessionSetCacheLimit_MB(tr_session* session, int mb);
 int tr_sessionGetCacheLimit_MB(tr_session const* session);
 
+/**
+ * @brief Set whether files written from the cache are synced to disk.
+ *
+ * If enabled, each file that's been written to is synced every few seconds
+ * and when it's closed, so that less is lost if the machine goes down.
+ */
+void tr_sessionSetCacheSyncEnabled(tr_session* session, bool enabled);
+bool tr_sessionIsCacheSyncEnabled(tr_session const* session);
+
+/**
+ * @brief Set how many threads do the session's disk I/O.
+ *
+ * Zero does all of the disk I/O in the libtransmission thread.
+ */
+void tr_sessionSetDiskIOThreads(tr_session* session, int count);
+int tr_sessionGetDiskIOThreads(tr_session const* session);
+
+/**
+ * @brief Set how many disk I/O operations can run on one device at once.
+ *
+ * One keeps a spinning disk from seeking back and forth between them.
+ * SSDs and RAIDs can do more at once, as long as there are enough threads.
+ */
+void tr_sessionSetDiskIOQueueDepth(tr_session* session, int depth);
+int tr_sessionGetDiskIOQueueDepth(tr_session const* session);
+
+/**
+ * @brief Use io_uring for the session's disk I/O instead of threads.
+ *
+ * Only Linux builds configured with io_uring support can do this. If it's
+ * not available, the disk I/O threads are used.
+ */
+void tr_sessionSetIOUringEnabled(tr_session* session, bool enabled);
+bool tr_sessionIsIOUringEnabled(tr_session const* session);
+
+/**
+ * @brief Set how much of seeding torrents' files can be memory-mapped.
+ *
+ * Mapped blocks are sent to unencrypted peers without being copied.
+ * Zero turns this off, and all uploads are read from disk as usual.
+ */
+void tr_sessionSetMmapLimit_MB(tr_session* session, int mb);
+int tr_sessionGetMmapLimit_MB(tr_session const* session);
+
+/**
+ * @brief Set how many threads hash pieces while a torrent is verified.
+ *
+ * Zero hashes them in the thread that reads them, one at a time.
+ */
+void tr_sessionSetVerifyThreads(tr_session* session, int count);
+int tr_sessionGetVerifyThreads(tr_session const* session);
+
+/**
+ * @brief Set whether torrents on different devices are verified at the same time.
+ *
+ * If disabled, only one torrent is verified at a time.
+ */
+void tr_sessionSetVerifyPerDevice(tr_session* session, bool enabled);
+bool tr_sessionIsVerifyPerDevice(tr_session const* session);
+
+/**
+ * @brief Set the most torrents that may be verified at the same time.
+ *
+ * This only matters if tr_sessionIsVerifyPerDevice() is set, and it's
+ * at least one.
+ */
+void tr_sessionSetVerifyMaxConcurrent(tr_session* session, int count);
+int tr_sessionGetVerifyMaxConcurrent(tr_session const* session);
+
+/**
+ * @brief Set whether verification reads around the page cache.
+ *
+ * This keeps a big verify from evicting data that peers are downloading.
+ * Where the filesystem doesn't support it, reads are cached as usual.
+ */
+void tr_sessionSetVerifyDirectIO(tr_session* session, bool enabled);
+bool tr_sessionIsVerifyDirectIO(tr_session const* session);
+
+/**
+ * @brief Set how fast, in KBps, all of the session's verifies may read from disk.
+ *
+ * Zero means no limit. Either way, verification backs off while the
+ * session is reading from the same device for peers.
+ */
+void tr_sessionSetVerifySpeedLimit_KBps(tr_session* session, int KBps);
+int tr_sessionGetVerifySpeedLimit_KBps(tr_session const* session);
+
+/**
+ * @brief Set whether verification runs as fast as the disk allows,
+ * ignoring the speed limit and other reads of the device.
+ */
+void tr_sessionSetVerifyFullSpeed(tr_session* session, bool enabled);
+bool tr_sessionIsVerifyFullSpeed(tr_session const* session);
+
+/**
+ * @brief Set whether verification trusts files that haven't changed.
+ *
+ * A file that has the same size, mtime and inode as when its pieces were
+ * last checked keeps the pieces it had, without being read again.
+ */
+void tr_sessionSetVerifySmart(tr_session* session, bool enabled);
+bool tr_sessionIsVerifySmart(tr_session const* session);
+
+/**
+ * @brief Set whether smart verify also compares a hash of a few chunks of each file.
+ *
+ * Files that match it are trusted even if their inode changed, such as
+ * after being moved to another filesystem.
+ */
+void tr_sessionSetVerifySmartSample(tr_session* session, bool enabled);
+bool tr_sessionIsVerifySmartSample(tr_session const* session);
+
 tr_encryption_mode tr_sessionGetEncryption(tr_session* session);
 void tr_sessionSetEncryption(tr_session* session, tr_encryption_mode mode);
 
@@ -1206,6 +1318,22 @@ tr_priority_t* tr_torrentGetFilePriorities(tr_torrent const* torrent);
 /** @brief Set a batch of files to be downloaded or not. */
 void tr_torrentSetFileDLs(tr_torrent* torrent, tr_file_index_t const* files, tr_file_index_t fileCount, bool do_download);
 
+/**
+ * @brief Download the torrent front to back, e.g. to play it while it's downloading.
+ *
+ * The pieces just past the first one we're missing are given deadlines.
+ * They're requested before anything else, and the ones that are due soonest
+ * go to the fastest peers. The rest of the torrent is still downloaded
+ * rarest first.
+ */
+void tr_torrentSetSequentialDownload(tr_torrent* torrent, bool sequential);
+
+bool tr_torrentGetSequentialDownload(tr_torrent const* torrent);
+
+/** @brief Like tr_torrentSetSequentialDownload(), but for a batch of files, each of which is downloaded front to back. */
+void tr_torrentSetFileSequential(tr_torrent* torrent, tr_file_index_t const* files, tr_file_index_t fileCount,
+    bool sequential);
+
 tr_info const* tr_torrentInfo(tr_torrent const* torrent);
 
 /* Raw function to change the torrent's downloadDir field.
@@ -1591,6 +1719,7 @@ typedef struct tr_file
     char* name; /* Path to the file */
     int8_t priority; /* TR_PRI_HIGH, _NORMAL, or _LOW */
     bool dnd; /* "do not download" flag */
+    bool sequential; /* download front to back. See tr_torrentSetFileSequential() */
     bool is_renamed; /* true if we're using a different path from the one in the metainfo; ie, if the user has renamed it */
     tr_piece_index_t firstPiece; /* We need pieces [firstPiece... */
     tr_piece_index_t lastPiece; /* ...lastPiece] to dl this file */
@@ -1868,6 +1997,10 @@ typedef struct tr_stat
         All torrents have a queue position, even if it's not queued. */
     int queuePosition;
 
+    /** This torrent's position in the verify queue, or -1 if it isn't
+        waiting to be verified. @see tr_torrentVerify() */
+    int verifyQueuePosition;
+
     /** True if the torrent is running, but has been idle for long enough
         to be considered stalled.  @see tr_sessionGetQueueStalledMinutes() */
     bool isStalled;
@@ -0,0 +1,235 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include "transmission.h"
+#include "bitfield.h"
+#include "file.h"
+#include "torrent.h"
+#include "utils.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+static void write_file_byte(tr_torrent* tor, tr_file_index_t i, uint64_t offset, char const* byte)
+{
+    char* path = tr_torrentFindFile(tor, i);
+    tr_sys_file_t fd = tr_sys_file_open(path, TR_SYS_FILE_WRITE, 0, NULL);
+
+    tr_sys_file_write_at(fd, byte, 1, offset, NULL, NULL);
+    tr_sys_file_close(fd, NULL);
+    tr_free(path);
+    libttest_sync();
+}
+
+static void corrupt_file(tr_torrent* tor, tr_file_index_t i, uint64_t offset)
+{
+    write_file_byte(tor, i, offset, "\1");
+}
+
+static void repair_file(tr_torrent* tor, tr_file_index_t i, uint64_t offset)
+{
+    write_file_byte(tor, i, offset, "\0");
+}
+
+static int test_verify_impl(int verify_threads, bool direct_io)
+{
+    tr_session* session;
+    tr_torrent* tor;
+    tr_variant settings;
+    uint32_t piece_size;
+    char* path;
+
+    tr_variantInitDict(&settings, 2);
+    tr_variantDictAddInt(&settings, TR_KEY_verify_threads, verify_threads);
+    tr_variantDictAddBool(&settings, TR_KEY_verify_direct_io, direct_io);
+    session = libttest_session_init(&settings);
+    tr_variantFree(&settings);
+    check_int(tr_sessionGetVerifyThreads(session), ==, verify_threads);
+
+    /* at least one torrent can always be verified */
+    tr_sessionSetVerifyMaxConcurrent(session, 0);
+    check_int(tr_sessionGetVerifyMaxConcurrent(session), ==, 1);
+
+    /* the first piece is bad, and the rest are good */
+    tor = libttest_zero_torrent_init(session);
+    libttest_zero_torrent_populate(tor, false);
+    piece_size = tor->info.pieceSize;
+    check_uint(tr_torrentStat(tor)->leftUntilDone, ==, piece_size);
+    check(!tr_torrentPieceIsComplete(tor, 0));
+    check(tr_torrentPieceIsComplete(tor, 1));
+
+    /* a piece that goes bad on disk is caught */
+    corrupt_file(tor, 0, piece_size * 2 + 100);
+    libttest_blockingTorrentVerify(tor);
+    check_uint(tr_torrentStat(tor)->leftUntilDone, ==, piece_size * 2);
+    check(!tr_torrentPieceIsComplete(tor, 2));
+    check(tr_torrentPieceIsComplete(tor, 3));
+
+    /* so are the pieces of a file that's gone */
+    path = tr_torrentFindFile(tor, 1);
+    check(tr_sys_path_remove(path, NULL));
+    tr_free(path);
+    libttest_blockingTorrentVerify(tor);
+    check(!tr_torrentPieceIsComplete(tor, tor->info.files[1].firstPiece));
+    check(!tr_torrentPieceIsComplete(tor, tor->info.files[1].lastPiece));
+    check(tr_torrentPieceIsComplete(tor, 1));
+
+    tr_torrentRemove(tor, true, tr_sys_path_remove);
+    libttest_session_close(session);
+    return 0;
+}
+
+static int test_verify_in_place(void)
+{
+    return test_verify_impl(0, false);
+}
+
+static int test_verify_threaded(void)
+{
+    return test_verify_impl(4, false);
+}
+
+static int test_verify_direct_io(void)
+{
+    return test_verify_impl(4, true);
+}
+
+static uint64_t time_verify(tr_session* session, tr_torrent* tor, int speed_limit_KBps, bool full_speed)
+{
+    uint64_t const start = tr_time_msec();
+
+    tr_sessionSetVerifySpeedLimit_KBps(session, speed_limit_KBps);
+    tr_sessionSetVerifyFullSpeed(session, full_speed);
+    libttest_blockingTorrentVerify(tor);
+
+    return tr_time_msec() - start;
+}
+
+static int test_verify_speed_limit(void)
+{
+    tr_session* session = libttest_session_init(NULL);
+    tr_torrent* tor = libttest_zero_torrent_init(session);
+    uint64_t const size = tor->info.totalSize;
+
+    libttest_zero_torrent_populate(tor, true);
+
+    /* the first second's worth is free, and the rest is throttled */
+    check_uint(time_verify(session, tor, size / 1024 / 2, false), >=, 500);
+    check_uint(tr_torrentStat(tor)->leftUntilDone, ==, 0);
+    check_int(tr_torrentStat(tor)->verifyQueuePosition, ==, -1);
+
+    /* unless verification is told to ignore the limit */
+    check_uint(time_verify(session, tor, 1, true), <, 500);
+    check_uint(tr_torrentStat(tor)->leftUntilDone, ==, 0);
+
+    tr_torrentRemove(tor, true, tr_sys_path_remove);
+    libttest_session_close(session);
+    return 0;
+}
+
+static int test_verify_smart(void)
+{
+    tr_session* session;
+    tr_torrent* tor;
+    tr_variant settings;
+
+    tr_variantInitDict(&settings, 2);
+    tr_variantDictAddBool(&settings, TR_KEY_verify_smart, true);
+    tr_variantDictAddBool(&settings, TR_KEY_verify_smart_sample, false);
+    session = libttest_session_init(&settings);
+    tr_variantFree(&settings);
+
+    /* verifying fingerprints the files */
+    tor = libttest_zero_torrent_init(session);
+    libttest_zero_torrent_populate(tor, true);
+    check(tor->fingerprints != NULL);
+    check(tr_torrentFingerprintMatches(tor, 0));
+
+    /* a file that looks the same isn't reread, so this goes unnoticed */
+    corrupt_file(tor, 0, 100);
+    tr_torrentTakeFingerprint(tor, 0);
+    libttest_blockingTorrentVerify(tor);
+    check(tr_torrentPieceIsComplete(tor, 0));
+
+    /* but once its mtime changes, it's rehashed */
+    tor->fingerprints[0].mtime -= 1;
+    libttest_blockingTorrentVerify(tor);
+    check(!tr_torrentPieceIsComplete(tor, 0));
+    check(tr_torrentPieceIsComplete(tor, 1));
+
+    /* with a sample, a file that's been moved to a new inode is trusted */
+    tr_sessionSetVerifySmartSample(session, true);
+    repair_file(tor, 0, 100);
+    tr_torrentTakeFingerprint(tor, 0);
+    check(tor->fingerprints[0].has_sample);
+    tor->fingerprints[0].inode += 1;
+    libttest_blockingTorrentVerify(tor);
+    check(!tr_torrentPieceIsComplete(tor, 0));
+
+    /* unless the sample doesn't match */
+    tor->fingerprints[0].inode += 1;
+    tor->fingerprints[0].sample[0] ^= 1;
+    libttest_blockingTorrentVerify(tor);
+    check(tr_torrentPieceIsComplete(tor, 0));
+    check_uint(tr_torrentStat(tor)->leftUntilDone, ==, 0);
+
+    tr_torrentRemove(tor, true, tr_sys_path_remove);
+    libttest_session_close(session);
+    return 0;
+}
+
+static int test_verify_pieces(void)
+{
+    tr_session* session;
+    tr_torrent* tor;
+    tr_bitfield pieces;
+    time_t checked;
+    uint32_t const piece_size = 32 * 1024;
+
+    session = libttest_session_init(NULL);
+    tor = libttest_zero_torrent_init(session);
+    libttest_zero_torrent_populate(tor, true);
+    checked = tor->info.pieces[5].timeChecked;
+
+    /* pieces 2 and 5 go bad, but only the first few pieces are checked */
+    corrupt_file(tor, 0, piece_size * 2 + 100);
+    corrupt_file(tor, 0, piece_size * 5 + 100);
+    tr_bitfieldConstruct(&pieces, tor->info.pieceCount);
+    tr_bitfieldAddRange(&pieces, 0, 4);
+    libttest_blockingTorrentVerifyPieces(tor, &pieces);
+    check(tr_torrentPieceIsComplete(tor, 1));
+    check(!tr_torrentPieceIsComplete(tor, 2));
+    check(tr_torrentPieceIsComplete(tor, 5));
+    check_int(tor->info.pieces[5].timeChecked, ==, checked);
+
+    /* checking the rest of the file finds the other one */
+    tr_bitfieldAddRange(&pieces, tor->info.files[0].firstPiece, tor->info.files[0].lastPiece + 1);
+    libttest_blockingTorrentVerifyPieces(tor, &pieces);
+    check(!tr_torrentPieceIsComplete(tor, 5));
+    check(tr_torrentPieceIsComplete(tor, 6));
+    tr_bitfieldDestruct(&pieces);
+
+    tr_torrentRemove(tor, true, tr_sys_path_remove);
+    libttest_session_close(session);
+    return 0;
+}
+
+int main(void)
+{
+    testFunc const tests[] =
+    {
+        test_verify_in_place,
+        test_verify_threaded,
+        test_verify_direct_io,
+        test_verify_speed_limit,
+        test_verify_smart,
+        test_verify_pieces
+    };
+
+    return runTests(tests, NUM_TESTS(tests));
+}
@@ -10,12 +10,17 @@
 #include <stdlib.h> /* free() */
 
 #include "transmission.h"
+#include "bitfield.h"
 #include "completion.h"
 #include "crypto-utils.h"
+#include "diskio.h" /* tr_diskioGetReadBacklog() */
 #include "file.h"
+#include "inout.h" /* tr_ioFindFileLocation() */
 #include "list.h"
 #include "log.h"
-#include "platform.h" /* tr_lock() */
+#include "platform.h" /* tr_lock(), tr_threadNew() */
+#include "session.h"
+#include "sha1-batch.h"
 #include "torrent.h"
 #include "tr-assert.h"
 #include "utils.h" /* tr_valloc(), tr_free() */
@@ -27,134 +32,567 @@
 
 enum
 {
-    MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY = 100
+    /* while the session is reading from the same device, verification
+       waits this long at a time, up to a limit, before each piece */
+    VERIFY_BACKOFF_MSEC = 20,
+    VERIFY_MAX_BACKOFF_MSEC = 1000,
+
+    /* how long a throttled verifier sleeps between checks for being stopped */
+    VERIFY_SLEEP_MSEC = 100,
+
+    /* how long the reader and the hashers sleep when they're waiting on each other */
+    VERIFY_WAIT_MSEC = 1,
+
+    /* the most memory that one verification's piece buffers can take */
+    VERIFY_MAX_BUFFER_BYTES = 64 * 1024 * 1024,
+
+    /* with direct I/O, reads that don't line up in the piece buffer go through this */
+    VERIFY_BOUNCE_BYTES = 256 * 1024,
+
+    VERIFY_MAX_THREADS = 32
 };
 
-static bool verifyTorrent(tr_torrent* tor, bool* stopFlag)
+/* A torrent is verified by one reader, which streams its files in order
+ * into a ring of piece-sized slots, and a few hashers, which each hash a
+ * different piece. The reader applies the results in piece order. */
+
+enum
 {
-    time_t end;
-    tr_sha1_ctx_t sha;
-    tr_sys_file_t fd = TR_BAD_SYS_FILE;
-    uint64_t filePos = 0;
-    bool changed = false;
-    bool hadPiece = false;
-    time_t lastSleptAt = 0;
-    uint32_t piecePos = 0;
-    tr_file_index_t fileIndex = 0;
-    tr_file_index_t prevFileIndex = !fileIndex;
-    tr_piece_index_t pieceIndex = 0;
-    time_t const begin = tr_time();
-    size_t const buflen = 1024 * 128; /* 128 KiB buffer */
-    uint8_t* buffer = tr_valloc(buflen);
+    SLOT_EMPTY, /* the reader can fill it */
+    SLOT_READ, /* waiting for a hasher */
+    SLOT_HASHING,
+    SLOT_HASHED /* waiting for the reader to apply the result */
+};
 
-    sha = tr_sha1_init();
+struct verify_slot
+{
+    int state;
+    tr_piece_index_t piece;
+    bool is_selected; /* false if the piece is just being passed over */
+    bool is_readable; /* all of the piece's bytes could be read */
+    bool has_piece;
+    uint8_t* buf;
+};
+
+struct verify_run
+{
+    tr_torrent* tor;
+
+    /* everything below is protected by `lock' */
+    tr_lock* lock;
 
-    tr_logAddTorDbg(tor, "%s", "verifying torrent...");
-    tr_torrentSetChecked(tor, 0);
+    struct verify_slot* slots;
+    int slot_count;
+    tr_piece_index_t volatile* pieces_done;
+    int hasher_count;
+    bool is_reading_done;
+
+    /* the reader's place in the files */
+    tr_file_index_t file_index;
+    uint64_t file_pos;
+    tr_sys_file_t fd;
+
+    /* the same file opened for direct I/O, or TR_BAD_SYS_FILE */
+    tr_sys_file_t direct_fd;
+    uint8_t* bounce;
+};
+
+static void hashSlots(tr_torrent const* tor, struct verify_slot** slots, int n)
+{
+    uint8_t hashes[TR_SHA1_BATCH_SIZE * SHA_DIGEST_LENGTH];
+    void const* data[TR_SHA1_BATCH_SIZE];
+    size_t lengths[TR_SHA1_BATCH_SIZE];
+    bool ok;
 
-    while (!*stopFlag && pieceIndex < tor->info.pieceCount)
+    TR_ASSERT(n <= TR_SHA1_BATCH_SIZE);
+
+    for (int i = 0; i < n; ++i)
+    {
+        data[i] = slots[i]->buf;
+        lengths[i] = slots[i]->is_readable ? tr_torPieceCountBytes(tor, slots[i]->piece) : 0;
+    }
+
+    ok = tr_sha1_batch(hashes, data, lengths, n);
+
+    for (int i = 0; i < n; ++i)
+    {
+        slots[i]->has_piece = ok && slots[i]->is_readable &&
+            memcmp(hashes + i * SHA_DIGEST_LENGTH, tor->info.pieces[slots[i]->piece].hash, SHA_DIGEST_LENGTH) == 0;
+    }
+}
+
+static void hasherFunc(void* vrun)
+{
+    struct verify_run* run = vrun;
+
+    tr_lockLock(run->lock);
+
+    for (;;)
     {
-        uint64_t leftInPiece;
-        uint64_t bytesThisPass;
-        uint64_t leftInFile;
-        tr_file const* file = &tor->info.files[fileIndex];
+        struct verify_slot* batch[TR_SHA1_BATCH_SIZE];
+        int ready = 0;
+        int n = 0;
 
-        /* if we're starting a new piece... */
-        if (piecePos == 0)
+        for (int i = 0; i < run->slot_count; ++i)
         {
-            hadPiece = tr_torrentPieceIsComplete(tor, pieceIndex);
+            if (run->slots[i].state == SLOT_READ)
+            {
+                ++ready;
+            }
         }
 
-        /* if we're starting a new file... */
-        if (filePos == 0 && fd == TR_BAD_SYS_FILE && fileIndex != prevFileIndex)
+        if (ready == 0)
         {
-            char* filename = tr_torrentFindFile(tor, fileIndex);
-            fd = filename == NULL ? TR_BAD_SYS_FILE : tr_sys_file_open(filename, TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0,
-                NULL);
-            tr_free(filename);
-            prevFileIndex = fileIndex;
+            if (run->is_reading_done)
+            {
+                break;
+            }
+
+            tr_lockUnlock(run->lock);
+            tr_wait_msec(VERIFY_WAIT_MSEC);
+            tr_lockLock(run->lock);
+            continue;
         }
 
-        /* figure out how much we can read this pass */
-        leftInPiece = tr_torPieceCountBytes(tor, pieceIndex) - piecePos;
-        leftInFile = file->length - filePos;
-        bytesThisPass = MIN(leftInFile, leftInPiece);
-        bytesThisPass = MIN(bytesThisPass, buflen);
+        /* take a fair share of what's been read, so that the
+           other hashers aren't left idle while this one works */
+        ready = MIN(MAX(ready / run->hasher_count, 1), TR_SHA1_BATCH_SIZE);
 
-        /* read a bit */
-        if (fd != TR_BAD_SYS_FILE)
+        for (int i = 0; n < ready && i < run->slot_count; ++i)
         {
-            uint64_t numRead;
-
-            if (tr_sys_file_read_at(fd, buffer, bytesThisPass, filePos, &numRead, NULL) && numRead > 0)
+            if (run->slots[i].state == SLOT_READ)
             {
-                bytesThisPass = numRead;
-                tr_sha1_update(sha, buffer, bytesThisPass);
-                tr_sys_file_advise(fd, filePos, bytesThisPass, TR_SYS_FILE_ADVICE_DONT_NEED, NULL);
+                batch[n] = &run->slots[i];
+                batch[n++]->state = SLOT_HASHING;
             }
         }
 
-        /* move our offsets */
-        leftInPiece -= bytesThisPass;
-        leftInFile -= bytesThisPass;
-        piecePos += bytesThisPass;
-        filePos += bytesThisPass;
+        tr_lockUnlock(run->lock);
 
-        /* if we're finishing a piece... */
-        if (leftInPiece == 0)
+        hashSlots(run->tor, batch, n);
+
+        tr_lockLock(run->lock);
+
+        for (int i = 0; i < n; ++i)
         {
-            time_t now;
-            bool hasPiece;
-            uint8_t hash[SHA_DIGEST_LENGTH];
+            batch[i]->state = SLOT_HASHED;
+        }
+    }
 
-            tr_sha1_final(sha, hash);
-            hasPiece = memcmp(hash, tor->info.pieces[pieceIndex].hash, SHA_DIGEST_LENGTH) == 0;
+    --run->hasher_count;
 
-            if (hasPiece || hadPiece)
-            {
-                tr_torrentSetHasPiece(tor, pieceIndex, hasPiece);
-                changed |= hasPiece != hadPiece;
-            }
+    tr_lockUnlock(run->lock);
+}
 
-            tr_torrentSetPieceChecked(tor, pieceIndex);
-            now = tr_time();
-            tor->anyDate = now;
+static void openFile(struct verify_run* run, tr_file_index_t file_index)
+{
+    char* filename = tr_torrentFindFile(run->tor, file_index);
 
-            /* sleeping even just a few msec per second goes a long
-             * way towards reducing IO load... */
-            if (lastSleptAt != now)
+    if (filename != NULL)
+    {
+        run->fd = tr_sys_file_open(filename, TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0, NULL);
+
+        /* not every filesystem supports direct I/O, so this may fail */
+        if (run->fd != TR_BAD_SYS_FILE && run->bounce != NULL)
+        {
+            run->direct_fd = tr_sys_file_open(filename, TR_SYS_FILE_READ | TR_SYS_FILE_DIRECT, 0, NULL);
+        }
+
+        tr_free(filename);
+    }
+}
+
+static void closeFile(struct verify_run* run)
+{
+    if (run->direct_fd != TR_BAD_SYS_FILE)
+    {
+        tr_sys_file_close(run->direct_fd, NULL);
+        run->direct_fd = TR_BAD_SYS_FILE;
+    }
+
+    if (run->fd != TR_BAD_SYS_FILE)
+    {
+        tr_sys_file_close(run->fd, NULL);
+        run->fd = TR_BAD_SYS_FILE;
+    }
+}
+
+/* read the next piece into `slot'. A missing or short file
+   leaves the piece unreadable, which means it fails */
+static void readPiece(struct verify_run* run, struct verify_slot* slot)
+{
+    tr_torrent* tor = run->tor;
+    uint32_t const len = tr_torPieceCountBytes(tor, slot->piece);
+    uint32_t piece_pos = 0;
+
+    slot->is_readable = true;
+
+    while (piece_pos < len)
+    {
+        tr_file const* file = &tor->info.files[run->file_index];
+        uint64_t const bytes_this_pass = MIN(file->length - run->file_pos, (uint64_t)(len - piece_pos));
+
+        /* if we're starting a new file... */
+        if (run->file_pos == 0 && run->fd == TR_BAD_SYS_FILE && file->length > 0)
+        {
+            openFile(run, run->file_index);
+        }
+
+        if (bytes_this_pass > 0)
+        {
+            uint64_t num_read;
+
+            if (run->fd == TR_BAD_SYS_FILE || !tr_sys_file_read_at_direct(run->fd, run->direct_fd, slot->buf + piece_pos,
+                bytes_this_pass, run->file_pos, run->bounce, VERIFY_BOUNCE_BYTES, &num_read, NULL) ||
+                num_read != bytes_this_pass)
             {
-                lastSleptAt = now;
-                tr_wait_msec(MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY);
+                slot->is_readable = false;
+            }
+            else
+            {
+                tr_sys_file_advise(run->fd, run->file_pos, bytes_this_pass, TR_SYS_FILE_ADVICE_DONT_NEED, NULL);
             }
-
-            sha = tr_sha1_init();
-            pieceIndex++;
-            piecePos = 0;
         }
 
+        piece_pos += bytes_this_pass;
+        run->file_pos += bytes_this_pass;
+
         /* if we're finishing a file... */
-        if (leftInFile == 0)
+        if (run->file_pos == file->length)
+        {
+            closeFile(run);
+            ++run->file_index;
+            run->file_pos = 0;
+        }
+    }
+}
+
+/* point the reader at the start of `piece', after it's skipped some */
+static void seekPiece(struct verify_run* run, tr_piece_index_t piece)
+{
+    tr_file_index_t file_index;
+    uint64_t file_pos;
+
+    tr_ioFindFileLocation(run->tor, piece, 0, &file_index, &file_pos);
+
+    if (file_index != run->file_index)
+    {
+        closeFile(run);
+    }
+
+    /* readPiece() only opens files from their start */
+    if (run->fd == TR_BAD_SYS_FILE && file_pos != 0)
+    {
+        openFile(run, file_index);
+    }
+
+    run->file_index = file_index;
+    run->file_pos = file_pos;
+}
+
+/* With smart verify, a piece whose files all look the same as they did
+ * when they were last fingerprinted keeps what it had, without being
+ * read. Returns the pieces that do need to be read. */
+static void getPiecesToRead(tr_torrent* tor, tr_bitfield* setme)
+{
+    tr_info const* inf = &tor->info;
+
+    tr_bitfieldConstruct(setme, inf->pieceCount);
+
+    if (!tr_sessionIsVerifySmart(tor->session))
+    {
+        tr_bitfieldSetHasAll(setme);
+        return;
+    }
+
+    for (tr_file_index_t i = 0; i < inf->fileCount; ++i)
+    {
+        tr_file const* file = &inf->files[i];
+
+        if (file->length > 0 && !tr_torrentFingerprintMatches(tor, i))
+        {
+            tr_bitfieldAddRange(setme, file->firstPiece, file->lastPiece + 1);
+        }
+    }
+}
+
+/* returns true if the torrent's completeness changed */
+static bool applyResult(tr_torrent* tor, struct verify_slot const* slot)
+{
+    bool const had_piece = tr_torrentPieceIsComplete(tor, slot->piece);
+
+    if (slot->has_piece || had_piece)
+    {
+        tr_torrentSetHasPiece(tor, slot->piece, slot->has_piece);
+    }
+
+    tr_torrentSetPieceChecked(tor, slot->piece);
+    tor->anyDate = tr_time();
+
+    return slot->has_piece != had_piece;
+}
+
+/* apply the results that are ready, in piece order. Returns the next piece to apply */
+static tr_piece_index_t applyResults(struct verify_run* run, tr_piece_index_t next, tr_piece_index_t end, bool* changed)
+{
+    tr_lockLock(run->lock);
+
+    while (next < end)
+    {
+        struct verify_slot* slot = &run->slots[next % run->slot_count];
+
+        if (slot->state != SLOT_HASHED)
+        {
+            break;
+        }
+
+        if (slot->is_selected)
         {
-            if (fd != TR_BAD_SYS_FILE)
+            *changed |= applyResult(run->tor, slot);
+            ++*run->pieces_done;
+        }
+
+        slot->state = SLOT_EMPTY;
+        ++next;
+    }
+
+    tr_lockUnlock(run->lock);
+
+    return next;
+}
+
+static int getSlotCount(tr_torrent const* tor, int hasher_count)
+{
+    int const most = VERIFY_MAX_BUFFER_BYTES / MAX(tor->info.pieceSize, 1U);
+
+    /* enough that each hasher can have a batch on the go while the reader fills the next */
+    return MAX(MIN(hasher_count * (TR_SHA1_BATCH_SIZE + 1), most), 2);
+}
+
+/***
+****  Throttling
+***/
+
+/* Verification gets out of the way of the session's own reads, such as
+ * peers' requests, of the same device. Past that, all the verifiers share
+ * the session's token bucket, if there's a speed limit. */
+
+static void throttle(tr_session* session, uint64_t device, uint32_t len, bool volatile* stopFlag)
+{
+    uint64_t limit;
+    uint64_t now;
+    uint64_t wait_msec = 0;
+
+    if (tr_sessionIsVerifyFullSpeed(session))
+    {
+        return;
+    }
+
+    for (int waited = 0; waited < VERIFY_MAX_BACKOFF_MSEC && !*stopFlag &&
+        tr_diskioGetReadBacklog(session->diskio, device) > 0; waited += VERIFY_BACKOFF_MSEC)
+    {
+        tr_wait_msec(VERIFY_BACKOFF_MSEC);
+    }
+
+    if ((limit = (uint64_t)tr_sessionGetVerifySpeedLimit_KBps(session) * tr_speed_K) == 0)
+    {
+        return;
+    }
+
+    tr_lockLock(session->verifyBucketLock);
+
+    /* the bucket holds up to a second's worth, and can go into debt for a big piece */
+    now = tr_time_msec();
+    session->verifyBucketTokens = MIN(session->verifyBucketTokens + (double)(now - session->verifyBucketTime) * limit / 1000,
+        (double)limit);
+    session->verifyBucketTime = now;
+    session->verifyBucketTokens -= len;
+
+    if (session->verifyBucketTokens < 0)
+    {
+        wait_msec = (uint64_t)(-session->verifyBucketTokens * 1000 / limit);
+    }
+
+    tr_lockUnlock(session->verifyBucketLock);
+
+    while (wait_msec > 0 && !*stopFlag)
+    {
+        uint64_t const msec = MIN(wait_msec, (uint64_t)VERIFY_SLEEP_MSEC);
+
+        tr_wait_msec(msec);
+        wait_msec -= msec;
+    }
+}
+
+/***
+****
+***/
+
+/* `pieces' is the pieces to verify, or NULL for all of them */
+static bool verifyTorrent(tr_torrent* tor, uint64_t device, tr_bitfield const* pieces,
+    tr_piece_index_t volatile* pieces_done, bool volatile* stopFlag)
+{
+    time_t end;
+    bool changed = false;
+    tr_piece_index_t next_read = 0;
+    tr_piece_index_t next_apply = 0;
+    time_t const begin = tr_time();
+    int const hasher_count = MIN(tr_sessionGetVerifyThreads(tor->session), VERIFY_MAX_THREADS);
+    bool is_skipping = false;
+    struct verify_run run;
+    tr_bitfield to_read;
+
+    memset(&run, 0, sizeof(run));
+    run.tor = tor;
+    run.lock = tr_lockNew();
+    run.fd = TR_BAD_SYS_FILE;
+    run.direct_fd = TR_BAD_SYS_FILE;
+    run.bounce = tr_sessionIsVerifyDirectIO(tor->session) ? tr_sys_file_alloc_direct_buffer(VERIFY_BOUNCE_BYTES) : NULL;
+    run.pieces_done = pieces_done;
+    run.slot_count = getSlotCount(tor, hasher_count);
+    run.slots = tr_new0(struct verify_slot, run.slot_count);
+
+    for (int i = 0; i < run.slot_count; ++i)
+    {
+        /* aligned, so that direct reads can go straight into it */
+        run.slots[i].buf = tr_sys_file_alloc_direct_buffer(tor->info.pieceSize);
+    }
+
+    tr_logAddTorDbg(tor, "verifying torrent with %d hashing threads...", hasher_count);
+    getPiecesToRead(tor, &to_read);
+
+    if (pieces == NULL)
+    {
+        tr_torrentSetChecked(tor, 0);
+    }
+    else
+    {
+        for (tr_piece_index_t i = 0; i < tor->info.pieceCount; ++i)
+        {
+            if (tr_bitfieldHas(pieces, i))
             {
-                tr_sys_file_close(fd, NULL);
-                fd = TR_BAD_SYS_FILE;
+                tor->info.pieces[i].timeChecked = 0;
             }
+        }
+    }
+
+    /* with no hashers, the reader hashes each piece itself */
+    run.hasher_count = hasher_count;
+
+    for (int i = 0; i < hasher_count; ++i)
+    {
+        tr_threadNew(hasherFunc, &run);
+    }
 
-            fileIndex++;
-            filePos = 0;
+    while (!*stopFlag && next_apply < tor->info.pieceCount)
+    {
+        struct verify_slot* slot = &run.slots[next_read % run.slot_count];
+
+        next_apply = applyResults(&run, next_apply, next_read, &changed);
+
+        /* wait for a slot to open up, or for the last results */
+        if (next_read == tor->info.pieceCount || next_read - next_apply == (tr_piece_index_t)run.slot_count)
+        {
+            tr_wait_msec(VERIFY_WAIT_MSEC);
+            continue;
+        }
+
+        slot->piece = next_read++;
+        slot->is_selected = pieces == NULL || tr_bitfieldHas(pieces, slot->piece);
+
+        if (!slot->is_selected || !tr_bitfieldHas(&to_read, slot->piece))
+        {
+            tr_lockLock(run.lock);
+            slot->has_piece = tr_torrentPieceIsComplete(tor, slot->piece);
+            slot->state = SLOT_HASHED;
+            tr_lockUnlock(run.lock);
+            is_skipping = true;
+            continue;
+        }
+
+        if (is_skipping)
+        {
+            seekPiece(&run, slot->piece);
+            is_skipping = false;
+        }
+
+        throttle(tor->session, device, tr_torPieceCountBytes(tor, slot->piece), stopFlag);
+        readPiece(&run, slot);
+
+        if (hasher_count == 0)
+        {
+            hashSlots(tor, &slot, 1);
+            slot->state = SLOT_HASHED;
+        }
+        else
+        {
+            tr_lockLock(run.lock);
+            slot->state = SLOT_READ;
+            tr_lockUnlock(run.lock);
         }
     }
 
     /* cleanup */
-    if (fd != TR_BAD_SYS_FILE)
+    tr_lockLock(run.lock);
+    run.is_reading_done = true;
+
+    while (run.hasher_count > 0)
+    {
+        tr_lockUnlock(run.lock);
+        tr_wait_msec(VERIFY_WAIT_MSEC);
+        tr_lockLock(run.lock);
+    }
+
+    tr_lockUnlock(run.lock);
+
+    closeFile(&run);
+    tr_free(run.bounce);
+
+    for (int i = 0; i < run.slot_count; ++i)
     {
-        tr_sys_file_close(fd, NULL);
+        free(run.slots[i].buf);
     }
 
-    tr_sha1_final(sha, NULL);
-    free(buffer);
+    tr_free(run.slots);
+    tr_lockFree(run.lock);
+    tr_bitfieldDestruct(&to_read);
+
+    /* now the pieces match what's on disk, so remember what that looks like.
+       Files that were only partly verified might still have changed elsewhere.
+       The files are looked at here, but tor->fingerprints is only touched with
+       the session locked, since saving the resume file reads it */
+    if (!*stopFlag)
+    {
+        tr_fingerprint* fingerprints = tr_new(tr_fingerprint, tor->info.fileCount);
+        bool* taken = tr_new0(bool, tor->info.fileCount);
+
+        for (tr_file_index_t i = 0; i < tor->info.fileCount; ++i)
+        {
+            tr_file const* file = &tor->info.files[i];
+
+            if (pieces == NULL ||
+                tr_bitfieldCountRange(pieces, file->firstPiece, file->lastPiece + 1) == file->lastPiece + 1 - file->firstPiece)
+            {
+                tr_torrentGetFingerprint(tor, i, &fingerprints[i]);
+                taken[i] = true;
+            }
+        }
+
+        tr_sessionLock(tor->session);
+
+        for (tr_file_index_t i = 0; i < tor->info.fileCount; ++i)
+        {
+            if (taken[i])
+            {
+                tr_torrentSetFingerprint(tor, i, &fingerprints[i]);
+            }
+        }
+
+        tr_sessionUnlock(tor->session);
+
+        tr_free(taken);
+        tr_free(fingerprints);
+    }
 
     /* stopwatch */
     end = tr_time();
@@ -168,18 +606,40 @@ static bool verifyTorrent(tr_torrent* tor, bool* stopFlag)
 ****
 ***/
 
+/* Torrents are verified one at a time, or one at a time per device
+ * if that's enabled, since verifying two at once from one disk would
+ * only make it seek back and forth between them. Even then, no more than
+ * tr_sessionGetVerifyMaxConcurrent() run at once, so that a session with
+ * lots of disks doesn't hash on every core. */
+
 struct verify_node
 {
     tr_torrent* torrent;
     tr_verify_done_func callback_func;
     void* callback_data;
     uint64_t current_size;
+    uint64_t device;
+    tr_bitfield* pieces; /* the pieces to verify, or NULL for all of them */
+    tr_piece_index_t piece_count;
+    tr_piece_index_t volatile pieces_done;
+    bool volatile stop;
 };
 
-static struct verify_node currentNode;
-static tr_list* verifyList = NULL;
-static tr_thread* verifyThread = NULL;
-static bool stopCurrent = false;
+static void nodeFree(void* vnode)
+{
+    struct verify_node* node = vnode;
+
+    if (node->pieces != NULL)
+    {
+        tr_bitfieldDestruct(node->pieces);
+        tr_free(node->pieces);
+    }
+
+    tr_free(node);
+}
+
+static tr_list* verifyList = NULL; /* queued nodes, sorted by compareVerifyByPriorityAndSize() */
+static tr_list* runningList = NULL; /* nodes that are being verified */
 
 static tr_lock* getVerifyLock(void)
 {
@@ -193,49 +653,127 @@ static tr_lock* getVerifyLock(void)
     return lock;
 }
 
-static void verifyThreadFunc(void* unused UNUSED)
+static struct verify_node* findRunning(tr_torrent const* tor)
 {
-    for (;;)
+    for (tr_list* l = runningList; l != NULL; l = l->next)
     {
-        bool changed = false;
-        tr_torrent* tor;
-        struct verify_node* node;
+        struct verify_node* node = l->data;
 
-        tr_lockLock(getVerifyLock());
-        stopCurrent = false;
-        node = verifyList != NULL ? verifyList->data : NULL;
+        if (node->torrent == tor)
+        {
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+/* call with the lock held */
+static bool isRunnable(struct verify_node const* node)
+{
+    if (runningList == NULL)
+    {
+        return true;
+    }
 
-        if (node == NULL)
+    if (!tr_sessionIsVerifyPerDevice(node->torrent->session) ||
+        tr_list_size(runningList) >= tr_sessionGetVerifyMaxConcurrent(node->torrent->session))
+    {
+        return false;
+    }
+
+    for (tr_list* l = runningList; l != NULL; l = l->next)
+    {
+        struct verify_node const* running = l->data;
+
+        if (running->device == node->device)
         {
-            currentNode.torrent = NULL;
-            break;
+            return false;
         }
+    }
 
-        currentNode = *node;
-        tor = currentNode.torrent;
-        tr_list_remove_data(&verifyList, node);
-        tr_free(node);
-        tr_lockUnlock(getVerifyLock());
+    return true;
+}
+
+/* call with the lock held. Moves the first queued node that can run now to the running list */
+static struct verify_node* takeNextNode(void)
+{
+    for (tr_list* l = verifyList; l != NULL; l = l->next)
+    {
+        struct verify_node* node = l->data;
+
+        if (isRunnable(node))
+        {
+            tr_list_remove_data(&verifyList, node);
+            tr_list_append(&runningList, node);
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+static void verifyThreadFunc(void* vnode)
+{
+    struct verify_node* node = vnode;
+
+    do
+    {
+        bool changed;
+        tr_torrent* tor = node->torrent;
 
         tr_logAddTorInfo(tor, "%s", _("Verifying torrent"));
         tr_torrentSetVerifyState(tor, TR_VERIFY_NOW);
-        changed = verifyTorrent(tor, &stopCurrent);
+        changed = verifyTorrent(tor, node->device, node->pieces, &node->pieces_done, &node->stop);
         tr_torrentSetVerifyState(tor, TR_VERIFY_NONE);
         TR_ASSERT(tr_isTorrent(tor));
 
-        if (!stopCurrent && changed)
+        if (!node->stop && changed)
         {
             tr_torrentSetDirty(tor);
         }
 
-        if (currentNode.callback_func != NULL)
+        if (node->callback_func != NULL)
         {
-            (*currentNode.callback_func)(tor, stopCurrent, currentNode.callback_data);
+            (*node->callback_func)(tor, node->stop, node->callback_data);
         }
+
+        tr_lockLock(getVerifyLock());
+        tr_list_remove_data(&runningList, node);
+        nodeFree(node);
+        node = takeNextNode();
+        tr_lockUnlock(getVerifyLock());
     }
+    while (node != NULL);
+}
 
-    verifyThread = NULL;
-    tr_lockUnlock(getVerifyLock());
+/* call with the lock held */
+static void startVerifiers(void)
+{
+    struct verify_node* node;
+
+    while ((node = takeNextNode()) != NULL)
+    {
+        tr_threadNew(verifyThreadFunc, node);
+    }
+}
+
+/* the device that holds the torrent's files, or 0 if it can't be found */
+static uint64_t getTorrentDevice(tr_torrent const* tor)
+{
+    tr_sys_path_info info;
+    char* path = NULL;
+    bool found;
+
+    for (tr_file_index_t i = 0; path == NULL && i < tor->info.fileCount; ++i)
+    {
+        path = tr_torrentFindFile(tor, i);
+    }
+
+    found = tr_sys_path_get_info(path != NULL ? path : tr_torrentGetCurrentDir(tor), 0, &info, NULL);
+    tr_free(path);
+
+    return found ? info.device : 0;
 }
 
 static int compareVerifyByPriorityAndSize(void const* va, void const* vb)
@@ -266,26 +804,52 @@ static int compareVerifyByPriorityAndSize(void const* va, void const* vb)
     return 0;
 }
 
-void tr_verifyAdd(tr_torrent* tor, tr_verify_done_func callback_func, void* callback_data)
+/* how many bytes of `pieces' there are to read */
+static uint64_t getPiecesSize(tr_torrent const* tor, tr_bitfield const* pieces)
+{
+    uint64_t size = 0;
+
+    for (tr_piece_index_t i = 0; i < tor->info.pieceCount; ++i)
+    {
+        if (tr_bitfieldHas(pieces, i))
+        {
+            size += tr_torPieceCountBytes(tor, i);
+        }
+    }
+
+    return size;
+}
+
+void tr_verifyAdd(tr_torrent* tor, tr_bitfield const* pieces, tr_verify_done_func callback_func, void* callback_data)
 {
     TR_ASSERT(tr_isTorrent(tor));
     tr_logAddTorInfo(tor, "%s", _("Queued for verification"));
 
-    struct verify_node* node = tr_new(struct verify_node, 1);
+    struct verify_node* node = tr_new0(struct verify_node, 1);
     node->torrent = tor;
     node->callback_func = callback_func;
     node->callback_data = callback_data;
-    node->current_size = tr_torrentGetCurrentSizeOnDisk(tor);
+    node->device = getTorrentDevice(tor);
 
-    tr_lockLock(getVerifyLock());
-    tr_torrentSetVerifyState(tor, TR_VERIFY_WAIT);
-    tr_list_insert_sorted(&verifyList, node, compareVerifyByPriorityAndSize);
-
-    if (verifyThread == NULL)
+    if (pieces == NULL)
+    {
+        node->current_size = tr_torrentGetCurrentSizeOnDisk(tor);
+        node->piece_count = tor->info.pieceCount;
+    }
+    else
     {
-        verifyThread = tr_threadNew(verifyThreadFunc, NULL);
+        /* partial verifies are sorted by how much they'll read */
+        node->pieces = tr_new0(tr_bitfield, 1);
+        tr_bitfieldConstruct(node->pieces, tor->info.pieceCount);
+        tr_bitfieldSetFromBitfield(node->pieces, pieces);
+        node->current_size = getPiecesSize(tor, pieces);
+        node->piece_count = tr_bitfieldCountTrueBits(pieces);
     }
 
+    tr_lockLock(getVerifyLock());
+    tr_torrentSetVerifyState(tor, TR_VERIFY_WAIT);
+    tr_list_insert_sorted(&verifyList, node, compareVerifyByPriorityAndSize);
+    startVerifiers();
     tr_lockUnlock(getVerifyLock());
 }
 
@@ -300,14 +864,15 @@ void tr_verifyRemove(tr_torrent* tor)
 {
     TR_ASSERT(tr_isTorrent(tor));
 
+    struct verify_node* running;
     tr_lock* lock = getVerifyLock();
     tr_lockLock(lock);
 
-    if (tor == currentNode.torrent)
+    if ((running = findRunning(tor)) != NULL)
     {
-        stopCurrent = true;
+        running->stop = true;
 
-        while (stopCurrent)
+        while (findRunning(tor) != NULL)
         {
             tr_lockUnlock(lock);
             tr_wait_msec(100);
@@ -327,19 +892,56 @@ void tr_verifyRemove(tr_torrent* tor)
                 (*node->callback_func)(tor, true, node->callback_data);
             }
 
-            tr_free(node);
+            nodeFree(node);
         }
     }
 
     tr_lockUnlock(lock);
 }
 
+bool tr_verifyGetProgress(tr_torrent const* tor, double* setme)
+{
+    struct verify_node const* node;
+
+    tr_lockLock(getVerifyLock());
+
+    if ((node = findRunning(tor)) != NULL)
+    {
+        *setme = node->piece_count != 0 ? node->pieces_done / (double)node->piece_count : 1.0;
+    }
+
+    tr_lockUnlock(getVerifyLock());
+
+    return node != NULL;
+}
+
+int tr_verifyGetQueuePosition(tr_torrent const* tor)
+{
+    int pos = 0;
+    tr_list* l;
+
+    tr_lockLock(getVerifyLock());
+
+    for (l = verifyList; l != NULL && ((struct verify_node const*)l->data)->torrent != tor; l = l->next)
+    {
+        ++pos;
+    }
+
+    tr_lockUnlock(getVerifyLock());
+
+    return l != NULL ? pos : -1;
+}
+
 void tr_verifyClose(tr_session* session UNUSED)
 {
     tr_lockLock(getVerifyLock());
 
-    stopCurrent = true;
-    tr_list_free(&verifyList, tr_free);
+    for (tr_list* l = runningList; l != NULL; l = l->next)
+    {
+        ((struct verify_node*)l->data)->stop = true;
+    }
+
+    tr_list_free(&verifyList, nodeFree);
 
     tr_lockUnlock(getVerifyLock());
 }
@@ -17,10 +17,20 @@
  * @{
  */
 
-void tr_verifyAdd(tr_torrent* tor, tr_verify_done_func callback_func, void* callback_user_data);
+struct tr_bitfield;
+
+/** @param pieces the pieces to verify, or NULL for all of them. It's copied. */
+void tr_verifyAdd(tr_torrent* tor, struct tr_bitfield const* pieces, tr_verify_done_func callback_func,
+    void* callback_user_data);
 
 void tr_verifyRemove(tr_torrent* tor);
 
+/** @brief Gets how much of a running verify is done, counting only the pieces it's verifying */
+bool tr_verifyGetProgress(tr_torrent const* tor, double* setme);
+
+/** @brief Gets the torrent's position in the verify queue, or -1 if it isn't waiting there */
+int tr_verifyGetQueuePosition(tr_torrent const* tor);
+
 void tr_verifyClose(tr_session*);
 
 /* @} */
@@ -31,6 +31,8 @@ static char const* comment = NULL;
 static char const* outfile = NULL;
 static char const* infile = NULL;
 static uint32_t piecesize_kib = 0;
+static char const* threads = NULL;
+static bool directIO = false;
 
 static tr_option options[] =
 {
@@ -39,6 +41,8 @@ static tr_option options[] =
     { 's', "piecesize", "Set how many KiB each piece should be, overriding the preferred default", "s", true, "<size in KiB>" },
     { 'c', "comment", "Add a comment", "c", true, "<comment>" },
     { 't', "tracker", "Add a tracker's announce URL", "t", true, "<url>" },
+    { 'T', "threads", "Set how many threads hash the pieces", "T", true, "<count>" },
+    { 'D', "direct-io", "Read the files around the page cache", "D", false, NULL },
     { 'V', "version", "Show version number and exit", "V", false, NULL },
     { 0, NULL, NULL, NULL, false, NULL }
 };
@@ -97,6 +101,14 @@ static int parseCommandLine(int argc, char const* const* argv)
 
             break;
 
+        case 'T':
+            threads = optarg;
+            break;
+
+        case 'D':
+            directIO = true;
+            break;
+
         case TR_OPT_UNK:
             infile = optarg;
             break;
@@ -203,6 +215,13 @@ int tr_main(int argc, char* argv[])
         tr_metaInfoBuilderSetPieceSize(b, piecesize_kib * KiB);
     }
 
+    if (threads != NULL)
+    {
+        tr_metaInfoBuilderSetThreadCount(b, strtoul(threads, NULL, 10));
+    }
+
+    tr_metaInfoBuilderSetDirectIO(b, directIO);
+
     tr_makeMetaInfo(b, outfile, trackers, trackerCount, comment, isPrivate);
 
     while (!b->isDone)